@@ -0,0 +1,93 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#include "argo.h"
+
+/*
+ * Storage for the values and strings produced by the Argo parser.
+ *
+ * Values are taken first from argo_value_storage, in the order given by
+ * argo_next_value.  Once that array is used up, and for the content of every
+ * string, space is bump-allocated from a list of large chunks obtained from
+ * malloc() as they are needed.  Nothing is freed individually, and the parser
+ * never discards anything itself, so a value read stays valid while others
+ * are read after it.  Everything is discarded at once by argo_arena_reset(),
+ * which keeps the chunks for reuse, or by argo_arena_free(), which returns
+ * them to malloc().
+ *
+ * A string under construction is always the most recent allocation, so it
+ * usually grows in place at the end of the current chunk.
+ *
+ * The parser itself reads strings into ARGO_TEXT, which keeps characters one
+ * per byte rather than one per ARGO_CHAR, and records whether any of them
+ * would have to be escaped in canonical JSON.  The characters the parser
+ * produces are the bytes of the input, so UTF-8 input stays UTF-8, and the
+ * code points of \u escapes, which the writer emits as single bytes if they
+ * are below U+0100.  Text with no character that needs an escape can be
+ * written with one fwrite().  The first character above U+00FF, which has no
+ * single-byte form, switches the text over to an ARGO_STRING.
+ */
+#define ARGO_ARENA_CHUNK (64 * 1024)
+#define ARGO_ARENA_MAX_CHUNK (4 * 1024 * 1024)
+
+/*
+ * Text of a string read by the parser.
+ */
+typedef struct argo_text {
+    size_t capacity;                // Current total size of space in the bytes.
+    size_t length;                  // Current length of the bytes.
+    unsigned char *bytes;           // Characters, while all of them are below U+0100.
+    int plain;                      // Nonzero if no character needs an escape sequence.
+    int wide;                       // Nonzero if the characters are in "string" instead.
+    ARGO_STRING string;             // Characters, once any of them is above U+00FF.
+} ARGO_TEXT;
+
+#define ARGO_TEXT_PLAIN(c) ((c) >= ARGO_SPACE && (c) != ARGO_QUOTE && (c) != ARGO_BSLASH)
+
+ARGO_VALUE *argo_alloc_value(void);
+void *argo_arena_alloc(size_t size);
+int argo_arena_grow(ARGO_STRING *s, ARGO_CHAR c);
+int argo_string_append_bytes(ARGO_STRING *s, const unsigned char *p, size_t n);
+int argo_text_grow(ARGO_TEXT *t, ARGO_CHAR c);
+int argo_text_append_bytes(ARGO_TEXT *t, const unsigned char *p, size_t n);
+int argo_text_string(ARGO_TEXT *t, ARGO_STRING *s);
+void argo_arena_reset(void);
+void argo_arena_free(void);
+unsigned long argo_arena_generation(void);
+
+/*
+ * Append a character to a string whose content is in the arena, or which
+ * is empty.  This is the arena counterpart of argo_append_char().
+ */
+static inline int argo_string_append(ARGO_STRING *s, ARGO_CHAR c) {
+    if(s->length < s->capacity) {
+        s->content[s->length++] = c;
+        return 0;
+    }
+    return argo_arena_grow(s, c);
+}
+
+/*
+ * Empty text, for the parser to read the next string into.
+ */
+static inline void argo_text_reset(ARGO_TEXT *t) {
+    t->length = 0;
+    t->plain = 1;
+    t->wide = 0;
+}
+
+/*
+ * Append a character to text.
+ */
+static inline int argo_text_append(ARGO_TEXT *t, ARGO_CHAR c) {
+    if(t->length < t->capacity && c <= 0xff && !t->wide) {
+        t->plain &= ARGO_TEXT_PLAIN(c);
+        t->bytes[t->length++] = c;
+        return 0;
+    }
+    return argo_text_grow(t, c);
+}
+
+#endif
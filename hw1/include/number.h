@@ -0,0 +1,49 @@
+#ifndef NUMBER_H
+#define NUMBER_H
+
+#include "argo.h"
+
+/*
+ * Conversion of numbers between decimal text and double.
+ *
+ * While the parser reads the digits of a number, it collects them in an
+ * ARGO_DECIMAL, from which argo_decimal_value() computes the double nearest
+ * to the number.  Most numbers have a significand and a power of ten that are
+ * both exact as doubles, and are converted by a single multiplication or
+ * division, which is then correctly rounded.  Any other number is converted
+ * from its text by strtod().
+ *
+ * argo_format_double() writes a double in canonical form, "0.ddd" followed
+ * by "e" and an exponent unless the exponent is zero, with the digits rounded
+ * correctly to ARGO_PRECISION significant digits and with trailing zeros
+ * removed.  As ARGO_PRECISION decimal digits are fewer than a double holds,
+ * that is also the shortest form that reads back as the same double,
+ * whenever there is one with no more than ARGO_PRECISION digits.
+ */
+#define ARGO_NUMBER_BUFFER 32
+
+typedef struct argo_decimal {
+    unsigned long long significand; // First significant digits of the number.
+    int digits;                     // Number of significant digits, including those not in significand.
+    long fraction;                  // Number of digits after the decimal point.
+    long exponent;                  // Exponent, limited to ARGO_DECIMAL_MAX_EXPONENT in magnitude.
+} ARGO_DECIMAL;
+
+#define ARGO_DECIMAL_DIGITS 19
+#define ARGO_DECIMAL_MAX_EXPONENT 100000
+
+int argo_decimal_value(ARGO_DECIMAL *d, ARGO_STRING *text, double *value);
+int argo_format_long(long value, char *buf);
+int argo_format_double(double value, char *buf);
+
+/*
+ * Add a digit to a decimal.
+ */
+static inline void argo_decimal_digit(ARGO_DECIMAL *d, ARGO_CHAR c) {
+    if(d->digits < ARGO_DECIMAL_DIGITS)
+        d->significand = 10 * d->significand + (c - ARGO_DIGIT0);
+    if(d->digits || c != ARGO_DIGIT0)
+        ++d->digits;
+}
+
+#endif
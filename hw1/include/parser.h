@@ -0,0 +1,56 @@
+#ifndef PARSER_H
+#define PARSER_H
+
+#include <stdio.h>
+
+#include "argo.h"
+#include "reader.h"
+#include "arena.h"
+
+/*
+ * Event interface to the Argo parser.
+ *
+ * argo_parse() reads one JSON value and reports its parts to a handler, in
+ * document order, as it goes, without building any tree of values.  For an
+ * object, start_object is followed by a key event and then the events of the
+ * member value for each member, and finally end_object; an array is reported
+ * in the same way, without keys.  Any callback may be NULL, in which case the
+ * event is ignored; with no handler at all the input is just validated.
+ *
+ * The text or number passed to a callback belongs to the parser and is
+ * overwritten by the next event.  A handler that wants to keep text copies it
+ * with argo_text_string() (see arena.h).  A handler that wants to keep a
+ * number takes it by copying the structure and zeroing the original, in which
+ * case the parser starts over with fresh space, allocated from the arena.
+ * Otherwise the parser reuses the same space, so memory does not grow with the
+ * size of the input, only with the longest string and the depth of nesting.
+ *
+ * A callback returns zero to continue or nonzero to stop the parse, which then
+ * fails without printing anything further.
+ */
+typedef struct argo_handler {
+    int (*start_object)(void *context);
+    int (*key)(void *context, ARGO_TEXT *name);
+    int (*end_object)(void *context);
+    int (*start_array)(void *context);
+    int (*end_array)(void *context);
+    int (*string)(void *context, ARGO_TEXT *s);
+    int (*number)(void *context, ARGO_NUMBER *n);
+    int (*basic)(void *context, ARGO_BASIC b);
+} ARGO_HANDLER;
+
+/*
+ * State of a parse in progress.
+ */
+typedef struct argo_parser {
+    ARGO_READER reader;             // Input.
+    const ARGO_HANDLER *handler;    // Handler to which events are reported.
+    void *context;                  // Argument passed to each callback.
+    ARGO_TEXT string;               // String or key most recently read.
+    ARGO_NUMBER number;             // Number most recently read.
+} ARGO_PARSER;
+
+int argo_parse(FILE *f, const ARGO_HANDLER *handler, void *context);
+int argo_canonicalize(FILE *in, FILE *out);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef QUERY_H
+#define QUERY_H
+
+#include <stddef.h>
+
+#include "argo.h"
+
+/*
+ * Lookups in a tree of Argo values.
+ *
+ * Keys and the tokens of a JSON pointer (RFC 6901) are C strings, each byte
+ * of which is taken as one character, as the parser does with the bytes of
+ * its input.  A key therefore matches a member name read from UTF-8 input if
+ * it is the same UTF-8.
+ *
+ * Looking up a key in an object with at least ARGO_INDEX_MIN members builds
+ * a hash index of the members, on the first lookup, and later lookups use the
+ * index.  Objects have no room for an index of their own, so indexes are found
+ * through a table keyed by the sentinel of the member list.  Indexes and the
+ * table are allocated from the arena and are discarded along with the tree
+ * when it is reset.  An index is rebuilt if members have since been added
+ * to or removed from either end of the object; an object whose members are
+ * changed in any other way must not be looked up in again.
+ */
+#define ARGO_INDEX_MIN 8
+
+ARGO_VALUE *argo_object_get(ARGO_OBJECT *o, const char *key);
+ARGO_VALUE *argo_array_get(ARGO_ARRAY *a, size_t i);
+ARGO_VALUE *argo_value_get(ARGO_VALUE *v, const char *pointer);
+
+#endif
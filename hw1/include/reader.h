@@ -0,0 +1,61 @@
+#ifndef READER_H
+#define READER_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "argo.h"
+
+/*
+ * Block-based input for the Argo parser.
+ *
+ * Rather than calling fgetc() for every character, the parser pulls bytes
+ * out of a reader with argo_getc(), which is just a pointer increment until
+ * the current block is used up.  If the input stream is a regular file, the
+ * whole file is mapped into memory and presented in blocks of
+ * ARGO_READER_WINDOW bytes, the pages of each block being released once the
+ * parser has moved past it, so that a large file is not kept resident;
+ * otherwise blocks of ARGO_READER_BLOCK bytes are read from the stream with
+ * fread(), unless the stream must not be read past the input consumed and
+ * cannot be repositioned, in which case characters are taken one at a time
+ * with fgetc() and the last one is given back with ungetc().  When the
+ * reader is closed, the stream is repositioned just after the last character
+ * consumed, so that the parser's read-ahead is not lost.
+ */
+#define ARGO_READER_BLOCK 65536
+#define ARGO_READER_WINDOW (1024 * 1024)
+
+typedef struct argo_reader {
+    const unsigned char *next;      // Next byte to be read.
+    const unsigned char *end;       // End of the bytes available in the current block.
+    unsigned char *buffer;          // Block buffer, or NULL if the input is mapped.
+    size_t block;                   // Number of bytes to read into the buffer at a time.
+    unsigned char last;             // Last character read, if reading with fgetc().
+    void *map;                      // Mapped contents of the input file, if any.
+    size_t map_length;              // Length of the mapping.
+    FILE *file;                     // Underlying input stream.
+} ARGO_READER;
+
+int argo_reader_open(ARGO_READER *r, FILE *f, int exact);
+int argo_reader_fill(ARGO_READER *r);
+void argo_reader_close(ARGO_READER *r);
+
+/*
+ * Read the next byte of input, or EOF if there is no more.
+ */
+static inline ARGO_CHAR argo_getc(ARGO_READER *r) {
+    if(r->next < r->end)
+        return *r->next++;
+    return argo_reader_fill(r);
+}
+
+/*
+ * Push back the character just returned by argo_getc(), like ungetc().
+ * Pushing back EOF has no effect.
+ */
+static inline void argo_ungetc(ARGO_CHAR c, ARGO_READER *r) {
+    if(c != EOF)
+        --r->next;
+}
+
+#endif
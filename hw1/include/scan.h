@@ -0,0 +1,29 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+/*
+ * Kernels that let the Argo parser step over many bytes of buffered input
+ * at once, rather than pulling them out of the reader one at a time.
+ *
+ * On x86 they test 16 bytes at a time with SSE2, or 32 bytes at a time with
+ * AVX2 if the processor supports it, and finish the last few bytes before
+ * the end of the buffer one at a time.  Elsewhere they are plain loops.
+ * Neither kernel ever looks at a byte at or beyond "end".
+ */
+
+/*
+ * Return a pointer to the first byte in [p, end) that is not whitespace,
+ * or end if there is none.  The number of newlines skipped is added to
+ * *lines and, if there were any, *line is set to point just after the last.
+ */
+const unsigned char *argo_skip_whitespace(const unsigned char *p, const unsigned char *end,
+                                          int *lines, const unsigned char **line);
+
+/*
+ * Return a pointer to the first byte in [p, end) that cannot be copied
+ * straight into the content of a string (a quote, a backslash or a control
+ * character), or end if there is none.
+ */
+const unsigned char *argo_scan_string_run(const unsigned char *p, const unsigned char *end);
+
+#endif
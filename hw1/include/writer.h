@@ -0,0 +1,41 @@
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <stdio.h>
+
+/*
+ * Buffered output for the Argo writers.
+ *
+ * Rather than calling fputc() for every character and checking each call
+ * for failure, the writers append to a buffer supplied by the caller, which
+ * is handed to the output stream with a single fwrite() when it fills up and
+ * when it is flushed at the end.  Once a write to the stream has failed, the
+ * writer stays failed: nothing more is written, and every later flush fails.
+ */
+#define ARGO_WRITER_BUFFER 65536
+
+typedef struct argo_writer {
+    char *buffer;                   // Output not yet written to the stream.
+    size_t length;                  // Number of bytes in the buffer.
+    size_t capacity;                // Size of the buffer.
+    FILE *file;                     // Underlying output stream.
+    int failed;                     // Nonzero if a write to the stream has failed.
+} ARGO_WRITER;
+
+void argo_writer_open(ARGO_WRITER *w, FILE *f, char *buffer, size_t size);
+int argo_writer_flush(ARGO_WRITER *w);
+int argo_put_bytes(ARGO_WRITER *w, const void *p, size_t n);
+int argo_writer_indent(ARGO_WRITER *w, int n);
+void argo_copy_bytes(void *restrict to, const void *restrict from, size_t n);
+
+/*
+ * Append a byte to the output.
+ */
+static inline int argo_put(ARGO_WRITER *w, int c) {
+    if(w->length == w->capacity && argo_writer_flush(w))
+        return -1;
+    w->buffer[w->length++] = c;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,299 @@
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "argo.h"
+#include "global.h"
+#include "arena.h"
+#include "writer.h"
+#include "debug.h"
+
+#define ARGO_ARENA_ALIGN (sizeof(double) > sizeof(void *) ? sizeof(double) : sizeof(void *))
+#define ARGO_ARENA_ROUND(n) (((n) + ARGO_ARENA_ALIGN - 1) & ~(ARGO_ARENA_ALIGN - 1))
+
+/*
+ * A chunk of the arena.  The space available for allocation follows the
+ * header, whose size is a multiple of the alignment.
+ */
+typedef struct argo_chunk {
+    struct argo_chunk *next;        // Next chunk, which is empty or not yet used since the last reset.
+    size_t size;                    // Number of bytes available after the header.
+    size_t used;                    // Number of bytes allocated so far.
+    size_t pad;
+} ARGO_CHUNK;
+
+static ARGO_CHUNK *argo_chunks;     // First chunk.
+static ARGO_CHUNK *argo_chunk;      // Chunk currently being allocated from.
+static unsigned long argo_generation;  // Number of times everything has been discarded.
+
+#define ARGO_CHUNK_DATA(k) ((unsigned char *)((k) + 1))
+
+/*
+ * Make the chunk after the current one, which must have room for at least
+ * "size" bytes, the current chunk.  A chunk left over from before the last
+ * reset is reused if it is big enough; otherwise a new one is inserted.
+ */
+static ARGO_CHUNK *argo_next_chunk(size_t size) {
+    ARGO_CHUNK *k = argo_chunk != NULL ? argo_chunk->next : argo_chunks;
+    if(k == NULL || k->size < size) {
+        size_t chunk_size = argo_chunk != NULL ? 2 * argo_chunk->size : ARGO_ARENA_CHUNK;
+        if(chunk_size > ARGO_ARENA_MAX_CHUNK)
+            chunk_size = ARGO_ARENA_MAX_CHUNK;
+        if(chunk_size < size)
+            chunk_size = ARGO_ARENA_ROUND(size);
+        ARGO_CHUNK *n = malloc(sizeof(ARGO_CHUNK) + chunk_size);
+        if(!n)
+            return NULL;
+        n->size = chunk_size;
+        n->next = k;
+        if(argo_chunk != NULL)
+            argo_chunk->next = n;
+        else
+            argo_chunks = n;
+        k = n;
+    }
+    k->used = 0;
+    argo_chunk = k;
+    return k;
+}
+
+/**
+ * @brief  Allocate space from the arena.
+ * @details  The space is suitably aligned for any Argo data and remains
+ * valid until the arena is reset or freed.
+ *
+ * @param size  Number of bytes required.
+ * @return  A pointer to the space, or NULL if memory could not be obtained.
+ */
+void *argo_arena_alloc(size_t size) {
+    size = ARGO_ARENA_ROUND(size);
+    ARGO_CHUNK *k = argo_chunk;
+    if(k == NULL || k->size - k->used < size) {
+        if((k = argo_next_chunk(size)) == NULL)
+            return NULL;
+    }
+    void *p = ARGO_CHUNK_DATA(k) + k->used;
+    k->used += size;
+    return p;
+}
+
+/**
+ * @brief  Allocate a new, zeroed value.
+ * @details  Values come from argo_value_storage while it lasts, and then
+ * from the arena, so there is no fixed limit on the number of values.
+ *
+ * @return  A pointer to the value, or NULL if memory could not be obtained,
+ * in which case an error message has been printed.
+ */
+ARGO_VALUE *argo_alloc_value(void) {
+    ARGO_VALUE *v;
+    if(argo_next_value < NUM_ARGO_VALUES)
+        v = argo_value_storage + argo_next_value++;
+    else if((v = argo_arena_alloc(sizeof(ARGO_VALUE))) == NULL) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        return NULL;
+    }
+    *v = (ARGO_VALUE){ 0 };
+    return v;
+}
+
+/*
+ * Make room for "new_size" bytes in space that was allocated from the arena
+ * with "old_size" bytes, of which "used" are in use.  If the space is the last
+ * thing allocated and there is room after it in the current chunk, it is
+ * extended where it is; otherwise it is copied into new space.
+ */
+static void *argo_arena_extend(void *space, size_t used, size_t old_size, size_t new_size) {
+    old_size = ARGO_ARENA_ROUND(old_size);
+    new_size = ARGO_ARENA_ROUND(new_size);
+    ARGO_CHUNK *k = argo_chunk;
+    if(space != NULL && k != NULL
+       && (unsigned char *)space + old_size == ARGO_CHUNK_DATA(k) + k->used
+       && k->size - k->used >= new_size - old_size) {
+        k->used += new_size - old_size;
+        return space;
+    }
+    void *p = argo_arena_alloc(new_size);
+    if(!p) {
+        fprintf(stderr, "[%d:%d] ERROR: Failed to allocate space for string text.\n",
+                argo_lines_read, argo_chars_read);
+        return NULL;
+    }
+    argo_copy_bytes(p, space, used);
+    return p;
+}
+
+/*
+ * New capacity for a string or text of capacity "capacity" that must hold
+ * at least "length" characters: twice the size, or exactly enough.
+ */
+static size_t argo_arena_capacity(size_t capacity, size_t length) {
+    capacity = capacity ? 2 * capacity : 16;
+    return capacity < length ? length : capacity;
+}
+
+/*
+ * Make room in the content of a string for at least "length" characters.
+ */
+static int argo_arena_reserve(ARGO_STRING *s, size_t length) {
+    size_t capacity = argo_arena_capacity(s->capacity, length);
+    ARGO_CHAR *content = argo_arena_extend(s->content, s->length * sizeof(ARGO_CHAR),
+                                           s->capacity * sizeof(ARGO_CHAR), capacity * sizeof(ARGO_CHAR));
+    if(!content)
+        return 1;
+    s->content = content;
+    s->capacity = capacity;
+    return 0;
+}
+
+/*
+ * Make room in the bytes of text for at least "length" characters.
+ */
+static int argo_text_reserve(ARGO_TEXT *t, size_t length) {
+    size_t capacity = argo_arena_capacity(t->capacity, length);
+    unsigned char *bytes = argo_arena_extend(t->bytes, t->length, t->capacity, capacity);
+    if(!bytes)
+        return 1;
+    t->bytes = bytes;
+    t->capacity = capacity;
+    return 0;
+}
+
+/**
+ * @brief  Enlarge the content of a string and append a character to it.
+ * @details  This is the slow path of argo_string_append(), taken when the
+ * content is full.
+ *
+ * @param s  The string.
+ * @param c  The character to append.
+ * @return  Zero if the operation completes without error, nonzero if
+ * memory could not be obtained.
+ */
+int argo_arena_grow(ARGO_STRING *s, ARGO_CHAR c) {
+    if(argo_arena_reserve(s, s->length + 1))
+        return 1;
+    s->content[s->length++] = c;
+    return 0;
+}
+
+/**
+ * @brief  Append a run of bytes, each taken as one character, to a string.
+ *
+ * @param s  The string.
+ * @param p  The bytes to append.
+ * @param n  The number of bytes.
+ * @return  Zero if the operation completes without error, nonzero if
+ * memory could not be obtained.
+ */
+int argo_string_append_bytes(ARGO_STRING *s, const unsigned char *p, size_t n) {
+    if(s->capacity - s->length < n && argo_arena_reserve(s, s->length + n))
+        return 1;
+    ARGO_CHAR *q = s->content + s->length;
+    for(size_t i = 0; i < n; i++)
+        q[i] = p[i];
+    s->length += n;
+    return 0;
+}
+
+/**
+ * @brief  Append a character to text, when it does not fit in the bytes.
+ * @details  This is the slow path of argo_text_append(), taken when the
+ * bytes are full, or the character is above U+00FF, or the text has already
+ * been switched over to an ARGO_STRING.
+ *
+ * @param t  The text.
+ * @param c  The character to append.
+ * @return  Zero if the operation completes without error, nonzero if
+ * memory could not be obtained.
+ */
+int argo_text_grow(ARGO_TEXT *t, ARGO_CHAR c) {
+    if(!t->wide && c > 0xff) {
+        t->string.length = 0;
+        if(argo_string_append_bytes(&t->string, t->bytes, t->length))
+            return 1;
+        t->wide = 1;
+        t->plain = 0;
+    }
+    if(t->wide)
+        return argo_string_append(&t->string, c);
+    if(argo_text_reserve(t, t->length + 1))
+        return 1;
+    t->plain &= ARGO_TEXT_PLAIN(c);
+    t->bytes[t->length++] = c;
+    return 0;
+}
+
+/**
+ * @brief  Append a run of bytes, none of which needs an escape sequence,
+ * to text.
+ *
+ * @param t  The text.
+ * @param p  The bytes to append.
+ * @param n  The number of bytes.
+ * @return  Zero if the operation completes without error, nonzero if
+ * memory could not be obtained.
+ */
+int argo_text_append_bytes(ARGO_TEXT *t, const unsigned char *p, size_t n) {
+    if(t->wide)
+        return argo_string_append_bytes(&t->string, p, n);
+    if(t->capacity - t->length < n && argo_text_reserve(t, t->length + n))
+        return 1;
+    argo_copy_bytes(t->bytes + t->length, p, n);
+    t->length += n;
+    return 0;
+}
+
+/**
+ * @brief  Append the characters of text to a string.
+ *
+ * @param t  The text.
+ * @param s  The string, whose content is in the arena, or which is empty.
+ * @return  Zero if the operation completes without error, nonzero if
+ * memory could not be obtained.
+ */
+int argo_text_string(ARGO_TEXT *t, ARGO_STRING *s) {
+    if(!t->wide)
+        return argo_string_append_bytes(s, t->bytes, t->length);
+    if(s->capacity - s->length < t->string.length
+       && argo_arena_reserve(s, s->length + t->string.length))
+        return 1;
+    argo_copy_bytes(s->content + s->length, t->string.content, t->string.length * sizeof(ARGO_CHAR));
+    s->length += t->string.length;
+    return 0;
+}
+
+/**
+ * @brief  Discard everything allocated from the arena and argo_value_storage.
+ * @details  The chunks are kept, to be reused by subsequent allocations.
+ */
+void argo_arena_reset(void) {
+    ++argo_generation;
+    argo_next_value = 0;
+    argo_chunk = NULL;
+    if(argo_chunks != NULL)
+        argo_next_chunk(0);
+}
+
+/**
+ * @brief  Discard everything allocated and release the arena's memory.
+ */
+void argo_arena_free(void) {
+    ARGO_CHUNK *k = argo_chunks;
+    while(k != NULL) {
+        ARGO_CHUNK *next = k->next;
+        free(k);
+        k = next;
+    }
+    argo_chunks = argo_chunk = NULL;
+    argo_next_value = 0;
+    ++argo_generation;
+}
+
+/**
+ * @brief  Tell whether things allocated earlier are still valid.
+ *
+ * @return  A number that changes whenever everything allocated from the
+ * arena and argo_value_storage is discarded.
+ */
+unsigned long argo_arena_generation(void) {
+    return argo_generation;
+}
@@ -6,30 +6,107 @@
 #include "argo.h"
 #include "global.h"
 #include "debug.h"
+#include "reader.h"
+#include "arena.h"
+#include "scan.h"
+#include "parser.h"
+#include "number.h"
+#include "writer.h"
+
+/*
+ * Report an event to the handler of a parse, if it handles that event.
+ * Evaluates to nonzero if the handler asks for the parse to stop.
+ */
+#define ARGO_EMIT(p, event, ...) \
+    ((p)->handler->event != NULL && (p)->handler->event((p)->context, ##__VA_ARGS__))
+
+/*
+ * State of the tree builder used by argo_read_value().
+ */
+typedef struct argo_builder {
+    ARGO_VALUE *root;               // Value read.
+    ARGO_VALUE **stack;             // Open arrays and objects, innermost last.
+    int depth;                      // Number of open arrays and objects.
+    int capacity;                   // Size of the stack.
+    ARGO_STRING name;               // Name for the next member of an object.
+} ARGO_BUILDER;
+
+/*
+ * State of the canonicalizer used by argo_canonicalize().
+ */
+typedef struct argo_canon {
+    ARGO_WRITER *out;               // Output.
+    char *started;                  // For each open array or object, whether a member has been written.
+    int depth;                      // Number of open arrays and objects.
+    int capacity;                   // Size of the "started" array.
+    int indent;                     // Indent level for pretty printing.
+    int keyed;                      // Nonzero if a key has been written and its value is next.
+    int failed;                     // Nonzero if writing has failed.
+} ARGO_CANON;
 
 ARGO_VALUE *argo_read_value(FILE *);
+int argo_parse_stream(FILE *, const ARGO_HANDLER *, void *, int);
 void init_vars();
-void next_char(ARGO_CHAR *, FILE *);
-ARGO_VALUE *argo_value(FILE *);
-int argo_value_helper(ARGO_CHAR *, ARGO_VALUE **, FILE *);
+void next_char(ARGO_CHAR *, ARGO_READER *);
+int argo_value(ARGO_PARSER *);
+int argo_value_helper(ARGO_CHAR *, ARGO_PARSER *);
 int eof(ARGO_CHAR);
 void add_node(ARGO_VALUE **, ARGO_VALUE **);
+ARGO_VALUE *argo_build_value(ARGO_BUILDER *, ARGO_VALUE_TYPE);
+int argo_build_container(ARGO_BUILDER *, ARGO_VALUE_TYPE);
+int argo_build_start_object(void *);
+int argo_build_start_array(void *);
+int argo_build_end(void *);
+int argo_build_key(void *, ARGO_TEXT *);
+int argo_build_string(void *, ARGO_TEXT *);
+int argo_build_number(void *, ARGO_NUMBER *);
+int argo_build_basic(void *, ARGO_BASIC);
 void print_char_err(ARGO_CHAR, ARGO_CHAR, char *);
-int argo_read_basic(ARGO_BASIC *, FILE *);
+int argo_read_basic(ARGO_BASIC *, ARGO_READER *);
 int argo_read_string(ARGO_STRING *, FILE *);
+int argo_scan_string(ARGO_TEXT *, ARGO_READER *);
 int argo_read_number(ARGO_NUMBER *, FILE *);
-int argo_read_array(ARGO_ARRAY *, FILE *);
-int argo_read_object(ARGO_OBJECT *, FILE *);
-int argo_read_member(ARGO_VALUE *, FILE *);
+int argo_scan_number(ARGO_NUMBER *, ARGO_READER *);
+int argo_read_array(ARGO_PARSER *);
+int argo_read_object(ARGO_PARSER *);
+int argo_read_member(ARGO_VALUE *, ARGO_READER *);
 int argo_write_value(ARGO_VALUE *, FILE *);
-int argo_write(ARGO_VALUE *, FILE *);
+int argo_write(ARGO_VALUE *, ARGO_WRITER *);
 int argo_write_basic(ARGO_BASIC *, FILE *);
+int argo_put_basic(ARGO_BASIC *, ARGO_WRITER *);
 int argo_write_string(ARGO_STRING *, FILE *);
+int argo_put_string(ARGO_STRING *, ARGO_WRITER *);
+int argo_put_char(ARGO_CHAR, ARGO_WRITER *);
+int argo_put_text(ARGO_TEXT *, ARGO_WRITER *);
 int argo_write_number(ARGO_NUMBER *, FILE *);
-int argo_write_array(ARGO_ARRAY *, FILE *);
-int argo_write_object(ARGO_OBJECT *, FILE *);
+int argo_put_number(ARGO_NUMBER *, ARGO_WRITER *);
+int argo_write_array(ARGO_ARRAY *, ARGO_WRITER *);
+int argo_write_object(ARGO_OBJECT *, ARGO_WRITER *);
 int argo_write_member(ARGO_VALUE *, FILE *);
 
+int argo_canon_indent(ARGO_CANON *);
+int argo_canon_next(ARGO_CANON *);
+int argo_canon_done(ARGO_CANON *, int);
+int argo_canon_open(ARGO_CANON *, ARGO_CHAR);
+int argo_canon_close(ARGO_CANON *, ARGO_CHAR);
+int argo_canon_start_object(void *);
+int argo_canon_end_object(void *);
+int argo_canon_start_array(void *);
+int argo_canon_end_array(void *);
+int argo_canon_key(void *, ARGO_TEXT *);
+int argo_canon_string(void *, ARGO_TEXT *);
+int argo_canon_number(void *, ARGO_NUMBER *);
+int argo_canon_basic(void *, ARGO_BASIC);
+
+extern const ARGO_HANDLER argo_builder;
+extern const ARGO_HANDLER argo_canonicalizer;
+
+/*
+ * Output buffer used by argo_write_value() and the other functions that
+ * write to a stream, none of which calls another.
+ */
+static char argo_write_buffer[ARGO_WRITER_BUFFER];
+
 
 /**
  * @brief  Read JSON input from a specified input stream, parse it,
@@ -40,9 +117,13 @@ int argo_write_member(ARGO_VALUE *, FILE *);
  * successfully parsed, then a pointer to a data structure representing
  * the corresponding value is returned.  See the assignment handout for
  * information on the JSON syntax standard and how parsing can be
- * accomplished.  As discussed in the assignment handout, the returned
- * pointer must be to one of the elements of the argo_value_storage
- * array that is defined in the const.h header file.
+ * accomplished.  Values are taken from the argo_value_storage array
+ * that is defined in the const.h header file and, once it is used up,
+ * from the arena described in arena.h.  Everything read remains valid,
+ * however many more values are read, until the arena is discarded with
+ * argo_arena_reset() or argo_arena_free().  Nothing beyond the value is
+ * consumed from the stream, even if it cannot be repositioned, so that the
+ * next value can be read from the same stream.
  * In case of an error (these include failure of the input to conform
  * to the JSON standard, premature EOF on the input stream, as well as
  * other I/O errors), a one-line error message is output to standard error
@@ -56,68 +137,220 @@ int argo_write_member(ARGO_VALUE *, FILE *);
 
 ARGO_VALUE *argo_read_value(FILE *f) {
     // TO BE IMPLEMENTED.
+    ARGO_BUILDER b = { NULL, NULL, 0, 0, { 0, 0, NULL } };
+    int ret = argo_parse_stream(f, &argo_builder, &b, 1);
+    free(b.stack);
+    return ret ? NULL : b.root;
+}
+
+/**
+ * @brief  Read JSON input from a specified input stream, parse it,
+ * and report its parts to a handler as they are read.
+ * @details  This function reads and parses a JSON value in the same way
+ * as argo_read_value(), but instead of building a data structure it calls
+ * back the specified handler for each part of the value, in the order in
+ * which they appear in the input, as described in parser.h.  The space used
+ * depends only on the longest string or number and the depth of nesting,
+ * however large the input.
+ * Afterwards the stream is repositioned just after the value if it allows
+ * this; otherwise input read ahead of the value is lost.
+ * In case of an error, a one-line error message is output to standard error
+ * and nonzero is returned, possibly after some events have been reported.
+ *
+ * @param f  Input stream from which JSON is to be read.
+ * @param handler  Handler to report events to, or NULL just to validate.
+ * @param context  Argument passed to each callback.
+ * @return  Zero if the operation is completely successful,
+ * nonzero if there is any error.
+ */
+int argo_parse(FILE *f, const ARGO_HANDLER *handler, void *context) {
+    return argo_parse_stream(f, handler, context, 0);
+}
+
+/*
+ * Parse as argo_parse() does, with the reader taking nothing from the stream
+ * beyond the value if "exact" is nonzero (see argo_reader_open()).
+ */
+int argo_parse_stream(FILE *f, const ARGO_HANDLER *handler, void *context, int exact) {
+    static const ARGO_HANDLER no_handler;
+    if(f == NULL) {
+        fprintf(stderr, "ERROR: Null pointer argument.\n");
+        return -1;
+    }
+    ARGO_PARSER p;
+    if(argo_reader_open(&p.reader, f, exact))
+        return -1;
     init_vars();
-    return argo_value(f);
+    p.handler = handler != NULL ? handler : &no_handler;
+    p.context = context;
+    p.string = (ARGO_TEXT){ 0, 0, NULL, 1, 0, { 0, 0, NULL } };
+    p.number = (ARGO_NUMBER){ { 0, 0, NULL }, 0, 0, 0, 0, 0 };
+    int ret = argo_value(&p);
+    argo_reader_close(&p.reader);
+    return ret;
+}
+
+/*
+ * Tree builder: the handler used by argo_read_value() to turn events into
+ * ARGO_VALUEs.  Each value is linked into the innermost open container as it
+ * is created, taking the member name from the preceding key event.  It
+ * takes over the parser's number without copying it, but copies the text of
+ * a string or key into an ARGO_STRING.
+ */
+ARGO_VALUE *argo_build_value(ARGO_BUILDER *b, ARGO_VALUE_TYPE type) {
+    ARGO_VALUE *v = argo_alloc_value();
+    if(v == NULL)
+        return NULL;
+    v->type = type;
+    if(b->depth == 0) {
+        b->root = v;
+        return v;
+    }
+    ARGO_VALUE *parent = b->stack[b->depth - 1];
+    v->name = b->name;
+    b->name = (ARGO_STRING){ 0, 0, NULL };
+    if(parent->type == ARGO_OBJECT_TYPE)
+        add_node(&parent->content.object.member_list, &v);
+    else
+        add_node(&parent->content.array.element_list, &v);
+    return v;
+}
+
+int argo_build_container(ARGO_BUILDER *b, ARGO_VALUE_TYPE type) {
+    ARGO_VALUE *v = argo_build_value(b, type);
+    ARGO_VALUE *sentinel = v != NULL ? argo_alloc_value() : NULL;
+    if(sentinel == NULL)
+        return -1;
+    sentinel->next = sentinel;
+    sentinel->prev = sentinel;
+    if(type == ARGO_OBJECT_TYPE)
+        v->content.object.member_list = sentinel;
+    else
+        v->content.array.element_list = sentinel;
+    if(b->depth == b->capacity) {
+        int capacity = b->capacity ? 2 * b->capacity : 16;
+        ARGO_VALUE **stack = realloc(b->stack, capacity * sizeof(ARGO_VALUE *));
+        if(!stack) {
+            fprintf(stderr, "ERROR: Out of memory.\n");
+            return -1;
+        }
+        b->stack = stack;
+        b->capacity = capacity;
+    }
+    b->stack[b->depth++] = v;
+    return 0;
+}
+
+int argo_build_start_object(void *context) {
+    return argo_build_container(context, ARGO_OBJECT_TYPE);
 }
 
+int argo_build_start_array(void *context) {
+    return argo_build_container(context, ARGO_ARRAY_TYPE);
+}
+
+int argo_build_end(void *context) {
+    --((ARGO_BUILDER *)context)->depth;
+    return 0;
+}
+
+int argo_build_key(void *context, ARGO_TEXT *name) {
+    ARGO_BUILDER *b = context;
+    b->name = (ARGO_STRING){ 0, 0, NULL };
+    return argo_text_string(name, &b->name);
+}
+
+int argo_build_string(void *context, ARGO_TEXT *s) {
+    ARGO_VALUE *v = argo_build_value(context, ARGO_STRING_TYPE);
+    if(v == NULL)
+        return -1;
+    return argo_text_string(s, &v->content.string);
+}
+
+int argo_build_number(void *context, ARGO_NUMBER *n) {
+    ARGO_VALUE *v = argo_build_value(context, ARGO_NUMBER_TYPE);
+    if(v == NULL)
+        return -1;
+    v->content.number = *n;
+    n->string_value = (ARGO_STRING){ 0, 0, NULL };
+    return 0;
+}
+
+int argo_build_basic(void *context, ARGO_BASIC basic) {
+    ARGO_VALUE *v = argo_build_value(context, ARGO_BASIC_TYPE);
+    if(v == NULL)
+        return -1;
+    v->content.basic = basic;
+    return 0;
+}
+
+const ARGO_HANDLER argo_builder = {
+    .start_object = argo_build_start_object,
+    .key = argo_build_key,
+    .end_object = argo_build_end,
+    .start_array = argo_build_start_array,
+    .end_array = argo_build_end,
+    .string = argo_build_string,
+    .number = argo_build_number,
+    .basic = argo_build_basic
+};
+
 void init_vars() {
     argo_chars_read = 0;
     argo_lines_read = 0;
-    argo_next_value = 0;
     indent_level = 0;
 }
 
-void next_char(ARGO_CHAR *c, FILE *f) {
+void next_char(ARGO_CHAR *c, ARGO_READER *r) {
     while(argo_is_whitespace(*c)) {
         ++argo_chars_read;
         if(*c == ARGO_LF) {
             ++argo_lines_read;
             argo_chars_read = 0;
         }
-        *c = fgetc(f);
+        // Skip any further whitespace in the buffer in one go
+        if(r->next < r->end && argo_is_whitespace(*r->next)) {
+            const unsigned char *line = NULL;
+            const unsigned char *p = argo_skip_whitespace(r->next, r->end, &argo_lines_read, &line);
+            if(line != NULL)
+                argo_chars_read = p - line;
+            else
+                argo_chars_read += p - r->next;
+            r->next = p;
+        }
+        *c = argo_getc(r);
     }
 }
 
-ARGO_VALUE *argo_value(FILE *f) {
-    if(f == NULL) {
-        fprintf(stderr, "ERROR: Null pointer argument.\n");
-        return NULL;
-    }
-    if(argo_next_value == NUM_ARGO_VALUES) {
-        fprintf(stderr, "ERROR: Out of memory. (Value capacity: %d.)\n", NUM_ARGO_VALUES);
-        return NULL;
-    }
-    ARGO_VALUE *value = argo_value_storage + argo_next_value++;
-    ARGO_CHAR c = fgetc(f);
-    next_char(&c, f);
+int argo_value(ARGO_PARSER *p) {
+    ARGO_READER *r = &p->reader;
+    ARGO_CHAR c = argo_getc(r);
+    next_char(&c, r);
     if(c == EOF && indent_level == 0) {
         fprintf(stderr, "[%d:%d] ERROR: Blank file.\n", argo_lines_read, argo_chars_read);
-        return NULL;
+        return -1;
     }
     if(eof(c))
-        return NULL;
-    argo_value_helper(&c, &value, f);
-    return value;
+        return -1;
+    return argo_value_helper(&c, p);
 }
 
-int argo_value_helper(ARGO_CHAR *c, ARGO_VALUE **value, FILE *f) {
+int argo_value_helper(ARGO_CHAR *c, ARGO_PARSER *p) {
+    ARGO_READER *r = &p->reader;
     // ARGO_BASIC
     if(*c == ARGO_T || *c == ARGO_F || *c == ARGO_N) {
         ARGO_CHAR token = *c;
-        ungetc(*c, f);
-        if(argo_read_basic(&(*value)->content.basic, f)) {
-            *value = NULL;
+        ARGO_BASIC b;
+        argo_ungetc(*c, r);
+        if(argo_read_basic(&b, r) || ARGO_EMIT(p, basic, b))
             return -1;
-        }
-        *c = fgetc(f);
-        next_char(c, f);
+        *c = argo_getc(r);
+        next_char(c, r);
         if((indent_level == 0 && *c == EOF) || (indent_level > 0 && (*c == ARGO_RBRACE || *c == ARGO_RBRACK || *c == ARGO_COMMA))) {
-            ungetc(*c, f);
-            (*value)->type = ARGO_BASIC_TYPE;
+            argo_ungetc(*c, r);
             return 0;
         }
         if(eof(*c)) {
-            *value = NULL;
             return -1;
         }
         ++argo_chars_read;
@@ -137,29 +370,25 @@ int argo_value_helper(ARGO_CHAR *c, ARGO_VALUE **value, FILE *f) {
             else
                 fprintf(stderr, "[%d:%d] ERROR: Invalid character '%c' (%d) after token '%s'.\n", argo_lines_read, argo_chars_read, *c, *c, ARGO_NULL_TOKEN);
         }
-        *value = NULL;
         return -1;
     }
     // ARGO_STRING
     if(*c == ARGO_QUOTE) {
-        ungetc(*c, f);
-        if(argo_read_string(&(*value)->content.string, f)) {
-            *value = NULL;
+        argo_ungetc(*c, r);
+        argo_text_reset(&p->string);
+        if(argo_scan_string(&p->string, r) || ARGO_EMIT(p, string, &p->string))
             return -1;
-        }
         // Check if next non-whitespace token is valid,
         // i.e., it is EOF for top indent level or
         // ':' after name of object member, ',', ']', '}'
         // after array element or object member value.
-        *c = fgetc(f);
-        next_char(c, f);
+        *c = argo_getc(r);
+        next_char(c, r);
         if((indent_level == 0 && *c == EOF) || (indent_level > 0 && (*c == ARGO_COLON || *c == ARGO_COMMA || *c == ARGO_RBRACE || *c == ARGO_RBRACK))) {
-            ungetc(*c, f);
-            (*value)->type = ARGO_STRING_TYPE;
+            argo_ungetc(*c, r);
             return 0;
         }
         if(eof(*c)) {
-            *value = NULL;
             return -1;
         }
         ++argo_chars_read;
@@ -167,25 +396,21 @@ int argo_value_helper(ARGO_CHAR *c, ARGO_VALUE **value, FILE *f) {
             fprintf(stderr, "[%d:%d] ERROR: Invalid character (%d) after string.\n", argo_lines_read, argo_chars_read, *c);
         else
             fprintf(stderr, "[%d:%d] ERROR: Invalid character '%c' (%d) after string.\n", argo_lines_read, argo_chars_read, *c, *c);
-        *value = NULL;
         return -1;
     }
     // ARGO_NUMBER
     if(argo_is_digit(*c) || *c == ARGO_MINUS) {
-        ungetc(*c, f);
-        if(argo_read_number(&(*value)->content.number, f)) {
-            *value = NULL;
+        argo_ungetc(*c, r);
+        p->number.string_value.length = 0;
+        if(argo_scan_number(&p->number, r) || ARGO_EMIT(p, number, &p->number))
             return -1;
-        }
-        *c = fgetc(f);
-        next_char(c, f);
+        *c = argo_getc(r);
+        next_char(c, r);
         if((indent_level == 0 && *c == EOF) || (indent_level > 0 && (*c == ARGO_COMMA || *c == ARGO_RBRACE || *c == ARGO_RBRACK))) {
-            ungetc(*c, f);
-            (*value)->type = ARGO_NUMBER_TYPE;
+            argo_ungetc(*c, r);
             return 0;
         }
         if(eof(*c)) {
-            *value = NULL;
             return -1;
         }
         ++argo_chars_read;
@@ -193,25 +418,20 @@ int argo_value_helper(ARGO_CHAR *c, ARGO_VALUE **value, FILE *f) {
             fprintf(stderr, "[%d:%d] ERROR: Invalid character (%d) after number.\n", argo_lines_read, argo_chars_read, *c);
         else
             fprintf(stderr, "[%d:%d] ERROR: Invalid character '%c' (%d) after number.\n", argo_lines_read, argo_chars_read, *c, *c);
-        *value = NULL;
         return -1;
     }
     // ARGO_ARRAY
     if(*c == ARGO_LBRACK) {
-        ungetc(*c, f);
-        if(argo_read_array(&(*value)->content.array, f)) {
-            *value = NULL;
+        argo_ungetc(*c, r);
+        if(argo_read_array(p))
             return -1;
-        }
-        *c = fgetc(f);
-        next_char(c, f);
+        *c = argo_getc(r);
+        next_char(c, r);
         if((indent_level == 0 && *c == EOF) || (indent_level > 0 && (*c == ARGO_COMMA || *c == ARGO_RBRACE || *c == ARGO_RBRACK))) {
-            ungetc(*c, f);
-            (*value)->type = ARGO_ARRAY_TYPE;
+            argo_ungetc(*c, r);
             return 0;
         }
         if(eof(*c)) {
-            *value = NULL;
             return -1;
         }
         ++argo_chars_read;
@@ -219,25 +439,20 @@ int argo_value_helper(ARGO_CHAR *c, ARGO_VALUE **value, FILE *f) {
             fprintf(stderr, "[%d:%d] ERROR: Invalid character (%d) after array.\n", argo_lines_read, argo_chars_read, *c);
         else
             fprintf(stderr, "[%d:%d] ERROR: Invalid character '%c' (%d) after array.\n", argo_lines_read, argo_chars_read, *c, *c);
-        *value = NULL;
         return -1;
     }
     // ARGO_OBJECT
     if(*c == ARGO_LBRACE) {
-        ungetc(*c, f);
-        if(argo_read_object(&(*value)->content.object, f)) {
-            *value = NULL;
+        argo_ungetc(*c, r);
+        if(argo_read_object(p))
             return -1;
-        }
-        *c = fgetc(f);
-        next_char(c, f);
+        *c = argo_getc(r);
+        next_char(c, r);
         if((indent_level == 0 && *c == EOF) || (indent_level > 0 && (*c == ARGO_COMMA || *c == ARGO_RBRACE || *c == ARGO_RBRACK))) {
-            ungetc(*c, f);
-            (*value)->type = ARGO_OBJECT_TYPE;
+            argo_ungetc(*c, r);
             return 0;
         }
         if(eof(*c)) {
-            *value = NULL;
             return -1;
         }
         ++argo_chars_read;
@@ -245,7 +460,6 @@ int argo_value_helper(ARGO_CHAR *c, ARGO_VALUE **value, FILE *f) {
             fprintf(stderr, "[%d:%d] ERROR: Invalid character (%d) after object.\n", argo_lines_read, argo_chars_read, *c);
         else
             fprintf(stderr, "[%d:%d] ERROR: Invalid character '%c' (%d) after object.\n", argo_lines_read, argo_chars_read, *c, *c);
-        *value = NULL;
         return -1;
     }
     ++argo_chars_read;
@@ -253,7 +467,6 @@ int argo_value_helper(ARGO_CHAR *c, ARGO_VALUE **value, FILE *f) {
         fprintf(stderr, "[%d:%d] ERROR: Invalid character (%d) at start of value.\n", argo_lines_read, argo_chars_read, *c);
     else
         fprintf(stderr, "[%d:%d] ERROR: Invalid character '%c' (%d) at start of value.\n", argo_lines_read, argo_chars_read, *c, *c);
-    *value = NULL;
     return -1;
 }
 
@@ -272,9 +485,9 @@ void print_char_err(ARGO_CHAR c1, ARGO_CHAR c2, char *c) {
         fprintf(stderr, "[%d:%d] ERROR: Expected '%c' (%d) but got '%c' (%d) for token '%s'.\n", argo_lines_read, argo_chars_read, c1, c1, c2, c2, c);
 }
 
-int argo_read_basic_helper(ARGO_CHAR *c, FILE *f, ARGO_BASIC **b, char *token, ARGO_BASIC type) {
+int argo_read_basic_helper(ARGO_CHAR *c, ARGO_READER *r, ARGO_BASIC **b, char *token, ARGO_BASIC type) {
     for(int i = 1; *(token + i) != '\0'; ++i) {
-        *c = fgetc(f);
+        *c = argo_getc(r);
         if(eof(*c)) {
             *b = NULL;
             return -1;
@@ -290,24 +503,24 @@ int argo_read_basic_helper(ARGO_CHAR *c, FILE *f, ARGO_BASIC **b, char *token, A
     return 0;
 }
 
-int argo_read_basic(ARGO_BASIC *b, FILE *f) {
-    if(b == NULL || f == NULL) {
+int argo_read_basic(ARGO_BASIC *b, ARGO_READER *r) {
+    if(b == NULL || r == NULL) {
         fprintf(stderr, "ERROR: Null pointer argument.\n");
         b = NULL;
         return -1;
     }
-    ARGO_CHAR c = fgetc(f);
+    ARGO_CHAR c = argo_getc(r);
     if(eof(c)) {
         b = NULL;
         return -1;
     }
     ++argo_chars_read;
     if(c == ARGO_N)
-        return argo_read_basic_helper(&c, f, &b, ARGO_NULL_TOKEN, ARGO_NULL);
+        return argo_read_basic_helper(&c, r, &b, ARGO_NULL_TOKEN, ARGO_NULL);
     if(c == ARGO_T)
-        return argo_read_basic_helper(&c, f, &b, ARGO_TRUE_TOKEN, ARGO_TRUE);
+        return argo_read_basic_helper(&c, r, &b, ARGO_TRUE_TOKEN, ARGO_TRUE);
     if(c == ARGO_F)
-        return argo_read_basic_helper(&c, f, &b, ARGO_FALSE_TOKEN, ARGO_FALSE);
+        return argo_read_basic_helper(&c, r, &b, ARGO_FALSE_TOKEN, ARGO_FALSE);
     if(argo_is_control(c))
         fprintf(stderr, "[%d:%d] ERROR: Invalid character (%d) at start of value.\n", argo_lines_read, argo_chars_read, c);
     else
@@ -344,11 +557,25 @@ void print_err(ARGO_CHAR c, char *type) {
 int argo_read_string(ARGO_STRING *s, FILE *f) {
     // TO BE IMPLEMENTED.
     if(s == NULL || f == NULL) {
+        fprintf(stderr, "ERROR: Null pointer argument.\n");
+        return -1;
+    }
+    ARGO_READER r;
+    if(argo_reader_open(&r, f, 1))
+        return -1;
+    ARGO_TEXT t = { 0, 0, NULL, 1, 0, { 0, 0, NULL } };
+    int ret = argo_scan_string(&t, &r) || argo_text_string(&t, s);
+    argo_reader_close(&r);
+    return ret ? -1 : 0;
+}
+
+int argo_scan_string(ARGO_TEXT *s, ARGO_READER *r) {
+    if(s == NULL || r == NULL) {
         fprintf(stderr, "ERROR: Null pointer argument.\n");
         s = NULL;
         return -1;
     }
-    ARGO_CHAR c = fgetc(f);
+    ARGO_CHAR c = argo_getc(r);
     if(eof(c)) {
         s = NULL;
         return -1;
@@ -362,7 +589,7 @@ int argo_read_string(ARGO_STRING *s, FILE *f) {
         s = NULL;
         return -1;
     }
-    c = fgetc(f);
+    c = argo_getc(r);
     while(c != ARGO_QUOTE) {
         if(eof(c)) {
             s = NULL;
@@ -377,7 +604,7 @@ int argo_read_string(ARGO_STRING *s, FILE *f) {
         }
         // Handle escape characters
         if(c == ARGO_BSLASH) {
-            c = fgetc(f);
+            c = argo_getc(r);
             if(eof(c)) {
                 s = NULL;
                 return -1;
@@ -397,7 +624,7 @@ int argo_read_string(ARGO_STRING *s, FILE *f) {
                 ARGO_CHAR t;
                 c = 0;
                 for(int i = 3; i >= 0; --i) {
-                    t = fgetc(f);
+                    t = argo_getc(r);
                     if(eof(t)) {
                         s = NULL;
                         return -1;
@@ -433,12 +660,22 @@ int argo_read_string(ARGO_STRING *s, FILE *f) {
                 return -1;
             }
         }
-        // If valid, call argo_append_char()
-        if(argo_append_char(s, c)) {
+        // If valid, append it to the string
+        if(argo_text_append(s, c)) {
             s = NULL;
             return -1;
         }
-        c = fgetc(f);
+        // Copy any ordinary characters that follow in one go
+        const unsigned char *run = argo_scan_string_run(r->next, r->end);
+        if(run > r->next) {
+            if(argo_text_append_bytes(s, r->next, run - r->next)) {
+                s = NULL;
+                return -1;
+            }
+            argo_chars_read += run - r->next;
+            r->next = run;
+        }
+        c = argo_getc(r);
     }
     ++argo_chars_read;
     return 0;
@@ -469,11 +706,24 @@ int argo_read_string(ARGO_STRING *s, FILE *f) {
 int argo_read_number(ARGO_NUMBER *n, FILE *f) {
     // TO BE IMPLEMENTED.
     if(n == NULL || f == NULL) {
+        fprintf(stderr, "ERROR: Null pointer argument.\n");
+        return -1;
+    }
+    ARGO_READER r;
+    if(argo_reader_open(&r, f, 1))
+        return -1;
+    int ret = argo_scan_number(n, &r);
+    argo_reader_close(&r);
+    return ret;
+}
+
+int argo_scan_number(ARGO_NUMBER *n, ARGO_READER *r) {
+    if(n == NULL || r == NULL) {
         fprintf(stderr, "ERROR: Null pointer argument.\n");
         n = NULL;
         return -1;
     }
-    ARGO_CHAR c = fgetc(f);
+    ARGO_CHAR c = argo_getc(r);
     if(eof(c)) {
         n = NULL;
         return -1;
@@ -491,10 +741,10 @@ int argo_read_number(ARGO_NUMBER *n, FILE *f) {
     n->valid_float = 1;
     n->valid_int = 1;
     char negative = 0;
-    argo_append_char(&n->string_value, c);
+    argo_string_append(&n->string_value, c);
     if(c == ARGO_MINUS) {
         negative = 1;
-        c = fgetc(f);
+        c = argo_getc(r);
         if(eof(c)) {
             n = NULL;
             return -1;
@@ -508,14 +758,15 @@ int argo_read_number(ARGO_NUMBER *n, FILE *f) {
             n = NULL;
             return -1;
         }
-        argo_append_char(&n->string_value, c);
+        argo_string_append(&n->string_value, c);
     }
     n->int_value = c - ARGO_DIGIT0;
-    n->float_value = n->int_value;
+    ARGO_DECIMAL d = { 0, 0, 0, 0 };
+    argo_decimal_digit(&d, c);
     if(c != ARGO_DIGIT0)
-        c = fgetc(f);
+        c = argo_getc(r);
     else {
-        c = fgetc(f);
+        c = argo_getc(r);
         if(argo_is_digit(c)) {
             ++argo_chars_read;
             fprintf(stderr, "[%d:%d] ERROR: Leading zeros in number.\n", argo_lines_read, argo_chars_read);
@@ -529,7 +780,6 @@ int argo_read_number(ARGO_NUMBER *n, FILE *f) {
     char int_underflow = 0;
     char float_underflow = 0;
     unsigned long long temp_llong = n->int_value;
-    long double temp_ldouble = n->float_value;
     while(argo_is_digit(c)) {
         ++argo_chars_read;
         n->int_value = n->int_value * 10 + (c - ARGO_DIGIT0);
@@ -538,22 +788,17 @@ int argo_read_number(ARGO_NUMBER *n, FILE *f) {
             int_underflow = 1;
         if(!negative && temp_llong > LONG_MAX)
             int_overflow = 1;
-        n->float_value = n->float_value * 10 + (c - ARGO_DIGIT0);
-        temp_ldouble = temp_ldouble * 10 + (c - ARGO_DIGIT0);
-        if(negative && temp_ldouble > DBL_MAX)
-            float_underflow = 1;
-        if(!negative && temp_ldouble > DBL_MAX)
-            float_overflow = 1;
-        argo_append_char(&n->string_value, c);
-        c = fgetc(f);
+        argo_decimal_digit(&d, c);
+        argo_string_append(&n->string_value, c);
+        c = argo_getc(r);
     }
     if(negative)
         n->int_value *= -1;
     if(c == ARGO_PERIOD) {
         ++argo_chars_read;
-        argo_append_char(&n->string_value, c);
+        argo_string_append(&n->string_value, c);
         n->valid_int = 0;
-        c = fgetc(f);
+        c = argo_getc(r);
         if(eof(c)) {
             n = NULL;
             return -1;
@@ -567,33 +812,19 @@ int argo_read_number(ARGO_NUMBER *n, FILE *f) {
             n = NULL;
             return -1;
         }
-        int count = 0;
         while(argo_is_digit(c)) {
             ++argo_chars_read;
-            ++count;
-            n->float_value = n->float_value * 10 + (c - ARGO_DIGIT0);
-            temp_ldouble = temp_ldouble * 10 + (c - ARGO_DIGIT0);
-            if(negative && temp_ldouble > DBL_MAX)
-                float_underflow = 1;
-            if(!negative && temp_ldouble > DBL_MAX)
-                float_overflow = 1;
-            argo_append_char(&n->string_value, c);
-            c = fgetc(f);
-        }
-        for(int i = 0; i < count; ++i) {
-            n->float_value /= 10;
-            temp_ldouble /= 10;
-            if(negative && temp_ldouble > DBL_MAX)
-                float_underflow = 1;
-            if(!negative && temp_ldouble > DBL_MAX)
-                float_overflow = 1;
+            ++d.fraction;
+            argo_decimal_digit(&d, c);
+            argo_string_append(&n->string_value, c);
+            c = argo_getc(r);
         }
     }
     if(argo_is_exponent(c)) {
         ++argo_chars_read;
-        argo_append_char(&n->string_value, c);
+        argo_string_append(&n->string_value, c);
         n->valid_int = 0;
-        c = fgetc(f);
+        c = argo_getc(r);
         if(eof(c)) {
             n = NULL;
             return -1;
@@ -607,9 +838,9 @@ int argo_read_number(ARGO_NUMBER *n, FILE *f) {
             n = NULL;
             return -1;
         }
-        argo_append_char(&n->string_value, c);
+        argo_string_append(&n->string_value, c);
         if(c == ARGO_MINUS) {
-            c = fgetc(f);
+            c = argo_getc(r);
             if(eof(c)) {
                 n = NULL;
                 return -1;
@@ -623,9 +854,9 @@ int argo_read_number(ARGO_NUMBER *n, FILE *f) {
                 n = NULL;
                 return -1;
             }
-            argo_append_char(&n->string_value, c);
+            argo_string_append(&n->string_value, c);
             unsigned long long exp = c - ARGO_DIGIT0;
-            c = fgetc(f);
+            c = argo_getc(r);
             while(argo_is_digit(c)) {
                 exp = exp * 10 + (c - ARGO_DIGIT0);
                 if((exp != 0) && (exp - 1 > LONG_MAX)) {
@@ -634,21 +865,14 @@ int argo_read_number(ARGO_NUMBER *n, FILE *f) {
                     return -1;
                 }
                 ++argo_chars_read;
-                argo_append_char(&n->string_value, c);
-                c = fgetc(f);
-            }
-            for(int i = 0; i < exp; ++i) {
-                n->float_value /= 10;
-                temp_ldouble /= 10;
-                if(negative && temp_ldouble > DBL_MAX)
-                    float_underflow = 1;
-                if(!negative && temp_ldouble > DBL_MAX)
-                    float_overflow = 1;
+                argo_string_append(&n->string_value, c);
+                c = argo_getc(r);
             }
+            d.exponent = exp > ARGO_DECIMAL_MAX_EXPONENT ? -ARGO_DECIMAL_MAX_EXPONENT : -(long)exp;
         }
         else {
             if(c == ARGO_PLUS) {
-                c = fgetc(f);
+                c = argo_getc(r);
                 if(eof(c)) {
                     n = NULL;
                     return -1;
@@ -662,10 +886,10 @@ int argo_read_number(ARGO_NUMBER *n, FILE *f) {
                     n = NULL;
                     return -1;
                 }
-                argo_append_char(&n->string_value, c);
+                argo_string_append(&n->string_value, c);
             }
             unsigned long long exp = c - ARGO_DIGIT0;
-            c = fgetc(f);
+            c = argo_getc(r);
             while(argo_is_digit(c)) {
                 exp = exp * 10 + (c - ARGO_DIGIT0);
                 if(exp > LONG_MAX) {
@@ -674,19 +898,22 @@ int argo_read_number(ARGO_NUMBER *n, FILE *f) {
                     return -1;
                 }
                 ++argo_chars_read;
-                argo_append_char(&n->string_value, c);
-                c = fgetc(f);
-            }
-            for(int i = 0; i < exp; ++i) {
-                n->float_value *= 10;
-                temp_ldouble *= 10;
-                if(negative && temp_ldouble > DBL_MAX)
-                    float_underflow = 1;
-                if(!negative && temp_ldouble > DBL_MAX)
-                    float_overflow = 1;
+                argo_string_append(&n->string_value, c);
+                c = argo_getc(r);
             }
+            d.exponent = exp > ARGO_DECIMAL_MAX_EXPONENT ? ARGO_DECIMAL_MAX_EXPONENT : (long)exp;
         }
     }
+    double magnitude;
+    if(argo_decimal_value(&d, &n->string_value, &magnitude)) {
+        n = NULL;
+        return -1;
+    }
+    if(negative && magnitude > DBL_MAX)
+        float_underflow = 1;
+    if(!negative && magnitude > DBL_MAX)
+        float_overflow = 1;
+    n->float_value = negative ? -magnitude : magnitude;
     if(int_overflow || float_overflow) {
         fprintf(stderr, "[%d:%d] ERROR: Overflow in number.\n", argo_lines_read, argo_chars_read);
         n = NULL;
@@ -699,21 +926,14 @@ int argo_read_number(ARGO_NUMBER *n, FILE *f) {
     }
     if(!n->valid_int)
         n->int_value = 0;
-    if(negative)
-        n->float_value *= -1;
-    ungetc(c, f);
+    argo_ungetc(c, r);
     return 0;
 }
 
-int argo_read_array(ARGO_ARRAY *a, FILE *f) {
-    if(a == NULL || f == NULL) {
-        fprintf(stderr, "ERROR: Null pointer argument.\n");
-        a = NULL;
-        return -1;
-    }
-    ARGO_CHAR c = fgetc(f);
+int argo_read_array(ARGO_PARSER *p) {
+    ARGO_READER *r = &p->reader;
+    ARGO_CHAR c = argo_getc(r);
     if(eof(c)) {
-        a = NULL;
         return -1;
     }
     ++argo_chars_read;
@@ -722,60 +942,45 @@ int argo_read_array(ARGO_ARRAY *a, FILE *f) {
             fprintf(stderr, "[%d:%d] ERROR: Invalid character (%d) at start of value.\n", argo_lines_read, argo_chars_read, c);
         else
             fprintf(stderr, "[%d:%d] ERROR: Invalid character '%c' (%d) at start of value.\n", argo_lines_read, argo_chars_read, c, c);
-        a = NULL;
         return -1;
     }
-    if(argo_next_value == NUM_ARGO_VALUES) {
-        fprintf(stderr, "ERROR: Out of memory. (Value capacity: %d.)\n", NUM_ARGO_VALUES);
-        a = NULL;
+    if(ARGO_EMIT(p, start_array))
         return -1;
-    }
     ++indent_level;
-    a->element_list = argo_value_storage + argo_next_value++;
-    a->element_list->next = a->element_list;
-    a->element_list->prev = a->element_list;
-    c = fgetc(f);
-    next_char(&c, f);
+    c = argo_getc(r);
+    next_char(&c, r);
     if(c == ARGO_RBRACK)
         ++argo_chars_read;
     while(c != ARGO_RBRACK) {
         if(eof(c)) {
-            a = NULL;
             return -1;
         }
-        ungetc(c, f);
-        ARGO_VALUE *value = argo_value(f);
-        if(value == NULL) {
-            a = NULL;
+        argo_ungetc(c, r);
+        if(argo_value(p))
             return -1;
-        }
-        add_node(&a->element_list, &value);
-        c = fgetc(f);
-        next_char(&c, f);
+        c = argo_getc(r);
+        next_char(&c, r);
         if(eof(c)) {
-            a = NULL;
             return -1;
         }
         ++argo_chars_read;
         if(c != ARGO_COMMA && c != ARGO_RBRACK) {
             print_err(c, "array");
-            a = NULL;
             return -1;
         }
         if(c == ARGO_COMMA) {
-            c = fgetc(f);
-            next_char(&c, f);
+            c = argo_getc(r);
+            next_char(&c, r);
             if(c == ARGO_RBRACK) {
                 ++argo_chars_read;
                 fprintf(stderr, "[%d:%d] ERROR: Premature end of array.\n", argo_lines_read, argo_chars_read);
-                a = NULL;
                 return -1;
             }
         }
     }
     // If end of array, then decrement indent level by one
     --indent_level;
-    return 0;
+    return ARGO_EMIT(p, end_array) ? -1 : 0;
 }
 
 void add_node(ARGO_VALUE **sentinel, ARGO_VALUE **value) {
@@ -785,15 +990,10 @@ void add_node(ARGO_VALUE **sentinel, ARGO_VALUE **value) {
     (*sentinel)->prev = *value;
 }
 
-int argo_read_object(ARGO_OBJECT *o, FILE *f) {
-    if(o == NULL || f == NULL) {
-        fprintf(stderr, "ERROR: Null pointer argument.\n");
-        o = NULL;
-        return -1;
-    }
-    ARGO_CHAR c = fgetc(f);
+int argo_read_object(ARGO_PARSER *p) {
+    ARGO_READER *r = &p->reader;
+    ARGO_CHAR c = argo_getc(r);
     if(eof(c)) {
-        o = NULL;
         return -1;
     }
     ++argo_chars_read;
@@ -802,25 +1002,17 @@ int argo_read_object(ARGO_OBJECT *o, FILE *f) {
             fprintf(stderr, "[%d:%d] ERROR: Invalid character (%d) at start of value.\n", argo_lines_read, argo_chars_read, c);
         else
             fprintf(stderr, "[%d:%d] ERROR: Invalid character '%c' (%d) at start of value.\n", argo_lines_read, argo_chars_read, c, c);
-        o = NULL;
         return -1;
     }
-    if(argo_next_value == NUM_ARGO_VALUES) {
-        fprintf(stderr, "ERROR: Out of memory. (Value capacity: %d.)\n", NUM_ARGO_VALUES);
-        o = NULL;
+    if(ARGO_EMIT(p, start_object))
         return -1;
-    }
     ++indent_level;
-    o->member_list = argo_value_storage + argo_next_value++;
-    o->member_list->next = o->member_list;
-    o->member_list->prev = o->member_list;
-    c = fgetc(f);
-    next_char(&c, f);
+    c = argo_getc(r);
+    next_char(&c, r);
     if(c == ARGO_RBRACE)
         ++argo_chars_read;
     while(c != ARGO_RBRACE) {
         if(eof(c)) {
-            o = NULL;
             return -1;
         }
         if(c != ARGO_QUOTE) {
@@ -829,24 +1021,15 @@ int argo_read_object(ARGO_OBJECT *o, FILE *f) {
                 fprintf(stderr, "[%d:%d] ERROR: Expected '%c' (%d) but got control character (%d) for object member.\n", argo_lines_read, argo_chars_read, ARGO_QUOTE, ARGO_QUOTE, c);
             else
                 fprintf(stderr, "[%d:%d] ERROR: Expected '%c' (%d) but got '%c' (%d) for object member.\n", argo_lines_read, argo_chars_read, ARGO_QUOTE, ARGO_QUOTE, c, c);
-            o = NULL;
             return -1;
         }
-        if(argo_next_value == NUM_ARGO_VALUES) {
-            fprintf(stderr, "ERROR: Out of memory. (Value capacity: %d.)\n", NUM_ARGO_VALUES);
-            o = NULL;
+        argo_ungetc(c, r);
+        argo_text_reset(&p->string);
+        if(argo_scan_string(&p->string, r) || ARGO_EMIT(p, key, &p->string))
             return -1;
-        }
-        ARGO_VALUE *value = argo_value_storage + argo_next_value++;
-        ungetc(c, f);
-        if(argo_read_string(&value->name, f)) {
-            o = NULL;
-            return -1;
-        }
-        c = fgetc(f);
-        next_char(&c, f);
+        c = argo_getc(r);
+        next_char(&c, r);
         if(eof(c)) {
-            o = NULL;
             return -1;
         }
         ++argo_chars_read;
@@ -855,47 +1038,38 @@ int argo_read_object(ARGO_OBJECT *o, FILE *f) {
                 fprintf(stderr, "[%d:%d] ERROR: Expected '%c' (%d) but got control character (%d) for object member.\n", argo_lines_read, argo_chars_read, ARGO_COLON, ARGO_COLON, c);
             else
                 fprintf(stderr, "[%d:%d] ERROR: Expected '%c' (%d) but got '%c' (%d) for object member.\n", argo_lines_read, argo_chars_read, ARGO_COLON, ARGO_COLON, c, c);
-            o = NULL;
             return -1;
         }
-        c = fgetc(f);
-        next_char(&c, f);
+        c = argo_getc(r);
+        next_char(&c, r);
         if(eof(c)) {
-            o = NULL;
             return -1;
         }
-        argo_value_helper(&c, &value, f);
-        if(value == NULL) {
-            o = NULL;
+        if(argo_value_helper(&c, p))
             return -1;
-        }
-        add_node(&o->member_list, &value);
-        c = fgetc(f);
-        next_char(&c, f);
+        c = argo_getc(r);
+        next_char(&c, r);
         if(eof(c)) {
-            o = NULL;
             return -1;
         }
         ++argo_chars_read;
         if(c != ARGO_COMMA && c != ARGO_RBRACE) {
             print_err(c, "object");
-            o = NULL;
             return -1;
         }
         if(c == ARGO_COMMA) {
-            c = fgetc(f);
-            next_char(&c, f);
+            c = argo_getc(r);
+            next_char(&c, r);
             if(c == ARGO_RBRACE) {
                 ++argo_chars_read;
                 fprintf(stderr, "[%d:%d] ERROR: Premature end of object.\n", argo_lines_read, argo_chars_read);
-                o = NULL;
                 return -1;
             }
         }
     }
     // If end of object, then decrement indent level by one
     --indent_level;
-    return 0;
+    return ARGO_EMIT(p, end_object) ? -1 : 0;
 }
 
 /**
@@ -914,55 +1088,67 @@ int argo_read_object(ARGO_OBJECT *o, FILE *f) {
 int argo_write_value(ARGO_VALUE *v, FILE *f) {
     // TO BE IMPLEMENTED.
     // global_options & 0xff gives the number of spaces per indentation level
+    if(v == NULL || f == NULL) {
+        fprintf(stderr, "[Write] ERROR: Null pointer argument.\n");
+        return -1;
+    }
+    ARGO_WRITER w;
+    argo_writer_open(&w, f, argo_write_buffer, sizeof(argo_write_buffer));
     indent_level = 0;
-    return argo_write(v, f);
+    int ret = argo_write(v, &w);
+    if(argo_writer_flush(&w)) {
+        if(!ret)
+            fprintf(stderr, "[Write] ERROR: Could not write to stream.\n");
+        return -1;
+    }
+    return ret;
 }
 
-int argo_write(ARGO_VALUE *v, FILE *f) {
-    if(v == NULL || f == NULL) {
+int argo_write(ARGO_VALUE *v, ARGO_WRITER *w) {
+    if(v == NULL || w == NULL) {
         fprintf(stderr, "[Write] ERROR: Null pointer argument.\n");
         return -1;
     }
     if(v->type == ARGO_BASIC_TYPE) {
-        if(!argo_write_basic(&v->content.basic, f)) {
+        if(!argo_put_basic(&v->content.basic, w)) {
             if((global_options & PRETTY_PRINT_OPTION) == PRETTY_PRINT_OPTION && indent_level == 0) {
-                if(fputc(ARGO_LF, f) == EOF)
+                if(argo_put(w, ARGO_LF))
                     return -1;
             }
             return 0;
         }
     }
     if(v->type == ARGO_STRING_TYPE) {
-        if(!argo_write_string(&v->content.string, f)) {
+        if(!argo_put_string(&v->content.string, w)) {
             if((global_options & PRETTY_PRINT_OPTION) == PRETTY_PRINT_OPTION && indent_level == 0) {
-                if(fputc(ARGO_LF, f) == EOF)
+                if(argo_put(w, ARGO_LF))
                     return -1;
             }
             return 0;
         }
     }
     if(v->type == ARGO_NUMBER_TYPE) {
-        if(!argo_write_number(&v->content.number, f)) {
+        if(!argo_put_number(&v->content.number, w)) {
             if((global_options & PRETTY_PRINT_OPTION) == PRETTY_PRINT_OPTION && indent_level == 0) {
-                if(fputc(ARGO_LF, f) == EOF)
+                if(argo_put(w, ARGO_LF))
                     return -1;
             }
             return 0;
         }
     }
     if(v->type == ARGO_ARRAY_TYPE) {
-        if(!argo_write_array(&v->content.array, f)) {
+        if(!argo_write_array(&v->content.array, w)) {
             if((global_options & PRETTY_PRINT_OPTION) == PRETTY_PRINT_OPTION && indent_level == 0) {
-                if(fputc(ARGO_LF, f) == EOF)
+                if(argo_put(w, ARGO_LF))
                     return -1;
             }
             return 0;
         }
     }
     if(v->type == ARGO_OBJECT_TYPE) {
-        if(!argo_write_object(&v->content.object, f)) {
+        if(!argo_write_object(&v->content.object, w)) {
             if((global_options & PRETTY_PRINT_OPTION) == PRETTY_PRINT_OPTION && indent_level == 0) {
-                if(fputc(ARGO_LF, f) == EOF)
+                if(argo_put(w, ARGO_LF))
                     return -1;
             }
             return 0;
@@ -977,21 +1163,19 @@ int argo_write_basic(ARGO_BASIC *b, FILE *f) {
         fprintf(stderr, "[Write] ERROR: Null pointer argument.\n");
         return -1;
     }
-    if(*b == ARGO_NULL) {
-        if(fputs(ARGO_NULL_TOKEN, f) == EOF)
-            return -1;
-        return 0;
-    }
-    if(*b == ARGO_TRUE) {
-        if(fputs(ARGO_TRUE_TOKEN, f) == EOF)
-            return -1;
-        return 0;
-    }
-    if(*b == ARGO_FALSE) {
-        if(fputs(ARGO_FALSE_TOKEN, f) == EOF)
-            return -1;
-        return 0;
-    }
+    ARGO_WRITER w;
+    argo_writer_open(&w, f, argo_write_buffer, sizeof(argo_write_buffer));
+    int ret = argo_put_basic(b, &w);
+    return argo_writer_flush(&w) || ret ? -1 : 0;
+}
+
+int argo_put_basic(ARGO_BASIC *b, ARGO_WRITER *w) {
+    if(*b == ARGO_NULL)
+        return argo_put_bytes(w, ARGO_NULL_TOKEN, sizeof(ARGO_NULL_TOKEN) - 1);
+    if(*b == ARGO_TRUE)
+        return argo_put_bytes(w, ARGO_TRUE_TOKEN, sizeof(ARGO_TRUE_TOKEN) - 1);
+    if(*b == ARGO_FALSE)
+        return argo_put_bytes(w, ARGO_FALSE_TOKEN, sizeof(ARGO_FALSE_TOKEN) - 1);
     return -1;
 }
 
@@ -1021,104 +1205,141 @@ int argo_write_string(ARGO_STRING *s, FILE *f) {
         fprintf(stderr, "[Write] ERROR: Null pointer argument.\n");
         return -1;
     }
-    if(fputc(ARGO_QUOTE, f) == EOF)
+    ARGO_WRITER w;
+    argo_writer_open(&w, f, argo_write_buffer, sizeof(argo_write_buffer));
+    int ret = argo_put_string(s, &w);
+    return argo_writer_flush(&w) || ret ? -1 : 0;
+}
+
+int argo_put_string(ARGO_STRING *s, ARGO_WRITER *w) {
+    if(argo_put(w, ARGO_QUOTE))
         return -1;
-    ARGO_CHAR c;
     for(int i = 0; i < s->length; ++i) {
-        c = *(s->content + i);
-        if(c > 0xffff || c < 0)
+        if(argo_put_char(*(s->content + i), w))
             return -1;
-        if(c == ARGO_BSLASH) {
-            if(fputc(ARGO_BSLASH, f) == EOF)
-                return -1;
-            if(fputc(ARGO_BSLASH, f) == EOF)
-                return -1;
-        }
-        else if(c == ARGO_QUOTE) {
-            if(fputc(ARGO_BSLASH, f) == EOF)
-                return -1;
-            if(fputc(ARGO_QUOTE, f) == EOF)
-                return -1;
-        }
-        else if(c == ARGO_BS) {
-            if(fputc(ARGO_BSLASH, f) == EOF)
-                return -1;
-            if(fputc(ARGO_B, f) == EOF)
-                return -1;
-        }
-        else if(c == ARGO_FF) {
-            if(fputc(ARGO_BSLASH, f) == EOF)
-                return -1;
-            if(fputc(ARGO_F, f) == EOF)
-                return -1;
-        }
-        else if(c == ARGO_LF) {
-            if(fputc(ARGO_BSLASH, f) == EOF)
-                return -1;
-            if(fputc(ARGO_N, f) == EOF)
-                return -1;
-        }
-        else if(c == ARGO_CR) {
-            if(fputc(ARGO_BSLASH, f) == EOF)
-                return -1;
-            if(fputc(ARGO_R, f) == EOF)
-                return -1;
-        }
-        else if(c == ARGO_HT) {
-            if(fputc(ARGO_BSLASH, f) == EOF)
-                return -1;
-            if(fputc(ARGO_T, f) == EOF)
-                return -1;
-        }
-        else if(c > 0x1f && c <= 0xff) {
-            if(fputc(c, f) == EOF)
-                return -1;
-        }
-        else if (c > 0xff || c <= 0x1f) {
-            if(fputc(ARGO_BSLASH, f) == EOF)
-                return -1;
-            if(fputc(ARGO_U, f) == EOF)
-                return -1;
-            int quotient;
-            int remainder;
-            for(int j = 4; j >= 1; --j) {
-                quotient = c;
-                for(int k = 0; k < j; ++k) {
-                    remainder = quotient % 16;
-                    quotient /= 16;
-                }
-                if(remainder == 0xa) {
-                    if(fputc('a', f) == EOF)
-                        return -1;
-                }
-                else if(remainder == 0xb) {
-                    if(fputc('b', f) == EOF)
-                        return -1;
-                }
-                else if(remainder == 0xc) {
-                    if(fputc('c', f) == EOF)
-                        return -1;
-                }
-                else if(remainder == 0xd) {
-                    if(fputc('d', f) == EOF)
-                        return -1;
-                }
-                else if(remainder == 0xe) {
-                    if(fputc('e', f) == EOF)
-                        return -1;
-                }
-                else if(remainder == 0xf) {
-                    if(fputc('f', f) == EOF)
-                        return -1;
-                }
-                else {
-                    if(fputc(remainder + ARGO_DIGIT0, f) == EOF)
-                        return -1;
-                }
+    }
+    if(argo_put(w, ARGO_QUOTE))
+        return -1;
+    return 0;
+}
+
+/*
+ * Write one character of the content of a string, escaped as necessary.
+ */
+int argo_put_char(ARGO_CHAR c, ARGO_WRITER *w) {
+    if(c > 0xffff || c < 0)
+        return -1;
+    if(c == ARGO_BSLASH) {
+        if(argo_put(w, ARGO_BSLASH))
+            return -1;
+        if(argo_put(w, ARGO_BSLASH))
+            return -1;
+    }
+    else if(c == ARGO_QUOTE) {
+        if(argo_put(w, ARGO_BSLASH))
+            return -1;
+        if(argo_put(w, ARGO_QUOTE))
+            return -1;
+    }
+    else if(c == ARGO_BS) {
+        if(argo_put(w, ARGO_BSLASH))
+            return -1;
+        if(argo_put(w, ARGO_B))
+            return -1;
+    }
+    else if(c == ARGO_FF) {
+        if(argo_put(w, ARGO_BSLASH))
+            return -1;
+        if(argo_put(w, ARGO_F))
+            return -1;
+    }
+    else if(c == ARGO_LF) {
+        if(argo_put(w, ARGO_BSLASH))
+            return -1;
+        if(argo_put(w, ARGO_N))
+            return -1;
+    }
+    else if(c == ARGO_CR) {
+        if(argo_put(w, ARGO_BSLASH))
+            return -1;
+        if(argo_put(w, ARGO_R))
+            return -1;
+    }
+    else if(c == ARGO_HT) {
+        if(argo_put(w, ARGO_BSLASH))
+            return -1;
+        if(argo_put(w, ARGO_T))
+            return -1;
+    }
+    else if(c > 0x1f && c <= 0xff) {
+        if(argo_put(w, c))
+            return -1;
+    }
+    else if (c > 0xff || c <= 0x1f) {
+        if(argo_put(w, ARGO_BSLASH))
+            return -1;
+        if(argo_put(w, ARGO_U))
+            return -1;
+        int quotient;
+        int remainder;
+        for(int j = 4; j >= 1; --j) {
+            quotient = c;
+            for(int k = 0; k < j; ++k) {
+                remainder = quotient % 16;
+                quotient /= 16;
+            }
+            if(remainder == 0xa) {
+                if(argo_put(w, 'a'))
+                    return -1;
+            }
+            else if(remainder == 0xb) {
+                if(argo_put(w, 'b'))
+                    return -1;
+            }
+            else if(remainder == 0xc) {
+                if(argo_put(w, 'c'))
+                    return -1;
+            }
+            else if(remainder == 0xd) {
+                if(argo_put(w, 'd'))
+                    return -1;
+            }
+            else if(remainder == 0xe) {
+                if(argo_put(w, 'e'))
+                    return -1;
+            }
+            else if(remainder == 0xf) {
+                if(argo_put(w, 'f'))
+                    return -1;
+            }
+            else {
+                if(argo_put(w, remainder + ARGO_DIGIT0))
+                    return -1;
             }
         }
     }
-    if(fputc(ARGO_QUOTE, f) == EOF)
+    return 0;
+}
+
+/*
+ * Write text read by the parser, as argo_put_string() would write it
+ * as an ARGO_STRING.
+ */
+int argo_put_text(ARGO_TEXT *t, ARGO_WRITER *w) {
+    if(t->wide)
+        return argo_put_string(&t->string, w);
+    if(argo_put(w, ARGO_QUOTE))
+        return -1;
+    if(t->plain) {
+        if(argo_put_bytes(w, t->bytes, t->length))
+            return -1;
+    }
+    else {
+        for(size_t i = 0; i < t->length; ++i)
+            if(argo_put_char(t->bytes[i], w))
+                return -1;
+    }
+    if(argo_put(w, ARGO_QUOTE))
         return -1;
     return 0;
 }
@@ -1147,203 +1368,284 @@ int argo_write_number(ARGO_NUMBER *n, FILE *f) {
         fprintf(stderr, "[Write] ERROR: Null pointer argument.\n");
         return -1;
     }
-    if(n->valid_int) {
-        long num = n->int_value;
-        if(num < 0) {
-            if(fputc(ARGO_MINUS, f) == EOF)
-                return -1;
-            num *= -1;
-        }
-        long div = 1;
-        while((num / div) >= 10)
-            div *= 10;
-        while(div > 0) {
-            if(fputc(((num / div) % 10) + ARGO_DIGIT0, f) == EOF)
-                return -1;
-            div /= 10;
-        }
-        return 0;
-    }
-    else if(n->valid_float) {
-        double num = n->float_value;
-        if(num < 0) {
-            if(fputc(ARGO_MINUS, f) == EOF)
-                return -1;
-            num *= -1;
-        }
-        long count = 0;
-        if(num > 0) {
-            while(num >= 1) {
-                ++count;
-                num /= 10;
-            }
-            while(num < 0.1) {
-                --count;
-                num *= 10;
-            }
-        }
-        else if(num < 0) {
-            while(num <= -1) {
-                ++count;
-                num /= 10;
-            }
-            while(num > -0.1) {
-                --count;
-                num *= 10;
-            }
-        }
-        if(fputc(ARGO_DIGIT0, f) == EOF)
-            return -1;
-        if(fputc(ARGO_PERIOD, f) == EOF)
-            return -1;
-        for(int i = 0; i < ARGO_PRECISION; ++i) {
-            num *= 10;
-            if(fputc((int) num + ARGO_DIGIT0, f) == EOF)
-                return -1;
-            num -= (int) num;
-            if(num == 0)
-                break;
-        }
-        if(count) {
-            if(fputc(ARGO_E, f) == EOF)
-                return -1;
-            if(count < 0) {
-                if(fputc(ARGO_MINUS, f) == EOF)
-                    return -1;
-                count *= -1;
-            }
-            long div = 1;
-            while((count / div) >= 10)
-                div *= 10;
-            while(div > 0) {
-                if(fputc(((count / div) % 10) + ARGO_DIGIT0, f) == EOF)
-                    return -1;
-                div /= 10;
-            }
-        }
-        return 0;
-    }
-    return -1;
+    ARGO_WRITER w;
+    argo_writer_open(&w, f, argo_write_buffer, sizeof(argo_write_buffer));
+    int ret = argo_put_number(n, &w);
+    return argo_writer_flush(&w) || ret ? -1 : 0;
 }
 
-int argo_write_array(ARGO_ARRAY *a, FILE *f) {
-    if(a == NULL || f == NULL) {
+int argo_put_number(ARGO_NUMBER *n, ARGO_WRITER *w) {
+    char buf[ARGO_NUMBER_BUFFER];
+    int length;
+    if(n->valid_int)
+        length = argo_format_long(n->int_value, buf);
+    else if(n->valid_float)
+        length = argo_format_double(n->float_value, buf);
+    else
+        return -1;
+    if(length < 0 || argo_put_bytes(w, buf, length))
+        return -1;
+    return 0;
+}
+
+int argo_write_array(ARGO_ARRAY *a, ARGO_WRITER *w) {
+    if(a == NULL || w == NULL) {
         fprintf(stderr, "[Write] ERROR: Null pointer argument.\n");
         return -1;
     }
-    if(fputc(ARGO_LBRACK, f) == EOF)
+    if(argo_put(w, ARGO_LBRACK))
         return -1;
     if((global_options & PRETTY_PRINT_OPTION) == PRETTY_PRINT_OPTION) {
-        if(fputc(ARGO_LF, f) == EOF)
-            return -1;
         if(a->element_list->next != a->element_list)
             ++indent_level;
-        int num_of_spaces = indent_level * (global_options & 0xff);
-        for(int i = 0; i < num_of_spaces; ++i)
-            if(fputc(ARGO_SPACE, f) == EOF)
-                return -1;
+        if(argo_writer_indent(w, indent_level * (global_options & 0xff)))
+            return -1;
     }
     if(a->element_list->next == a->element_list) {
-        if(fputc(ARGO_RBRACK, f) == EOF)
+        if(argo_put(w, ARGO_RBRACK))
             return -1;
         return 0;
     }
     ARGO_VALUE *ptr = a->element_list->next;
     while(ptr != a->element_list->prev) {
-        if(argo_write(ptr, f))
+        if(argo_write(ptr, w))
             return -1;
-        if(fputc(ARGO_COMMA, f) == EOF)
+        if(argo_put(w, ARGO_COMMA))
             return -1;
         if((global_options & PRETTY_PRINT_OPTION) == PRETTY_PRINT_OPTION) {
-            if(fputc(ARGO_LF, f) == EOF)
+            if(argo_writer_indent(w, indent_level * (global_options & 0xff)))
                 return -1;
-            int num_of_spaces = indent_level * (global_options & 0xff);
-            for(int i = 0; i < num_of_spaces; ++i)
-                if(fputc(ARGO_SPACE, f) == EOF)
-                    return -1;
         }
         ptr = ptr->next;
     }
-    if(argo_write(ptr, f))
+    if(argo_write(ptr, w))
         return -1;
     if((global_options & PRETTY_PRINT_OPTION) == PRETTY_PRINT_OPTION) {
-        if(fputc(ARGO_LF, f) == EOF)
-            return -1;
         --indent_level;
-        int num_of_spaces = indent_level * (global_options & 0xff);
-        for(int i = 0; i < num_of_spaces; ++i)
-            if(fputc(ARGO_SPACE, f) == EOF)
-                return -1;
+        if(argo_writer_indent(w, indent_level * (global_options & 0xff)))
+            return -1;
     }
-    if(fputc(ARGO_RBRACK, f) == EOF)
+    if(argo_put(w, ARGO_RBRACK))
         return -1;
     return 0;
 }
 
-int argo_write_object(ARGO_OBJECT *o, FILE *f) {
-    if(o == NULL || f == NULL) {
+int argo_write_object(ARGO_OBJECT *o, ARGO_WRITER *w) {
+    if(o == NULL || w == NULL) {
         fprintf(stderr, "[Write] ERROR: Null pointer argument.\n");
         return -1;
     }
-    if(fputc(ARGO_LBRACE, f) == EOF)
+    if(argo_put(w, ARGO_LBRACE))
         return -1;
     if((global_options & PRETTY_PRINT_OPTION) == PRETTY_PRINT_OPTION) {
-        if(fputc(ARGO_LF, f) == EOF)
-            return -1;
         if(o->member_list->next != o->member_list)
             ++indent_level;
-        int num_of_spaces = indent_level * (global_options & 0xff);
-        for(int i = 0; i < num_of_spaces; ++i)
-            if(fputc(ARGO_SPACE, f) == EOF)
-                return -1;
+        if(argo_writer_indent(w, indent_level * (global_options & 0xff)))
+            return -1;
     }
     if(o->member_list->next == o->member_list) {
-        if(fputc(ARGO_RBRACE, f) == EOF)
+        if(argo_put(w, ARGO_RBRACE))
             return -1;
         return 0;
     }
     ARGO_VALUE *ptr = o->member_list->next;
     while(ptr != o->member_list->prev) {
-        if(argo_write_string(&ptr->name, f))
+        if(argo_put_string(&ptr->name, w))
             return -1;
-        if(fputc(ARGO_COLON, f) == EOF)
+        if(argo_put(w, ARGO_COLON))
             return -1;
         if((global_options & PRETTY_PRINT_OPTION) == PRETTY_PRINT_OPTION)
-            if(fputc(ARGO_SPACE, f) == EOF)
+            if(argo_put(w, ARGO_SPACE))
                 return -1;
-        if(argo_write(ptr, f))
+        if(argo_write(ptr, w))
             return -1;
-        if(fputc(ARGO_COMMA, f) == EOF)
+        if(argo_put(w, ARGO_COMMA))
             return -1;
         if((global_options & PRETTY_PRINT_OPTION) == PRETTY_PRINT_OPTION) {
-            if(fputc(ARGO_LF, f) == EOF)
+            if(argo_writer_indent(w, indent_level * (global_options & 0xff)))
                 return -1;
-            int num_of_spaces = indent_level * (global_options & 0xff);
-            for(int i = 0; i < num_of_spaces; ++i)
-                if(fputc(ARGO_SPACE, f) == EOF)
-                    return -1;
         }
         ptr = ptr->next;
     }
-    if(argo_write_string(&ptr->name, f))
+    if(argo_put_string(&ptr->name, w))
         return -1;
-    if(fputc(ARGO_COLON, f) == EOF)
+    if(argo_put(w, ARGO_COLON))
         return -1;
     if((global_options & PRETTY_PRINT_OPTION) == PRETTY_PRINT_OPTION)
-        if(fputc(ARGO_SPACE, f) == EOF)
+        if(argo_put(w, ARGO_SPACE))
             return -1;
-    if(argo_write(ptr, f))
+    if(argo_write(ptr, w))
         return -1;
     if((global_options & PRETTY_PRINT_OPTION) == PRETTY_PRINT_OPTION) {
-        if(fputc(ARGO_LF, f) == EOF)
-            return -1;
         --indent_level;
-        int num_of_spaces = indent_level * (global_options & 0xff);
-        for(int i = 0; i < num_of_spaces; ++i)
-            if(fputc(ARGO_SPACE, f) == EOF)
-                return -1;
+        if(argo_writer_indent(w, indent_level * (global_options & 0xff)))
+            return -1;
     }
-    if(fputc(ARGO_RBRACE, f) == EOF)
+    if(argo_put(w, ARGO_RBRACE))
         return -1;
     return 0;
 }
+
+/**
+ * @brief  Read JSON input from a specified input stream and write its
+ * canonical form to a specified output stream, in a single pass.
+ * @details  This function produces the same output as argo_read_value()
+ * followed by argo_write_value(), but writes each part of the value as soon
+ * as it has been parsed, so that memory use depends only on the depth of
+ * nesting and the longest string, not on the size of the input.  Output
+ * goes to the stream through a local buffer of ARGO_WRITER_BUFFER bytes.
+ * If the input turns out to be invalid, the canonical form of the part of
+ * it before the error has already been output.
+ *
+ * @param in  Input stream from which JSON is to be read.
+ * @param out  Output stream to which JSON is to be written.
+ * @return  Zero if the operation is completely successful,
+ * nonzero if there is any error.
+ */
+int argo_canonicalize(FILE *in, FILE *out) {
+    char buffer[ARGO_WRITER_BUFFER];
+    if(out == NULL) {
+        fprintf(stderr, "[Write] ERROR: Null pointer argument.\n");
+        return -1;
+    }
+    ARGO_WRITER w;
+    argo_writer_open(&w, out, buffer, sizeof(buffer));
+    ARGO_CANON k = { &w, NULL, 0, 0, 0, 0, 0 };
+    int ret = argo_parse(in, &argo_canonicalizer, &k);
+    free(k.started);
+    if(ret) {
+        argo_writer_flush(&w);
+        return -1;
+    }
+    if(argo_writer_flush(&w) || k.failed) {
+        fprintf(stderr, "[Write] ERROR: Could not write to stream.\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Canonicalizer: the handler used by argo_canonicalize().  It writes what
+ * argo_write() would write for each event, deciding what goes before a value
+ * from whether anything has yet been written in the innermost open array or
+ * object.  If writing fails, the rest of the input is still parsed, so that
+ * a syntax error later on is reported in preference, as it was when the
+ * whole value was read before anything was written.
+ */
+int argo_canon_indent(ARGO_CANON *k) {
+    if((global_options & PRETTY_PRINT_OPTION) != PRETTY_PRINT_OPTION)
+        return 0;
+    return argo_writer_indent(k->out, k->indent * (global_options & 0xff));
+}
+
+int argo_canon_next(ARGO_CANON *k) {
+    if(k->keyed) {
+        k->keyed = 0;
+        return 0;
+    }
+    if(k->depth == 0)
+        return 0;
+    if(k->started[k->depth - 1]) {
+        if(argo_put(k->out, ARGO_COMMA))
+            return -1;
+    }
+    else {
+        k->started[k->depth - 1] = 1;
+        ++k->indent;
+    }
+    return argo_canon_indent(k);
+}
+
+int argo_canon_done(ARGO_CANON *k, int ret) {
+    if(!ret && k->depth == 0 && (global_options & PRETTY_PRINT_OPTION) == PRETTY_PRINT_OPTION)
+        ret = argo_put(k->out, ARGO_LF);
+    if(ret)
+        k->failed = 1;
+    return 0;
+}
+
+int argo_canon_open(ARGO_CANON *k, ARGO_CHAR c) {
+    if(k->depth == k->capacity) {
+        int capacity = k->capacity ? 2 * k->capacity : 16;
+        char *started = realloc(k->started, capacity);
+        if(!started) {
+            fprintf(stderr, "ERROR: Out of memory.\n");
+            return -1;
+        }
+        k->started = started;
+        k->capacity = capacity;
+    }
+    if(!k->failed && (argo_canon_next(k) || argo_put(k->out, c)))
+        k->failed = 1;
+    k->started[k->depth++] = 0;
+    return 0;
+}
+
+int argo_canon_close(ARGO_CANON *k, ARGO_CHAR c) {
+    char started = k->started[--k->depth];
+    if(k->failed)
+        return 0;
+    if(started)
+        --k->indent;
+    return argo_canon_done(k, argo_canon_indent(k) || argo_put(k->out, c));
+}
+
+int argo_canon_start_object(void *context) {
+    return argo_canon_open(context, ARGO_LBRACE);
+}
+
+int argo_canon_end_object(void *context) {
+    return argo_canon_close(context, ARGO_RBRACE);
+}
+
+int argo_canon_start_array(void *context) {
+    return argo_canon_open(context, ARGO_LBRACK);
+}
+
+int argo_canon_end_array(void *context) {
+    return argo_canon_close(context, ARGO_RBRACK);
+}
+
+int argo_canon_key(void *context, ARGO_TEXT *name) {
+    ARGO_CANON *k = context;
+    if(k->failed)
+        return 0;
+    if(argo_canon_next(k) || argo_put_text(name, k->out) || argo_put(k->out, ARGO_COLON))
+        k->failed = 1;
+    else if((global_options & PRETTY_PRINT_OPTION) == PRETTY_PRINT_OPTION && argo_put(k->out, ARGO_SPACE))
+        k->failed = 1;
+    k->keyed = 1;
+    return 0;
+}
+
+int argo_canon_string(void *context, ARGO_TEXT *s) {
+    ARGO_CANON *k = context;
+    if(k->failed)
+        return 0;
+    return argo_canon_done(k, argo_canon_next(k) || argo_put_text(s, k->out));
+}
+
+int argo_canon_number(void *context, ARGO_NUMBER *n) {
+    ARGO_CANON *k = context;
+    if(k->failed)
+        return 0;
+    return argo_canon_done(k, argo_canon_next(k) || argo_put_number(n, k->out));
+}
+
+int argo_canon_basic(void *context, ARGO_BASIC b) {
+    ARGO_CANON *k = context;
+    if(k->failed)
+        return 0;
+    return argo_canon_done(k, argo_canon_next(k) || argo_put_basic(&b, k->out));
+}
+
+const ARGO_HANDLER argo_canonicalizer = {
+    .start_object = argo_canon_start_object,
+    .key = argo_canon_key,
+    .end_object = argo_canon_end_object,
+    .start_array = argo_canon_start_array,
+    .end_array = argo_canon_end_array,
+    .string = argo_canon_string,
+    .number = argo_canon_number,
+    .basic = argo_canon_basic
+};
@@ -4,6 +4,7 @@
 #include "argo.h"
 #include "global.h"
 #include "debug.h"
+#include "parser.h"
 
 #ifdef _STRING_H
 #error "Do not #include <string.h>. You will get a ZERO."
@@ -23,17 +24,15 @@ int main(int argc, char **argv) {
     if(global_options == HELP_OPTION)
         USAGE(*argv, EXIT_SUCCESS);
     // TO BE IMPLEMENTED
+    int ret = EXIT_FAILURE;
     if(global_options == VALIDATE_OPTION)
-        if(argo_read_value(stdin) != NULL)
-            return EXIT_SUCCESS;
-    if((global_options & CANONICALIZE_OPTION) == CANONICALIZE_OPTION) {
-        ARGO_VALUE *value = argo_read_value(stdin);
-        if(value != NULL) {
-            if(!argo_write_value(value, stdout))
-                return EXIT_SUCCESS;
-        }
-    }
-    return EXIT_FAILURE;
+        if(!argo_parse(stdin, NULL, NULL))
+            ret = EXIT_SUCCESS;
+    if((global_options & CANONICALIZE_OPTION) == CANONICALIZE_OPTION)
+        if(!argo_canonicalize(stdin, stdout))
+            ret = EXIT_SUCCESS;
+    argo_arena_free();
+    return ret;
 }
 
 /*
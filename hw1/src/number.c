@@ -0,0 +1,216 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <float.h>
+
+#include "argo.h"
+#include "number.h"
+#include "debug.h"
+
+/*
+ * Powers of ten that are exact as doubles.
+ */
+static const double argo_powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+#define ARGO_MAX_EXACT_POWER 22
+#define ARGO_MAX_EXACT_INTEGER (1ULL << 53)
+
+/*
+ * The same in long double, which on x86 has a 64-bit significand and so
+ * holds powers of ten exactly up to 10^27.  A scaled value below 10^15, so
+ * below 2^50, is then within ARGO_ROUND_MARGIN of the exact product.
+ */
+static const long double argo_long_powers_of_ten[] = {
+    1e0L, 1e1L, 1e2L, 1e3L, 1e4L, 1e5L, 1e6L, 1e7L, 1e8L, 1e9L, 1e10L, 1e11L, 1e12L, 1e13L,
+    1e14L, 1e15L, 1e16L, 1e17L, 1e18L, 1e19L, 1e20L, 1e21L, 1e22L, 1e23L, 1e24L, 1e25L, 1e26L, 1e27L
+};
+
+#if LDBL_MANT_DIG >= 64
+#define ARGO_MAX_LONG_EXACT_POWER 27
+#define ARGO_ROUND_MARGIN (1.0L / 32768)
+#else
+#define ARGO_MAX_LONG_EXACT_POWER ARGO_MAX_EXACT_POWER
+#define ARGO_ROUND_MARGIN (1.0L / 16)
+#endif
+
+/**
+ * @brief  Compute the double nearest to a decimal number.
+ * @details  The number is converted directly if its significand and power
+ * of ten are exact as doubles, and otherwise from its text, with strtod().
+ *
+ * @param d  The digits and exponent of the number.
+ * @param text  The text of the number.
+ * @param value  Set to the magnitude of the number, which is greater than
+ * DBL_MAX if the number is too large to be represented.
+ * @return  Zero if the operation completes without error, nonzero if
+ * memory could not be obtained.
+ */
+int argo_decimal_value(ARGO_DECIMAL *d, ARGO_STRING *text, double *value) {
+    if(d->digits == 0) {
+        *value = 0;
+        return 0;
+    }
+    if(d->digits <= ARGO_DECIMAL_DIGITS && d->significand <= ARGO_MAX_EXACT_INTEGER) {
+        unsigned long long m = d->significand;
+        long scale = d->exponent - d->fraction;
+        while(scale > ARGO_MAX_EXACT_POWER && m <= ARGO_MAX_EXACT_INTEGER / 10) {
+            m *= 10;
+            --scale;
+        }
+        if(scale >= 0 && scale <= ARGO_MAX_EXACT_POWER) {
+            *value = (double)m * argo_powers_of_ten[scale];
+            return 0;
+        }
+        if(scale < 0 && scale >= -ARGO_MAX_EXACT_POWER) {
+            *value = (double)m / argo_powers_of_ten[-scale];
+            return 0;
+        }
+    }
+    char small[64];
+    char *buf = text->length < sizeof(small) ? small : malloc(text->length + 1);
+    if(!buf) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        return -1;
+    }
+    size_t j = 0;
+    for(size_t i = 0; i < text->length; ++i) {
+        if(i > 0 || text->content[i] != ARGO_MINUS)
+            buf[j++] = text->content[i];
+    }
+    buf[j] = '\0';
+    *value = strtod(buf, NULL);
+    if(buf != small)
+        free(buf);
+    return 0;
+}
+
+/*
+ * Round a positive double to ARGO_PRECISION significant digits, giving
+ * the digits as an integer and the exponent that goes with "0." in front
+ * of them.  The value is scaled by an exact power of ten, with one rounding,
+ * which cannot move it by more than ARGO_ROUND_MARGIN; unless the scaled value
+ * is that close to halfway between two integers, the integer it rounds to is
+ * the one that the exact value rounds to.  Returns nonzero if it cannot tell,
+ * or the power of ten is not exact.
+ */
+static int argo_round_digits(double value, unsigned long long *digits, int *exponent) {
+    union { double value; unsigned long long bits; } u = { value };
+    unsigned long long bits = u.bits;
+    int b = (int)((bits >> 52) & 0x7ff) - 1023;
+    if(b == -1023)
+        return -1;
+    // floor(b * log10(2)), which is floor(log10(value)) or one less.
+    int e = (b * 78913) >> 18;
+    for(int i = 0; i < 2; ++i, ++e) {
+        int k = ARGO_PRECISION - 1 - e;
+        if(k > ARGO_MAX_LONG_EXACT_POWER || k < -ARGO_MAX_LONG_EXACT_POWER)
+            return -1;
+        long double y = k >= 0 ? value * argo_long_powers_of_ten[k] : value / argo_long_powers_of_ten[-k];
+        if(y >= argo_long_powers_of_ten[ARGO_PRECISION])
+            continue;
+        if(y < argo_long_powers_of_ten[ARGO_PRECISION - 1])
+            return -1;
+        unsigned long long n = (unsigned long long)y;
+        long double f = y - n;
+        if(f >= 0.5L - ARGO_ROUND_MARGIN && f <= 0.5L + ARGO_ROUND_MARGIN)
+            return -1;
+        if(f > 0.5L && ++n == (unsigned long long)argo_powers_of_ten[ARGO_PRECISION]) {
+            n /= 10;
+            ++e;
+        }
+        *digits = n;
+        *exponent = e + 1;
+        return 0;
+    }
+    return -1;
+}
+
+/*
+ * Round a positive double as argo_round_digits() does, using printf().
+ */
+static void argo_round_digits_slow(double value, unsigned long long *digits, int *exponent) {
+    char buf[ARGO_NUMBER_BUFFER];
+    snprintf(buf, sizeof(buf), "%.*e", ARGO_PRECISION - 1, value);
+    unsigned long long n = 0;
+    char *p = buf;
+    for(; *p != ARGO_E; ++p) {
+        if(argo_is_digit(*p))
+            n = 10 * n + (*p - ARGO_DIGIT0);
+    }
+    int negative = *++p == ARGO_MINUS;
+    int e = 0;
+    while(*++p != '\0')
+        e = 10 * e + (*p - ARGO_DIGIT0);
+    *digits = n;
+    *exponent = (negative ? -e : e) + 1;
+}
+
+/**
+ * @brief  Write an integer in decimal.
+ *
+ * @param value  The integer.
+ * @param buf  Buffer of at least ARGO_NUMBER_BUFFER bytes, into which the
+ * digits are written, without a terminating null.
+ * @return  The number of bytes written.
+ */
+int argo_format_long(long value, char *buf) {
+    char digits[ARGO_NUMBER_BUFFER];
+    unsigned long m = value < 0 ? -(unsigned long)value : (unsigned long)value;
+    int n = 0;
+    do {
+        digits[n++] = ARGO_DIGIT0 + m % 10;
+        m /= 10;
+    } while(m);
+    char *p = buf;
+    if(value < 0)
+        *p++ = ARGO_MINUS;
+    while(n)
+        *p++ = digits[--n];
+    return p - buf;
+}
+
+/**
+ * @brief  Write a double in canonical form.
+ *
+ * @param value  The double.
+ * @param buf  Buffer of at least ARGO_NUMBER_BUFFER bytes, into which the
+ * canonical form is written, without a terminating null.
+ * @return  The number of bytes written, or -1 if the value is infinite or
+ * not a number, which has no canonical form.
+ */
+int argo_format_double(double value, char *buf) {
+    if(value != value || value > DBL_MAX || value < -DBL_MAX)
+        return -1;
+    char *p = buf;
+    if(value < 0) {
+        *p++ = ARGO_MINUS;
+        value = -value;
+    }
+    *p++ = ARGO_DIGIT0;
+    *p++ = ARGO_PERIOD;
+    if(value == 0) {
+        *p++ = ARGO_DIGIT0;
+        return p - buf;
+    }
+    unsigned long long digits;
+    int exponent;
+    if(argo_round_digits(value, &digits, &exponent))
+        argo_round_digits_slow(value, &digits, &exponent);
+    char d[ARGO_PRECISION];
+    for(int i = ARGO_PRECISION - 1; i >= 0; --i) {
+        d[i] = ARGO_DIGIT0 + digits % 10;
+        digits /= 10;
+    }
+    int n = ARGO_PRECISION;
+    while(n > 1 && d[n - 1] == ARGO_DIGIT0)
+        --n;
+    for(int i = 0; i < n; ++i)
+        *p++ = d[i];
+    if(exponent) {
+        *p++ = ARGO_E;
+        p += argo_format_long(exponent, p);
+    }
+    return p - buf;
+}
@@ -0,0 +1,298 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include "argo.h"
+#include "global.h"
+#include "arena.h"
+#include "query.h"
+#include "debug.h"
+
+/*
+ * A key being looked up: "length" bytes at "bytes", in which "~0" and "~1"
+ * stand for '~' and '/' if the key is a token of a JSON pointer.
+ */
+typedef struct argo_key {
+    const unsigned char *bytes;
+    size_t length;
+    int pointer;
+} ARGO_KEY;
+
+/*
+ * Hash index of the members of an object, by open addressing with linear
+ * probing.  Members are inserted in order, so if several have the same name,
+ * the first of them is found.
+ */
+typedef struct argo_index {
+    ARGO_VALUE *sentinel;           // Sentinel of the member list indexed.
+    ARGO_VALUE *first;              // First member when the index was built.
+    ARGO_VALUE *last;               // Last member when the index was built.
+    size_t mask;                    // Number of slots, less one.
+    ARGO_VALUE **slots;             // Members, or NULL for an empty slot.
+} ARGO_INDEX;
+
+/*
+ * Table of the indexes built since the arena was last reset, by sentinel,
+ * also with linear probing.
+ */
+static ARGO_INDEX **argo_indexes;
+static size_t argo_indexes_mask;
+static size_t argo_indexes_count;
+static unsigned long argo_indexes_generation;
+
+#define ARGO_HASH_BASIS 14695981039346656037ULL
+#define ARGO_HASH_PRIME 1099511628211ULL
+
+static inline uint64_t argo_hash_char(uint64_t h, ARGO_CHAR c) {
+    return (h ^ (uint32_t)c) * ARGO_HASH_PRIME;
+}
+
+static size_t argo_hash_pointer(ARGO_VALUE *p) {
+    uint64_t h = (uintptr_t)p;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static size_t argo_hash_name(ARGO_STRING *name) {
+    uint64_t h = ARGO_HASH_BASIS;
+    for(size_t i = 0; i < name->length; ++i)
+        h = argo_hash_char(h, name->content[i]);
+    return h;
+}
+
+/*
+ * Get the character of a key at *i, and advance *i past it.
+ */
+static inline ARGO_CHAR argo_key_char(ARGO_KEY *k, size_t *i) {
+    ARGO_CHAR c = k->bytes[(*i)++];
+    if(c == '~' && k->pointer)
+        c = k->bytes[(*i)++] == '0' ? '~' : '/';
+    return c;
+}
+
+static size_t argo_hash_key(ARGO_KEY *k) {
+    uint64_t h = ARGO_HASH_BASIS;
+    for(size_t i = 0; i < k->length; )
+        h = argo_hash_char(h, argo_key_char(k, &i));
+    return h;
+}
+
+static int argo_key_equal(ARGO_KEY *k, ARGO_STRING *name) {
+    size_t j = 0;
+    for(size_t i = 0; i < k->length; ) {
+        if(j == name->length || name->content[j++] != argo_key_char(k, &i))
+            return 0;
+    }
+    return j == name->length;
+}
+
+/*
+ * Find the slot in the table of indexes for the index of an object, given
+ * the sentinel of its member list.  The slot holds NULL if there is none.
+ */
+static ARGO_INDEX **argo_index_slot(ARGO_VALUE *sentinel) {
+    if(argo_indexes_generation != argo_arena_generation()) {
+        argo_indexes = NULL;
+        argo_indexes_mask = argo_indexes_count = 0;
+        argo_indexes_generation = argo_arena_generation();
+    }
+    if(argo_indexes == NULL)
+        return NULL;
+    size_t i = argo_hash_pointer(sentinel) & argo_indexes_mask;
+    while(argo_indexes[i] != NULL && argo_indexes[i]->sentinel != sentinel)
+        i = (i + 1) & argo_indexes_mask;
+    return &argo_indexes[i];
+}
+
+/*
+ * Enter an index in the table of indexes, enlarging the table if it is
+ * half full.
+ */
+static int argo_index_add(ARGO_INDEX *x) {
+    ARGO_INDEX **slot = argo_index_slot(x->sentinel);
+    if(slot != NULL && *slot != NULL) {
+        *slot = x;
+        return 0;
+    }
+    if(2 * (argo_indexes_count + 1) > argo_indexes_mask + 1) {
+        size_t size = argo_indexes != NULL ? 2 * (argo_indexes_mask + 1) : 64;
+        ARGO_INDEX **indexes = argo_arena_alloc(size * sizeof(ARGO_INDEX *));
+        if(!indexes)
+            return -1;
+        for(size_t j = 0; j < size; ++j)
+            indexes[j] = NULL;
+        for(size_t j = 0; argo_indexes != NULL && j <= argo_indexes_mask; ++j) {
+            if(argo_indexes[j] == NULL)
+                continue;
+            size_t i = argo_hash_pointer(argo_indexes[j]->sentinel) & (size - 1);
+            while(indexes[i] != NULL)
+                i = (i + 1) & (size - 1);
+            indexes[i] = argo_indexes[j];
+        }
+        argo_indexes = indexes;
+        argo_indexes_mask = size - 1;
+        slot = argo_index_slot(x->sentinel);
+    }
+    *slot = x;
+    ++argo_indexes_count;
+    return 0;
+}
+
+/*
+ * Build the index of an object with "count" members, given the sentinel
+ * of its member list.
+ */
+static ARGO_INDEX *argo_index_build(ARGO_VALUE *sentinel, size_t count) {
+    size_t size = 16;
+    while(size < 2 * count)
+        size *= 2;
+    ARGO_INDEX *x = argo_arena_alloc(sizeof(ARGO_INDEX));
+    ARGO_VALUE **slots = x != NULL ? argo_arena_alloc(size * sizeof(ARGO_VALUE *)) : NULL;
+    if(!slots)
+        return NULL;
+    for(size_t i = 0; i < size; ++i)
+        slots[i] = NULL;
+    for(ARGO_VALUE *m = sentinel->next; m != sentinel; m = m->next) {
+        size_t i = argo_hash_name(&m->name) & (size - 1);
+        while(slots[i] != NULL)
+            i = (i + 1) & (size - 1);
+        slots[i] = m;
+    }
+    x->sentinel = sentinel;
+    x->first = sentinel->next;
+    x->last = sentinel->prev;
+    x->mask = size - 1;
+    x->slots = slots;
+    if(argo_index_add(x))
+        return NULL;
+    return x;
+}
+
+/*
+ * Look up a key in an object, through its index if it has one that is up
+ * to date, and otherwise by going through the members, after which an index
+ * is built if there are enough of them.
+ */
+static ARGO_VALUE *argo_object_find(ARGO_OBJECT *o, ARGO_KEY *k) {
+    ARGO_VALUE *sentinel = o->member_list;
+    if(sentinel == NULL)
+        return NULL;
+    ARGO_INDEX **slot = argo_index_slot(sentinel);
+    ARGO_INDEX *x = slot != NULL ? *slot : NULL;
+    if(x == NULL || x->first != sentinel->next || x->last != sentinel->prev) {
+        ARGO_VALUE *found = NULL;
+        size_t count = 0;
+        for(ARGO_VALUE *m = sentinel->next; m != sentinel; m = m->next) {
+            if(found == NULL && argo_key_equal(k, &m->name))
+                found = m;
+            ++count;
+        }
+        if(count >= ARGO_INDEX_MIN)
+            argo_index_build(sentinel, count);
+        return found;
+    }
+    for(size_t i = argo_hash_key(k) & x->mask; x->slots[i] != NULL; i = (i + 1) & x->mask) {
+        if(argo_key_equal(k, &x->slots[i]->name))
+            return x->slots[i];
+    }
+    return NULL;
+}
+
+/**
+ * @brief  Look up a member of an object by name.
+ * @details  If there are several members with the name, the first of them
+ * is found.  The first lookup in an object with at least ARGO_INDEX_MIN
+ * members builds a hash index of them, so that later lookups take constant
+ * time on average, rather than time proportional to the number of members.
+ *
+ * @param o  The object.
+ * @param key  The name of the member, each byte of which is one character.
+ * @return  The member, or NULL if the object has no member with that name.
+ */
+ARGO_VALUE *argo_object_get(ARGO_OBJECT *o, const char *key) {
+    if(o == NULL || key == NULL) {
+        fprintf(stderr, "ERROR: Null pointer argument.\n");
+        return NULL;
+    }
+    size_t length = 0;
+    while(key[length] != '\0')
+        ++length;
+    ARGO_KEY k = { (const unsigned char *)key, length, 0 };
+    return argo_object_find(o, &k);
+}
+
+/**
+ * @brief  Get an element of an array by position.
+ *
+ * @param a  The array.
+ * @param i  The position of the element, counting from zero.
+ * @return  The element, or NULL if the array has no more than i elements.
+ */
+ARGO_VALUE *argo_array_get(ARGO_ARRAY *a, size_t i) {
+    if(a == NULL) {
+        fprintf(stderr, "ERROR: Null pointer argument.\n");
+        return NULL;
+    }
+    ARGO_VALUE *sentinel = a->element_list;
+    if(sentinel == NULL)
+        return NULL;
+    ARGO_VALUE *e = sentinel->next;
+    while(e != sentinel && i--)
+        e = e->next;
+    return e != sentinel ? e : NULL;
+}
+
+/**
+ * @brief  Find the value that a JSON pointer refers to.
+ * @details  The pointer is interpreted as specified by RFC 6901: it is
+ * empty, referring to the value itself, or a sequence of tokens, each
+ * preceded by '/', in which "~1" stands for '/' and "~0" for '~'.  Each
+ * token is the name of a member of an object, looked up as by
+ * argo_object_get(), or the position of an element of an array, in
+ * decimal with no leading zeros.
+ *
+ * @param v  The value from which the pointer is followed.
+ * @param pointer  The JSON pointer.
+ * @return  The value referred to, or NULL if there is none or the pointer
+ * is not well formed.
+ */
+ARGO_VALUE *argo_value_get(ARGO_VALUE *v, const char *pointer) {
+    if(v == NULL || pointer == NULL) {
+        fprintf(stderr, "ERROR: Null pointer argument.\n");
+        return NULL;
+    }
+    const char *p = pointer;
+    while(*p != '\0') {
+        if(*p++ != '/')
+            return NULL;
+        const char *end = p;
+        while(*end != '\0' && *end != '/') {
+            if(*end == '~' && end[1] != '0' && end[1] != '1')
+                return NULL;
+            end += *end == '~' ? 2 : 1;
+        }
+        if(v->type == ARGO_OBJECT_TYPE) {
+            ARGO_KEY k = { (const unsigned char *)p, end - p, 1 };
+            v = argo_object_find(&v->content.object, &k);
+        }
+        else if(v->type == ARGO_ARRAY_TYPE) {
+            if(end == p || (*p == ARGO_DIGIT0 && end - p > 1))
+                return NULL;
+            size_t i = 0;
+            for(const char *q = p; q < end; ++q) {
+                if(!argo_is_digit(*q) || i > (SIZE_MAX - 9) / 10)
+                    return NULL;
+                i = 10 * i + (*q - ARGO_DIGIT0);
+            }
+            v = argo_array_get(&v->content.array, i);
+        }
+        else {
+            return NULL;
+        }
+        if(v == NULL)
+            return NULL;
+        p = end;
+    }
+    return v;
+}
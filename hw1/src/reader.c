@@ -0,0 +1,135 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "argo.h"
+#include "reader.h"
+#include "debug.h"
+
+/**
+ * @brief  Prepare to read from a specified input stream through a reader.
+ * @details  If the stream is a regular file, its contents are mapped into
+ * memory and reading starts at the current position of the stream.
+ * Otherwise a buffer is allocated for reading the stream a block at a time.
+ * If "exact" is nonzero and the stream cannot be repositioned, then no
+ * buffer is used and characters are read one at a time with fgetc(), so
+ * that no input beyond what is consumed is taken from the stream.  This is
+ * needed when the caller intends to go on reading from the same stream
+ * afterwards.
+ *
+ * @param r  The reader to be initialized.
+ * @param f  Input stream to be read.
+ * @param exact  Nonzero if the stream must not be read past the input consumed.
+ * @return  Zero if the operation is completely successful,
+ * nonzero if there is any error.
+ */
+int argo_reader_open(ARGO_READER *r, FILE *f, int exact) {
+    r->next = r->end = NULL;
+    r->buffer = NULL;
+    r->map = NULL;
+    r->map_length = 0;
+    r->file = f;
+    struct stat st;
+    long pos = ftell(f);
+    int fd = fileno(f);
+    if(pos >= 0 && fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > pos) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            r->map = map;
+            r->map_length = st.st_size;
+            r->next = (unsigned char *)map + pos;
+            r->end = r->next;
+            return 0;
+        }
+    }
+    if(exact && pos < 0) {
+        r->block = 0;
+        r->next = r->end = &r->last + 1;
+        return 0;
+    }
+    r->block = ARGO_READER_BLOCK;
+    r->buffer = malloc(r->block);
+    if(!r->buffer) {
+        fprintf(stderr, "ERROR: Failed to allocate input buffer.\n");
+        return -1;
+    }
+    r->next = r->end = r->buffer;
+    return 0;
+}
+
+/**
+ * @brief  Refill the buffer of a reader whose current block has been consumed.
+ * @details  This is the slow path of argo_getc().  Only the character most
+ * recently returned is ever pushed back, and it is always in the current
+ * block, so nothing needs to be kept from the previous block.  For a mapped
+ * file, the next window of the mapping becomes the current block.  When
+ * reading with fgetc(), the character read is kept as a block of its own,
+ * so that it can be pushed back in the same way.
+ *
+ * @param r  The reader.
+ * @return  The next byte of input, or EOF if there is no more.
+ */
+int argo_reader_fill(ARGO_READER *r) {
+    if(r->map != NULL) {
+        const unsigned char *base = r->map;
+        size_t offset = r->next - base;
+        if(offset >= r->map_length)
+            return EOF;
+        // Release the pages of the previous window, up to the one holding
+        // the character just read, which may still be pushed back.
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t done = offset > 0 ? (offset - 1) / page * page : 0;
+        size_t from = done > 2 * ARGO_READER_WINDOW ? (done - 2 * ARGO_READER_WINDOW) / page * page : 0;
+        if(done > from)
+            madvise((unsigned char *)r->map + from, done - from, MADV_DONTNEED);
+        size_t length = r->map_length - offset;
+        r->end = r->next + (length < ARGO_READER_WINDOW ? length : ARGO_READER_WINDOW);
+        return *r->next++;
+    }
+    if(r->block == 0) {
+        int c = fgetc(r->file);
+        if(c == EOF)
+            return EOF;
+        r->last = c;
+        r->end = r->next = &r->last + 1;
+        return c;
+    }
+    if(r->buffer == NULL)
+        return EOF;
+    size_t n = fread(r->buffer, 1, r->block, r->file);
+    r->next = r->buffer;
+    r->end = r->buffer + n;
+    if(n == 0)
+        return EOF;
+    return *r->next++;
+}
+
+/**
+ * @brief  Finish reading through a reader.
+ * @details  The underlying stream is repositioned just after the last byte
+ * consumed, if the reader has read beyond it and the stream allows this,
+ * and any memory used by the reader is released.
+ *
+ * @param r  The reader.
+ */
+void argo_reader_close(ARGO_READER *r) {
+    if(r->map != NULL) {
+        fseek(r->file, (unsigned char *)r->next - (unsigned char *)r->map, SEEK_SET);
+        munmap(r->map, r->map_length);
+        r->map = NULL;
+    }
+    else if(r->buffer != NULL) {
+        long unread = r->end - r->next;
+        if(unread > 0 && fseek(r->file, -unread, SEEK_CUR) != 0 && unread == 1)
+            ungetc(*r->next, r->file);
+        free(r->buffer);
+        r->buffer = NULL;
+    }
+    else if(r->block == 0 && r->next < r->end) {
+        ungetc(*r->next, r->file);
+    }
+    r->next = r->end = NULL;
+}
@@ -0,0 +1,185 @@
+#include <stddef.h>
+#include <stdio.h>
+
+#include "argo.h"
+#include "scan.h"
+#include "debug.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#define ARGO_SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+/*
+ * Byte-at-a-time versions, which also finish the bytes left over by the
+ * vector versions.
+ */
+static const unsigned char *skip_whitespace_scalar(const unsigned char *p, const unsigned char *end,
+                                                   int *lines, const unsigned char **line) {
+    while(p < end && argo_is_whitespace(*p)) {
+        if(*p++ == ARGO_LF) {
+            ++*lines;
+            *line = p;
+        }
+    }
+    return p;
+}
+
+static const unsigned char *scan_string_run_scalar(const unsigned char *p, const unsigned char *end) {
+    while(p < end && *p != ARGO_QUOTE && *p != ARGO_BSLASH && !argo_is_control(*p))
+        ++p;
+    return p;
+}
+
+#ifdef ARGO_SCAN_X86
+
+/*
+ * The AVX2 kernels clear the upper halves of the vector registers before
+ * returning, as SSE code run afterwards with the upper halves dirty is much
+ * slower on some processors.
+ */
+
+/*
+ * Account for the newlines in a block of whitespace, given the mask of their
+ * positions in the block, which starts at p.
+ */
+static inline void count_lines(unsigned int nl, const unsigned char *p, int *lines,
+                               const unsigned char **line) {
+    if(nl) {
+        *lines += __builtin_popcount(nl);
+        *line = p + (31 - __builtin_clz(nl)) + 1;
+    }
+}
+
+static const unsigned char *skip_whitespace_sse2(const unsigned char *p, const unsigned char *end,
+                                                 int *lines, const unsigned char **line) {
+    const __m128i sp = _mm_set1_epi8(ARGO_SPACE), lf = _mm_set1_epi8(ARGO_LF);
+    const __m128i cr = _mm_set1_epi8(ARGO_CR), ht = _mm_set1_epi8(ARGO_HT);
+    while(end - p >= 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)p);
+        __m128i n = _mm_cmpeq_epi8(x, lf);
+        __m128i w = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, sp), n),
+                                 _mm_or_si128(_mm_cmpeq_epi8(x, cr), _mm_cmpeq_epi8(x, ht)));
+        unsigned int other = ~_mm_movemask_epi8(w) & 0xffff;
+        unsigned int nl = _mm_movemask_epi8(n);
+        if(other) {
+            int i = __builtin_ctz(other);
+            count_lines(nl & ((1u << i) - 1), p, lines, line);
+            return p + i;
+        }
+        count_lines(nl, p, lines, line);
+        p += 16;
+    }
+    return skip_whitespace_scalar(p, end, lines, line);
+}
+
+static const unsigned char *scan_string_run_sse2(const unsigned char *p, const unsigned char *end) {
+    const __m128i quote = _mm_set1_epi8(ARGO_QUOTE), bslash = _mm_set1_epi8(ARGO_BSLASH);
+    const __m128i control = _mm_set1_epi8(ARGO_SPACE - 1);
+    while(end - p >= 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)p);
+        __m128i s = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, quote), _mm_cmpeq_epi8(x, bslash)),
+                                 _mm_cmpeq_epi8(_mm_min_epu8(x, control), x));
+        unsigned int m = _mm_movemask_epi8(s);
+        if(m)
+            return p + __builtin_ctz(m);
+        p += 16;
+    }
+    return scan_string_run_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+static const unsigned char *skip_whitespace_avx2(const unsigned char *p, const unsigned char *end,
+                                                 int *lines, const unsigned char **line) {
+    const __m256i sp = _mm256_set1_epi8(ARGO_SPACE), lf = _mm256_set1_epi8(ARGO_LF);
+    const __m256i cr = _mm256_set1_epi8(ARGO_CR), ht = _mm256_set1_epi8(ARGO_HT);
+    while(end - p >= 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)p);
+        __m256i n = _mm256_cmpeq_epi8(x, lf);
+        __m256i w = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(x, sp), n),
+                                    _mm256_or_si256(_mm256_cmpeq_epi8(x, cr), _mm256_cmpeq_epi8(x, ht)));
+        unsigned int other = ~(unsigned int)_mm256_movemask_epi8(w);
+        unsigned int nl = _mm256_movemask_epi8(n);
+        if(other) {
+            int i = __builtin_ctz(other);
+            count_lines(i ? nl & (~0u >> (32 - i)) : 0, p, lines, line);
+            _mm256_zeroupper();
+            return p + i;
+        }
+        count_lines(nl, p, lines, line);
+        p += 32;
+    }
+    _mm256_zeroupper();
+    return skip_whitespace_sse2(p, end, lines, line);
+}
+
+__attribute__((target("avx2")))
+static const unsigned char *scan_string_run_avx2(const unsigned char *p, const unsigned char *end) {
+    const __m256i quote = _mm256_set1_epi8(ARGO_QUOTE), bslash = _mm256_set1_epi8(ARGO_BSLASH);
+    const __m256i control = _mm256_set1_epi8(ARGO_SPACE - 1);
+    while(end - p >= 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)p);
+        __m256i s = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(x, quote), _mm256_cmpeq_epi8(x, bslash)),
+                                    _mm256_cmpeq_epi8(_mm256_min_epu8(x, control), x));
+        unsigned int m = _mm256_movemask_epi8(s);
+        if(m) {
+            _mm256_zeroupper();
+            return p + __builtin_ctz(m);
+        }
+        p += 32;
+    }
+    _mm256_zeroupper();
+    return scan_string_run_sse2(p, end);
+}
+
+/*
+ * The kernels in use, chosen on the first call according to the processor.
+ */
+static const unsigned char *skip_whitespace_init(const unsigned char *, const unsigned char *,
+                                                 int *, const unsigned char **);
+static const unsigned char *scan_string_run_init(const unsigned char *, const unsigned char *);
+
+static const unsigned char *(*skip_whitespace)(const unsigned char *, const unsigned char *,
+                                               int *, const unsigned char **) = skip_whitespace_init;
+static const unsigned char *(*scan_string_run)(const unsigned char *, const unsigned char *) = scan_string_run_init;
+
+static void scan_select(void) {
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        debug("Using AVX2 scanning");
+        skip_whitespace = skip_whitespace_avx2;
+        scan_string_run = scan_string_run_avx2;
+    }
+    else {
+        debug("Using SSE2 scanning");
+        skip_whitespace = skip_whitespace_sse2;
+        scan_string_run = scan_string_run_sse2;
+    }
+}
+
+static const unsigned char *skip_whitespace_init(const unsigned char *p, const unsigned char *end,
+                                                 int *lines, const unsigned char **line) {
+    scan_select();
+    return skip_whitespace(p, end, lines, line);
+}
+
+static const unsigned char *scan_string_run_init(const unsigned char *p, const unsigned char *end) {
+    scan_select();
+    return scan_string_run(p, end);
+}
+
+#else
+
+#define skip_whitespace skip_whitespace_scalar
+#define scan_string_run scan_string_run_scalar
+
+#endif
+
+const unsigned char *argo_skip_whitespace(const unsigned char *p, const unsigned char *end,
+                                          int *lines, const unsigned char **line) {
+    return skip_whitespace(p, end, lines, line);
+}
+
+const unsigned char *argo_scan_string_run(const unsigned char *p, const unsigned char *end) {
+    return scan_string_run(p, end);
+}
@@ -0,0 +1,115 @@
+#include <stdio.h>
+
+#include "argo.h"
+#include "writer.h"
+#include "debug.h"
+
+/*
+ * Newline followed by spaces, from which indentation is copied.
+ */
+static const char argo_indentation[] = "\n"
+    "                                                                "
+    "                                                                ";
+
+#define ARGO_INDENT_CHUNK ((int)sizeof(argo_indentation) - 2)
+
+/**
+ * @brief  Set up a writer to write to a stream through a buffer.
+ *
+ * @param w  The writer.
+ * @param f  The output stream.
+ * @param buffer  Space in which output is collected.
+ * @param size  The size of the buffer, which must not be zero.
+ */
+void argo_writer_open(ARGO_WRITER *w, FILE *f, char *buffer, size_t size) {
+    w->buffer = buffer;
+    w->length = 0;
+    w->capacity = size;
+    w->file = f;
+    w->failed = 0;
+}
+
+/**
+ * @brief  Write the contents of the buffer to the stream.
+ *
+ * @param w  The writer.
+ * @return  Zero if everything written so far has been written to the
+ * stream without error, nonzero otherwise.
+ */
+int argo_writer_flush(ARGO_WRITER *w) {
+    if(!w->failed && w->length && fwrite(w->buffer, 1, w->length, w->file) != w->length)
+        w->failed = 1;
+    w->length = 0;
+    return w->failed ? -1 : 0;
+}
+
+/**
+ * @brief  Copy bytes between places that do not overlap.
+ * @details  This file is compiled with optimization (see the Makefile),
+ * which turns the loop into a block copy.
+ *
+ * @param to  Where the bytes are copied to.
+ * @param from  Where the bytes are copied from.
+ * @param n  The number of bytes.
+ */
+void argo_copy_bytes(void *restrict to, const void *restrict from, size_t n) {
+    unsigned char *q = to;
+    const unsigned char *p = from;
+    for(size_t i = 0; i < n; i++)
+        q[i] = p[i];
+}
+
+/**
+ * @brief  Append a run of bytes to the output.
+ * @details  If the bytes do not fit in the buffer, as much as fits is
+ * copied into it and it is flushed, and the rest is then copied into it,
+ * or written straight to the stream if it would fill it again.
+ *
+ * @param w  The writer.
+ * @param p  The bytes to append.
+ * @param n  The number of bytes.
+ * @return  Zero if the operation completes without error, nonzero if
+ * writing to the stream has failed.
+ */
+int argo_put_bytes(ARGO_WRITER *w, const void *p, size_t n) {
+    size_t room = w->capacity - w->length;
+    if(n <= room) {
+        argo_copy_bytes(w->buffer + w->length, p, n);
+        w->length += n;
+        return 0;
+    }
+    argo_copy_bytes(w->buffer + w->length, p, room);
+    w->length = w->capacity;
+    p = (const char *)p + room;
+    n -= room;
+    if(argo_writer_flush(w))
+        return -1;
+    if(n < w->capacity) {
+        argo_copy_bytes(w->buffer, p, n);
+        w->length = n;
+        return 0;
+    }
+    if(fwrite(p, 1, n, w->file) != n)
+        w->failed = 1;
+    return w->failed ? -1 : 0;
+}
+
+/**
+ * @brief  Start a new line, indented by a number of spaces.
+ *
+ * @param w  The writer.
+ * @param n  The number of spaces.
+ * @return  Zero if the operation completes without error, nonzero if
+ * writing to the stream has failed.
+ */
+int argo_writer_indent(ARGO_WRITER *w, int n) {
+    int chunk = n < ARGO_INDENT_CHUNK ? n : ARGO_INDENT_CHUNK;
+    if(argo_put_bytes(w, argo_indentation, chunk + 1))
+        return -1;
+    for(n -= chunk; n > 0; n -= chunk) {
+        chunk = n < ARGO_INDENT_CHUNK ? n : ARGO_INDENT_CHUNK;
+        if(argo_put_bytes(w, argo_indentation + 1, chunk))
+            return -1;
+    }
+    return 0;
+}
@@ -1,8 +1,20 @@
 #include <criterion/criterion.h>
 #include <criterion/logging.h>
+#include <stdarg.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <float.h>
+#include <limits.h>
+#include <signal.h>
 
 #include "argo.h"
 #include "global.h"
+#include "query.h"
+#include "reader.h"
+#include "scan.h"
+#include "parser.h"
+#include "number.h"
+#include "writer.h"
 
 static char *progname = "bin/argo";
 
@@ -93,3 +105,974 @@ Test(basecode_suite, argo_basic_test) {
     cr_assert_eq(return_code, EXIT_SUCCESS,
                  "Program output did not match reference output.");
 }
+
+Test(basecode_suite, argo_floats_test) {
+    char *cmd = "bin/argo -c < rsrc/floats.json > test_output/floats_-c.json";
+    char *cmp = "cmp test_output/floats_-c.json tests/rsrc/floats_-c.json";
+
+    int return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Program exited with 0x%x instead of EXIT_SUCCESS",
+                 return_code);
+    return_code = WEXITSTATUS(system(cmp));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Program output did not match reference output.");
+}
+
+Test(basecode_suite, argo_read_twice_test) {
+    char first_in[] = "{\"a\": [\"first\", 1], \"s\": \"xyz\"}";
+    char second_in[] = "{\"b\": [\"second\", 2], \"s\": \"uvw\"}";
+    FILE *f = fmemopen(first_in, sizeof(first_in) - 1, "r");
+    ARGO_VALUE *first = argo_read_value(f);
+    fclose(f);
+    cr_assert_not_null(first, "Failed to read the first value");
+    f = fmemopen(second_in, sizeof(second_in) - 1, "r");
+    ARGO_VALUE *second = argo_read_value(f);
+    fclose(f);
+    cr_assert_not_null(second, "Failed to read the second value");
+    cr_assert_neq(first, second, "Both reads returned the same value");
+
+    char *out = NULL;
+    size_t size = 0;
+    f = open_memstream(&out, &size);
+    int ret = argo_write_value(first, f);
+    fclose(f);
+    cr_assert_eq(ret, 0, "Failed to write the first value");
+    cr_assert_str_eq(out, "{\"a\":[\"first\",1],\"s\":\"xyz\"}",
+                     "First value was changed by the second read: %s", out);
+    free(out);
+}
+
+static ARGO_VALUE *read_json(char *text) {
+    FILE *f = fmemopen(text, strlen(text), "r");
+    ARGO_VALUE *v = argo_read_value(f);
+    fclose(f);
+    return v;
+}
+
+static long int_at(ARGO_VALUE *v, char *pointer) {
+    ARGO_VALUE *m = argo_value_get(v, pointer);
+    cr_assert_not_null(m, "Nothing found at \"%s\"", pointer);
+    cr_assert_eq(m->type, ARGO_NUMBER_TYPE, "Value at \"%s\" is not a number", pointer);
+    return m->content.number.int_value;
+}
+
+/*
+ * An object with enough members to be looked up through a hash index.
+ */
+static char query_json[] =
+    "{\"a\": [10, 20, 30], \"a/b\": 1, \"m~n\": 2, \"dup\": 3, \"c\": 4,"
+    " \"d\": 5, \"e\": 6, \"f\": 7, \"dup\": 8, \"g\": 9}";
+
+Test(basecode_suite, argo_object_get_test) {
+    ARGO_VALUE *v = read_json(query_json);
+    cr_assert_not_null(v, "Failed to read the value");
+    ARGO_OBJECT *o = &v->content.object;
+    // The first lookups go through the members, and the later ones through the index.
+    for(int i = 0; i < 2; i++) {
+        ARGO_VALUE *m = argo_object_get(o, "e");
+        cr_assert_not_null(m, "Member \"e\" was not found");
+        cr_assert_eq(m->content.number.int_value, 6, "Wrong member found for \"e\"");
+        cr_assert_null(argo_object_get(o, "h"), "Found a member \"h\" that does not exist");
+        cr_assert_null(argo_object_get(o, ""), "Found a member \"\" that does not exist");
+        m = argo_object_get(o, "dup");
+        cr_assert_not_null(m, "Member \"dup\" was not found");
+        cr_assert_eq(m->content.number.int_value, 3, "The first \"dup\" member was not the one found");
+    }
+
+    v = read_json("{\"x\": 1, \"x\": 2}");
+    cr_assert_not_null(v, "Failed to read the value");
+    ARGO_VALUE *m = argo_object_get(&v->content.object, "x");
+    cr_assert_not_null(m, "Member \"x\" was not found");
+    cr_assert_eq(m->content.number.int_value, 1, "The first \"x\" member was not the one found");
+}
+
+Test(basecode_suite, argo_object_get_modified_test) {
+    ARGO_VALUE *v = read_json(query_json);
+    cr_assert_not_null(v, "Failed to read the value");
+    ARGO_OBJECT *o = &v->content.object;
+    cr_assert_not_null(argo_object_get(o, "c"), "Member \"c\" was not found");
+
+    // Move the only member of another object to the end of this one.
+    ARGO_VALUE *w = read_json("{\"late\": 11}");
+    cr_assert_not_null(w, "Failed to read the value");
+    ARGO_VALUE *sentinel = o->member_list;
+    ARGO_VALUE *m = w->content.object.member_list->next;
+    m->prev = sentinel->prev;
+    m->next = sentinel;
+    sentinel->prev->next = m;
+    sentinel->prev = m;
+    m = argo_object_get(o, "late");
+    cr_assert_not_null(m, "Member added after the index was built was not found");
+    cr_assert_eq(m->content.number.int_value, 11, "Wrong member found for \"late\"");
+
+    // Take the first member out.
+    m = sentinel->next;
+    sentinel->next = m->next;
+    m->next->prev = sentinel;
+    cr_assert_null(argo_object_get(o, "a"), "Member removed after the index was built was found");
+    cr_assert_not_null(argo_object_get(o, "g"), "Member \"g\" was not found");
+}
+
+Test(basecode_suite, argo_value_get_test) {
+    ARGO_VALUE *v = read_json(query_json);
+    cr_assert_not_null(v, "Failed to read the value");
+    cr_assert_eq(argo_value_get(v, ""), v, "Empty pointer did not refer to the value itself");
+    cr_assert_eq(int_at(v, "/a/0"), 10, "Wrong value at \"/a/0\"");
+    cr_assert_eq(int_at(v, "/a/2"), 30, "Wrong value at \"/a/2\"");
+    cr_assert_eq(int_at(v, "/a~1b"), 1, "Wrong value at \"/a~1b\"");
+    cr_assert_eq(int_at(v, "/m~0n"), 2, "Wrong value at \"/m~0n\"");
+    cr_assert_eq(int_at(v, "/dup"), 3, "Wrong value at \"/dup\"");
+
+    cr_assert_null(argo_value_get(v, "/a/3"), "Found an element past the end of the array");
+    cr_assert_null(argo_array_get(&argo_value_get(v, "/a")->content.array, 3),
+                   "Found an element past the end of the array");
+    cr_assert_null(argo_value_get(v, "/a/99999999999999999999999"), "Found an element at a huge index");
+    cr_assert_null(argo_value_get(v, "/a/01"), "Found an element at an index with a leading zero");
+    cr_assert_null(argo_value_get(v, "/a/-1"), "Found an element at a negative index");
+    cr_assert_null(argo_value_get(v, "/a/0/x"), "Found a member of a number");
+
+    cr_assert_null(argo_value_get(v, "a"), "Pointer with no leading \"/\" was accepted");
+    cr_assert_null(argo_value_get(v, "dup"), "Pointer with no leading \"/\" was accepted");
+    cr_assert_null(argo_value_get(v, "/m~2n"), "Pointer with a bad escape was accepted");
+}
+
+/*
+ * Write a value into a string, to be freed by the caller.
+ */
+static char *write_json(ARGO_VALUE *v) {
+    char *out = NULL;
+    size_t size = 0;
+    FILE *f = open_memstream(&out, &size);
+    int ret = argo_write_value(v, f);
+    fclose(f);
+    cr_assert_eq(ret, 0, "Failed to write the value");
+    return out;
+}
+
+/*
+ * Write input for read_after_error() to a stream: a value followed by a stray
+ * character, and then an array of READ_REST_LENGTH numbers that takes up more
+ * than a block of the reader.
+ */
+#define READ_REST_LENGTH 20000
+static void write_after_error(FILE *f) {
+    fputs("[1, 2] x [", f);
+    for(int i = 0; i < READ_REST_LENGTH; i++)
+        fprintf(f, i > 0 ? ", %d" : "%d", i);
+    fputs("]\n", f);
+}
+
+/*
+ * The first value read fails at the stray character, and the reader must
+ * leave everything after it in the stream for the next value.  A value that
+ * is read successfully is followed only by white space up to the end of the
+ * input, which it consumes.
+ */
+static void read_after_error(FILE *f) {
+    cr_assert_null(argo_read_value(f), "The stray character was accepted");
+    ARGO_VALUE *v = argo_read_value(f);
+    cr_assert_not_null(v, "Failed to read the value after the stray character");
+    cr_assert_eq(v->type, ARGO_ARRAY_TYPE, "The value after the stray character is not an array");
+    ARGO_ARRAY *a = &v->content.array;
+    for(int i = 0; i < READ_REST_LENGTH; i += READ_REST_LENGTH / 8 - 1) {
+        ARGO_VALUE *e = argo_array_get(a, i);
+        cr_assert(e != NULL && e->content.number.int_value == i, "Wrong element %d", i);
+    }
+    cr_assert_not_null(argo_array_get(a, READ_REST_LENGTH - 1), "The array was cut short");
+    cr_assert_null(argo_array_get(a, READ_REST_LENGTH), "The array has too many elements");
+    cr_assert_eq(fgetc(f), EOF, "Input was left after the last value");
+}
+
+Test(basecode_suite, argo_read_file_test) {
+    FILE *f = tmpfile();
+    cr_assert_not_null(f, "Failed to create a file");
+    write_after_error(f);
+    rewind(f);
+    read_after_error(f);
+    fclose(f);
+}
+
+/*
+ * A pipe cannot be repositioned, so the reader must not take anything from it
+ * beyond the character at which the first read fails.
+ */
+Test(basecode_suite, argo_read_pipe_test) {
+    int fds[2];
+    cr_assert_eq(pipe(fds), 0, "Failed to create a pipe");
+    pid_t pid = fork();
+    cr_assert_neq(pid, -1, "Failed to fork");
+    if(pid == 0) {
+        close(fds[0]);
+        FILE *out = fdopen(fds[1], "w");
+        write_after_error(out);
+        fclose(out);
+        _exit(0);
+    }
+    close(fds[1]);
+    FILE *f = fdopen(fds[0], "r");
+    read_after_error(f);
+    fclose(f);
+    int status;
+    waitpid(pid, &status, 0);
+}
+
+/*
+ * Read an array holding a single token that starts a few bytes before the end
+ * of the first block of input, and check that it is read as it would be from
+ * the start of a block.  The input is read from a memory stream, which can be
+ * repositioned but not mapped, and so is read in blocks of ARGO_READER_BLOCK
+ * bytes, or from a regular file, which is mapped and read a window of
+ * ARGO_READER_WINDOW bytes at a time.
+ */
+static void read_across(size_t block, size_t before, char *token, int file) {
+    size_t length = block - before + strlen(token) + 1;
+    char *in = malloc(length + 1);
+    in[0] = '[';
+    for(size_t i = 1; i < block - before; i++)
+        in[i] = ' ';
+    sprintf(in + block - before, "%s]", token);
+    FILE *f;
+    if(file) {
+        f = tmpfile();
+        cr_assert_not_null(f, "Failed to create a file");
+        fwrite(in, 1, length, f);
+        rewind(f);
+    }
+    else {
+        f = fmemopen(in, length, "r");
+    }
+    ARGO_VALUE *v = argo_read_value(f);
+    fclose(f);
+    free(in);
+    cr_assert_not_null(v, "Failed to read %s at %zu bytes before the block end", token, before);
+    char *out = write_json(v);
+    char text[64];
+    snprintf(text, sizeof(text), "[%s]", token);
+    char *exp = write_json(read_json(text));
+    cr_assert_str_eq(out, exp, "Read %s at %zu bytes before the block end as %s",
+                     token, before, out);
+    free(exp);
+    free(out);
+}
+
+static char *block_tokens[] = {
+    "\"abc\\\"d\\u00e9f\\n\"", "-12345.678e+9", "false", "9876543210.0123456789", NULL
+};
+
+Test(basecode_suite, argo_read_block_edge_test) {
+    for(char **token = block_tokens; *token != NULL; token++) {
+        for(size_t before = 1; before < strlen(*token); before++)
+            read_across(ARGO_READER_BLOCK, before, *token, 0);
+        read_across(ARGO_READER_WINDOW, 3, *token, 1);
+    }
+}
+
+/*
+ * Get space for SCAN_MAX bytes of input to the scanning kernels, placed so
+ * that they end just before a page that cannot be read.  A kernel that reads
+ * beyond the end of its input then crashes.
+ */
+#define SCAN_MAX 70
+static unsigned char *scan_space(void) {
+    long page = sysconf(_SC_PAGESIZE);
+    unsigned char *base = mmap(NULL, 2 * page, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    cr_assert_neq(base, MAP_FAILED, "Failed to map space for the input");
+    cr_assert_eq(mprotect(base + page, page, PROT_NONE), 0, "Failed to protect the guard page");
+    return base + page;
+}
+
+/*
+ * Lengths from 0 to SCAN_MAX cover inputs that end in the middle of a vector
+ * and just before, at and after the end of one or two vectors of 16 or 32 bytes.
+ */
+Test(basecode_suite, argo_scan_string_run_test) {
+    static unsigned char plain[] = { 'a', ' ', 0x7f, 0x80, 0xc3, 0xa9, 0xff, '!', '#', ']' };
+    static unsigned char stop[] = { ARGO_QUOTE, ARGO_BSLASH, 0x00, ARGO_LF, 0x1f };
+    unsigned char *limit = scan_space();
+    for(int len = 0; len <= SCAN_MAX; len++) {
+        unsigned char *p = limit - len;
+        for(int i = 0; i < len; i++)
+            p[i] = plain[i % sizeof(plain)];
+        cr_assert_eq(argo_scan_string_run(p, limit), limit,
+                     "Stopped early in %d plain bytes", len);
+        for(int pos = 0; pos < len; pos++) {
+            for(int k = 0; k < sizeof(stop); k++) {
+                p[pos] = stop[k];
+                // A later byte that also stops the run must not be the one found.
+                if(pos + 1 < len)
+                    p[len - 1] = stop[(k + 1) % sizeof(stop)];
+                const unsigned char *q = argo_scan_string_run(p, limit);
+                cr_assert_eq(q, p + pos, "Byte 0x%02x at %d of %d found at %ld",
+                             stop[k], pos, len, (long)(q - p));
+                p[len - 1] = plain[(len - 1) % sizeof(plain)];
+            }
+            p[pos] = plain[pos % sizeof(plain)];
+        }
+    }
+}
+
+/*
+ * Check argo_skip_whitespace() on the whitespace at p, which must end at
+ * "stop".  The newlines before it are counted onto an existing count.
+ */
+static void check_skip(const unsigned char *p, const unsigned char *end, const unsigned char *stop) {
+    int exp_lines = 3;
+    const unsigned char *exp_line = NULL;
+    for(const unsigned char *q = p; q < stop; q++) {
+        if(*q == ARGO_LF) {
+            ++exp_lines;
+            exp_line = q + 1;
+        }
+    }
+    int lines = 3;
+    const unsigned char *line = NULL;
+    const unsigned char *q = argo_skip_whitespace(p, end, &lines, &line);
+    cr_assert_eq(q, stop, "Whitespace of %ld bytes ended at %ld, expected %ld",
+                 (long)(end - p), (long)(q - p), (long)(stop - p));
+    cr_assert_eq(lines, exp_lines, "Counted %d lines in %ld bytes, expected %d",
+                 lines - 3, (long)(end - p), exp_lines - 3);
+    cr_assert_eq(line, exp_line, "Last line starts at %ld, expected %ld",
+                 line ? (long)(line - p) : -1L, exp_line ? (long)(exp_line - p) : -1L);
+}
+
+Test(basecode_suite, argo_skip_whitespace_test) {
+    static char *fills[] = { " \t\r\n", "\n", "  \n   \n\r\n\t\t", " " };
+    unsigned char *limit = scan_space();
+    for(int len = 0; len <= SCAN_MAX; len++) {
+        unsigned char *p = limit - len;
+        for(char **fill = fills; fill < fills + sizeof(fills) / sizeof(fills[0]); fill++) {
+            size_t n = strlen(*fill);
+            for(int i = 0; i < len; i++)
+                p[i] = (*fill)[i % n];
+            check_skip(p, limit, limit);
+            for(int pos = 0; pos < len; pos++) {
+                unsigned char c = p[pos];
+                p[pos] = pos % 2 ? 'x' : 0x80;
+                check_skip(p, limit, p + pos);
+                p[pos] = c;
+            }
+        }
+    }
+
+    // Newlines on either side of the edge between two vectors of either width.
+    unsigned char *p = limit - SCAN_MAX;
+    for(int edge = 16; edge <= 32; edge += 16) {
+        for(int i = 0; i < SCAN_MAX; i++)
+            p[i] = ' ';
+        p[edge - 1] = p[edge] = ARGO_LF;
+        check_skip(p, limit, limit);
+        p[edge + 1] = '0';
+        check_skip(p, limit, p + edge + 1);
+        p[edge] = '0';
+        check_skip(p, limit, p + edge);
+    }
+}
+
+/*
+ * A handler that logs each event as a word, and stops the parse with a
+ * nonzero return at a given event.
+ */
+typedef struct event_log {
+    FILE *out;
+    int events;
+    int stop_at;                    // Event at which to stop, counting from 1, or 0 not to stop.
+} EVENT_LOG;
+
+static int log_event(EVENT_LOG *log, char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    if(log->events++ > 0)
+        fputc(' ', log->out);
+    vfprintf(log->out, fmt, args);
+    va_end(args);
+    return log->events == log->stop_at ? 7 : 0;
+}
+
+static int log_text(EVENT_LOG *log, char *kind, ARGO_TEXT *t) {
+    if(t->wide)
+        return log_event(log, "%s:wide%zu", kind, t->string.length);
+    return log_event(log, "%s:%.*s", kind, (int)t->length, t->bytes);
+}
+
+static int log_start_object(void *c) { return log_event(c, "{"); }
+static int log_end_object(void *c) { return log_event(c, "}"); }
+static int log_start_array(void *c) { return log_event(c, "["); }
+static int log_end_array(void *c) { return log_event(c, "]"); }
+static int log_key(void *c, ARGO_TEXT *t) { return log_text(c, "k", t); }
+static int log_string(void *c, ARGO_TEXT *t) { return log_text(c, "s", t); }
+
+static int log_number(void *c, ARGO_NUMBER *n) {
+    if(n->valid_int)
+        return log_event(c, "n:%ld", n->int_value);
+    return log_event(c, "n:%g", n->float_value);
+}
+
+static int log_basic(void *c, ARGO_BASIC b) {
+    return log_event(c, "b:%s", b == ARGO_NULL ? "null" : b == ARGO_TRUE ? "true" : "false");
+}
+
+static int count_number(void *c, ARGO_NUMBER *n) {
+    ++*(int *)c;
+    return 0;
+}
+
+static const ARGO_HANDLER event_logger = {
+    log_start_object, log_key, log_end_object, log_start_array, log_end_array,
+    log_string, log_number, log_basic
+};
+
+static char event_json[] =
+    "{\"a\": [1, -2.5e3, {\"b\": null}], \"c\": {}, \"d\": [[], \"x\\ty\"],"
+    " \"e\": true, \"\\u4e2d\": false}";
+static char *event_list =
+    "{ k:a [ n:1 n:-2500 { k:b b:null } ] k:c { } k:d [ [ ] s:x\ty ] k:e b:true k:wide1 b:false }";
+#define EVENT_COUNT 24
+
+/*
+ * Read what is left of a stream into a string, to be freed by the caller.
+ */
+static char *read_rest(FILE *f) {
+    char *rest = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&rest, &size);
+    int c;
+    while((c = fgetc(f)) != EOF)
+        fputc(c, out);
+    fclose(out);
+    return rest;
+}
+
+/*
+ * Parse event_json with the event logger, stopping at a given event.
+ * Anything printed to stderr during the parse is returned in *err.
+ */
+static int parse_events(int stop_at, char **events, char **err) {
+    EVENT_LOG log = { NULL, 0, stop_at };
+    size_t size;
+    log.out = open_memstream(events, &size);
+    FILE *in = fmemopen(event_json, strlen(event_json), "r");
+    FILE *errf = tmpfile();
+    fflush(stderr);
+    int saved = dup(fileno(stderr));
+    dup2(fileno(errf), fileno(stderr));
+    int ret = argo_parse(in, &event_logger, &log);
+    fflush(stderr);
+    dup2(saved, fileno(stderr));
+    close(saved);
+    fclose(in);
+    fclose(log.out);
+    rewind(errf);
+    *err = read_rest(errf);
+    fclose(errf);
+    return ret;
+}
+
+Test(basecode_suite, argo_parse_events_test) {
+    char *events, *err;
+    int ret = parse_events(0, &events, &err);
+    cr_assert_eq(ret, 0, "Failed to parse the document: %s", err);
+    cr_assert_str_eq(events, event_list, "Wrong events: %s", events);
+    free(events);
+    free(err);
+
+    // Events without a callback are ignored.
+    int numbers = 0;
+    ARGO_HANDLER count = { .number = count_number };
+    FILE *in = fmemopen(event_json, strlen(event_json), "r");
+    cr_assert_eq(argo_parse(in, &count, &numbers), 0, "Failed to parse with only a number callback");
+    fclose(in);
+    cr_assert_eq(numbers, 2, "Counted %d numbers, expected 2", numbers);
+    in = fmemopen(event_json, strlen(event_json), "r");
+    cr_assert_eq(argo_parse(in, NULL, NULL), 0, "Failed to parse with no handler");
+    fclose(in);
+}
+
+Test(basecode_suite, argo_parse_stop_test) {
+    for(int stop_at = 1; stop_at <= EVENT_COUNT; stop_at++) {
+        char *events, *err;
+        int ret = parse_events(stop_at, &events, &err);
+        cr_assert_neq(ret, 0, "The parse went on after the handler stopped it at event %d", stop_at);
+        cr_assert_str_eq(err, "", "Stopping at event %d printed: %s", stop_at, err);
+        // The events up to the one that stopped the parse, and no more.
+        char *exp = strdup(event_list);
+        char *end = exp;
+        for(int i = 0; i < stop_at; i++)
+            end = strchr(end + 1, ' ') ?: end + strlen(end);
+        *end = '\0';
+        cr_assert_str_eq(events, exp, "Stopping at event %d gave the events: %s", stop_at, events);
+        free(exp);
+        free(events);
+        free(err);
+    }
+}
+
+/*
+ * Canonicalize input from a stream into a string, to be freed by the caller.
+ */
+static int canonicalize(FILE *in, char **out) {
+    size_t size;
+    FILE *f = open_memstream(out, &size);
+    int ret = argo_canonicalize(in, f);
+    fclose(f);
+    return ret;
+}
+
+Test(basecode_suite, argo_canonicalize_error_test) {
+    char *cmd = "printf '[1,2,{\"a\":' | bin/argo -c > test_output/prefix_-c.json";
+    int return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_FAILURE,
+                 "Program exited with 0x%x instead of EXIT_FAILURE", return_code);
+    FILE *f = fopen("test_output/prefix_-c.json", "r");
+    cr_assert_not_null(f, "No output was written");
+    char *out = read_rest(f);
+    fclose(f);
+    cr_assert_str_eq(out, "[1,2,{\"a\":", "Wrong output before the error: %s", out);
+    free(out);
+
+    // The output stops where the missing value would have been written.
+    global_options = CANONICALIZE_OPTION | PRETTY_PRINT_OPTION | 2;
+    char *whole = write_json(read_json("[1,2,{\"a\":3}]"));
+    *strchr(whole, '3') = '\0';
+    char in[] = "[1,2,{\"a\":";
+    f = fmemopen(in, strlen(in), "r");
+    int ret = canonicalize(f, &out);
+    fclose(f);
+    global_options = 0;
+    cr_assert_neq(ret, 0, "The incomplete input was accepted");
+    cr_assert_str_eq(out, whole, "Wrong pretty output before the error: %s", out);
+    free(whole);
+    free(out);
+}
+
+Test(basecode_suite, argo_canonicalize_deep_test) {
+    int depth = 5000;
+    char *in = NULL;
+    size_t size = 0;
+    FILE *f = open_memstream(&in, &size);
+    for(int i = 0; i < depth; i++)
+        fputs(i % 2 ? "{\"k\": " : "[0, ", f);
+    fputs("1", f);
+    for(int i = depth - 1; i >= 0; i--)
+        fputs(i % 2 ? "}" : "]", f);
+    fclose(f);
+    for(int pretty = 0; pretty < 2; pretty++) {
+        global_options = CANONICALIZE_OPTION | (pretty ? PRETTY_PRINT_OPTION | 1 : 0);
+        char *exp = write_json(read_json(in));
+        char *out;
+        f = fmemopen(in, size, "r");
+        int ret = canonicalize(f, &out);
+        fclose(f);
+        global_options = 0;
+        cr_assert_eq(ret, 0, "Failed to canonicalize %d levels of nesting", depth);
+        cr_assert_str_eq(out, exp, "Output for %d levels of nesting differs from argo_write_value()",
+                         depth);
+        free(exp);
+        free(out);
+    }
+    free(in);
+}
+
+/*
+ * On each of the sample inputs, the output of argo_canonicalize() must be the
+ * same as that of argo_read_value() and argo_write_value(), with and without
+ * pretty printing.
+ */
+Test(basecode_suite, argo_canonicalize_rsrc_test) {
+    static char *files[] = {
+        "rsrc/strings.json", "rsrc/numbers.json", "rsrc/floats.json", "rsrc/package-lock.json",
+        NULL
+    };
+    static int options[] = {
+        0, PRETTY_PRINT_OPTION | 0, PRETTY_PRINT_OPTION | 2, PRETTY_PRINT_OPTION | 4
+    };
+    for(char **file = files; *file != NULL; file++) {
+        for(int i = 0; i < sizeof(options) / sizeof(options[0]); i++) {
+            global_options = CANONICALIZE_OPTION | options[i];
+            FILE *f = fopen(*file, "r");
+            cr_assert_not_null(f, "Failed to open %s", *file);
+            ARGO_VALUE *v = argo_read_value(f);
+            fclose(f);
+            cr_assert_not_null(v, "Failed to read %s", *file);
+            char *exp = write_json(v);
+            char *out;
+            f = fopen(*file, "r");
+            int ret = canonicalize(f, &out);
+            fclose(f);
+            global_options = 0;
+            cr_assert_eq(ret, 0, "Failed to canonicalize %s", *file);
+            cr_assert_str_eq(out, exp, "Output for %s with options 0x%x differs from argo_write_value()",
+                             *file, options[i]);
+            free(exp);
+            free(out);
+        }
+    }
+}
+
+/*
+ * Strings with escapes and UTF-8, and their canonical forms.  Raw bytes are
+ * kept as they are; \u escapes below U+0100 become single bytes, and any
+ * string with a character above U+00FF has those characters escaped again.
+ */
+static char *text_cases[][2] = {
+    { "\"caf\\u00e9\"", "\"caf\xe9\"" },
+    { "\"caf\xc3\xa9\"", "\"caf\xc3\xa9\"" },
+    { "\"\\u4e2d\"", "\"\\u4e2d\"" },
+    { "\"\\uD83D\\uDE00\"", "\"\\ud83d\\ude00\"" },
+    { "\"\xc3\xa9\\u4e2d\"", "\"\xc3\xa9\\u4e2d\"" },
+    { "\"\\u00ff\\u0100\"", "\"\xff\\u0100\"" },
+    { "\"\\u0001\\t\\/\\\"\\\\\"", "\"\\u0001\\t/\\\"\\\\\"" },
+    { "\"\x7f\x80\xff\"", "\"\x7f\x80\xff\"" },
+    { "{\"\\u00e9\\u4e2d\": \"k\\u0000\", \"\xf0\x9f\x98\x80\": \"\\ud83d\\ude00x\"}",
+      "{\"\xe9\\u4e2d\":\"k\\u0000\",\"\xf0\x9f\x98\x80\":\"\\ud83d\\ude00x\"}" },
+    { NULL, NULL }
+};
+
+Test(basecode_suite, argo_text_round_trip_test) {
+    global_options = CANONICALIZE_OPTION;
+    for(int i = 0; text_cases[i][0] != NULL; i++) {
+        char *in = text_cases[i][0], *exp = text_cases[i][1];
+        ARGO_VALUE *v = read_json(in);
+        cr_assert_not_null(v, "Failed to read case %d", i);
+        char *out = write_json(v);
+        cr_assert_str_eq(out, exp, "Case %d was written as %s", i, out);
+        free(out);
+        // Canonical output reads back as itself, whether written in one pass or not.
+        for(int pass = 0; pass < 2; pass++) {
+            char *text = pass ? exp : in;
+            FILE *f = fmemopen(text, strlen(text), "r");
+            int ret = canonicalize(f, &out);
+            fclose(f);
+            cr_assert_eq(ret, 0, "Failed to canonicalize case %d", i);
+            cr_assert_str_eq(out, exp, "Case %d was canonicalized as %s", i, out);
+            free(out);
+        }
+    }
+    global_options = 0;
+}
+
+/*
+ * A handler that keeps a copy of the last string, with its flags.
+ */
+typedef struct text_copy {
+    unsigned char *bytes;
+    size_t length;
+    int plain, wide;
+} TEXT_COPY;
+
+static int copy_text(void *c, ARGO_TEXT *t) {
+    TEXT_COPY *copy = c;
+    free(copy->bytes);
+    copy->bytes = malloc(t->length + 1);
+    if(!t->wide)
+        memcpy(copy->bytes, t->bytes, t->length);
+    copy->length = t->length;
+    copy->plain = t->plain;
+    copy->wide = t->wide;
+    return 0;
+}
+
+/*
+ * A string with no character to escape is flagged as plain, and is written
+ * exactly as it was read, even when it is longer than the output buffer.
+ * An escape makes it no longer plain, though it is written the same way.
+ */
+Test(basecode_suite, argo_text_plain_test) {
+    size_t length = 3 * ARGO_WRITER_BUFFER / 2;
+    char *in = malloc(length + 3);
+    in[0] = '"';
+    for(size_t i = 1; i <= length; i++) {
+        unsigned char c = ARGO_SPACE + i % (256 - ARGO_SPACE);
+        in[i] = c == ARGO_QUOTE || c == ARGO_BSLASH ? 'x' : c;
+    }
+    in[length + 1] = '"';
+    in[length + 2] = '\0';
+    ARGO_HANDLER handler = { .string = copy_text };
+    TEXT_COPY copy = { NULL, 0, 0, 0 };
+    FILE *f = fmemopen(in, length + 2, "r");
+    cr_assert_eq(argo_parse(f, &handler, &copy), 0, "Failed to parse the plain string");
+    fclose(f);
+    cr_assert(copy.plain && !copy.wide, "The plain string was not flagged as plain");
+    cr_assert(copy.length == length && !memcmp(copy.bytes, in + 1, length),
+              "The plain string was not read as it is");
+
+    global_options = CANONICALIZE_OPTION;
+    char *out = write_json(read_json(in));
+    cr_assert_str_eq(out, in, "The plain string was not written as it was read");
+    free(out);
+    f = fmemopen(in, length + 2, "r");
+    cr_assert_eq(canonicalize(f, &out), 0, "Failed to canonicalize the plain string");
+    fclose(f);
+    cr_assert_str_eq(out, in, "The plain string was not canonicalized as it was read");
+    free(out);
+
+    in[length - 1] = ARGO_BSLASH;
+    in[length] = 't';
+    f = fmemopen(in, length + 2, "r");
+    cr_assert_eq(argo_parse(f, &handler, &copy), 0, "Failed to parse the string with a tab");
+    fclose(f);
+    cr_assert(!copy.plain && !copy.wide, "The string with a tab was flagged as plain");
+    out = write_json(read_json(in));
+    global_options = 0;
+    cr_assert_str_eq(out, in, "The string with a tab was not written with its escape");
+    free(out);
+    free(copy.bytes);
+    free(in);
+}
+
+/*
+ * Convert the magnitude of a number as the parser does, collecting its
+ * digits in an ARGO_DECIMAL and passing its text along for strtod().
+ */
+static double decimal_value(char *s) {
+    ARGO_DECIMAL d = { 0, 0, 0, 0 };
+    ARGO_STRING text = { 0, 0, NULL };
+    for(char *p = s; *p != '\0'; p++)
+        argo_append_char(&text, *p);
+    char *p = s;
+    if(*p == '-')
+        p++;
+    for(; argo_is_digit(*p); p++)
+        argo_decimal_digit(&d, *p);
+    if(*p == '.') {
+        for(p++; argo_is_digit(*p); p++) {
+            d.fraction++;
+            argo_decimal_digit(&d, *p);
+        }
+    }
+    if(argo_is_exponent(*p)) {
+        d.exponent = strtol(p + 1, NULL, 10);
+        if(d.exponent > ARGO_DECIMAL_MAX_EXPONENT)
+            d.exponent = ARGO_DECIMAL_MAX_EXPONENT;
+        if(d.exponent < -ARGO_DECIMAL_MAX_EXPONENT)
+            d.exponent = -ARGO_DECIMAL_MAX_EXPONENT;
+    }
+    double value;
+    cr_assert_eq(argo_decimal_value(&d, &text, &value), 0, "Failed to convert %s", s);
+    free(text.content);
+    return value;
+}
+
+/*
+ * Numbers on either side of the limits of the exact conversion, and numbers
+ * that only strtod() can convert, must all give the double nearest to them.
+ */
+Test(basecode_suite, argo_decimal_value_test) {
+    static char *numbers[] = {
+        // A significand and a power of ten that are exact as doubles.
+        "1e22", "7e-22", "1234.5e-19", "9007199254740992", "9007199254740992e22",
+        "9007199254740992e-22", "1e23", "123e-24",
+        // More than 19 digits, or a significand or scale out of range.
+        "9007199254740993", "12345678901234567890123", "1.00000000000000000000001",
+        "9007199254740992e23", "9007199254740991e23", "9007199254740992e-23", "2.2250738585072014e-308",
+        "4.9406564584124654e-324", "2.4703282292062328e-324", "1e-400",
+        "1.7976931348623157e308", "-0.0", "0", "0.000",
+        NULL
+    };
+    for(char **n = numbers; *n != NULL; n++) {
+        double value = decimal_value(*n);
+        double exp = strtod(**n == '-' ? *n + 1 : *n, NULL);
+        cr_assert(value == exp, "%s was converted to %.17g instead of %.17g", *n, value, exp);
+    }
+    double value = decimal_value("1.8e308");
+    cr_assert(value > DBL_MAX, "1.8e308 was converted to %g", value);
+    value = decimal_value("1e100000");
+    cr_assert(value > DBL_MAX, "1e100000 was converted to %g", value);
+}
+
+static char *format_double(double value) {
+    static char buf[ARGO_NUMBER_BUFFER + 1];
+    int n = argo_format_double(value, buf);
+    if(n < 0)
+        return NULL;
+    buf[n] = '\0';
+    return buf;
+}
+
+/*
+ * Canonical forms, including values exactly halfway or within a rounding
+ * error of halfway between two 15-digit decimals, which argo_format_double()
+ * has to round with printf(), and values that round up to the next power of
+ * ten.
+ */
+Test(basecode_suite, argo_format_double_test) {
+    static struct { double value; char *form; } cases[] = {
+        { 1.234, "0.1234e1" }, { 0.1, "0.1" }, { 1, "0.1e1" }, { -1.5, "-0.15e1" },
+        { 0, "0.0" }, { -0.0, "0.0" }, { 1e22, "0.1e23" }, { 1e-22, "0.1e-21" },
+        { 123456789012345.5, "0.123456789012346e15" },
+        { 123456789012344.5, "0.123456789012344e15" },
+        { 0.1096958932099035, "0.109695893209904" },
+        { 0.7146545339367395, "0.714654533936739" },
+        { 0.9999999999999999, "0.1e1" }, { 999999999999999.9, "0.1e16" },
+        { 9.999999999999999e-300, "0.1e-298" },
+        { DBL_MAX, "0.179769313486232e309" }, { -DBL_MAX, "-0.179769313486232e309" },
+        { DBL_MIN, "0.22250738585072e-307" }, { 4.9406564584124654e-324, "0.494065645841247e-323" },
+        { 0, NULL }
+    };
+    for(int i = 0; cases[i].form != NULL; i++) {
+        char *form = format_double(cases[i].value);
+        cr_assert_not_null(form, "%.17g could not be formatted", cases[i].value);
+        cr_assert_str_eq(form, cases[i].form, "%.17g was formatted as %s", cases[i].value, form);
+    }
+    cr_assert_null(format_double(1.0 / 0.0), "An infinite value was formatted");
+    cr_assert_null(format_double(-1.0 / 0.0), "An infinite value was formatted");
+    cr_assert_null(format_double(0.0 / 0.0), "A NaN was formatted");
+}
+
+/*
+ * Doubles with random bits must be formatted with the digits that printf()
+ * gives them, and must read back as the double nearest to those digits.
+ */
+Test(basecode_suite, argo_format_double_random_test) {
+    unsigned long long bits = 88172645463325252ULL;
+    for(int i = 0; i < 100000; i++) {
+        bits ^= bits << 13;
+        bits ^= bits >> 7;
+        bits ^= bits << 17;
+        union { unsigned long long bits; double value; } u = { bits & ~(1ULL << 63) };
+        if(u.value > DBL_MAX || u.value != u.value)
+            continue;
+        char *form = format_double(u.value);
+        char ref[ARGO_NUMBER_BUFFER];
+        snprintf(ref, sizeof(ref), "%.*e", ARGO_PRECISION - 1, u.value);
+        // "d.ddd...e+x" has the digits of "0.dddd...ey", with y = x + 1.
+        char digits[ARGO_PRECISION + 1];
+        int n = 0;
+        for(char *p = ref; *p != 'e'; p++)
+            if(argo_is_digit(*p))
+                digits[n++] = *p;
+        while(n > 1 && digits[n - 1] == '0')
+            n--;
+        digits[n] = '\0';
+        int exponent = atoi(strchr(ref, 'e') + 1) + 1;
+        char exp[ARGO_NUMBER_BUFFER + 8];
+        if(exponent)
+            snprintf(exp, sizeof(exp), "0.%se%d", digits, exponent);
+        else
+            snprintf(exp, sizeof(exp), "0.%s", digits);
+        cr_assert_str_eq(form, exp, "%.17g was formatted as %s", u.value, form);
+        double value = decimal_value(form);
+        double back = strtod(form, NULL);
+        cr_assert(value == back, "%s was read as %.17g", form, value);
+    }
+}
+
+Test(basecode_suite, argo_format_long_test) {
+    static struct { long value; char *form; } cases[] = {
+        { 0, "0" }, { 7, "7" }, { -7, "-7" }, { 1000000, "1000000" },
+        { LONG_MAX, "9223372036854775807" }, { LONG_MIN, "-9223372036854775808" },
+        { LONG_MIN + 1, "-9223372036854775807" }, { 0, NULL }
+    };
+    char buf[ARGO_NUMBER_BUFFER + 1];
+    for(int i = 0; cases[i].form != NULL; i++) {
+        int n = argo_format_long(cases[i].value, buf);
+        buf[n] = '\0';
+        cr_assert_str_eq(buf, cases[i].form, "%ld was formatted as %s", cases[i].value, buf);
+    }
+}
+
+#define WRITER_SMALL 16
+
+/*
+ * Put bytes through a writer with a small buffer, and check how much of
+ * them has been handed to the stream.
+ */
+static void put_and_check(ARGO_WRITER *w, FILE *f, size_t *size, char *bytes, size_t n,
+                          size_t written, size_t buffered) {
+    cr_assert_eq(argo_put_bytes(w, bytes, n), 0, "Failed to put %zu bytes", n);
+    fflush(f);
+    cr_assert(*size == written && w->length == buffered,
+              "After %zu bytes, %zu were written and %zu buffered instead of %zu and %zu",
+              n, *size, w->length, written, buffered);
+}
+
+/*
+ * A run that exactly fills the buffer stays in it until more output comes.
+ * A run that overflows it fills it and is flushed with it, and the rest is
+ * buffered, or written straight to the stream if it would fill the buffer
+ * again.
+ */
+Test(basecode_suite, argo_writer_test) {
+    char in[200];
+    for(int i = 0; i < sizeof(in); i++)
+        in[i] = 'a' + i % 26;
+    char *out = NULL;
+    size_t size = 0;
+    FILE *f = open_memstream(&out, &size);
+    char buffer[WRITER_SMALL];
+    ARGO_WRITER w;
+    argo_writer_open(&w, f, buffer, sizeof(buffer));
+    put_and_check(&w, f, &size, in, 16, 0, 16);
+    cr_assert_eq(argo_put(&w, in[16]), 0, "Failed to put a byte");
+    fflush(f);
+    cr_assert(size == 16 && w.length == 1, "A full buffer was not flushed by the next byte");
+    put_and_check(&w, f, &size, in + 17, 20, 32, 5);
+    put_and_check(&w, f, &size, in + 37, 0, 32, 5);
+    put_and_check(&w, f, &size, in + 37, 27, 64, 0);
+    put_and_check(&w, f, &size, in + 64, 1, 64, 1);
+    put_and_check(&w, f, &size, in + 65, 100, 165, 0);
+    put_and_check(&w, f, &size, in + 165, 16, 165, 16);
+    put_and_check(&w, f, &size, in + 181, 16, 197, 0);
+    cr_assert_eq(argo_writer_flush(&w), 0, "Failed to flush the writer");
+    fflush(f);
+    cr_assert(size == 197 && !memcmp(out, in, size), "The bytes were not written in order");
+
+    // Indentation longer than the run of spaces it is copied from.
+    cr_assert_eq(argo_writer_indent(&w, 257), 0, "Failed to indent");
+    cr_assert_eq(argo_writer_flush(&w), 0, "Failed to flush the writer");
+    fclose(f);
+    cr_assert_eq(size, 197 + 258, "Indentation of 257 was written as %zu bytes", size - 197);
+    cr_assert_eq(out[197], '\n', "Indentation does not start a new line");
+    for(size_t i = 198; i < size; i++)
+        cr_assert_eq(out[i], ' ', "Indentation has '%c' at %zu", out[i], i - 198);
+    free(out);
+}
+
+/*
+ * A write to a pipe that has been closed fails, and so does every flush
+ * after it.  So does a write to a stream that takes fewer bytes than it is
+ * given, whether the bytes come from the buffer or straight from the caller.
+ */
+Test(basecode_suite, argo_writer_error_test) {
+    char in[100];
+    for(int i = 0; i < sizeof(in); i++)
+        in[i] = 'a' + i % 26;
+    void (*handler)(int) = signal(SIGPIPE, SIG_IGN);
+    int fd[2];
+    cr_assert_eq(pipe(fd), 0, "Failed to create a pipe");
+    close(fd[0]);
+    FILE *f = fdopen(fd[1], "w");
+    setvbuf(f, NULL, _IONBF, 0);
+    char buffer[WRITER_SMALL];
+    ARGO_WRITER w;
+    argo_writer_open(&w, f, buffer, sizeof(buffer));
+    cr_assert_eq(argo_put_bytes(&w, in, 10), 0, "Buffered bytes could not be put");
+    cr_assert_neq(argo_writer_flush(&w), 0, "A write to a closed pipe did not fail");
+    cr_assert_neq(argo_put_bytes(&w, in, 40), 0, "A put after a failed write did not fail");
+    cr_assert_neq(argo_writer_flush(&w), 0, "A flush after a failed write did not fail");
+    cr_assert_neq(argo_write_value(read_json("[1, \"two\", {\"three\": 3}]"), f), 0,
+                  "Writing a value to a closed pipe did not fail");
+    fclose(f);
+    signal(SIGPIPE, handler);
+
+    // The stream holds fewer bytes than are put.
+    char mem[WRITER_SMALL + 8];
+    for(int direct = 0; direct < 2; direct++) {
+        f = fmemopen(mem, sizeof(mem), "w");
+        setvbuf(f, NULL, _IONBF, 0);
+        argo_writer_open(&w, f, buffer, sizeof(buffer));
+        cr_assert_eq(argo_put_bytes(&w, in, 10), 0, "Buffered bytes could not be put");
+        if(direct) {
+            cr_assert_neq(argo_put_bytes(&w, in + 10, 40), 0, "A short write did not fail");
+            cr_assert(!memcmp(mem, in, WRITER_SMALL), "The buffer was not written before the rest");
+        }
+        else {
+            cr_assert_eq(argo_put_bytes(&w, in + 10, 10), 0, "Failed to fill the buffer");
+            cr_assert_eq(argo_put_bytes(&w, in + 20, 10), 0, "Buffered bytes could not be put");
+            cr_assert_neq(argo_writer_flush(&w), 0, "A short write did not fail");
+        }
+        cr_assert_neq(argo_writer_flush(&w), 0, "A flush after a short write did not fail");
+        fclose(f);
+    }
+}
@@ -0,0 +1,27 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+/*
+ * Capture of client sessions, for replay by util/replay.
+ *
+ * When enabled, every connection and every command received is appended to
+ * the capture file as a line of the form
+ *
+ *     <microseconds> <connection> <event>
+ *
+ * where the time is measured from the start of the capture, connections are
+ * numbered from 0 in order of arrival, and the event is "connect <ext>",
+ * "disconnect", or the command in its text form (binary frames are written
+ * as the equivalent text command).  Lines are written through a buffer under
+ * a lock, so capture is meant to be enabled only while collecting a trace.
+ */
+#define CAPTURE_CONNECT "connect"
+#define CAPTURE_DISCONNECT "disconnect"
+
+int capture_open(char *path);
+int capture_connect(int ext);
+void capture_command(int conn, const char *cmd);
+void capture_disconnect(int conn);
+void capture_close(void);
+
+#endif
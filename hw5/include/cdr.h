@@ -0,0 +1,42 @@
+#ifndef CDR_H
+#define CDR_H
+
+#include <stdint.h>
+
+/*
+ * Call detail records.
+ *
+ * One record is produced for every call set up by tu_dial(), when the call
+ * ends.  Records are pushed into a fixed-size lock-free ring, from which a
+ * background thread writes them to the CDR file in batches, so that the
+ * threads handling calls never wait for the file.  If the ring is full the
+ * record is dropped and counted in the metrics rather than blocking the call path.
+ *
+ * The file is opened for appending.  If its name ends in ".bin" the records
+ * are written in binary, as raw CDR structures in host byte order; otherwise
+ * they are written as CSV lines, with a header line if the file is empty.
+ * Times are wall-clock times in nanoseconds since the epoch; connect_ns is 0
+ * for calls that were never answered.  Index 0 of chats and chat_bytes
+ * counts messages sent by the caller, index 1 those sent by the callee.
+ */
+typedef struct cdr {
+    int64_t dial_ns;
+    int64_t connect_ns;
+    int64_t hangup_ns;
+    int32_t caller;
+    int32_t callee;
+    uint32_t chats[2];
+    uint64_t chat_bytes[2];
+} CDR;
+
+/*
+ * Number of records the ring can hold (a power of two).
+ */
+#define CDR_RING_SIZE 4096
+
+int cdr_open(char *path);
+int cdr_log(CDR *rec);
+int64_t cdr_now(void);
+void cdr_close(void);
+
+#endif
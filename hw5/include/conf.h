@@ -0,0 +1,43 @@
+#ifndef CONF_H
+#define CONF_H
+
+#include <semaphore.h>
+
+#include "tu.h"
+#include "server.h"
+#include "outq.h"
+
+/*
+ * Conference calls.
+ *
+ * A TU with dial tone may join a numbered conference room with the command
+ * "conf <room>", which puts it in the TU_CONFERENCE state.  The room is created
+ * when its first member joins and goes away when its last member hangs up.
+ * Chat messages sent by a member are delivered to every other member.
+ *
+ * The state and command are numbered after those in tu.h and server.h,
+ * which cannot be extended.
+ */
+#define TU_CONFERENCE ((TU_STATE)(TU_ERROR + 1))
+#define TU_CONF_CMD ((TU_COMMAND)(TU_CHAT_CMD + 1))
+
+#define CONF_STATE_NAME "CONFERENCE"
+#define CONF_COMMAND_NAME "conf"
+
+/*
+ * Structure type representing a conference room.
+ */
+typedef struct conf CONF;
+
+CONF *conf_get(int room);
+void conf_put(CONF *conf);
+sem_t *conf_mutex(CONF *conf);
+int conf_room(CONF *conf);
+int conf_size(CONF *conf);
+void conf_add(CONF *conf, TU *tu, OUTQ *outq, int binary);
+void conf_remove(CONF *conf, TU *tu);
+int conf_chat(CONF *conf, TU *from, char *msg);
+
+int tu_conference(TU *tu, int room);
+
+#endif
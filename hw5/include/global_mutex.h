@@ -1,3 +0,0 @@
-#include "csapp.h"
-
-extern sem_t global_mutex;
\ No newline at end of file
@@ -0,0 +1,62 @@
+#ifndef HUNT_H
+#define HUNT_H
+
+#include <semaphore.h>
+
+#include "pbx.h"
+#include "pbx_ext.h"
+
+/*
+ * Wait queues and hunt groups.
+ *
+ * A TU with dial tone that sends "queue <ext>" calls the extension as with
+ * "dial", except that if the extension is busy the TU enters the TU_QUEUED
+ * state instead of TU_BUSY_SIGNAL.  It then waits in first-come, first-served
+ * order behind any other TUs queued for the extension, and is put through
+ * (going to TU_RING_BACK) as soon as the extension is back on hook.
+ *
+ * A hunt group is a numbered set of agent TUs, which a TU joins with
+ * "agent <group>" and leaves when it is unregistered.  "hunt <group>" calls
+ * the agent that is on hook, starting after the one last called, and queues
+ * the caller if every agent is busy, until one of them hangs up.
+ *
+ * A queued TU leaves the queue by hanging up.  If the extension it is
+ * waiting for is unregistered, it gets a busy signal.
+ *
+ * The state and commands are numbered after those of pbx_ext.h.
+ */
+#define TU_QUEUED ((TU_STATE)(TU_CONFERENCE + 1))
+#define TU_QUEUE_CMD ((TU_COMMAND)(TU_EXT_CMD + 1))
+#define TU_HUNT_CMD ((TU_COMMAND)(TU_QUEUE_CMD + 1))
+#define TU_AGENT_CMD ((TU_COMMAND)(TU_HUNT_CMD + 1))
+
+#define QUEUED_STATE_NAME "QUEUED"
+#define QUEUE_COMMAND_NAME "queue"
+#define HUNT_COMMAND_NAME "hunt"
+#define AGENT_COMMAND_NAME "agent"
+
+/*
+ * Structure type representing the queue of an extension or a hunt group.
+ */
+typedef struct hunt HUNT;
+
+HUNT *hunt_init(TU *tu);
+void hunt_fini(HUNT *hunt);
+HUNT *hunt_group(int group);
+int hunt_call(HUNT *hunt, TU *tu, int number);
+void hunt_join(HUNT *hunt, TU *tu);
+void hunt_leave(HUNT *hunt, TU *tu);
+void hunt_close(HUNT *hunt);
+void hunt_cancel(HUNT *hunt, TU *tu, unsigned int ticket);
+void hunt_serve(HUNT *hunt);
+
+int tu_connect(TU *tu, TU *target, HUNT *hunt, unsigned int ticket);
+unsigned int tu_wait(TU *tu, HUNT *hunt, int number);
+void tu_cancel_wait(TU *tu, HUNT *hunt, unsigned int ticket);
+HUNT *tu_queue(TU *tu);
+int tu_agent(TU *tu, int group);
+void tu_unplug(TU *tu);
+
+int pbx_queue(PBX *pbx, TU *tu, int ext);
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <semaphore.h>
+#include <time.h>
+
+#include "server.h"
+
+/*
+ * Runtime counters and gauges maintained by the PBX.
+ * All updates are relaxed atomic additions, cheap enough to leave enabled under load.
+ */
+typedef enum metric {
+    METRIC_REGISTERED, METRIC_ACTIVE_CALLS, METRIC_CALLS, METRIC_CHATS, METRIC_CONF_MEMBERS,
+    METRIC_BYTES_IN, METRIC_BYTES_OUT,
+    METRIC_PBX_WAITS, METRIC_PBX_WAIT_NS, METRIC_TU_WAITS, METRIC_TU_WAIT_NS,
+    METRIC_THROTTLED, METRIC_THROTTLE_NS, METRIC_OUTQ_DROPS, METRIC_OUTQ_CUTS,
+    METRIC_CDRS, METRIC_CDR_DROPS, METRIC_SESSIONS_RESUMED, METRIC_SESSIONS_EXPIRED,
+    METRIC_QUEUED,
+    METRIC_COUNT
+} METRIC;
+
+/*
+ * Locks whose wait time is accounted for by metrics_lock().
+ */
+typedef enum metric_lock {
+    METRIC_LOCK_PBX, METRIC_LOCK_TU
+} METRIC_LOCK;
+
+void metrics_init(void);
+void metrics_add(METRIC m, long v);
+void metrics_lock(sem_t *sem, METRIC_LOCK lock);
+void metrics_command(TU_COMMAND cmd, struct timespec *start);
+void metrics_thread_waits(long *waits, long *ns);
+void metrics_write(int fd);
+int metrics_serve(char *port);
+void metrics_stop(void);
+
+#endif
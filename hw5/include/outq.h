@@ -0,0 +1,43 @@
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include <stddef.h>
+
+/*
+ * Structure type representing the outbound queue of a network client.
+ *
+ * Output destined for a client is never written to its socket with a blocking
+ * call.  Instead it is handed to the client's outbound queue, which attempts an
+ * immediate non-blocking send and otherwise retains the data until a shared
+ * writer thread finds the socket writable.  This makes the time for which the
+ * TU locks are held independent of how fast the peer drains its connection.
+ */
+typedef struct outq OUTQ;
+
+/*
+ * Structure type representing a reference-counted message that can be queued
+ * for several clients at once without being copied.
+ */
+typedef struct outq_msg OUTQ_MSG;
+
+/*
+ * Maximum number of bytes that may be waiting in a single outbound queue.
+ * Once a client falls this far behind, droppable output (chat messages) is
+ * discarded, and any other output causes the client to be disconnected.
+ */
+#define OUTQ_MAX_BYTES (64 * 1024)
+
+/*
+ * Flag for outq_put(): the data may be discarded if the queue is full.
+ */
+#define OUTQ_DROP 0x1
+
+OUTQ *outq_init(int fd);
+int outq_put(OUTQ *q, const char *buf, size_t len, int flags);
+int outq_put_msg(OUTQ *q, OUTQ_MSG *msg, int flags);
+OUTQ_MSG *outq_msg_init(const char *buf, size_t len);
+void outq_msg_release(OUTQ_MSG *msg);
+void outq_release(OUTQ *q);
+int outq_shutdown(long timeout_ms);
+
+#endif
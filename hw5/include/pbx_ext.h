@@ -0,0 +1,39 @@
+#ifndef PBX_EXT_H
+#define PBX_EXT_H
+
+#include "pbx.h"
+#include "conf.h"
+
+/*
+ * Additional PBX functions, declared here because pbx.h cannot be changed.
+ */
+int pbx_draining(PBX *pbx);
+int pbx_request_extension(PBX *pbx, TU *tu, int ext);
+
+/*
+ * Extension numbers.
+ *
+ * Extensions are allocated by the PBX independently of the file descriptors
+ * of the underlying connections.  Passing PBX_ANY_EXTENSION to pbx_register()
+ * assigns the extension that has been free the longest, starting from
+ * PBX_FIRST_EXTENSION.  A client whose TU is on hook may instead ask for a
+ * particular free extension with the command "ext <number>".  Extensions
+ * range up to PBX_EXTENSION_LIMIT, which replaces the PBX_MAX_EXTENSIONS
+ * limit of pbx.h.
+ */
+#define PBX_ANY_EXTENSION (-1)
+#define PBX_FIRST_EXTENSION 1
+#define PBX_EXTENSION_LIMIT (1 << 20)
+
+/*
+ * Number of shards into which the registry is divided, which must be set
+ * before pbx_init() is called.
+ */
+#define PBX_DEFAULT_SHARDS 16
+
+extern int pbx_shards;
+
+#define TU_EXT_CMD ((TU_COMMAND)(TU_CONF_CMD + 1))
+#define EXT_COMMAND_NAME "ext"
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef POOL_H
+#define POOL_H
+
+/*
+ * Pool of pre-spawned server threads.
+ *
+ * The workers are not tied to connections.  Connections waiting to be served
+ * are kept in a run queue: a worker takes the connection at its head,
+ * carries out at most POOL_QUANTUM of the commands its client has sent,
+ * and then puts it back at the tail if it has more to offer, or hands it to
+ * a poller thread that waits, with epoll, for more input on every idle
+ * connection and queues each one again as soon as some arrives.  Clients are
+ * therefore served round-robin, a client that is not sending anything
+ * occupies no thread, and the number of connections that can be served at
+ * once is not limited by the number of workers.  A client that exceeds its
+ * rate limit does not keep a worker either: its connection is parked with
+ * the poller until its next token is due.  Handing a new connection to the
+ * pool never blocks the accept loop.
+ */
+#define POOL_DEFAULT_WORKERS 8
+
+/*
+ * Maximum number of commands carried out for one client before the worker
+ * moves on to the next one.
+ */
+#define POOL_QUANTUM 4
+
+int pool_init(int nworkers);
+void pool_submit(int connfd);
+void pool_stop(void);
+void pool_exit(void);
+
+#endif
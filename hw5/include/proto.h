@@ -0,0 +1,54 @@
+#ifndef PROTO_H
+#define PROTO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tu.h"
+
+/*
+ * Binary framed protocol.
+ *
+ * A client that sends the text command "binary" receives the acknowledgement
+ * "BINARY\r\n", after which all traffic on the connection in both directions
+ * consists of frames.  Every frame starts with a fixed header of
+ * PROTO_HEADER_SIZE bytes, with multi-byte fields in network byte order:
+ *
+ *   byte 0     frame type (PROTO_COMMAND, PROTO_STATE or PROTO_CHAT)
+ *   byte 1     command code (TU_COMMAND) or state code (TU_STATE)
+ *   bytes 2-3  length of the payload that follows the header
+ *   bytes 4-7  numeric argument (extension or room number), or PROTO_NO_ARG
+ *
+ * The only frames with a payload are chat commands and chat notifications,
+ * whose payload is the message itself, without a terminating newline.
+ * Immediately after the acknowledgement, the server sends a state frame
+ * giving the current state of the TU.
+ */
+#define PROTO_BINARY_COMMAND "binary"
+#define PROTO_BINARY_ACK "BINARY"
+
+#define PROTO_HEADER_SIZE 8
+#define PROTO_MAX_PAYLOAD 0xffff
+#define PROTO_NO_ARG 0xffffffffU
+
+typedef enum proto_frame_type {
+    PROTO_COMMAND = 1, PROTO_STATE = 2, PROTO_CHAT = 3
+} PROTO_FRAME_TYPE;
+
+/*
+ * Decoded frame header.
+ */
+typedef struct proto_frame {
+    uint8_t type;
+    uint8_t code;
+    uint16_t len;
+    uint32_t arg;
+} PROTO_FRAME;
+
+void proto_encode(char *buf, PROTO_FRAME *frame);
+void proto_decode(const char *buf, PROTO_FRAME *frame);
+char *proto_chat(const char *msg, int binary, size_t *lenp);
+
+int tu_set_binary(TU *tu);
+
+#endif
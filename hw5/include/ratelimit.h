@@ -0,0 +1,42 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <time.h>
+
+/*
+ * Token bucket limiting the rate at which commands from one client are
+ * carried out.  Each command takes one token; tokens accumulate at a fixed
+ * rate up to a maximum burst.  A client that runs out of tokens is not
+ * served again until the next token arrives, so that input backs up into its
+ * own connection instead of taking CPU time and locks away from other
+ * clients.  The bucket only says how long that is: a thread serving just
+ * that client sleeps, while a pool worker sets the client aside and moves
+ * on to others.
+ *
+ * A bucket is only ever used by one thread at a time, the one serving its
+ * client, so it needs no locking.
+ */
+typedef struct ratelimit {
+    double rate;
+    double burst;
+    double tokens;
+    struct timespec last;
+} RATELIMIT;
+
+/*
+ * Default limits, in commands per second and commands.
+ */
+#define RATELIMIT_DEFAULT_RATE 1000.0
+#define RATELIMIT_DEFAULT_BURST 100.0
+
+/*
+ * Limits applied to every client, set from the command line.
+ * A rate of 0 disables rate limiting.
+ */
+extern double ratelimit_rate;
+extern double ratelimit_burst;
+
+void ratelimit_init(RATELIMIT *rl, double rate, double burst);
+long ratelimit_take(RATELIMIT *rl);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef SERVER_EXT_H
+#define SERVER_EXT_H
+
+#include "tu.h"
+
+/*
+ * Service of a client connection in steps, for use by threads that serve
+ * many clients in turn.  Declared here because server.h cannot be changed.
+ * pbx_client_service() is the same as pbx_client_open(), then
+ * pbx_client_run() on the blocking connection until it returns CLIENT_DONE,
+ * then pbx_client_close().
+ */
+typedef struct client CLIENT;
+
+#define CLIENT_DONE 0
+#define CLIENT_WAIT 1
+#define CLIENT_MORE 2
+#define CLIENT_THROTTLED 3
+
+CLIENT *pbx_client_open(int connfd);
+int pbx_client_fd(CLIENT *c);
+int pbx_client_run(CLIENT *c, int quantum);
+long pbx_client_delay(CLIENT *c);
+void pbx_client_close(CLIENT *c);
+
+#endif
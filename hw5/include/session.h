@@ -0,0 +1,60 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdint.h>
+
+#include "tu.h"
+#include "outq.h"
+
+/*
+ * Resumable sessions.
+ *
+ * A client may ask for its TU to outlive its connection by sending the
+ * command "session", to which the server replies "SESSION <token>", the
+ * token being 16 hexadecimal digits.  If the connection is then lost, the TU
+ * stays registered, keeping its extension and any call in progress, for a
+ * grace period.  A client that connects again within the grace period and
+ * sends "resume <token>" takes the TU back: its new TU is unregistered and
+ * discarded, and the client is sent the current state of the resumed TU.
+ * The token remains valid for later disconnections.  An unknown or expired
+ * token, or a session that is still connected, gets the reply "SESSION EXPIRED".
+ *
+ * Output for a TU while it has no connection, such as chat messages and state
+ * notifications, is lost; the notification sent on resumption brings the
+ * client up to date.  A TU that is in a conference leaves it on disconnecting.
+ * Both commands are only accepted in the text protocol.
+ */
+typedef struct session SESSION;
+
+#define SESSION_COMMAND_NAME "session"
+#define RESUME_COMMAND_NAME "resume"
+#define SESSION_REPLY "SESSION"
+#define SESSION_EXPIRED "EXPIRED"
+
+/*
+ * Default grace period, in milliseconds.
+ */
+#define SESSION_DEFAULT_GRACE_MS 10000
+
+/*
+ * Grace period applied to every session, set from the command line.
+ */
+extern long session_grace_ms;
+
+SESSION *session_open(TU *tu);
+uint64_t session_token(SESSION *s);
+TU *session_tu(SESSION *s);
+int session_detach(SESSION *s);
+SESSION *session_resume(uint64_t token);
+void session_close(SESSION *s);
+void session_shutdown(void);
+
+/*
+ * TU functions for moving a TU between connections, declared here because
+ * tu.h cannot be changed.
+ */
+OUTQ *tu_detach(TU *tu);
+void tu_attach(TU *tu, int fd, OUTQ *outq);
+int tu_send(TU *tu, const char *line);
+
+#endif
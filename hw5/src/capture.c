@@ -0,0 +1,93 @@
+/*
+ * CAPTURE: recording of client sessions for later replay.
+ */
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include "capture.h"
+#include "debug.h"
+#include "csapp.h"
+
+#define CAPTURE_BUFFER_SIZE (1 << 20)
+
+static struct {
+    FILE *out;
+    sem_t mutex;
+    struct timespec start;
+    atomic_int next_conn;
+} capture;
+
+static void capture_write(int conn, const char *event, const char *arg) {
+    if(capture.out == NULL || conn < 0) return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long us = (now.tv_sec - capture.start.tv_sec) * 1000000
+              + (now.tv_nsec - capture.start.tv_nsec) / 1000;
+    P(&capture.mutex);
+    if(capture.out != NULL) {
+        if(arg != NULL) fprintf(capture.out, "%ld %d %s %s\n", us, conn, event, arg);
+        else fprintf(capture.out, "%ld %d %s\n", us, conn, event);
+    }
+    V(&capture.mutex);
+}
+
+/*
+ * Start capturing client sessions to a file.
+ *
+ * @param path  The name of the file, which is truncated if it exists.
+ * @return 0 if successful, otherwise -1.
+ */
+int capture_open(char *path) {
+    FILE *out = fopen(path, "w");
+    if(out == NULL) return -1;
+    setvbuf(out, NULL, _IOFBF, CAPTURE_BUFFER_SIZE);
+    Sem_init(&capture.mutex, 0, 1);
+    clock_gettime(CLOCK_MONOTONIC, &capture.start);
+    atomic_init(&capture.next_conn, 0);
+    capture.out = out;
+    return 0;
+}
+
+/*
+ * Record a new connection.
+ *
+ * @param ext  The extension assigned to the connection's TU.
+ * @return the number identifying the connection in the capture, or -1 if
+ * capture is not enabled.
+ */
+int capture_connect(int ext) {
+    if(capture.out == NULL) return -1;
+    int conn = atomic_fetch_add(&capture.next_conn, 1);
+    char arg[16];
+    snprintf(arg, sizeof(arg), "%d", ext);
+    capture_write(conn, CAPTURE_CONNECT, arg);
+    return conn;
+}
+
+/*
+ * Record a command received on a connection.
+ *
+ * @param conn  The connection, as returned by capture_connect().
+ * @param cmd  The command line, without its terminator.
+ */
+void capture_command(int conn, const char *cmd) {
+    capture_write(conn, cmd, NULL);
+}
+
+/*
+ * Record the end of a connection.
+ */
+void capture_disconnect(int conn) {
+    capture_write(conn, CAPTURE_DISCONNECT, NULL);
+}
+
+/*
+ * Stop capturing, flushing any buffered lines to the file.
+ */
+void capture_close(void) {
+    if(capture.out == NULL) return;
+    P(&capture.mutex);
+    fclose(capture.out);
+    capture.out = NULL;
+    V(&capture.mutex);
+}
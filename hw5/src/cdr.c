@@ -0,0 +1,219 @@
+/*
+ * CDR: call detail record logging.
+ */
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "cdr.h"
+#include "metrics.h"
+#include "debug.h"
+#include "csapp.h"
+
+/*
+ * Time the writer thread sleeps when the ring is empty.  This bounds how long a
+ * record can wait before being written, without producers ever having to wake it.
+ */
+#define CDR_FLUSH_MS 10
+
+/*
+ * Maximum number of records formatted into one write() call.
+ */
+#define CDR_BATCH 256
+
+#define CDR_CSV_HEADER "dial_ns,connect_ns,hangup_ns,caller,callee," \
+                       "caller_chats,caller_chat_bytes,callee_chats,callee_chat_bytes\n"
+
+#define CDR_CSV_MAX 192
+
+/*
+ * Bounded multi-producer, single-consumer ring.  The sequence number of each slot
+ * tells whether it is free for the producer claiming position pos (seq == pos) or
+ * holds a record for the consumer at position pos (seq == pos + 1).  Producers
+ * claim positions with a compare-and-swap on tail; only the writer thread uses head.
+ *
+ * Producers count themselves in producers for as long as they are in cdr_log(),
+ * having announced themselves before checking enabled.  Once cdr_close() has
+ * cleared enabled, the writer waits for the count to drop to zero before it
+ * takes the ring to be finished, so that a producer that saw logging enabled
+ * just before it was disabled still has its record written.
+ */
+struct cdr_slot {
+    atomic_size_t seq;
+    CDR rec;
+};
+
+static struct {
+    struct cdr_slot slots[CDR_RING_SIZE];
+    _Alignas(64) atomic_size_t tail;
+    _Alignas(64) size_t head;
+    atomic_int enabled;
+    atomic_int stopping;
+    atomic_int producers;
+    int fd;
+    int binary;
+    pthread_t tid;
+} ring;
+
+/*
+ * Get the current wall-clock time, for recording in a CDR.
+ */
+int64_t cdr_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Take the next record out of the ring.  Only called by the writer thread.
+ *
+ * @return 1 if a record was taken, 0 if the ring is empty.
+ */
+static int cdr_pop(CDR *rec) {
+    struct cdr_slot *slot = &ring.slots[ring.head & (CDR_RING_SIZE - 1)];
+    if(atomic_load_explicit(&slot->seq, memory_order_acquire) != ring.head + 1) return 0;
+    *rec = slot->rec;
+    atomic_store_explicit(&slot->seq, ring.head + CDR_RING_SIZE, memory_order_release);
+    ++ring.head;
+    return 1;
+}
+
+static size_t cdr_format(char *buf, CDR *rec) {
+    return snprintf(buf, CDR_CSV_MAX, "%lld,%lld,%lld,%d,%d,%u,%llu,%u,%llu\n",
+                    (long long)rec->dial_ns, (long long)rec->connect_ns, (long long)rec->hangup_ns,
+                    rec->caller, rec->callee,
+                    rec->chats[0], (unsigned long long)rec->chat_bytes[0],
+                    rec->chats[1], (unsigned long long)rec->chat_bytes[1]);
+}
+
+static void cdr_write(char *buf, size_t len) {
+    while(len > 0) {
+        ssize_t n = write(ring.fd, buf, len);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            debug("cdr_write: %s\n", strerror(errno));
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+/*
+ * Thread function for the writer thread.  Drains the ring in batches until
+ * cdr_close() is called and the ring is empty.
+ */
+static void *cdr_writer(void *arg) {
+    size_t size = ring.binary ? CDR_BATCH * sizeof(CDR) : CDR_BATCH * CDR_CSV_MAX;
+    char *buf = Malloc(size);
+    while(1) {
+        size_t len = 0;
+        int count = 0;
+        CDR rec;
+        while(count < CDR_BATCH && cdr_pop(&rec)) {
+            if(ring.binary) {
+                memcpy(buf + len, &rec, sizeof(CDR));
+                len += sizeof(CDR);
+            }
+            else len += cdr_format(buf + len, &rec);
+            ++count;
+        }
+        if(len > 0) cdr_write(buf, len);
+        if(count == CDR_BATCH) continue;
+        if(atomic_load(&ring.stopping)) {
+            // Records pushed before cdr_close() was called are still written,
+            // including those of producers that are still pushing them.
+            if(atomic_load(&ring.producers) == 0 && atomic_load(&ring.tail) == ring.head) break;
+            continue;
+        }
+        struct timespec delay = { 0, CDR_FLUSH_MS * 1000000 };
+        nanosleep(&delay, NULL);
+    }
+    Free(buf);
+    return NULL;
+}
+
+/*
+ * Start logging call detail records to a file.
+ *
+ * @param path  The name of the file, which is created if it does not exist
+ * and otherwise appended to.
+ * @return 0 if successful, otherwise -1.
+ */
+int cdr_open(char *path) {
+    if(atomic_load(&ring.enabled)) return -1;
+    ring.fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if(ring.fd < 0) return -1;
+    size_t len = strlen(path);
+    ring.binary = len >= 4 && strcmp(path + len - 4, ".bin") == 0;
+    if(!ring.binary && lseek(ring.fd, 0, SEEK_END) == 0)
+        cdr_write(CDR_CSV_HEADER, strlen(CDR_CSV_HEADER));
+    for(size_t i = 0; i < CDR_RING_SIZE; i++) atomic_init(&ring.slots[i].seq, i);
+    atomic_init(&ring.tail, 0);
+    ring.head = 0;
+    atomic_init(&ring.stopping, 0);
+    atomic_init(&ring.producers, 0);
+    Pthread_create(&ring.tid, NULL, cdr_writer, NULL);
+    atomic_store(&ring.enabled, 1);
+    return 0;
+}
+
+/*
+ * Claim a slot in the ring and publish a record in it.
+ *
+ * @return 0 if the record was queued, -1 if the ring is full.
+ */
+static int cdr_push(CDR *rec) {
+    size_t pos = atomic_load_explicit(&ring.tail, memory_order_relaxed);
+    struct cdr_slot *slot;
+    while(1) {
+        slot = &ring.slots[pos & (CDR_RING_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if(diff == 0) {
+            if(atomic_compare_exchange_weak_explicit(&ring.tail, &pos, pos + 1,
+                                                     memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if(diff < 0) {
+            metrics_add(METRIC_CDR_DROPS, 1);
+            return -1;
+        }
+        else pos = atomic_load_explicit(&ring.tail, memory_order_relaxed);
+    }
+    slot->rec = *rec;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    metrics_add(METRIC_CDRS, 1);
+    return 0;
+}
+
+/*
+ * Queue a call detail record for writing.  This never blocks.
+ *
+ * @param rec  The record, which is copied.
+ * @return 0 if the record was queued, -1 if logging is disabled or the ring is full.
+ */
+int cdr_log(CDR *rec) {
+    if(!atomic_load_explicit(&ring.enabled, memory_order_relaxed)) return -1;
+    // Sequentially consistent, so that cdr_close() either sees this producer
+    // counted or this producer sees logging disabled.
+    atomic_fetch_add(&ring.producers, 1);
+    if(!atomic_load(&ring.enabled)) {
+        atomic_fetch_sub(&ring.producers, 1);
+        return -1;
+    }
+    int ret = cdr_push(rec);
+    atomic_fetch_sub(&ring.producers, 1);
+    return ret;
+}
+
+/*
+ * Stop logging, once all records already queued, or being queued, have been written.
+ */
+void cdr_close(void) {
+    if(!atomic_load(&ring.enabled)) return;
+    atomic_store(&ring.enabled, 0);
+    atomic_store(&ring.stopping, 1);
+    Pthread_join(ring.tid, NULL);
+    close(ring.fd);
+}
@@ -0,0 +1,178 @@
+/*
+ * CONF: conference rooms shared by any number of TUs.
+ */
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "pbx.h"
+#include "conf.h"
+#include "proto.h"
+#include "debug.h"
+#include "csapp.h"
+
+struct conf_member {
+    TU *tu;
+    OUTQ *outq;
+    int binary;
+};
+
+/*
+ * The mutex of a conference protects its member list and, while they are
+ * members, the state of the TUs themselves, in the same way as the mutex of a
+ * two-party call.  Like calls, conference objects are recycled rather than
+ * freed, because a TU's lock pointer may still refer to one after it is left.
+ */
+struct conf {
+    sem_t mutex;
+    int room;
+    int ref_count;
+    struct conf_member *members;
+    int size;
+    int capacity;
+    struct conf *next;
+};
+
+/*
+ * Rooms currently in use, and conference objects available for reuse.
+ * Both lists, and the reference counts of the rooms, are protected by conf_registry_mutex.
+ */
+static struct conf *conf_rooms;
+static struct conf *conf_pool;
+static sem_t conf_registry_mutex;
+static pthread_once_t conf_registry_once = PTHREAD_ONCE_INIT;
+
+static void conf_registry_init(void) {
+    Sem_init(&conf_registry_mutex, 0, 1);
+}
+
+/*
+ * Obtain a reference to a conference room, creating the room if nobody is in it.
+ *
+ * @param room  The room number.
+ * @return the conference.
+ */
+CONF *conf_get(int room) {
+    Pthread_once(&conf_registry_once, conf_registry_init);
+    P(&conf_registry_mutex);
+    struct conf *conf = conf_rooms;
+    while(conf != NULL && conf->room != room) conf = conf->next;
+    if(conf == NULL) {
+        if((conf = conf_pool) != NULL) conf_pool = conf->next;
+        else {
+            conf = Malloc(sizeof(struct conf));
+            Sem_init(&conf->mutex, 0, 1);
+            conf->members = NULL;
+            conf->capacity = 0;
+        }
+        conf->room = room;
+        conf->ref_count = 0;
+        conf->size = 0;
+        conf->next = conf_rooms;
+        conf_rooms = conf;
+        debug("conf_get: opening room %d\n", room);
+    }
+    ++conf->ref_count;
+    V(&conf_registry_mutex);
+    return conf;
+}
+
+/*
+ * Release a reference to a conference room.  When the last reference is
+ * released the room is closed and the conference object is recycled.
+ *
+ * @param conf  The conference.
+ */
+void conf_put(CONF *conf) {
+    P(&conf_registry_mutex);
+    if(--conf->ref_count == 0) {
+        struct conf **pp = &conf_rooms;
+        while(*pp != conf) pp = &(*pp)->next;
+        *pp = conf->next;
+        conf->next = conf_pool;
+        conf_pool = conf;
+        debug("conf_put: closing room %d\n", conf->room);
+    }
+    V(&conf_registry_mutex);
+}
+
+/*
+ * Get the mutex that protects a conference and the state of its members.
+ */
+sem_t *conf_mutex(CONF *conf) {
+    return &conf->mutex;
+}
+
+/*
+ * Get the room number of a conference.
+ */
+int conf_room(CONF *conf) {
+    return conf->room;
+}
+
+/*
+ * Get the number of members of a conference.  The caller must hold its mutex.
+ */
+int conf_size(CONF *conf) {
+    return conf->size;
+}
+
+/*
+ * Add a TU to the members of a conference.  The caller must hold its mutex.
+ *
+ * @param conf  The conference.
+ * @param tu  The TU joining the conference.
+ * @param outq  The outbound queue of the TU's client, to which chats are delivered.
+ * @param binary  Nonzero if the client uses the binary protocol.
+ */
+void conf_add(CONF *conf, TU *tu, OUTQ *outq, int binary) {
+    if(conf->size == conf->capacity) {
+        conf->capacity = conf->capacity ? 2 * conf->capacity : 8;
+        conf->members = Realloc(conf->members, conf->capacity * sizeof(struct conf_member));
+    }
+    conf->members[conf->size].tu = tu;
+    conf->members[conf->size].outq = outq;
+    conf->members[conf->size].binary = binary;
+    ++conf->size;
+}
+
+/*
+ * Remove a TU from the members of a conference.  The caller must hold its mutex.
+ */
+void conf_remove(CONF *conf, TU *tu) {
+    for(int i = 0; i < conf->size; i++) {
+        if(conf->members[i].tu == tu) {
+            conf->members[i] = conf->members[--conf->size];
+            return;
+        }
+    }
+}
+
+/*
+ * Deliver a chat message to every member of a conference except its sender.
+ * The message is formatted at most once for each protocol, and the same buffer
+ * is queued for every recipient that cannot take it immediately.  The caller
+ * must hold the conference's mutex, so that all members see chats in the same order.
+ *
+ * @param conf  The conference.
+ * @param from  The TU sending the chat.
+ * @param msg  The message.
+ * @return the number of members to which the message was sent or queued.
+ */
+int conf_chat(CONF *conf, TU *from, char *msg) {
+    OUTQ_MSG *shared[2] = { NULL, NULL };
+    int sent = 0;
+    for(int i = 0; i < conf->size; i++) {
+        struct conf_member *m = &conf->members[i];
+        if(m->tu == from) continue;
+        if(shared[m->binary] == NULL) {
+            size_t len;
+            char *msg_buf = proto_chat(msg, m->binary, &len);
+            shared[m->binary] = outq_msg_init(msg_buf, len);
+            Free(msg_buf);
+        }
+        if(outq_put_msg(m->outq, shared[m->binary], OUTQ_DROP) == 0) ++sent;
+    }
+    outq_msg_release(shared[0]);
+    outq_msg_release(shared[1]);
+    return sent;
+}
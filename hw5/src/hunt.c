@@ -0,0 +1,270 @@
+/*
+ * HUNT: queues of TUs waiting for a busy extension or hunt group.
+ */
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "pbx.h"
+#include "hunt.h"
+#include "metrics.h"
+#include "debug.h"
+#include "csapp.h"
+
+/*
+ * A TU waiting in a queue, which holds a reference to the TU.  The ticket
+ * identifies the wait, so that an entry for a TU that has hung up (and perhaps
+ * queued again) before hunt_cancel() got to it is recognized as stale and
+ * discarded when it reaches the head of the queue.
+ */
+struct hunt_waiter {
+    TU *tu;
+    unsigned int ticket;
+    struct hunt_waiter *next;
+};
+
+/*
+ * The mutex of a queue protects its members and waiters.  It is always taken
+ * before the locks of any TUs, and it is held while a waiter is put through,
+ * so a member that comes back on hook while the queue is being served waits
+ * for the mutex and then serves the queue again: no wakeup can be lost.
+ *
+ * The queue of an extension has its TU as its only member.  It is recycled
+ * when the TU is freed rather than freed itself, because a TU that hangs up
+ * while queued may still refer to it after the extension has gone (it then
+ * finds nothing to remove).  Hunt groups are created on first use and never freed.
+ */
+struct hunt {
+    sem_t mutex;
+    int group;
+    TU **members;
+    int size;
+    int capacity;
+    int next_member;
+    struct hunt_waiter *head;
+    struct hunt_waiter *tail;
+    struct hunt *next;
+};
+
+/*
+ * Hunt groups in use, and extension queues available for reuse.
+ * Both lists are protected by hunt_registry_mutex.
+ */
+static struct hunt *hunt_groups;
+static struct hunt *hunt_pool;
+static sem_t hunt_registry_mutex;
+static pthread_once_t hunt_registry_once = PTHREAD_ONCE_INIT;
+
+static void hunt_registry_init(void) {
+    Sem_init(&hunt_registry_mutex, 0, 1);
+}
+
+/*
+ * Obtain an empty queue, reusing a recycled one if possible.
+ * The registry mutex must be held.
+ */
+static struct hunt *hunt_alloc(int group) {
+    struct hunt *hunt = hunt_pool;
+    if(hunt != NULL) hunt_pool = hunt->next;
+    else {
+        hunt = Malloc(sizeof(struct hunt));
+        Sem_init(&hunt->mutex, 0, 1);
+        hunt->members = NULL;
+        hunt->capacity = 0;
+    }
+    hunt->group = group;
+    hunt->size = 0;
+    hunt->next_member = 0;
+    hunt->head = hunt->tail = NULL;
+    hunt->next = NULL;
+    return hunt;
+}
+
+/*
+ * Create the queue of an extension.
+ *
+ * @param tu  The TU of the extension, which is the only member of the queue.
+ * @return the queue.
+ */
+HUNT *hunt_init(TU *tu) {
+    Pthread_once(&hunt_registry_once, hunt_registry_init);
+    P(&hunt_registry_mutex);
+    struct hunt *hunt = hunt_alloc(-1);
+    V(&hunt_registry_mutex);
+    hunt_join(hunt, tu);
+    return hunt;
+}
+
+/*
+ * Recycle the queue of an extension whose TU is being freed, which must have
+ * been closed.
+ */
+void hunt_fini(HUNT *hunt) {
+    if(hunt == NULL) return;
+    P(&hunt_registry_mutex);
+    hunt->next = hunt_pool;
+    hunt_pool = hunt;
+    V(&hunt_registry_mutex);
+}
+
+/*
+ * Obtain a hunt group, creating it if it has not been used before.
+ *
+ * @param group  The group number.
+ * @return the group, or NULL if the number is invalid.
+ */
+HUNT *hunt_group(int group) {
+    if(group < 0) return NULL;
+    Pthread_once(&hunt_registry_once, hunt_registry_init);
+    P(&hunt_registry_mutex);
+    struct hunt *hunt = hunt_groups;
+    while(hunt != NULL && hunt->group != group) hunt = hunt->next;
+    if(hunt == NULL) {
+        hunt = hunt_alloc(group);
+        hunt->next = hunt_groups;
+        hunt_groups = hunt;
+        debug("hunt_group: opening group %d\n", group);
+    }
+    V(&hunt_registry_mutex);
+    return hunt;
+}
+
+/*
+ * Try to put a TU through to a member of a queue that is on hook, starting
+ * after the member that was called last.  The queue's mutex must be held.
+ *
+ * @return the result of tu_connect() for the last member tried: 0 if the TU
+ * was put through, 1 if every member is busy, 2 if the TU is no longer calling.
+ */
+static int hunt_connect(struct hunt *hunt, TU *tu, unsigned int ticket) {
+    int ret = 1;
+    for(int k = 0; k < hunt->size && ret == 1; k++) {
+        int i = (hunt->next_member + k) % hunt->size;
+        ret = tu_connect(tu, hunt->members[i], hunt, ticket);
+        if(ret == 0) hunt->next_member = (i + 1) % hunt->size;
+    }
+    return ret;
+}
+
+/*
+ * Call a queue from a TU with dial tone.  The TU is put through if a member is
+ * on hook and nobody is waiting ahead of it; otherwise it joins the end of
+ * the queue in the TU_QUEUED state.  A TU without dial tone is just notified
+ * of its state, as by tu_dial().
+ *
+ * @param hunt  The queue, or NULL if the caller was unable to determine one,
+ * in which case the TU goes to the TU_ERROR state as when dialing nobody.
+ * @param tu  The calling TU.
+ * @param number  The extension or group number reported with TU_QUEUED.
+ * @return 0 if successful, -1 if the TU transitioned to the TU_ERROR state.
+ */
+int hunt_call(HUNT *hunt, TU *tu, int number) {
+    if(hunt == NULL) return tu_dial(tu, NULL);
+    metrics_lock(&hunt->mutex, METRIC_LOCK_TU);
+    if(hunt->head == NULL && hunt_connect(hunt, tu, 0) != 1) {
+        V(&hunt->mutex);
+        return 0;
+    }
+    unsigned int ticket = tu_wait(tu, hunt, number);
+    if(ticket != 0) {
+        struct hunt_waiter *waiter = Malloc(sizeof(struct hunt_waiter));
+        tu_ref(tu, "hunt_call");
+        waiter->tu = tu;
+        waiter->ticket = ticket;
+        waiter->next = NULL;
+        if(hunt->tail != NULL) hunt->tail->next = waiter;
+        else hunt->head = waiter;
+        hunt->tail = waiter;
+        metrics_add(METRIC_QUEUED, 1);
+    }
+    V(&hunt->mutex);
+    return 0;
+}
+
+/*
+ * Add a TU to the members of a queue, and put through the TU waiting at its head
+ * if the new member is on hook.
+ */
+void hunt_join(HUNT *hunt, TU *tu) {
+    metrics_lock(&hunt->mutex, METRIC_LOCK_TU);
+    if(hunt->size == hunt->capacity) {
+        hunt->capacity = hunt->capacity ? 2 * hunt->capacity : 4;
+        hunt->members = Realloc(hunt->members, hunt->capacity * sizeof(TU *));
+    }
+    hunt->members[hunt->size++] = tu;
+    V(&hunt->mutex);
+    hunt_serve(hunt);
+}
+
+/*
+ * Remove a TU from the members of a queue.  TUs waiting in the queue stay there
+ * for the remaining members.
+ */
+void hunt_leave(HUNT *hunt, TU *tu) {
+    metrics_lock(&hunt->mutex, METRIC_LOCK_TU);
+    for(int i = 0; i < hunt->size; i++) {
+        if(hunt->members[i] == tu) {
+            hunt->members[i] = hunt->members[--hunt->size];
+            break;
+        }
+    }
+    if(hunt->next_member >= hunt->size) hunt->next_member = 0;
+    V(&hunt->mutex);
+}
+
+/*
+ * Close the queue of an extension that is being unregistered.  Every TU
+ * still waiting gets a busy signal, as though it had dialed the extension.
+ */
+void hunt_close(HUNT *hunt) {
+    metrics_lock(&hunt->mutex, METRIC_LOCK_TU);
+    struct hunt_waiter *waiter = hunt->head;
+    hunt->head = hunt->tail = NULL;
+    hunt->size = 0;
+    while(waiter != NULL) {
+        struct hunt_waiter *next = waiter->next;
+        tu_cancel_wait(waiter->tu, hunt, waiter->ticket);
+        tu_unref(waiter->tu, "hunt_close");
+        Free(waiter);
+        waiter = next;
+    }
+    V(&hunt->mutex);
+}
+
+/*
+ * Remove a TU that has hung up from a queue in which it was waiting.
+ *
+ * @param ticket  The ticket of the TU's wait, which tu_hangup() reports.
+ */
+void hunt_cancel(HUNT *hunt, TU *tu, unsigned int ticket) {
+    metrics_lock(&hunt->mutex, METRIC_LOCK_TU);
+    struct hunt_waiter **link = &hunt->head, *prev = NULL;
+    while(*link != NULL && ((*link)->tu != tu || (*link)->ticket != ticket)) {
+        prev = *link;
+        link = &prev->next;
+    }
+    struct hunt_waiter *waiter = *link;
+    if(waiter != NULL) {
+        if((*link = waiter->next) == NULL) hunt->tail = prev;
+        tu_unref(tu, "hunt_cancel");
+        Free(waiter);
+    }
+    V(&hunt->mutex);
+}
+
+/*
+ * Put through as many waiting TUs as there are members on hook, in the order
+ * in which they queued.  This is called whenever a member may have become free.
+ */
+void hunt_serve(HUNT *hunt) {
+    metrics_lock(&hunt->mutex, METRIC_LOCK_TU);
+    struct hunt_waiter *waiter;
+    while((waiter = hunt->head) != NULL) {
+        int ret = hunt_connect(hunt, waiter->tu, waiter->ticket);
+        if(ret == 1) break;
+        if(ret == 0) debug("hunt_serve: queued TU put through\n");
+        if((hunt->head = waiter->next) == NULL) hunt->tail = NULL;
+        tu_unref(waiter->tu, "hunt_serve");
+        Free(waiter);
+    }
+    V(&hunt->mutex);
+}
@@ -1,46 +1,113 @@
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/select.h>
 
 #include "pbx.h"
+#include "pbx_ext.h"
 #include "server.h"
 #include "debug.h"
 #include "csapp.h"
-#include "global_mutex.h"
+#include "metrics.h"
+#include "ratelimit.h"
+#include "pool.h"
+#include "cdr.h"
+#include "session.h"
+#include "capture.h"
 
 static void terminate(int status);
 static void sighup_handler(int sig);
+static void sigusr1_handler(int sig);
 static void *thread(void *vargp);
 
+/*
+ * Maximum number of connections accepted each time the listening socket
+ * becomes readable, before signals are checked again.
+ */
+#define ACCEPT_BATCH 32
+
 static volatile sig_atomic_t sighup_flag = 0;
-static int *connfdp;
+static volatile sig_atomic_t sigusr1_flag = 0;
+static int nworkers = POOL_DEFAULT_WORKERS;
 
 /*
  * "PBX" telephone exchange simulation.
  *
- * Usage: pbx <port>
+ * Usage: pbx -p <port> [-a <admin port>] [-l <commands/sec>] [-b <burst>] [-t <threads>] [-c <cdr file>] [-g <grace ms>] [-s <shards>] [-r <capture file>]
  */
 int main(int argc, char* argv[]){
     // Option processing should be performed here.
     // Option '-p <port>' is required in order to specify the port number
     // on which the server should listen.
+    // Option '-a <admin port>' is optional and specifies a port on the loopback
+    // interface from which runtime metrics can be read.
+    // Options '-l <commands/sec>' and '-b <burst>' set the token-bucket rate limit
+    // applied to each client (-l 0 disables it).
+    // Option '-t <threads>' sets the number of pre-spawned server threads, which
+    // serve all the connections between them (-t 0 starts a new thread for each
+    // connection instead).
+    // Option '-c <cdr file>' appends a call detail record for each call to the file.
+    // Option '-g <grace ms>' sets how long a resumable session survives disconnection.
+    // Option '-s <shards>' sets the number of independently locked parts of the registry.
+    // Option '-r <capture file>' records all client sessions for replay by util/replay.
     char opt, flag = 0;
-    char *port;
-    while((opt = getopt(argc, argv, "p:")) != -1) {
+    char *port, *admin_port = NULL, *cdr_file = NULL, *capture_file = NULL;
+    while((opt = getopt(argc, argv, "p:a:l:b:t:c:g:s:r:")) != -1) {
         switch(opt) {
             case 'p':
                 if(atoi(optarg) > 0) {
                     port = optarg;
                     flag = 1;
                 }
+                break;
+            case 'a':
+                if(atoi(optarg) > 0) admin_port = optarg;
+                break;
+            case 'l':
+                if(atof(optarg) >= 0) ratelimit_rate = atof(optarg);
+                break;
+            case 'b':
+                if(atof(optarg) >= 1) ratelimit_burst = atof(optarg);
+                break;
+            case 't':
+                if(atoi(optarg) >= 0) nworkers = atoi(optarg);
+                break;
+            case 'c':
+                cdr_file = optarg;
+                break;
+            case 'g':
+                if(atol(optarg) >= 0) session_grace_ms = atol(optarg);
+                break;
+            case 's':
+                if(atoi(optarg) > 0) pbx_shards = atoi(optarg);
+                break;
+            case 'r':
+                capture_file = optarg;
+                break;
         }
     }
     if(!flag) {
-        fprintf(stderr, "Usage: %s %s\n", argv[0], "-p <port>");
+        fprintf(stderr, "Usage: %s %s\n", argv[0], "-p <port> [-a <admin port>] [-l <commands/sec>] [-b <burst>] [-t <threads>] [-c <cdr file>] [-g <grace ms>] [-s <shards>] [-r <capture file>]");
         exit(EXIT_SUCCESS);
     }
+    // SIGHUP and SIGUSR1 stay blocked in every thread, so that they cannot
+    // interrupt a server thread waiting on a semaphore (which P() treats as fatal).
+    // The main thread unblocks them only while it waits for connections.
+    sigset_t signals, unblocked;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, &unblocked);
+
     // Perform required initialization of the PBX module.
     debug("Initializing PBX...\n");
     pbx = pbx_init();
+    metrics_init();
+    if(admin_port != NULL && metrics_serve(admin_port) < 0)
+        fprintf(stderr, "Unable to serve metrics on port %s\n", admin_port);
+    if(cdr_file != NULL && cdr_open(cdr_file) < 0)
+        fprintf(stderr, "Unable to open CDR file %s\n", cdr_file);
+    if(capture_file != NULL && capture_open(capture_file) < 0)
+        fprintf(stderr, "Unable to open capture file %s\n", capture_file);
 
     // TODO: Set up the server socket and enter a loop to accept connections
     // on this socket.  For each connection, a thread should be started to
@@ -49,11 +116,14 @@ int main(int argc, char* argv[]){
     // shutdown of the server.
 
     // Install SIGHUP signal handler.
+    // Install SIGUSR1 signal handler, which requests a dump of the metrics.
     // Ignore SIGPIPE.
-    struct sigaction sa_sighup = {0}, sa_sigpipe = {0};
+    struct sigaction sa_sighup = {0}, sa_sigusr1 = {0}, sa_sigpipe = {0};
     sa_sighup.sa_handler = sighup_handler;
+    sa_sigusr1.sa_handler = sigusr1_handler;
     sa_sigpipe.sa_handler = SIG_IGN;
     sigaction(SIGHUP, &sa_sighup, NULL);
+    sigaction(SIGUSR1, &sa_sigusr1, NULL);
     sigaction(SIGPIPE, &sa_sigpipe, NULL);
 
     // NOTE: We are allowed to use code snippets from the textbook and/or slides.
@@ -66,18 +136,39 @@ int main(int argc, char* argv[]){
 
     listenfd = Open_listenfd(port);
     if(listenfd < 0) terminate(EXIT_FAILURE);
-    Sem_init(&global_mutex, 0, 1);
+    fcntl(listenfd, F_SETFL, O_NONBLOCK);
+    if(nworkers > 0) pool_init(nworkers);
+    fd_set readfds;
     while(!sighup_flag) {
-        clientlen = sizeof(struct sockaddr_storage);
-        connfdp = Malloc(sizeof(int));
-        if(connfdp == NULL) terminate(EXIT_FAILURE);
-        *connfdp = accept(listenfd, (SA *)&clientaddr, &clientlen);
-        if(*connfdp < 0 && errno != EINTR) terminate(EXIT_FAILURE);
-        if(*connfdp < 0) break;
-        Pthread_create(&tid, NULL, thread, connfdp);
+        FD_ZERO(&readfds);
+        FD_SET(listenfd, &readfds);
+        if(pselect(listenfd + 1, &readfds, NULL, NULL, NULL, &unblocked) < 0) {
+            if(errno != EINTR) terminate(EXIT_FAILURE);
+            if(sigusr1_flag) {
+                sigusr1_flag = 0;
+                metrics_write(STDERR_FILENO);
+            }
+            continue;
+        }
+        // Accept all the connections that are pending, not just one per wakeup.
+        for(int i = 0; i < ACCEPT_BATCH; i++) {
+            clientlen = sizeof(struct sockaddr_storage);
+            int connfd = accept(listenfd, (SA *)&clientaddr, &clientlen);
+            if(connfd < 0) {
+                if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+                if(errno == EINTR || errno == ECONNABORTED) continue;
+                terminate(EXIT_FAILURE);
+            }
+            if(nworkers > 0) {
+                pool_submit(connfd);
+                continue;
+            }
+            int *connfdp = Malloc(sizeof(int));
+            *connfdp = connfd;
+            Pthread_create(&tid, NULL, thread, connfdp);
+        }
     }
     Close(listenfd);
-    sem_destroy(&global_mutex);
     terminate(EXIT_SUCCESS);
 }
 
@@ -86,8 +177,12 @@ int main(int argc, char* argv[]){
  */
 static void terminate(int status) {
     debug("Shutting down PBX...\n");
-    Free(connfdp);
+    pool_stop();
+    metrics_stop();
     pbx_shutdown(pbx);
+    cdr_close();
+    capture_close();
+    pool_exit();
     debug("PBX server terminating\n");
     pthread_exit(NULL);
 }
@@ -100,6 +195,14 @@ static void sighup_handler(int sig) {
     sighup_flag = 1;
 }
 
+/*
+ * This is the SIGUSR1 handler. Upon receipt of a
+ * SIGUSR1 signal, the main loop dumps the metrics to stderr.
+ */
+static void sigusr1_handler(int sig) {
+    sigusr1_flag = 1;
+}
+
 /*
  * For each connection, a client service thread is started.
  */
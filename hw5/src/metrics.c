@@ -0,0 +1,288 @@
+/*
+ * Metrics: runtime counters, lock wait times and command latencies for the PBX.
+ *
+ * The current values can be obtained in Prometheus text format either by
+ * connecting to the local admin port (see metrics_serve()) or by sending the
+ * server SIGUSR1, which writes them to standard error.
+ */
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "metrics.h"
+#include "conf.h"
+#include "pbx_ext.h"
+#include "hunt.h"
+#include "debug.h"
+#include "csapp.h"
+
+/*
+ * Number of latency histogram buckets.  Bucket i counts commands that took
+ * less than 2^i microseconds (and at least 2^(i-1)); the last bucket is unbounded.
+ */
+#define LATENCY_BUCKETS 24
+
+#define NUM_COMMANDS (TU_AGENT_CMD + 1)
+
+/*
+ * Each counter lives on its own cache line, so that threads updating
+ * different counters do not contend.
+ */
+static struct {
+    atomic_long value;
+    char pad[64 - sizeof(atomic_long)];
+} counters[METRIC_COUNT];
+
+static struct {
+    atomic_long bucket[LATENCY_BUCKETS];
+    atomic_long count;
+    atomic_long sum_us;
+    char pad[64];
+} latency[NUM_COMMANDS];
+
+static struct timespec start_time;
+static pthread_once_t start_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Values of the rate counters at the previous dump, used to report per-second rates.
+ */
+static sem_t rate_mutex;
+static double last_dump;
+static long last_calls, last_chats;
+
+/*
+ * Listening socket of the admin thread, or -1 if metrics are not being served.
+ */
+static int admin_listenfd = -1;
+
+/*
+ * Lock waits of the calling thread, for attributing contention to the
+ * operations a thread performs (see metrics_thread_waits()).
+ */
+static _Thread_local long thread_waits, thread_wait_ns;
+
+static char *command_name(int cmd) {
+    if(cmd == TU_CONF_CMD) return CONF_COMMAND_NAME;
+    if(cmd == TU_EXT_CMD) return EXT_COMMAND_NAME;
+    if(cmd == TU_QUEUE_CMD) return QUEUE_COMMAND_NAME;
+    if(cmd == TU_HUNT_CMD) return HUNT_COMMAND_NAME;
+    if(cmd == TU_AGENT_CMD) return AGENT_COMMAND_NAME;
+    return tu_command_names[cmd];
+}
+
+static char *metric_lock_names[] = {
+    [METRIC_LOCK_PBX] "pbx",
+    [METRIC_LOCK_TU]  "tu"
+};
+
+static double elapsed(struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) + (now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+static void metrics_start(void) {
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    Sem_init(&rate_mutex, 0, 1);
+}
+
+/*
+ * Initialize the metrics module, starting the uptime clock.
+ * It is safe to call this more than once.
+ */
+void metrics_init(void) {
+    Pthread_once(&start_once, metrics_start);
+}
+
+/*
+ * Add a value to a counter or gauge.
+ *
+ * @param m  The metric to be updated.
+ * @param v  The amount to add (negative to decrease a gauge).
+ */
+void metrics_add(METRIC m, long v) {
+    atomic_fetch_add_explicit(&counters[m].value, v, memory_order_relaxed);
+}
+
+/*
+ * Perform a P operation on a semaphore used as a lock, accounting for any time
+ * spent waiting.  The uncontended case costs one sem_trywait() and no clock reads.
+ *
+ * @param sem  The semaphore.
+ * @param lock  Which class of lock the semaphore belongs to.
+ */
+void metrics_lock(sem_t *sem, METRIC_LOCK lock) {
+    if(sem_trywait(sem) == 0) return;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    P(sem);
+    long ns = elapsed(&start) * 1e9;
+    ++thread_waits;
+    thread_wait_ns += ns;
+    if(lock == METRIC_LOCK_PBX) {
+        metrics_add(METRIC_PBX_WAITS, 1);
+        metrics_add(METRIC_PBX_WAIT_NS, ns);
+    } else {
+        metrics_add(METRIC_TU_WAITS, 1);
+        metrics_add(METRIC_TU_WAIT_NS, ns);
+    }
+}
+
+/*
+ * Get the number of lock acquisitions made by the calling thread that had to
+ * wait, and the total time spent waiting, since the thread started.
+ *
+ * @param waits  Set to the number of waits.
+ * @param ns  Set to the time spent waiting, in nanoseconds.
+ */
+void metrics_thread_waits(long *waits, long *ns) {
+    *waits = thread_waits;
+    *ns = thread_wait_ns;
+}
+
+/*
+ * Record the latency of a command issued by a client.
+ *
+ * @param cmd  The command.
+ * @param start  The time at which processing of the command began (CLOCK_MONOTONIC).
+ */
+void metrics_command(TU_COMMAND cmd, struct timespec *start) {
+    if(cmd < 0 || cmd >= NUM_COMMANDS) return;
+    long us = elapsed(start) * 1e6;
+    int b = 0;
+    while(b < LATENCY_BUCKETS - 1 && us >= (1L << b)) ++b;
+    atomic_fetch_add_explicit(&latency[cmd].bucket[b], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&latency[cmd].count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&latency[cmd].sum_us, us, memory_order_relaxed);
+}
+
+static long counter(METRIC m) {
+    return atomic_load_explicit(&counters[m].value, memory_order_relaxed);
+}
+
+/*
+ * Write the current values of all metrics to a file descriptor,
+ * in Prometheus text exposition format.
+ *
+ * @param fd  The file descriptor.
+ */
+void metrics_write(int fd) {
+    metrics_init();
+    FILE *out = fdopen(dup(fd), "w");
+    if(out == NULL) return;
+    double uptime = elapsed(&start_time);
+    long calls = counter(METRIC_CALLS), chats = counter(METRIC_CHATS);
+    P(&rate_mutex);
+    double interval = uptime - last_dump;
+    double calls_rate = interval > 0 ? (calls - last_calls) / interval : 0;
+    double chats_rate = interval > 0 ? (chats - last_chats) / interval : 0;
+    last_dump = uptime;
+    last_calls = calls;
+    last_chats = chats;
+    V(&rate_mutex);
+
+    fprintf(out, "pbx_uptime_seconds %.3f\n", uptime);
+    fprintf(out, "pbx_registered_tus %ld\n", counter(METRIC_REGISTERED));
+    fprintf(out, "pbx_active_calls %ld\n", counter(METRIC_ACTIVE_CALLS));
+    fprintf(out, "pbx_calls_total %ld\n", calls);
+    fprintf(out, "pbx_calls_per_second %.3f\n", calls_rate);
+    fprintf(out, "pbx_conference_members %ld\n", counter(METRIC_CONF_MEMBERS));
+    fprintf(out, "pbx_chats_total %ld\n", chats);
+    fprintf(out, "pbx_chats_per_second %.3f\n", chats_rate);
+    fprintf(out, "pbx_bytes_in_total %ld\n", counter(METRIC_BYTES_IN));
+    fprintf(out, "pbx_bytes_out_total %ld\n", counter(METRIC_BYTES_OUT));
+    fprintf(out, "pbx_throttled_commands_total %ld\n", counter(METRIC_THROTTLED));
+    fprintf(out, "pbx_throttle_seconds_total %.9f\n", counter(METRIC_THROTTLE_NS) / 1e9);
+    fprintf(out, "pbx_output_dropped_total %ld\n", counter(METRIC_OUTQ_DROPS));
+    fprintf(out, "pbx_output_disconnects_total %ld\n", counter(METRIC_OUTQ_CUTS));
+    fprintf(out, "pbx_cdrs_total %ld\n", counter(METRIC_CDRS));
+    fprintf(out, "pbx_cdrs_dropped_total %ld\n", counter(METRIC_CDR_DROPS));
+    fprintf(out, "pbx_sessions_resumed_total %ld\n", counter(METRIC_SESSIONS_RESUMED));
+    fprintf(out, "pbx_sessions_expired_total %ld\n", counter(METRIC_SESSIONS_EXPIRED));
+    fprintf(out, "pbx_calls_queued_total %ld\n", counter(METRIC_QUEUED));
+    fprintf(out, "pbx_lock_waits_total{lock=\"%s\"} %ld\n",
+            metric_lock_names[METRIC_LOCK_PBX], counter(METRIC_PBX_WAITS));
+    fprintf(out, "pbx_lock_wait_seconds_total{lock=\"%s\"} %.9f\n",
+            metric_lock_names[METRIC_LOCK_PBX], counter(METRIC_PBX_WAIT_NS) / 1e9);
+    fprintf(out, "pbx_lock_waits_total{lock=\"%s\"} %ld\n",
+            metric_lock_names[METRIC_LOCK_TU], counter(METRIC_TU_WAITS));
+    fprintf(out, "pbx_lock_wait_seconds_total{lock=\"%s\"} %.9f\n",
+            metric_lock_names[METRIC_LOCK_TU], counter(METRIC_TU_WAIT_NS) / 1e9);
+    for(int c = 0; c < NUM_COMMANDS; c++) {
+        long cumulative = 0;
+        for(int b = 0; b < LATENCY_BUCKETS; b++) {
+            cumulative += atomic_load_explicit(&latency[c].bucket[b], memory_order_relaxed);
+            if(b < LATENCY_BUCKETS - 1)
+                fprintf(out, "pbx_command_latency_us_bucket{cmd=\"%s\",le=\"%ld\"} %ld\n",
+                        command_name(c), 1L << b, cumulative);
+            else
+                fprintf(out, "pbx_command_latency_us_bucket{cmd=\"%s\",le=\"+Inf\"} %ld\n",
+                        command_name(c), cumulative);
+        }
+        fprintf(out, "pbx_command_latency_us_sum{cmd=\"%s\"} %ld\n", command_name(c),
+                atomic_load_explicit(&latency[c].sum_us, memory_order_relaxed));
+        fprintf(out, "pbx_command_latency_us_count{cmd=\"%s\"} %ld\n", command_name(c),
+                atomic_load_explicit(&latency[c].count, memory_order_relaxed));
+    }
+    fclose(out);
+}
+
+/*
+ * Thread function for the admin thread.  Every connection to the admin port
+ * receives a single dump of the metrics, after which it is closed.
+ */
+static void *metrics_thread(void *arg) {
+    int listenfd = *((int *)arg);
+    Free(arg);
+    Pthread_detach(pthread_self());
+    while(1) {
+        int connfd = accept(listenfd, NULL, NULL);
+        if(connfd < 0) {
+            if(errno == EINTR) continue;
+            break;
+        }
+        metrics_write(connfd);
+        close(connfd);
+    }
+    close(listenfd);
+    return NULL;
+}
+
+/*
+ * Start serving metrics on an admin port bound to the loopback interface.
+ *
+ * @param port  The port number on which to listen.
+ * @return 0 if the admin thread was started, otherwise -1.
+ */
+int metrics_serve(char *port) {
+    metrics_init();
+    struct addrinfo hints = {0}, *list, *p;
+    int listenfd = -1, optval = 1;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    if(getaddrinfo("localhost", port, &hints, &list) != 0) return -1;
+    for(p = list; p != NULL; p = p->ai_next) {
+        if((listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) continue;
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+        if(bind(listenfd, p->ai_addr, p->ai_addrlen) == 0 && listen(listenfd, LISTENQ) == 0) break;
+        close(listenfd);
+        listenfd = -1;
+    }
+    freeaddrinfo(list);
+    if(listenfd < 0) return -1;
+    int *listenfdp = Malloc(sizeof(int));
+    *listenfdp = listenfd;
+    admin_listenfd = listenfd;
+    pthread_t tid;
+    Pthread_create(&tid, NULL, metrics_thread, listenfdp);
+    debug("Serving metrics on localhost:%s\n", port);
+    return 0;
+}
+
+/*
+ * Stop serving metrics.  Shutting down the listening socket causes the admin
+ * thread to return from accept() and exit.
+ */
+void metrics_stop(void) {
+    if(admin_listenfd >= 0) shutdown(admin_listenfd, SHUT_RDWR);
+}
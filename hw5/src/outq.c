@@ -0,0 +1,469 @@
+/*
+ * OUTQ: non-blocking delivery of output to network clients.
+ */
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+
+#include "outq.h"
+#include "metrics.h"
+#include "debug.h"
+#include "csapp.h"
+
+struct outq_msg {
+    atomic_int ref_count;
+    size_t len;
+    char data[];
+};
+
+/*
+ * A message waiting in a queue, together with how much of it has been sent.
+ */
+struct outq_buf {
+    struct outq_buf *next;
+    OUTQ_MSG *msg;
+    size_t off;
+};
+
+struct outq {
+    int fd;
+    sem_t mutex;
+    struct outq_buf *head;
+    struct outq_buf *tail;
+    size_t bytes;
+    char pending;
+    char dead;
+    int ref_count;
+};
+
+/*
+ * State of the writer thread, which drains the queues of clients whose
+ * sockets were not able to accept all of their output immediately.
+ * Each queue in the pending array holds a reference on behalf of the writer.
+ */
+static struct {
+    sem_t mutex;
+    int wake[2];
+    OUTQ **pending;
+    int size;
+    int capacity;
+    pthread_t tid;
+    char stopping;       // Set by outq_shutdown(); no new queues are accepted.
+    struct timespec deadline;  // When stopping, time at which remaining queues are cut.
+    int abandoned;       // Number of queues cut at the deadline.
+} writer;
+
+static pthread_once_t writer_once = PTHREAD_ONCE_INIT;
+
+static void *outq_writer(void *arg);
+
+static void outq_writer_init(void) {
+    Sem_init(&writer.mutex, 0, 1);
+    if(pipe(writer.wake) < 0) unix_error("pipe error");
+    fcntl(writer.wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(writer.wake[1], F_SETFL, O_NONBLOCK);
+    writer.pending = NULL;
+    writer.size = 0;
+    writer.capacity = 0;
+    writer.stopping = 0;
+    writer.abandoned = 0;
+    Pthread_create(&writer.tid, NULL, outq_writer, NULL);
+}
+
+static void outq_writer_wake(void) {
+    char c = 0;
+    if(write(writer.wake[1], &c, 1) < 0 && errno != EAGAIN)
+        debug("outq_writer: wakeup failed\n");
+}
+
+/*
+ * Hand a queue to the writer thread.
+ * The caller must hold the queue's mutex and have taken a reference for the writer.
+ *
+ * @return 0 if the writer accepted the queue, -1 if the writer is shutting down.
+ */
+static int outq_writer_add(OUTQ *q) {
+    Pthread_once(&writer_once, outq_writer_init);
+    P(&writer.mutex);
+    if(writer.stopping) {
+        V(&writer.mutex);
+        return -1;
+    }
+    if(writer.size == writer.capacity) {
+        writer.capacity = writer.capacity ? 2 * writer.capacity : 16;
+        writer.pending = Realloc(writer.pending, writer.capacity * sizeof(OUTQ *));
+    }
+    writer.pending[writer.size++] = q;
+    V(&writer.mutex);
+    outq_writer_wake();
+    return 0;
+}
+
+/*
+ * Remove one occurrence of a queue from the writer's pending array.
+ */
+static void outq_writer_remove(OUTQ *q) {
+    P(&writer.mutex);
+    for(int i = 0; i < writer.size; i++) {
+        if(writer.pending[i] == q) {
+            writer.pending[i] = writer.pending[--writer.size];
+            break;
+        }
+    }
+    V(&writer.mutex);
+}
+
+/*
+ * Discard all data waiting in a queue.  The caller must hold the queue's mutex.
+ */
+static void outq_discard(OUTQ *q) {
+    struct outq_buf *b = q->head;
+    while(b != NULL) {
+        struct outq_buf *next = b->next;
+        outq_msg_release(b->msg);
+        Free(b);
+        b = next;
+    }
+    q->head = q->tail = NULL;
+    q->bytes = 0;
+}
+
+/*
+ * Disconnect a client that has failed or fallen too far behind.
+ * Shutting down the socket causes the client's service thread to see EOF.
+ * The caller must hold the queue's mutex.
+ */
+static void outq_cut(OUTQ *q) {
+    debug("outq: disconnecting client (fd %d, %zu bytes queued)\n", q->fd, q->bytes);
+    metrics_add(METRIC_OUTQ_CUTS, 1);
+    q->dead = 1;
+    outq_discard(q);
+    shutdown(q->fd, SHUT_RDWR);
+}
+
+/*
+ * Send as much queued data as the socket will accept without blocking.
+ * The caller must hold the queue's mutex.
+ *
+ * @return 1 if the queue is now empty (or the connection has failed), 0 if data remains.
+ */
+static int outq_send(OUTQ *q) {
+    while(q->head != NULL) {
+        struct outq_buf *b = q->head;
+        ssize_t n = send(q->fd, b->msg->data + b->off, b->msg->len - b->off, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            outq_cut(q);
+            return 1;
+        }
+        metrics_add(METRIC_BYTES_OUT, n);
+        b->off += n;
+        q->bytes -= n;
+        if(b->off == b->msg->len) {
+            q->head = b->next;
+            if(q->head == NULL) q->tail = NULL;
+            outq_msg_release(b->msg);
+            Free(b);
+        }
+    }
+    return 1;
+}
+
+/*
+ * Milliseconds from now until a CLOCK_MONOTONIC deadline, or 0 if it has passed.
+ */
+static int outq_ms_until(struct timespec *deadline) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long ms = (deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+    return ms > 0 ? ms : 0;
+}
+
+/*
+ * Cut off every queue still pending when the shutdown deadline passes,
+ * dropping the writer's references to them.
+ *
+ * @return the number of queues that were cut.
+ */
+static int outq_writer_abandon(void) {
+    P(&writer.mutex);
+    int n = writer.size;
+    OUTQ **qs = writer.pending;
+    writer.pending = NULL;
+    writer.size = writer.capacity = 0;
+    V(&writer.mutex);
+    for(int i = 0; i < n; i++) {
+        P(&qs[i]->mutex);
+        outq_cut(qs[i]);
+        qs[i]->pending = 0;
+        V(&qs[i]->mutex);
+        outq_release(qs[i]);
+    }
+    Free(qs);
+    return n;
+}
+
+/*
+ * Thread function for the writer thread.
+ * Waits for the sockets of pending queues to become writable and drains them.
+ * Once shutdown has been requested, the thread exits as soon as nothing is pending,
+ * or at the shutdown deadline, whichever comes first.
+ */
+static void *outq_writer(void *arg) {
+    struct pollfd *fds = NULL;
+    OUTQ **qs = NULL;
+    int capacity = 0;
+    while(1) {
+        P(&writer.mutex);
+        int n = writer.size;
+        int stopping = writer.stopping;
+        if(n + 1 > capacity) {
+            capacity = writer.capacity + 1;
+            fds = Realloc(fds, capacity * sizeof(struct pollfd));
+            qs = Realloc(qs, capacity * sizeof(OUTQ *));
+        }
+        memcpy(qs, writer.pending, n * sizeof(OUTQ *));
+        V(&writer.mutex);
+        int timeout = -1;
+        if(stopping) {
+            if(n == 0) break;
+            if((timeout = outq_ms_until(&writer.deadline)) == 0) {
+                writer.abandoned = outq_writer_abandon();
+                break;
+            }
+        }
+        fds[0].fd = writer.wake[0];
+        fds[0].events = POLLIN;
+        for(int i = 0; i < n; i++) {
+            fds[i + 1].fd = qs[i]->fd;
+            fds[i + 1].events = POLLOUT;
+        }
+        if(poll(fds, n + 1, timeout) < 0) {
+            if(errno != EINTR) debug("outq_writer: poll failed\n");
+            continue;
+        }
+        if(fds[0].revents) {
+            char drain[64];
+            while(read(writer.wake[0], drain, sizeof(drain)) > 0);
+        }
+        for(int i = 0; i < n; i++) {
+            if(!fds[i + 1].revents) continue;
+            OUTQ *q = qs[i];
+            P(&q->mutex);
+            int done = outq_send(q);
+            if(done) q->pending = 0;
+            V(&q->mutex);
+            if(done) {
+                outq_writer_remove(q);
+                outq_release(q);
+            }
+        }
+    }
+    Free(fds);
+    Free(qs);
+    return NULL;
+}
+
+/*
+ * Initialize an outbound queue for a network connection.
+ * The queue takes ownership of the file descriptor, which is closed when the
+ * last reference to the queue is released.
+ *
+ * @param fd  The file descriptor of the underlying network connection.
+ * @return  The queue, holding one reference for the caller, or NULL on failure.
+ */
+OUTQ *outq_init(int fd) {
+    OUTQ *q = Malloc(sizeof(OUTQ));
+    if(q == NULL) return NULL;
+    // Notifications are small and each must go out at once: without this, a
+    // second write on a connection waits for the client's delayed ACK of the first.
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    q->fd = fd;
+    Sem_init(&q->mutex, 0, 1);
+    q->head = q->tail = NULL;
+    q->bytes = 0;
+    q->pending = 0;
+    q->dead = 0;
+    q->ref_count = 1;
+    return q;
+}
+
+/*
+ * Send data to a client, or queue whatever cannot be sent without blocking.
+ * If the data is the contents of a shared message, the queue refers to the
+ * message rather than copying it.
+ */
+static int outq_put_data(OUTQ *q, const char *buf, size_t len, OUTQ_MSG *msg, int flags) {
+    if(q == NULL) return -1;
+    P(&q->mutex);
+    if(q->dead) {
+        V(&q->mutex);
+        return -1;
+    }
+    ssize_t sent = 0;
+    if(q->head == NULL) {
+        while((sent = send(q->fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL)) < 0 && errno == EINTR);
+        if(sent < 0) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                outq_cut(q);
+                V(&q->mutex);
+                return -1;
+            }
+            sent = 0;
+        }
+        metrics_add(METRIC_BYTES_OUT, sent);
+        if(sent == len) {
+            V(&q->mutex);
+            return 0;
+        }
+    }
+    if(q->bytes + len - sent > OUTQ_MAX_BYTES) {
+        // A partially sent message cannot be dropped without corrupting the stream.
+        if((flags & OUTQ_DROP) && sent == 0) {
+            debug("outq: dropping %zu bytes (fd %d)\n", len, q->fd);
+            metrics_add(METRIC_OUTQ_DROPS, 1);
+        }
+        else outq_cut(q);
+        V(&q->mutex);
+        return -1;
+    }
+    struct outq_buf *b = Malloc(sizeof(struct outq_buf));
+    b->next = NULL;
+    if(msg != NULL) {
+        atomic_fetch_add_explicit(&msg->ref_count, 1, memory_order_relaxed);
+        b->msg = msg;
+        b->off = sent;
+    } else {
+        b->msg = outq_msg_init(buf + sent, len - sent);
+        b->off = 0;
+    }
+    if(q->tail == NULL) q->head = b;
+    else q->tail->next = b;
+    q->tail = b;
+    q->bytes += len - sent;
+    if(!q->pending) {
+        ++q->ref_count;
+        if(outq_writer_add(q) < 0) {
+            // Shutting down: nobody is left to deliver the data.
+            --q->ref_count;
+            outq_cut(q);
+            V(&q->mutex);
+            return -1;
+        }
+        q->pending = 1;
+    }
+    V(&q->mutex);
+    return 0;
+}
+
+/*
+ * Queue data for delivery to a network client.  This function never blocks on
+ * the network: if the socket cannot take the data right away, the remainder is
+ * copied into the queue and handed to the writer thread.
+ *
+ * @param q  The queue.
+ * @param buf  The data to be sent.
+ * @param len  The number of bytes of data.
+ * @param flags  OUTQ_DROP if the data may be discarded when the queue is full,
+ * otherwise 0, in which case a full queue causes the client to be disconnected.
+ * @return 0 if the data was sent or queued, -1 if it was dropped.
+ */
+int outq_put(OUTQ *q, const char *buf, size_t len, int flags) {
+    return outq_put_data(q, buf, len, NULL, flags);
+}
+
+/*
+ * Queue a shared message for delivery to a network client.  This behaves like
+ * outq_put(), except that if the message has to be queued, the queue takes a
+ * reference to it instead of making a copy.  A message sent to many clients
+ * is therefore formatted and stored only once.
+ *
+ * @param q  The queue.
+ * @param msg  The message, which remains referenced by the caller.
+ * @param flags  As for outq_put().
+ * @return 0 if the message was sent or queued, -1 if it was dropped.
+ */
+int outq_put_msg(OUTQ *q, OUTQ_MSG *msg, int flags) {
+    return outq_put_data(q, msg->data, msg->len, msg, flags);
+}
+
+/*
+ * Create a message that may be queued for any number of clients.
+ *
+ * @param buf  The contents of the message, which are copied.
+ * @param len  The length of the message.
+ * @return  The message, holding one reference for the caller.
+ */
+OUTQ_MSG *outq_msg_init(const char *buf, size_t len) {
+    OUTQ_MSG *msg = Malloc(sizeof(OUTQ_MSG) + len);
+    atomic_init(&msg->ref_count, 1);
+    msg->len = len;
+    memcpy(msg->data, buf, len);
+    return msg;
+}
+
+/*
+ * Release a reference to a message, freeing it once no queue refers to it.
+ *
+ * @param msg  The message.
+ */
+void outq_msg_release(OUTQ_MSG *msg) {
+    if(msg == NULL) return;
+    if(atomic_fetch_sub_explicit(&msg->ref_count, 1, memory_order_release) == 1) {
+        atomic_thread_fence(memory_order_acquire);
+        Free(msg);
+    }
+}
+
+/*
+ * Release a reference to an outbound queue.  When the last reference is released,
+ * any undelivered data is discarded, the connection is closed and the queue is freed.
+ *
+ * @param q  The queue.
+ */
+void outq_release(OUTQ *q) {
+    if(q == NULL) return;
+    P(&q->mutex);
+    int ref_count = --q->ref_count;
+    V(&q->mutex);
+    if(ref_count == 0) {
+        outq_discard(q);
+        close(q->fd);
+        sem_destroy(&q->mutex);
+        Free(q);
+    }
+}
+
+/*
+ * Deliver output still waiting in outbound queues and stop the writer thread.
+ * Queues that have not drained within the timeout are discarded and their
+ * connections shut down.  After this returns, output that cannot be sent
+ * immediately is no longer queued, and the client is disconnected instead.
+ *
+ * @param timeout_ms  The maximum time to wait, in milliseconds.
+ * @return the number of queues whose output had to be discarded.
+ */
+int outq_shutdown(long timeout_ms) {
+    Pthread_once(&writer_once, outq_writer_init);
+    P(&writer.mutex);
+    if(writer.stopping) {
+        V(&writer.mutex);
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &writer.deadline);
+    writer.deadline.tv_sec += timeout_ms / 1000;
+    writer.deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+    if(writer.deadline.tv_nsec >= 1000000000) {
+        writer.deadline.tv_sec++;
+        writer.deadline.tv_nsec -= 1000000000;
+    }
+    writer.stopping = 1;
+    V(&writer.mutex);
+    outq_writer_wake();
+    Pthread_join(writer.tid, NULL);
+    return writer.abandoned;
+}
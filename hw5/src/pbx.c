@@ -2,28 +2,115 @@
  * PBX: simulates a Private Branch Exchange.
  */
 #include <stdlib.h>
+#include <stdatomic.h>
 #include <pthread.h>
 
 #include "pbx.h"
+#include "pbx_ext.h"
+#include "hunt.h"
+#include "metrics.h"
+#include "outq.h"
+#include "session.h"
 #include "debug.h"
 #include "csapp.h"
 
-struct pbx_client {
+/*
+ * The registry is partitioned into shards by extension number: extension ext
+ * belongs to shard ext % nshards, at index ext / nshards of that shard's slot
+ * array.  Each shard has its own mutex, so that operations on extensions in
+ * different shards do not contend.  Dialing locks only the shard of the
+ * extension being called, which keeps the target registered while the call
+ * is set up; the TUs themselves are locked by tu_dial().  The only operation
+ * involving two shards, moving a TU to a requested extension, locks them in
+ * order of shard number.
+ *
+ * Within a shard, the unused slots form a doubly linked free list, with the
+ * most recently freed extensions at the tail, so that an extension is reused
+ * as late as possible and a requested extension can be taken out of the middle
+ * of the list.  The array is doubled in size when the free list runs out.
+ * Extensions are allocated from the shards in turn.
+ */
+#define PBX_INITIAL_SLOTS 16
+
+int pbx_shards = PBX_DEFAULT_SHARDS;
+
+struct pbx_slot {
     TU *tu;
-    int ext;
-    struct pbx_client *next;
-    struct pbx_client *prev;
+    int next;
+    int prev;
+};
+
+struct pbx_shard {
+    sem_t mutex;
+    int capacity;
+    int free_head;
+    int free_tail;
+    struct pbx_slot *slots;
+    char pad[64];
 };
 
 struct pbx {
     sem_t w;
-    sem_t mutex;
-    int size;
-    struct pbx_client *registry;
+    atomic_int draining;
+    atomic_int size;
+    atomic_uint next_shard;
+    int nshards;
+    struct pbx_shard *shards;
 };
 
+static struct pbx_shard *pbx_shard(PBX *pbx, int ext) {
+    return &pbx->shards[ext % pbx->nshards];
+}
+
+static void pbx_free_append(struct pbx_shard *shard, int i) {
+    shard->slots[i].tu = NULL;
+    shard->slots[i].next = -1;
+    shard->slots[i].prev = shard->free_tail;
+    if(shard->free_tail >= 0) shard->slots[shard->free_tail].next = i;
+    else shard->free_head = i;
+    shard->free_tail = i;
+}
+
+static void pbx_free_remove(struct pbx_shard *shard, int i) {
+    struct pbx_slot *slot = &shard->slots[i];
+    if(slot->prev >= 0) shard->slots[slot->prev].next = slot->next;
+    else shard->free_head = slot->next;
+    if(slot->next >= 0) shard->slots[slot->next].prev = slot->prev;
+    else shard->free_tail = slot->prev;
+}
+
 /*
- * Initialize a new PBX.
+ * Enlarge a shard so that it has a slot at a specified index, adding the new
+ * slots to its free list.  The caller must hold the shard's mutex.
+ *
+ * @return 0 if successful, -1 if the index would be beyond PBX_EXTENSION_LIMIT.
+ */
+static int pbx_grow(PBX *pbx, struct pbx_shard *shard, int i) {
+    int limit = (PBX_EXTENSION_LIMIT + pbx->nshards - 1) / pbx->nshards;
+    if(i >= limit) return -1;
+    int capacity = shard->capacity;
+    while(capacity <= i) capacity *= 2;
+    if(capacity > limit) capacity = limit;
+    shard->slots = Realloc(shard->slots, capacity * sizeof(struct pbx_slot));
+    for(int j = shard->capacity; j < capacity; j++) pbx_free_append(shard, j);
+    shard->capacity = capacity;
+    return 0;
+}
+
+/*
+ * Get the TU registered at an extension.  The caller must hold the mutex of
+ * the extension's shard.
+ *
+ * @return the TU, or NULL if the extension is not in use.
+ */
+static TU *pbx_lookup(PBX *pbx, int ext) {
+    struct pbx_shard *shard = pbx_shard(pbx, ext);
+    int i = ext / pbx->nshards;
+    return i < shard->capacity ? shard->slots[i].tu : NULL;
+}
+
+/*
+ * Initialize a new PBX, with pbx_shards shards.
  *
  * @return the newly initialized PBX, or NULL if initialization fails.
  */
@@ -31,16 +118,83 @@ PBX *pbx_init() {
     // TO BE IMPLEMENTED
     PBX *pbx = Malloc(sizeof(PBX));
     if(pbx == NULL) return NULL;
-    Sem_init(&pbx->mutex, 0, 1);
     Sem_init(&pbx->w, 0, 1);
-    pbx->size = 0;
-    pbx->registry = Malloc(sizeof(struct pbx_client));
-    if(pbx->registry == NULL) return NULL;
-    pbx->registry->next = pbx->registry;
-    pbx->registry->prev = pbx->registry;
+    atomic_init(&pbx->draining, 0);
+    atomic_init(&pbx->size, 0);
+    // Shard 0 has no extension 0, so allocation starts from the next shard.
+    atomic_init(&pbx->next_shard, PBX_FIRST_EXTENSION);
+    pbx->nshards = pbx_shards > 0 ? pbx_shards : 1;
+    pbx->shards = Calloc(pbx->nshards, sizeof(struct pbx_shard));
+    for(int n = 0; n < pbx->nshards; n++) {
+        struct pbx_shard *shard = &pbx->shards[n];
+        Sem_init(&shard->mutex, 0, 1);
+        shard->capacity = PBX_INITIAL_SLOTS;
+        shard->free_head = shard->free_tail = -1;
+        shard->slots = Calloc(shard->capacity, sizeof(struct pbx_slot));
+        for(int i = 0; i < shard->capacity; i++) {
+            if(i * pbx->nshards + n >= PBX_FIRST_EXTENSION) pbx_free_append(shard, i);
+        }
+    }
     return pbx;
 }
 
+/*
+ * Time limits for pbx_shutdown(), in milliseconds.  Service threads are given
+ * PBX_DRAIN_MS to finish the commands they are processing and unregister; any
+ * that remain are then forcibly disconnected and given PBX_FORCE_MS more.
+ * Output still queued for clients is flushed until PBX_FLUSH_MS after the
+ * start of the shutdown, at which point it is discarded.
+ */
+#define PBX_DRAIN_MS 300
+#define PBX_FORCE_MS 100
+#define PBX_FLUSH_MS 500
+
+/*
+ * Wait for all extensions to be unregistered, giving up at a deadline.
+ *
+ * @return 0 if the registry became empty, -1 if the deadline passed first.
+ */
+static int pbx_wait_empty(PBX *pbx, long ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += ms / 1000;
+    deadline.tv_nsec += (ms % 1000) * 1000000;
+    if(deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    while(sem_timedwait(&pbx->w, &deadline) < 0) {
+        if(errno != EINTR) return -1;
+    }
+    V(&pbx->w);
+    return 0;
+}
+
+/*
+ * Shut down the network connections of all registered extensions.
+ *
+ * @param how  SHUT_RD to let server threads finish and unregister while output
+ * can still be delivered, SHUT_RDWR to disconnect the clients completely.
+ * @return the number of connections shut down.
+ */
+static int pbx_shutdown_clients(PBX *pbx, int how) {
+    int n = 0;
+    for(int k = 0; k < pbx->nshards; k++) {
+        struct pbx_shard *shard = &pbx->shards[k];
+        metrics_lock(&shard->mutex, METRIC_LOCK_PBX);
+        for(int i = 0; i < shard->capacity; i++) {
+            if(shard->slots[i].tu == NULL) continue;
+            // TUs kept registered by a disconnected session have no connection.
+            int fd = tu_fileno(shard->slots[i].tu);
+            if(fd < 0) continue;
+            shutdown(fd, how);
+            ++n;
+        }
+        V(&shard->mutex);
+    }
+    return n;
+}
+
 /*
  * Shut down a pbx, shutting down all network connections, waiting for all server
  * threads to terminate, and freeing all associated resources.
@@ -49,29 +203,75 @@ PBX *pbx_init() {
  * Once all the server threads have terminated, any remaining resources associated
  * with the PBX are freed.  The PBX object itself is freed, and should not be used again.
  *
+ * The shutdown takes a bounded amount of time: connections are first shut down
+ * for reading only, so that each server thread sees EOF, hangs up and unregisters
+ * while notifications to its peer can still be delivered.  Server threads also
+ * stop reading commands once the shutdown has begun (see pbx_draining()), so
+ * that input already buffered in a connection does not hold them up.  TUs kept
+ * registered by disconnected sessions are unregistered at once.  Connections whose
+ * threads have not finished in time are shut down completely, and output that
+ * has not been flushed by the final deadline is discarded.  If server threads
+ * are still running after that, the PBX is not freed.
+ *
  * @param pbx  The PBX to be shut down.
  */
 void pbx_shutdown(PBX *pbx) {
     // TO BE IMPLEMENTED
-    if(pbx == NULL || pbx->registry == NULL) return;
-    P(&pbx->mutex);
-    struct pbx_client *node = pbx->registry->next;
-    while(node != pbx->registry) {
-        shutdown(node->ext, SHUT_RDWR);
-        node = node->next;
+    if(pbx == NULL || pbx->shards == NULL) return;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    atomic_store(&pbx->draining, 1);
+    session_shutdown();
+    int draining = pbx_shutdown_clients(pbx, SHUT_RD);
+    debug("pbx_shutdown: draining %d connections\n", draining);
+    int forced = 0, finished = 1;
+    if(pbx_wait_empty(pbx, PBX_DRAIN_MS) < 0) {
+        forced = pbx_shutdown_clients(pbx, SHUT_RDWR);
+        debug("pbx_shutdown: forcing %d connections closed\n", forced);
+        if(pbx_wait_empty(pbx, PBX_FORCE_MS) < 0) finished = 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long elapsed_ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+    int discarded = outq_shutdown(elapsed_ms < PBX_FLUSH_MS ? PBX_FLUSH_MS - elapsed_ms : 0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fprintf(stderr, "PBX shutdown took %.3f s: %d connections drained, %d forced, "
+            "%d output queues discarded%s\n",
+            (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9,
+            draining - forced, forced, discarded,
+            finished ? "" : ", server threads still running");
+    if(!finished) return;
+    for(int k = 0; k < pbx->nshards; k++) {
+        sem_destroy(&pbx->shards[k].mutex);
+        Free(pbx->shards[k].slots);
     }
-    debug("pbx_shutdown: (1) Thread count is %d\n", pbx->size);
-    V(&pbx->mutex);
-    P(&pbx->w);
-    debug("pbx_shutdown: (2) Thread count is %d\n", pbx->size);
-    //while(pbx->size > 0);
-    V(&pbx->w);
-    sem_destroy(&pbx->mutex);
     sem_destroy(&pbx->w);
-    Free(pbx->registry);
+    Free(pbx->shards);
     Free(pbx);
 }
 
+/*
+ * Determine whether a PBX is being shut down.  Server threads check this
+ * between commands and stop serving their clients once it is set.
+ *
+ * @param pbx  The PBX.
+ * @return nonzero if pbx_shutdown() has been called, otherwise 0.
+ */
+int pbx_draining(PBX *pbx) {
+    return atomic_load_explicit(&pbx->draining, memory_order_relaxed);
+}
+
+/*
+ * Count a newly registered TU, or one that has been unregistered, in the size
+ * of the PBX.  The semaphore w is held while the PBX is not empty, so that
+ * pbx_shutdown() can wait for the last TU to be unregistered.
+ */
+static void pbx_count(PBX *pbx, int delta) {
+    int size = atomic_fetch_add(&pbx->size, delta);
+    metrics_add(METRIC_REGISTERED, delta);
+    if(delta > 0 && size == 0) P(&pbx->w);
+    else if(delta < 0 && size == 1) V(&pbx->w);
+}
+
 /*
  * Register a telephone unit with a PBX at a specified extension number.
  * This amounts to "plugging a telephone unit into the PBX".
@@ -83,39 +283,83 @@ void pbx_shutdown(PBX *pbx) {
  *
  * @param pbx  The PBX registry.
  * @param tu  The TU to be registered.
- * @param ext  The extension number on which the TU is to be registered.
+ * @param ext  The extension number on which the TU is to be registered,
+ * or PBX_ANY_EXTENSION to have the PBX allocate one.
  * @return 0 if registration succeeds, otherwise -1.
  */
 int pbx_register(PBX *pbx, TU *tu, int ext) {
     // TO BE IMPLEMENTED
-    if(pbx == NULL || tu == NULL || ext < 0) return -1;
-    P(&pbx->mutex);
-    if(pbx->size >= PBX_MAX_EXTENSIONS) {
-        V(&pbx->mutex);
+    if(pbx == NULL || tu == NULL) return -1;
+    if(ext != PBX_ANY_EXTENSION && (ext < PBX_FIRST_EXTENSION || ext >= PBX_EXTENSION_LIMIT))
         return -1;
+    int k = ext != PBX_ANY_EXTENSION ? ext % pbx->nshards
+            : atomic_fetch_add_explicit(&pbx->next_shard, 1, memory_order_relaxed) % pbx->nshards;
+    struct pbx_shard *shard = &pbx->shards[k];
+    metrics_lock(&shard->mutex, METRIC_LOCK_PBX);
+    int i = ext / pbx->nshards;
+    if(ext == PBX_ANY_EXTENSION) {
+        if(shard->free_head < 0 && pbx_grow(pbx, shard, shard->capacity) < 0) {
+            V(&shard->mutex);
+            return -1;
+        }
+        i = shard->free_head;
+        ext = i * pbx->nshards + k;
     }
-    struct pbx_client *pbx_client = Malloc(sizeof(struct pbx_client));
-    if(pbx_client == NULL) {
-        V(&pbx->mutex);
+    else if(i >= shard->capacity && pbx_grow(pbx, shard, i) < 0) {
+        V(&shard->mutex);
         return -1;
     }
-    tu_ref(tu, "pbx_register");
-    if(tu_set_extension(tu, ext) < 0) {
-        V(&pbx->mutex);
+    if(shard->slots[i].tu != NULL || tu_set_extension(tu, ext) < 0) {
+        V(&shard->mutex);
         return -1;
     }
-    pbx_client->tu = tu;
-    pbx_client->ext = ext;
-    pbx_client->next = pbx->registry;
-    pbx_client->prev = pbx->registry->prev;
-    pbx->registry->prev->next = pbx_client;
-    pbx->registry->prev = pbx_client;
-    ++pbx->size;
-    if(pbx->size == 1) P(&pbx->w);
-    V(&pbx->mutex);
+    pbx_free_remove(shard, i);
+    tu_ref(tu, "pbx_register");
+    shard->slots[i].tu = tu;
+    V(&shard->mutex);
+    pbx_count(pbx, 1);
     return 0;
 }
 
+/*
+ * Move a registered TU that is on hook to a different extension, at the request
+ * of its client.  A notification of the TU's extension is sent to the client,
+ * whether or not it has changed.
+ *
+ * @param pbx  The PBX registry.
+ * @param tu  The TU.
+ * @param ext  The requested extension number.
+ * @return 0 if the TU now has the requested extension, -1 if the extension
+ * is invalid or in use by another TU, or the TU is not on hook.
+ */
+int pbx_request_extension(PBX *pbx, TU *tu, int ext) {
+    if(pbx == NULL || tu == NULL) return -1;
+    // Only the TU's own service thread changes its extension, so it cannot
+    // change between reading it and locking its shard.
+    int old = tu_extension(tu);
+    if(old < 0) return -1;
+    int valid = ext >= PBX_FIRST_EXTENSION && ext < PBX_EXTENSION_LIMIT;
+    struct pbx_shard *from = pbx_shard(pbx, old), *to = valid ? pbx_shard(pbx, ext) : from;
+    struct pbx_shard *first = from < to ? from : to, *second = from < to ? to : from;
+    metrics_lock(&first->mutex, METRIC_LOCK_PBX);
+    if(second != first) metrics_lock(&second->mutex, METRIC_LOCK_PBX);
+    int i = ext / pbx->nshards;
+    int ok = pbx_lookup(pbx, old) == tu && valid
+             && (i < to->capacity || pbx_grow(pbx, to, i) == 0)
+             && (ext == old || to->slots[i].tu == NULL);
+    // Setting the current extension again just repeats the notification.
+    if(!ok) tu_set_extension(tu, old);
+    else if(tu_set_extension(tu, ext) < 0) ok = 0;
+    else if(ext != old) {
+        pbx_free_remove(to, i);
+        to->slots[i].tu = tu;
+        pbx_free_append(from, old / pbx->nshards);
+    }
+    if(second != first) V(&second->mutex);
+    V(&first->mutex);
+    return ok ? 0 : -1;
+}
+
 /*
  * Unregister a TU from a PBX.
  * This amounts to "unplugging a telephone unit from the PBX".
@@ -132,37 +376,25 @@ int pbx_unregister(PBX *pbx, TU *tu) {
     // TO BE IMPLEMENTED
     if(pbx == NULL || tu == NULL) return -1;
     debug("Called pbx_unregister\n");
-    P(&pbx->mutex);
-    if(pbx != NULL && pbx->size <= 0) {
-        V(&pbx->mutex);
+    int ext = tu_extension(tu);
+    if(ext < 0) return -1;
+    struct pbx_shard *shard = pbx_shard(pbx, ext);
+    metrics_lock(&shard->mutex, METRIC_LOCK_PBX);
+    if(pbx_lookup(pbx, ext) != tu) {
+        V(&shard->mutex);
         return -1;
     }
+    tu_unplug(tu);
     debug("Calling tu_hangup in pbx_unregister\n");
     if(tu_hangup(tu) < 0) {
-        V(&pbx->mutex);
+        V(&shard->mutex);
         return -1;
     }
     debug("Called tu_hangup in pbx_unregister\n");
-    struct pbx_client *node = pbx->registry->next;
-    char flag = 0;
-    while(node != pbx->registry) {
-        if(node->tu == tu) {
-            flag = 1;
-            node->prev->next = node->next;
-            node->next->prev = node->prev;
-            tu_unref(tu, "pbx_unregister");
-            Free(node);
-            break;
-        }
-        node = node->next;
-    }
-    if(!flag) {
-        V(&pbx->mutex);
-        return -1;
-    }
-    --pbx->size;
-    if(pbx->size == 0) V(&pbx->w);
-    V(&pbx->mutex);
+    pbx_free_append(shard, ext / pbx->nshards);
+    V(&shard->mutex);
+    tu_unref(tu, "pbx_unregister");
+    pbx_count(pbx, -1);
     debug("Returning from pbx_unregister\n");
     return 0;
 }
@@ -178,23 +410,43 @@ int pbx_unregister(PBX *pbx, TU *tu) {
 int pbx_dial(PBX *pbx, TU *tu, int ext) {
     // TO BE IMPLEMENTED
     if(pbx == NULL || tu == NULL || ext < 0) return -1;
-    P(&pbx->mutex);
-    struct pbx_client *node = pbx->registry->next;
-    char flag = 0;
-    while(node != pbx->registry) {
-        if(node->ext == ext) {
-            flag = 1;
-            tu_dial(tu, node->tu);
-            break;
-        }
-        node = node->next;
-    }
-    if(!flag) {
+    struct pbx_shard *shard = pbx_shard(pbx, ext);
+    metrics_lock(&shard->mutex, METRIC_LOCK_PBX);
+    TU *target = pbx_lookup(pbx, ext);
+    if(target == NULL) {
         debug("pbx_dial: ext %d not found", ext);
         tu_dial(tu, NULL);
-        V(&pbx->mutex);
+        V(&shard->mutex);
         return -1;
     }
-    V(&pbx->mutex);
+    tu_dial(tu, target);
+    V(&shard->mutex);
+    return 0;
+}
+
+/*
+ * Use the PBX to call a specified extension from a TU, waiting in the
+ * extension's queue if it is busy (see hunt.h).
+ *
+ * @param pbx  The PBX registry.
+ * @param tu  The TU that is initiating the call.
+ * @param ext  The extension number to be called.
+ * @return 0 if the call was put through or queued, otherwise -1.
+ */
+int pbx_queue(PBX *pbx, TU *tu, int ext) {
+    if(pbx == NULL || tu == NULL || ext < 0) return -1;
+    struct pbx_shard *shard = pbx_shard(pbx, ext);
+    metrics_lock(&shard->mutex, METRIC_LOCK_PBX);
+    TU *target = pbx_lookup(pbx, ext);
+    if(target == NULL || target == tu) {
+        // Nobody to wait for: the same as dialing.
+        int ret = tu_dial(tu, target);
+        V(&shard->mutex);
+        return target == NULL ? -1 : ret;
+    }
+    // The shard's mutex keeps the target from being unregistered, and its queue
+    // from being closed, until the TU has joined the queue.
+    hunt_call(tu_queue(target), tu, ext);
+    V(&shard->mutex);
     return 0;
 }
@@ -0,0 +1,334 @@
+/*
+ * POOL: pre-spawned server threads that serve connections in turn.
+ */
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/epoll.h>
+
+#include "pool.h"
+#include "server_ext.h"
+#include "debug.h"
+#include "csapp.h"
+
+/*
+ * Stack size for worker threads.  Serving a client needs very little stack,
+ * and the default would reserve several megabytes for each of many threads.
+ */
+#define POOL_STACK_SIZE (256 * 1024)
+
+/*
+ * Maximum number of events taken by the poller from each epoll_wait() call.
+ */
+#define POOL_EVENTS 64
+
+/*
+ * A connection handed to the pool.  Until a worker has registered its client
+ * with the PBX, client is NULL.  A connection is either in the run queue,
+ * being served by exactly one worker, waiting in the poller's epoll set, or
+ * parked until its client may be served again after being throttled.
+ */
+struct pool_conn {
+    int fd;
+    CLIENT *client;
+    char polled;                // Nonzero once the connection is in the epoll set.
+    long long wake;             // When a parked connection is to be queued, in ns.
+    struct pool_conn *next;
+};
+
+static struct {
+    sem_t mutex;                // Protects the run queue, stopping and opening
+    sem_t items;                // Counts connections in the run queue, plus exit requests
+    sem_t opened;               // Posted when the last open in progress at a stop is done
+    struct pool_conn *head;     // Run queue, served from the head
+    struct pool_conn *tail;
+    struct pool_conn *parked;   // Throttled connections, soonest to wake first
+    int stopping;
+    int opening;                // Number of workers registering a client
+    int exiting;
+    int epfd;
+    int wake[2];                // Pipe by which the poller is woken early
+    int size;
+} pool;
+
+static long long pool_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/*
+ * Wake the poller from epoll_wait(), so that it looks at the parked
+ * connections and at pool.exiting again.  The pipe is non-blocking, and if
+ * it is full the poller is awake anyway.
+ */
+static void pool_wake(void) {
+    char c = 0;
+    if(write(pool.wake[1], &c, 1) < 0) debug("pool_wake: wakeup not sent\n");
+}
+
+/*
+ * Add a connection to the tail of the run queue, with the mutex held.
+ * The caller must post pool.items once it has released the mutex.
+ */
+static void pool_append(struct pool_conn *pc) {
+    pc->next = NULL;
+    if(pool.tail != NULL) pool.tail->next = pc;
+    else pool.head = pc;
+    pool.tail = pc;
+}
+
+/*
+ * Add a connection to the tail of the run queue.
+ */
+static void pool_ready(struct pool_conn *pc) {
+    P(&pool.mutex);
+    pool_append(pc);
+    V(&pool.mutex);
+    V(&pool.items);
+}
+
+/*
+ * Take the connection at the head of the run queue, waiting for one if it is empty.
+ *
+ * @return the connection, or NULL if the worker is to exit.
+ */
+static struct pool_conn *pool_take(void) {
+    P(&pool.items);
+    P(&pool.mutex);
+    struct pool_conn *pc = pool.head;
+    if(pc != NULL) {
+        pool.head = pc->next;
+        if(pool.head == NULL) pool.tail = NULL;
+    }
+    V(&pool.mutex);
+    return pc;
+}
+
+/*
+ * Have the poller queue a connection again once more input arrives on it.
+ * The connection must not be touched afterwards, as it may already be
+ * being served by another worker.
+ */
+static void pool_poll(struct pool_conn *pc) {
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.ptr = pc };
+    int op = pc->polled ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    pc->polled = 1;
+    if(epoll_ctl(pool.epfd, op, pc->fd, &ev) < 0) unix_error("epoll_ctl error");
+}
+
+/*
+ * Set aside a connection whose client has been throttled, until it may be
+ * served again.  Meanwhile it is neither in the run queue nor polled, so it
+ * costs no worker any time, and its input backs up into its own socket.
+ * The connection must not be touched afterwards.
+ *
+ * @param pc  The connection.
+ * @param delay  The time in nanoseconds until it may be served again.
+ */
+static void pool_park(struct pool_conn *pc, long delay) {
+    pc->wake = pool_now() + delay;
+    P(&pool.mutex);
+    if(pool.stopping) {
+        // Its client is about to see the shutdown, which it should not wait for.
+        pool_append(pc);
+        V(&pool.mutex);
+        V(&pool.items);
+        return;
+    }
+    struct pool_conn **pp = &pool.parked;
+    while(*pp != NULL && (*pp)->wake <= pc->wake) pp = &(*pp)->next;
+    pc->next = *pp;
+    *pp = pc;
+    int first = pool.parked == pc;
+    V(&pool.mutex);
+    // A new soonest wakeup shortens the poller's timeout.
+    if(first) pool_wake();
+}
+
+/*
+ * Queue every parked connection that is due, or all of them if the pool is
+ * stopping.
+ *
+ * @return the time in milliseconds until the next parked connection is due,
+ * rounded up, or -1 if none is parked.
+ */
+static int pool_unpark(void) {
+    long long now = pool_now();
+    int n = 0, timeout = -1;
+    P(&pool.mutex);
+    while(pool.parked != NULL && (pool.stopping || pool.parked->wake <= now)) {
+        struct pool_conn *pc = pool.parked;
+        pool.parked = pc->next;
+        pool_append(pc);
+        ++n;
+    }
+    if(pool.parked != NULL)
+        timeout = (pool.parked->wake - now + 999999) / 1000000;
+    V(&pool.mutex);
+    while(n-- > 0) V(&pool.items);
+    return timeout;
+}
+
+/*
+ * End the service of a connection.
+ */
+static void pool_close(struct pool_conn *pc) {
+    // The descriptor stays open until the TU's output has been flushed,
+    // so it must leave the epoll set first.
+    if(pc->polled) epoll_ctl(pool.epfd, EPOLL_CTL_DEL, pc->fd, NULL);
+    if(pc->client != NULL) pbx_client_close(pc->client);
+    else close(pc->fd);
+    Free(pc);
+}
+
+/*
+ * Thread function for a worker.
+ */
+static void *pool_worker(void *arg) {
+    Pthread_detach(pthread_self());
+    struct pool_conn *pc;
+    while((pc = pool_take()) != NULL) {
+        if(pc->client == NULL) {
+            P(&pool.mutex);
+            if(pool.stopping) {
+                V(&pool.mutex);
+                pool_close(pc);
+                continue;
+            }
+            ++pool.opening;
+            V(&pool.mutex);
+            pc->client = pbx_client_open(pc->fd);
+            P(&pool.mutex);
+            // No open starts once stopping is set, so this posts at most once.
+            if(--pool.opening == 0 && pool.stopping) V(&pool.opened);
+            V(&pool.mutex);
+        }
+        switch(pbx_client_run(pc->client, POOL_QUANTUM)) {
+            case CLIENT_MORE:
+                pool_ready(pc);
+                break;
+            case CLIENT_WAIT:
+                pool_poll(pc);
+                break;
+            case CLIENT_THROTTLED:
+                pool_park(pc, pbx_client_delay(pc->client));
+                break;
+            default:
+                pool_close(pc);
+                break;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Thread function for the poller, which queues connections as input arrives
+ * on them, and parked connections as they become due.
+ */
+static void *pool_poller(void *arg) {
+    Pthread_detach(pthread_self());
+    struct epoll_event events[POOL_EVENTS];
+    char drain[64];
+    while(1) {
+        int n = epoll_wait(pool.epfd, events, POOL_EVENTS, pool_unpark());
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            unix_error("epoll_wait error");
+        }
+        for(int i = 0; i < n; i++) {
+            if(events[i].data.ptr != NULL) {
+                pool_ready(events[i].data.ptr);
+                continue;
+            }
+            while(read(pool.wake[0], drain, sizeof(drain)) > 0);
+            P(&pool.mutex);
+            int exiting = pool.exiting;
+            V(&pool.mutex);
+            if(exiting) return NULL;
+        }
+    }
+}
+
+/*
+ * Start the workers and the poller.
+ *
+ * @param nworkers  The number of worker threads.
+ * @return 0 if successful, otherwise -1.
+ */
+int pool_init(int nworkers) {
+    if(nworkers <= 0) return -1;
+    if((pool.epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) return -1;
+    if(pipe(pool.wake) < 0) {
+        close(pool.epfd);
+        return -1;
+    }
+    for(int i = 0; i < 2; i++)
+        fcntl(pool.wake[i], F_SETFL, fcntl(pool.wake[i], F_GETFL) | O_NONBLOCK);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    epoll_ctl(pool.epfd, EPOLL_CTL_ADD, pool.wake[0], &ev);
+    Sem_init(&pool.mutex, 0, 1);
+    Sem_init(&pool.items, 0, 0);
+    Sem_init(&pool.opened, 0, 0);
+    pool.head = pool.tail = pool.parked = NULL;
+    pool.stopping = pool.opening = pool.exiting = 0;
+    pool.size = nworkers;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, POOL_STACK_SIZE);
+    pthread_t tid;
+    for(int i = 0; i < nworkers; i++)
+        Pthread_create(&tid, &attr, pool_worker, NULL);
+    Pthread_create(&tid, &attr, pool_poller, NULL);
+    pthread_attr_destroy(&attr);
+    debug("Started %d server threads\n", nworkers);
+    return 0;
+}
+
+/*
+ * Hand an accepted connection to the pool.  This never blocks: the connection
+ * joins the run queue, and is registered with the PBX by the worker that
+ * takes it.
+ *
+ * @param connfd  The file descriptor of the connection.
+ */
+void pool_submit(int connfd) {
+    fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL) | O_NONBLOCK);
+    struct pool_conn *pc = Malloc(sizeof(struct pool_conn));
+    pc->fd = connfd;
+    pc->client = NULL;
+    pc->polled = 0;
+    pool_ready(pc);
+}
+
+/*
+ * Stop registering new clients.  Connections not yet taken by a worker are
+ * closed as workers reach them.  When this returns, every client that a worker
+ * has taken on is already registered with the PBX, so that pbx_shutdown() can
+ * find it: this waits for any registration that is still in progress.  Registered clients go on being served, so that they see the
+ * shutdown of their connections and unregister; throttled clients are no
+ * longer made to wait for that.
+ */
+void pool_stop(void) {
+    if(pool.size == 0) return;
+    P(&pool.mutex);
+    pool.stopping = 1;
+    int opening = pool.opening;
+    V(&pool.mutex);
+    pool_wake();
+    if(opening > 0) P(&pool.opened);
+}
+
+/*
+ * Tell the poller and every worker to exit once the run queue is empty.
+ * This should be called after pool_stop() and pbx_shutdown().
+ * Neither function has any effect if the pool was never started.
+ */
+void pool_exit(void) {
+    if(pool.size == 0) return;
+    P(&pool.mutex);
+    pool.exiting = 1;
+    V(&pool.mutex);
+    pool_wake();
+    for(int i = 0; i < pool.size; i++) V(&pool.items);
+}
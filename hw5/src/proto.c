@@ -0,0 +1,70 @@
+/*
+ * PROTO: encoding and decoding of the binary framed protocol.
+ */
+#include <stdlib.h>
+#include <arpa/inet.h>
+
+#include "pbx.h"
+#include "proto.h"
+#include "debug.h"
+#include "csapp.h"
+
+/*
+ * Encode a frame header.
+ *
+ * @param buf  Buffer of at least PROTO_HEADER_SIZE bytes.
+ * @param frame  The header to encode.
+ */
+void proto_encode(char *buf, PROTO_FRAME *frame) {
+    uint16_t len = htons(frame->len);
+    uint32_t arg = htonl(frame->arg);
+    buf[0] = frame->type;
+    buf[1] = frame->code;
+    memcpy(buf + 2, &len, sizeof(len));
+    memcpy(buf + 4, &arg, sizeof(arg));
+}
+
+/*
+ * Decode a frame header.
+ *
+ * @param buf  Buffer holding PROTO_HEADER_SIZE bytes.
+ * @param frame  The header to fill in.
+ */
+void proto_decode(const char *buf, PROTO_FRAME *frame) {
+    uint16_t len;
+    uint32_t arg;
+    memcpy(&len, buf + 2, sizeof(len));
+    memcpy(&arg, buf + 4, sizeof(arg));
+    frame->type = buf[0];
+    frame->code = buf[1];
+    frame->len = ntohs(len);
+    frame->arg = ntohl(arg);
+}
+
+/*
+ * Format a chat message for delivery to a client, either as a text line or
+ * as a binary chat frame.  Binary payloads longer than PROTO_MAX_PAYLOAD are
+ * truncated.
+ *
+ * @param msg  The message.
+ * @param binary  Nonzero if the client uses the binary protocol.
+ * @param lenp  Set to the length of the formatted message.
+ * @return the formatted message, which the caller must free.
+ */
+char *proto_chat(const char *msg, int binary, size_t *lenp) {
+    size_t len = strlen(msg);
+    char *buf;
+    if(binary) {
+        if(len > PROTO_MAX_PAYLOAD) len = PROTO_MAX_PAYLOAD;
+        PROTO_FRAME frame = { PROTO_CHAT, 0, len, PROTO_NO_ARG };
+        buf = Malloc(PROTO_HEADER_SIZE + len);
+        proto_encode(buf, &frame);
+        memcpy(buf + PROTO_HEADER_SIZE, msg, len);
+        *lenp = PROTO_HEADER_SIZE + len;
+    } else {
+        *lenp = len + strlen("CHAT ") + strlen(EOL);
+        buf = Malloc(*lenp + 1);
+        sprintf(buf, "CHAT %s%s", msg, EOL);
+    }
+    return buf;
+}
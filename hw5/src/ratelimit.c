@@ -0,0 +1,52 @@
+/*
+ * RATELIMIT: per-client token buckets.
+ */
+#include "ratelimit.h"
+#include "metrics.h"
+#include "debug.h"
+
+double ratelimit_rate = RATELIMIT_DEFAULT_RATE;
+double ratelimit_burst = RATELIMIT_DEFAULT_BURST;
+
+static double seconds_since(struct timespec *since, struct timespec *now) {
+    return (now->tv_sec - since->tv_sec) + (now->tv_nsec - since->tv_nsec) / 1e9;
+}
+
+/*
+ * Initialize a token bucket, which starts out full.
+ *
+ * @param rl  The bucket.
+ * @param rate  The rate at which tokens are added, per second, or 0 for no limit.
+ * @param burst  The maximum number of tokens (at least 1).
+ */
+void ratelimit_init(RATELIMIT *rl, double rate, double burst) {
+    rl->rate = rate;
+    rl->burst = burst < 1 ? 1 : burst;
+    rl->tokens = rl->burst;
+    clock_gettime(CLOCK_MONOTONIC, &rl->last);
+}
+
+/*
+ * Take one token from a bucket, if one is available.
+ *
+ * @param rl  The bucket.
+ * @return 0 if a token was taken, otherwise the number of nanoseconds until
+ * one will be available, when the caller should try again.
+ */
+long ratelimit_take(RATELIMIT *rl) {
+    if(rl->rate <= 0) return 0;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    rl->tokens += seconds_since(&rl->last, &now) * rl->rate;
+    if(rl->tokens > rl->burst) rl->tokens = rl->burst;
+    rl->last = now;
+    if(rl->tokens >= 1) {
+        rl->tokens -= 1;
+        return 0;
+    }
+    // Rounded up, so that a token is sure to be there by then.
+    long ns = (1 - rl->tokens) / rl->rate * 1e9 + 1;
+    metrics_add(METRIC_THROTTLED, 1);
+    metrics_add(METRIC_THROTTLE_NS, ns);
+    return ns;
+}
@@ -6,9 +6,131 @@
 
 #include "debug.h"
 #include "pbx.h"
+#include "pbx_ext.h"
+#include "session.h"
 #include "server.h"
+#include "server_ext.h"
 #include "csapp.h"
-#include "global_mutex.h"
+#include "metrics.h"
+#include "conf.h"
+#include "hunt.h"
+#include "proto.h"
+#include "ratelimit.h"
+#include "capture.h"
+
+/*
+ * Carry out a command received as a binary frame.  No parsing is needed:
+ * the command and its argument are taken directly from the frame header.
+ *
+ * @return the command, or TU_NO_CMD if the frame is not a valid command.
+ */
+static TU_COMMAND binary_command(TU *tu, PROTO_FRAME *frame, char *payload) {
+    if(frame->type != PROTO_COMMAND) return TU_NO_CMD;
+    switch(frame->code) {
+        case TU_PICKUP_CMD:
+            tu_pickup(tu);
+            break;
+        case TU_HANGUP_CMD:
+            tu_hangup(tu);
+            break;
+        case TU_DIAL_CMD:
+            if(frame->arg == PROTO_NO_ARG) return TU_NO_CMD;
+            pbx_dial(pbx, tu, frame->arg);
+            break;
+        case TU_CHAT_CMD:
+            tu_chat(tu, payload != NULL ? payload : "");
+            break;
+        case TU_CONF_CMD:
+            if(frame->arg == PROTO_NO_ARG) return TU_NO_CMD;
+            tu_conference(tu, frame->arg);
+            break;
+        case TU_EXT_CMD:
+            if(frame->arg == PROTO_NO_ARG) return TU_NO_CMD;
+            pbx_request_extension(pbx, tu, frame->arg);
+            break;
+        case TU_QUEUE_CMD:
+            if(frame->arg == PROTO_NO_ARG) return TU_NO_CMD;
+            pbx_queue(pbx, tu, frame->arg);
+            break;
+        case TU_HUNT_CMD:
+            if(frame->arg == PROTO_NO_ARG) return TU_NO_CMD;
+            hunt_call(hunt_group(frame->arg), tu, frame->arg);
+            break;
+        case TU_AGENT_CMD:
+            if(frame->arg == PROTO_NO_ARG) return TU_NO_CMD;
+            tu_agent(tu, frame->arg);
+            break;
+        default:
+            return TU_NO_CMD;
+    }
+    return frame->code;
+}
+
+/*
+ * Record a binary command in the capture, in its text form.
+ */
+static void capture_frame(int conn, PROTO_FRAME *frame, char *payload) {
+    if(conn < 0 || frame->type != PROTO_COMMAND) return;
+    char *name = frame->code == TU_CONF_CMD ? CONF_COMMAND_NAME
+                 : frame->code == TU_EXT_CMD ? EXT_COMMAND_NAME
+                 : frame->code == TU_QUEUE_CMD ? QUEUE_COMMAND_NAME
+                 : frame->code == TU_HUNT_CMD ? HUNT_COMMAND_NAME
+                 : frame->code == TU_AGENT_CMD ? AGENT_COMMAND_NAME
+                 : frame->code <= TU_CHAT_CMD ? tu_command_names[frame->code] : NULL;
+    if(name == NULL) return;
+    char *line;
+    if(frame->code == TU_CHAT_CMD) {
+        line = Malloc(strlen(name) + (payload != NULL ? strlen(payload) : 0) + 2);
+        sprintf(line, "%s %s", name, payload != NULL ? payload : "");
+        // The capture is line-oriented, and binary chats may contain line breaks.
+        for(char *cp = line; *cp != '\0'; cp++) {
+            if(*cp == '\n' || *cp == '\r') *cp = ' ';
+        }
+    }
+    else {
+        line = Malloc(strlen(name) + 16);
+        if(frame->arg == PROTO_NO_ARG) strcpy(line, name);
+        else sprintf(line, "%s %u", name, frame->arg);
+    }
+    capture_command(conn, line);
+    Free(line);
+}
+
+/*
+ * Reply to a "session" or "resume" command.
+ *
+ * @param session  The client's session, or NULL if there is none.
+ */
+static void session_reply(TU *tu, SESSION *session) {
+    char line[64];
+    if(session != NULL)
+        snprintf(line, sizeof(line), "%s %016llx", SESSION_REPLY,
+                 (unsigned long long)session_token(session));
+    else snprintf(line, sizeof(line), "%s %s", SESSION_REPLY, SESSION_EXPIRED);
+    tu_send(tu, line);
+}
+
+/*
+ * State of the service of one client connection.  Input is read into a buffer
+ * as it arrives, and carried out one complete command at a time, so that the
+ * service can be suspended between commands and taken up again later,
+ * possibly by a different thread.
+ */
+struct client {
+    int fd;                 // The connection.
+    TU *tu;                 // TU of the client, on which a reference is held.
+    SESSION *session;       // The client's session, or NULL if there is none.
+    RATELIMIT rl;           // Limit on the rate at which commands are carried out.
+    long delay;             // Nanoseconds until the next command may be carried out.
+    int conn;               // Connection number in the capture.
+    char binary;            // Nonzero once the client uses the binary protocol.
+    char *buf;              // Input received but not yet carried out.
+    size_t start;           // Offset of the first byte not yet carried out.
+    size_t len;             // Offset of the end of the input.
+    size_t size;            // Size of the buffer.
+};
+
+#define CLIENT_BUFFER 512
 
 /*
  * Thread function for the thread that handles interaction with a client TU.
@@ -19,96 +141,310 @@ void *pbx_client_service(void *arg) {
     // TO BE IMPLEMENTED
     // NOTE: We are allowed to use code snippets from the textbook and/or slides.
     // Retrieve the connection file descriptor (to communicate with the client).
-    P(&global_mutex);
     int connfd = *((int *)arg);
     // Free the argument pointer.
     Free(arg);
     // The thread is detached, so that it does not have to be explicitly reaped.
     Pthread_detach(pthread_self());
+    // The connection is blocking, so the thread waits in read() for each command.
+    CLIENT *client = pbx_client_open(connfd);
+    while(pbx_client_run(client, 0) != CLIENT_DONE);
+    pbx_client_close(client);
+    return NULL;
+}
+
+/*
+ * Create a TU for a new network connection and register it with the PBX,
+ * which assigns it an extension number and notifies the client.
+ *
+ * @param connfd  The file descriptor of the connection.
+ * @return the state of the service of the connection.
+ */
+CLIENT *pbx_client_open(int connfd) {
+    CLIENT *c = Malloc(sizeof(CLIENT));
+    c->fd = connfd;
     // Initialize a new TU with the connection file descriptor.
-    TU *tu = tu_init(connfd);
-    // Register the TU with the PBX server under a particular extension number (i.e., connfd).
-    pbx_register(pbx, tu, connfd);
-    V(&global_mutex);
-    // The thread should enter a service loop in which it repeatedly
-    // receives a message sent by the client, parses the message, and carries
-    // out the specified command.
-    char *msg = NULL;
-    size_t read_buf_size, msg_size, alloc_size;
-    while(1) {
-        alloc_size = 1;
-        msg = Malloc(alloc_size);
-        msg_size = 0;
-        char read_buf;
-        while((read_buf_size = Read(connfd, &read_buf, 1)) > 0) {
-            P(&global_mutex);
-            if(read_buf == '\n') {
-                V(&global_mutex);
-                break;
-            }
-            if(read_buf != '\r' && read_buf != '\n') {
-                if(alloc_size - msg_size < read_buf_size) {
-                    msg = Realloc(msg, 2 * msg_size + read_buf_size);
-                    alloc_size = 2 * msg_size + read_buf_size;
+    c->tu = tu_init(connfd);
+    // Register the TU with the PBX server, which assigns it an extension number.
+    pbx_register(pbx, c->tu, PBX_ANY_EXTENSION);
+    c->session = NULL;
+    // Commands beyond the client's rate limit are delayed, not rejected.
+    ratelimit_init(&c->rl, ratelimit_rate, ratelimit_burst);
+    c->delay = 0;
+    c->conn = capture_connect(tu_extension(c->tu));
+    c->binary = 0;
+    c->buf = Malloc(CLIENT_BUFFER);
+    c->start = c->len = 0;
+    c->size = CLIENT_BUFFER;
+    return c;
+}
+
+/*
+ * Get the file descriptor of the connection of a client.
+ */
+int pbx_client_fd(CLIENT *c) {
+    return c->fd;
+}
+
+/*
+ * Get the time until a client that has been throttled may be served again.
+ *
+ * @return the time in nanoseconds, as of the return of CLIENT_THROTTLED
+ * by pbx_client_run().
+ */
+long pbx_client_delay(CLIENT *c) {
+    return c->delay;
+}
+
+/*
+ * Determine the length of the first command in the input buffer: a line of
+ * text, including its terminating newline, or a binary frame.
+ *
+ * @return the length, or 0 if the buffer does not hold a complete command.
+ */
+static size_t client_command_length(CLIENT *c) {
+    char *cp = c->buf + c->start;
+    size_t avail = c->len - c->start;
+    if(c->binary) {
+        if(avail < PROTO_HEADER_SIZE) return 0;
+        PROTO_FRAME frame;
+        proto_decode(cp, &frame);
+        return avail < PROTO_HEADER_SIZE + frame.len ? 0 : PROTO_HEADER_SIZE + frame.len;
+    }
+    char *nl = memchr(cp, '\n', avail);
+    return nl == NULL ? 0 : nl - cp + 1;
+}
+
+/*
+ * Read whatever input is available into the buffer, enlarging it if it is full.
+ *
+ * @return the result of read().
+ */
+static ssize_t client_read(CLIENT *c) {
+    if(c->start > 0) {
+        memmove(c->buf, c->buf + c->start, c->len - c->start);
+        c->len -= c->start;
+        c->start = 0;
+    }
+    if(c->len == c->size) {
+        c->size *= 2;
+        c->buf = Realloc(c->buf, c->size);
+    }
+    ssize_t n = read(c->fd, c->buf + c->len, c->size - c->len);
+    if(n > 0) {
+        c->len += n;
+        metrics_add(METRIC_BYTES_IN, n);
+    }
+    return n;
+}
+
+/*
+ * Carry out a command received as a line of text.
+ *
+ * @param msg  The line, without its line terminator, which is modified.
+ * @return the command, or TU_NO_CMD if the line is not one of the TU commands.
+ */
+static TU_COMMAND text_command(CLIENT *c, char *msg) {
+    TU *tu = c->tu;
+    TU_COMMAND cmd = TU_NO_CMD;
+    char *saveptr;
+    char *first_token = strtok_r(msg, " \t", &saveptr);
+    if(first_token == NULL) return cmd;
+    if(strcmp(first_token, tu_command_names[TU_PICKUP_CMD]) == 0) {
+        cmd = TU_PICKUP_CMD;
+        tu_pickup(tu);
+    }
+    else if(strcmp(first_token, tu_command_names[TU_HANGUP_CMD]) == 0) {
+        cmd = TU_HANGUP_CMD;
+        tu_hangup(tu);
+    }
+    else if(strcmp(first_token, tu_command_names[TU_DIAL_CMD]) == 0) {
+        cmd = TU_DIAL_CMD;
+        char *ext = strtok_r(NULL, " \t", &saveptr);
+        if(ext != NULL) pbx_dial(pbx, tu, atoi(ext));
+    }
+    else if(strcmp(first_token, PROTO_BINARY_COMMAND) == 0) {
+        if(tu_set_binary(tu) == 0) c->binary = 1;
+    }
+    else if(strcmp(first_token, CONF_COMMAND_NAME) == 0) {
+        cmd = TU_CONF_CMD;
+        char *room = strtok_r(NULL, " \t", &saveptr);
+        if(room != NULL) tu_conference(tu, atoi(room));
+    }
+    else if(strcmp(first_token, SESSION_COMMAND_NAME) == 0) {
+        if(c->session == NULL) c->session = session_open(tu);
+        session_reply(tu, c->session);
+    }
+    else if(strcmp(first_token, RESUME_COMMAND_NAME) == 0) {
+        char *token = strtok_r(NULL, " \t", &saveptr);
+        SESSION *resumed = token != NULL ? session_resume(strtoull(token, NULL, 16)) : NULL;
+        if(resumed == NULL) session_reply(tu, NULL);
+        else {
+            // The TU created for this connection gives way to the resumed one.
+            OUTQ *outq = tu_detach(tu);
+            if(c->session != NULL) session_close(c->session);
+            pbx_unregister(pbx, tu);
+            tu_unref(tu, "pbx_client_service");
+            c->session = resumed;
+            c->tu = tu = session_tu(resumed);
+            tu_ref(tu, "pbx_client_service");
+            tu_attach(tu, c->fd, outq);
+        }
+    }
+    else if(strcmp(first_token, EXT_COMMAND_NAME) == 0) {
+        cmd = TU_EXT_CMD;
+        char *ext = strtok_r(NULL, " \t", &saveptr);
+        if(ext != NULL) pbx_request_extension(pbx, tu, atoi(ext));
+    }
+    else if(strcmp(first_token, QUEUE_COMMAND_NAME) == 0) {
+        cmd = TU_QUEUE_CMD;
+        char *ext = strtok_r(NULL, " \t", &saveptr);
+        if(ext != NULL) pbx_queue(pbx, tu, atoi(ext));
+    }
+    else if(strcmp(first_token, HUNT_COMMAND_NAME) == 0) {
+        cmd = TU_HUNT_CMD;
+        char *group = strtok_r(NULL, " \t", &saveptr);
+        if(group != NULL) hunt_call(hunt_group(atoi(group)), tu, atoi(group));
+    }
+    else if(strcmp(first_token, AGENT_COMMAND_NAME) == 0) {
+        cmd = TU_AGENT_CMD;
+        char *group = strtok_r(NULL, " \t", &saveptr);
+        if(group != NULL) tu_agent(tu, atoi(group));
+    }
+    else if(strcmp(first_token, tu_command_names[TU_CHAT_CMD]) == 0) {
+        cmd = TU_CHAT_CMD;
+        char *chat_msg = strtok_r(NULL, "", &saveptr);
+        if(chat_msg == NULL) tu_chat(tu, "");
+        else {
+            int i = 0;
+            char all_whitespace = 1;
+            while(i < strlen(chat_msg)) {
+                if(!isspace(chat_msg[i])) {
+                    all_whitespace = 0;
+                    break;
                 }
-                strncpy(msg + msg_size, &read_buf, read_buf_size);
-                msg_size += read_buf_size;
+                ++i;
             }
-            V(&global_mutex);
-        }
-        if(read_buf_size == 0) break;
-        P(&global_mutex);
-        msg = Realloc(msg, msg_size + 1);
-        msg[msg_size] = '\0';
-        char *first_token = strtok(msg, " \t");
-        if(first_token == NULL) {
-            Free(msg);
-            msg = NULL;
-            V(&global_mutex);
-            continue;
-        }
-        if(strcmp(first_token, tu_command_names[TU_PICKUP_CMD]) == 0) {
-            tu_pickup(tu);
+            if(all_whitespace) tu_chat(tu, "");
+            else tu_chat(tu, chat_msg + i);
         }
-        else if(strcmp(first_token, tu_command_names[TU_HANGUP_CMD]) == 0) {
-            tu_hangup(tu);
-        }
-        else if(strcmp(first_token, tu_command_names[TU_DIAL_CMD]) == 0) {
-            char *ext = strtok(NULL, " \t");
-            if(ext != NULL) pbx_dial(pbx, tu, atoi(ext));
+    }
+    return cmd;
+}
+
+/*
+ * Carry out the first command in the input buffer and remove it.
+ *
+ * @param len  The length of the command, as given by client_command_length().
+ */
+static void client_command(CLIENT *c, size_t len) {
+    char *cp = c->buf + c->start;
+    c->start += len;
+    struct timespec start;
+    TU_COMMAND cmd;
+    if(c->binary) {
+        PROTO_FRAME frame;
+        proto_decode(cp, &frame);
+        char *payload = NULL;
+        if(frame.len > 0) {
+            payload = Malloc(frame.len + 1);
+            memcpy(payload, cp + PROTO_HEADER_SIZE, frame.len);
+            payload[frame.len] = '\0';
         }
-        else if(strcmp(first_token, tu_command_names[TU_CHAT_CMD]) == 0) {
-            char *chat_msg = strtok(NULL, "");
-            if(chat_msg == NULL) tu_chat(tu, "");
-            else {
-                int i = 0;
-                char all_whitespace = 1;
-                while(i < strlen(chat_msg)) {
-                    if(!isspace(chat_msg[i])) {
-                        all_whitespace = 0;
-                        break;
-                    }
-                    ++i;
-                }
-                if(all_whitespace) tu_chat(tu, "");
-                else tu_chat(tu, chat_msg + i);
-            }
+        capture_frame(c->conn, &frame, payload);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        cmd = binary_command(c->tu, &frame, payload);
+        if(payload != NULL) Free(payload);
+    }
+    else {
+        // Carriage returns are dropped wherever they appear in the line.
+        char *msg = Malloc(len);
+        size_t msg_size = 0;
+        for(size_t i = 0; i < len - 1; i++) {
+            if(cp[i] != '\r') msg[msg_size++] = cp[i];
         }
+        msg[msg_size] = '\0';
+        capture_command(c->conn, msg);
         debug("%s\n", msg);
+        // Blank lines are not counted as commands.
+        int blank = strspn(msg, " \t") == msg_size;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        cmd = blank ? TU_NO_CMD : text_command(c, msg);
         Free(msg);
-        msg = NULL;
-        V(&global_mutex);
+        if(blank) return;
     }
-    P(&global_mutex);
-    debug("Unregistering client service thread (ext: %d)...\n", connfd);
-    if(msg != NULL) {
-        Free(msg);
-        debug("Freed the message\n");
-        msg = NULL;
+    metrics_command(cmd, &start);
+}
+
+/*
+ * Serve a client: carry out the commands it has sent, reading more input
+ * as needed, until it has no more complete commands to offer, the
+ * connection is closed, or a number of commands have been carried out.
+ * Once the PBX has begun to shut down, no more commands are carried out.
+ * A client that has exceeded its rate limit is made to wait: with no limit
+ * on the number of commands, the thread serving it sleeps; otherwise the
+ * caller is told to serve other clients meanwhile.
+ *
+ * @param c  The client.
+ * @param quantum  The maximum number of commands to carry out, or 0 for no limit.
+ * @return CLIENT_DONE if the client should be closed, CLIENT_WAIT if the
+ * connection is non-blocking and has no more input for now, CLIENT_MORE
+ * if the quantum was used up, or CLIENT_THROTTLED if the client is not to
+ * be served again for pbx_client_delay() nanoseconds.
+ */
+int pbx_client_run(CLIENT *c, int quantum) {
+    int done = 0;
+    while(!pbx_draining(pbx)) {
+        size_t len = client_command_length(c);
+        if(len == 0) {
+            // A connection reset by the client is treated the same as EOF.
+            ssize_t n = client_read(c);
+            if(n > 0) continue;
+            if(n < 0 && errno == EINTR) continue;
+            if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return CLIENT_WAIT;
+            return CLIENT_DONE;
+        }
+        if(quantum > 0 && done == quantum) return CLIENT_MORE;
+        if((c->delay = ratelimit_take(&c->rl)) > 0) {
+            if(quantum > 0) return CLIENT_THROTTLED;
+            struct timespec delay = { c->delay / 1000000000, c->delay % 1000000000 };
+            while(nanosleep(&delay, &delay) < 0 && errno == EINTR);
+            continue;
+        }
+        client_command(c, len);
+        ++done;
     }
-    pbx_unregister(pbx, tu);
+    return CLIENT_DONE;
+}
+
+/*
+ * End the service of a client whose connection has been closed, or which is
+ * to be disconnected: unregister its TU, unless it is kept for a resumable
+ * session, and release the reference held on it.
+ *
+ * @param c  The client, which is freed.
+ */
+void pbx_client_close(CLIENT *c) {
+    debug("Unregistering client service thread (ext: %d)...\n", c->fd);
+    TU *tu = c->tu;
+    capture_disconnect(c->conn);
+    // A resumable TU stays registered for its grace period, without a connection,
+    // unless the server is shutting down.
+    int detached = 0;
+    if(c->session != NULL && !pbx_draining(pbx)) {
+        // Releasing the queue closes the connection, and a client that sees
+        // that may reconnect at once, so the session must be resumable first.
+        OUTQ *outq = tu_detach(tu);
+        detached = session_detach(c->session) == 0;
+        outq_release(outq);
+    }
+    if(!detached) {
+        if(c->session != NULL) session_close(c->session);
+        pbx_unregister(pbx, tu);
+    }
+    Free(c->buf);
+    Free(c);
+    // The connection is closed once the TU's outbound queue has been released,
+    // so that output still in flight is never written to a reused descriptor.
     tu_unref(tu, "pbx_client_service");
-    Close(connfd);
-    V(&global_mutex);
-    return NULL;
 }
@@ -0,0 +1,273 @@
+/*
+ * SESSION: resumable sessions, which keep a TU registered for a grace period
+ * after its client's connection is lost.
+ */
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/random.h>
+
+#include "session.h"
+#include "pbx.h"
+#include "metrics.h"
+#include "debug.h"
+#include "csapp.h"
+
+/*
+ * Number of buckets in the token table (a power of two).  Tokens are random,
+ * so their low bits are used directly as the hash.
+ */
+#define SESSION_BUCKETS 1024
+
+/*
+ * Interval at which the reaper thread looks for expired sessions.
+ */
+#define SESSION_REAP_MS 50
+
+long session_grace_ms = SESSION_DEFAULT_GRACE_MS;
+
+/*
+ * A session is in the token table from session_open() until it is closed or
+ * expires.  While its client is disconnected it is also on the expiry list,
+ * which is in order of deadline because every session has the same grace period.
+ */
+struct session {
+    uint64_t token;
+    TU *tu;
+    int detached;
+    struct timespec deadline;
+    struct session *hnext;
+    struct session *next;
+    struct session *prev;
+};
+
+static struct {
+    sem_t mutex;
+    struct session *table[SESSION_BUCKETS];
+    struct session expiry;     // Sentinel of the expiry list
+    int stopping;
+    int reaping;
+    pthread_t tid;
+} sessions;
+
+static pthread_once_t sessions_once = PTHREAD_ONCE_INIT;
+
+static void sessions_init(void) {
+    Sem_init(&sessions.mutex, 0, 1);
+    sessions.expiry.next = sessions.expiry.prev = &sessions.expiry;
+}
+
+static struct session **session_bucket(uint64_t token) {
+    return &sessions.table[token & (SESSION_BUCKETS - 1)];
+}
+
+/*
+ * Remove a session from the token table.  The caller must hold the mutex.
+ */
+static void session_unhash(SESSION *s) {
+    struct session **sp = session_bucket(s->token);
+    while(*sp != s) sp = &(*sp)->hnext;
+    *sp = s->hnext;
+}
+
+static void session_unlink(SESSION *s) {
+    s->prev->next = s->next;
+    s->next->prev = s->prev;
+}
+
+/*
+ * Unregister the TUs of sessions taken off the expiry list, and free the sessions.
+ * Called without the mutex held, because unregistering hangs up the TU.
+ */
+static void session_expire(struct session *list) {
+    while(list != NULL) {
+        struct session *s = list;
+        list = s->next;
+        debug("session_expire: ext %d\n", tu_extension(s->tu));
+        pbx_unregister(pbx, s->tu);
+        tu_unref(s->tu, "session_expire");
+        Free(s);
+        metrics_add(METRIC_SESSIONS_EXPIRED, 1);
+    }
+}
+
+/*
+ * Take sessions off the expiry list and out of the table, either all of them or
+ * just those whose deadline has passed.  The caller must hold the mutex.
+ *
+ * @return the sessions, as a list linked through their next fields.
+ */
+static struct session *session_take_expired(int all) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    struct session *list = NULL, **tail = &list;
+    while(sessions.expiry.next != &sessions.expiry) {
+        struct session *s = sessions.expiry.next;
+        if(!all && (s->deadline.tv_sec > now.tv_sec ||
+                    (s->deadline.tv_sec == now.tv_sec && s->deadline.tv_nsec > now.tv_nsec)))
+            break;
+        session_unlink(s);
+        session_unhash(s);
+        s->next = NULL;
+        *tail = s;
+        tail = &s->next;
+    }
+    return list;
+}
+
+/*
+ * Thread function for the reaper thread, which unregisters the TUs of sessions
+ * whose grace period has run out.
+ */
+static void *session_reaper(void *arg) {
+    while(1) {
+        P(&sessions.mutex);
+        if(sessions.stopping) {
+            V(&sessions.mutex);
+            break;
+        }
+        struct session *list = session_take_expired(0);
+        V(&sessions.mutex);
+        session_expire(list);
+        struct timespec delay = { 0, SESSION_REAP_MS * 1000000 };
+        nanosleep(&delay, NULL);
+    }
+    return NULL;
+}
+
+/*
+ * Make the TU of a client resumable, starting the reaper thread if this is
+ * the first session.
+ *
+ * @param tu  The TU, which the session holds a reference to until it is closed.
+ * @return the session, or NULL if sessions are no longer being created
+ * because the server is shutting down.
+ */
+SESSION *session_open(TU *tu) {
+    Pthread_once(&sessions_once, sessions_init);
+    SESSION *s = Malloc(sizeof(SESSION));
+    // The token is what authorizes taking over the TU, so it must not be guessable.
+    do {
+        if(getrandom(&s->token, sizeof(s->token), 0) != sizeof(s->token)) {
+            Free(s);
+            return NULL;
+        }
+    } while(s->token == 0);
+    s->tu = tu;
+    s->detached = 0;
+    s->next = s->prev = NULL;
+    P(&sessions.mutex);
+    if(sessions.stopping) {
+        V(&sessions.mutex);
+        Free(s);
+        return NULL;
+    }
+    if(!sessions.reaping) {
+        Pthread_create(&sessions.tid, NULL, session_reaper, NULL);
+        sessions.reaping = 1;
+    }
+    struct session **bucket = session_bucket(s->token);
+    s->hnext = *bucket;
+    *bucket = s;
+    tu_ref(tu, "session_open");
+    V(&sessions.mutex);
+    return s;
+}
+
+/*
+ * Get the token that identifies a session.
+ */
+uint64_t session_token(SESSION *s) {
+    return s->token;
+}
+
+/*
+ * Get the TU of a session.
+ */
+TU *session_tu(SESSION *s) {
+    return s->tu;
+}
+
+/*
+ * Start the grace period of a session whose client has disconnected.
+ * The session must not be used again by the caller, since from now on it may
+ * be resumed by another client or expire at any time.
+ *
+ * @param s  The session.
+ * @return 0 if successful, -1 if the server is shutting down, in which case
+ * the session has not been changed and should be closed instead.
+ */
+int session_detach(SESSION *s) {
+    P(&sessions.mutex);
+    if(sessions.stopping) {
+        V(&sessions.mutex);
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &s->deadline);
+    s->deadline.tv_sec += session_grace_ms / 1000;
+    s->deadline.tv_nsec += (session_grace_ms % 1000) * 1000000;
+    if(s->deadline.tv_nsec >= 1000000000) {
+        s->deadline.tv_sec++;
+        s->deadline.tv_nsec -= 1000000000;
+    }
+    s->detached = 1;
+    s->prev = sessions.expiry.prev;
+    s->next = &sessions.expiry;
+    sessions.expiry.prev->next = s;
+    sessions.expiry.prev = s;
+    V(&sessions.mutex);
+    return 0;
+}
+
+/*
+ * Take over a session whose client has disconnected, ending its grace period.
+ *
+ * @param token  The token of the session.
+ * @return the session, whose TU stays registered, or NULL if there is no
+ * disconnected session with that token.
+ */
+SESSION *session_resume(uint64_t token) {
+    Pthread_once(&sessions_once, sessions_init);
+    P(&sessions.mutex);
+    struct session *s = *session_bucket(token);
+    while(s != NULL && s->token != token) s = s->hnext;
+    if(s == NULL || !s->detached) {
+        V(&sessions.mutex);
+        return NULL;
+    }
+    session_unlink(s);
+    s->detached = 0;
+    s->next = s->prev = NULL;
+    V(&sessions.mutex);
+    metrics_add(METRIC_SESSIONS_RESUMED, 1);
+    return s;
+}
+
+/*
+ * Close a session whose client is connected, so that it can no longer be resumed.
+ * The session's reference to the TU is released, but the TU is not unregistered.
+ *
+ * @param s  The session.
+ */
+void session_close(SESSION *s) {
+    P(&sessions.mutex);
+    session_unhash(s);
+    V(&sessions.mutex);
+    tu_unref(s->tu, "session_close");
+    Free(s);
+}
+
+/*
+ * Expire all disconnected sessions at once and stop the reaper thread.
+ * Sessions can no longer be created or detached after this has been called.
+ */
+void session_shutdown(void) {
+    Pthread_once(&sessions_once, sessions_init);
+    P(&sessions.mutex);
+    sessions.stopping = 1;
+    struct session *list = session_take_expired(1);
+    int reaping = sessions.reaping;
+    V(&sessions.mutex);
+    session_expire(list);
+    if(reaping) Pthread_join(sessions.tid, NULL);
+}
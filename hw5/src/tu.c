@@ -2,22 +2,139 @@
  * TU: simulates a "telephone unit", which interfaces a client with the PBX.
  */
 #include <stdlib.h>
+#include <stdatomic.h>
 #include <pthread.h>
 
 #include "pbx.h"
+#include "conf.h"
+#include "hunt.h"
+#include "proto.h"
+#include "outq.h"
+#include "cdr.h"
+#include "session.h"
+#include "metrics.h"
 #include "debug.h"
 #include "csapp.h"
 
+/*
+ * A call in progress between two TUs.  While a TU is in a call, its state and
+ * that of its peer are protected by the call's mutex rather than by their own,
+ * so that every command other than dial needs just one lock acquisition.
+ *
+ * Call objects are recycled through a free list and never freed, so a thread
+ * that has read a TU's lock pointer just before the call ended may still
+ * safely block on the call's mutex (it then finds that the TU's lock has
+ * changed and retries).
+ *
+ * The call detail record is filled in under the call's mutex as the call
+ * progresses, and handed to the CDR log when the call is torn down.
+ */
+struct call {
+    sem_t mutex;
+    TU *caller;
+    CDR cdr;
+    struct call *next;
+};
+
 struct tu {
     int fd;
+    int ext;
     TU *peer;
     TU_STATE state;
     sem_t mutex;
-    int ref_count;
+    _Atomic(sem_t *) lock;
+    struct call *call;
+    CONF *conf;
+    _Atomic(HUNT *) queue;
+    _Atomic(HUNT *) group;
+    HUNT *waiting;
+    unsigned int ticket;
+    int queued_for;
+    atomic_int ref_count;
+    OUTQ *outq;
+    char binary;
 };
 
+static struct call *call_pool;
+static sem_t call_pool_mutex;
+static pthread_once_t call_pool_once = PTHREAD_ONCE_INIT;
+
+static void call_pool_init(void) {
+    Sem_init(&call_pool_mutex, 0, 1);
+}
+
+/*
+ * Obtain an unused call object, allocating a new one if none is free.
+ */
+static struct call *call_get(void) {
+    Pthread_once(&call_pool_once, call_pool_init);
+    P(&call_pool_mutex);
+    struct call *call = call_pool;
+    if(call != NULL) call_pool = call->next;
+    V(&call_pool_mutex);
+    if(call == NULL) {
+        call = Malloc(sizeof(struct call));
+        Sem_init(&call->mutex, 0, 1);
+    }
+    return call;
+}
+
+/*
+ * Return a call object that is no longer in use to the free list.
+ */
+static void call_put(struct call *call) {
+    P(&call_pool_mutex);
+    call->next = call_pool;
+    call_pool = call;
+    V(&call_pool_mutex);
+}
+
+/*
+ * Acquire the lock that currently protects the state of a TU: its own mutex,
+ * or the mutex of the call or conference it is in.  The lock pointer only changes while the
+ * lock it points to is held, so it is re-checked after acquisition.
+ *
+ * @return the lock that was acquired, to be released with V().
+ */
+static sem_t *tu_lock(TU *tu) {
+    while(1) {
+        sem_t *lock = atomic_load_explicit(&tu->lock, memory_order_acquire);
+        metrics_lock(lock, METRIC_LOCK_TU);
+        if(atomic_load_explicit(&tu->lock, memory_order_relaxed) == lock) return lock;
+        V(lock);
+    }
+}
+
+/*
+ * Queue a notification of the current state of a TU for its network client,
+ * as a text line or a binary state frame according to the client's protocol.
+ * The caller must hold the lock of the TU.
+ */
+static void tu_notify(TU *tu) {
+    char buf[64];
+    int len, arg = -1;
+    if(tu->state == TU_ON_HOOK) arg = tu->ext;
+    else if(tu->state == TU_CONNECTED) arg = tu->peer->ext;
+    else if(tu->state == TU_CONFERENCE) arg = conf_room(tu->conf);
+    else if(tu->state == TU_QUEUED) arg = tu->queued_for;
+    if(tu->binary) {
+        PROTO_FRAME frame = { PROTO_STATE, tu->state, 0, arg < 0 ? PROTO_NO_ARG : arg };
+        proto_encode(buf, &frame);
+        len = PROTO_HEADER_SIZE;
+    }
+    else {
+        char *name = tu->state == TU_CONFERENCE ? CONF_STATE_NAME
+                     : tu->state == TU_QUEUED ? QUEUED_STATE_NAME : tu_state_names[tu->state];
+        if(arg >= 0) len = snprintf(buf, sizeof(buf), "%s %d%s", name, arg, EOL);
+        else len = snprintf(buf, sizeof(buf), "%s%s", name, EOL);
+    }
+    outq_put(tu->outq, buf, len, 0);
+}
+
 /*
  * Initialize a TU
+ * The TU has no extension, and its client is not notified of its state,
+ * until it is registered with the PBX.
  *
  * @param fd  The file descriptor of the underlying network connection.
  * @return  The TU, newly initialized and in the TU_ON_HOOK state, if initialization
@@ -29,25 +146,33 @@ TU *tu_init(int fd) {
     if(tu == NULL) return NULL;
     debug("Reached tu_init\n");
     tu->fd = fd;
+    tu->ext = -1;
     tu->peer = NULL;
+    tu->call = NULL;
+    tu->conf = NULL;
+    atomic_init(&tu->queue, NULL);
+    atomic_init(&tu->group, NULL);
+    tu->waiting = NULL;
+    tu->ticket = 0;
+    tu->binary = 0;
     tu->state = TU_ON_HOOK;
-    tu->ref_count = 1;
+    atomic_init(&tu->ref_count, 1);
     Sem_init(&tu->mutex, 0, 1);
-    char *tu_buf = Malloc(strlen(tu_state_names[tu->state]) + 1);
-    strcpy(tu_buf, tu_state_names[tu->state]);
-    char num[12];
-    sprintf(num, " %d", tu->fd);
-    tu_buf = Realloc(tu_buf, strlen(tu_buf) + strlen(num) + 1);
-    strcat(tu_buf, num);
-    tu_buf = Realloc(tu_buf, strlen(tu_buf) + 3);
-    strcat(tu_buf, EOL);
-    Write(tu->fd, tu_buf, strlen(tu_buf));
-    Free(tu_buf);
+    atomic_init(&tu->lock, &tu->mutex);
+    tu->outq = outq_init(fd);
+    if(tu->outq == NULL) {
+        sem_destroy(&tu->mutex);
+        Free(tu);
+        return NULL;
+    }
     return tu;
 }
 
 /*
  * Increment the reference count on a TU.
+ * The count is updated atomically, without taking the TU's mutex.
+ * A new reference can only be created from an existing one, so no ordering
+ * with respect to other memory operations is required.
  *
  * @param tu  The TU whose reference count is to be incremented
  * @param reason  A string describing the reason why the count is being incremented
@@ -56,14 +181,15 @@ TU *tu_init(int fd) {
 void tu_ref(TU *tu, char *reason) {
     // TO BE IMPLEMENTED
     if(tu == NULL) return;
-    P(&tu->mutex);
-    ++tu->ref_count;
+    atomic_fetch_add_explicit(&tu->ref_count, 1, memory_order_relaxed);
     if(reason != NULL) debug("tu_ref: %s\n", reason);
-    V(&tu->mutex);
 }
 
 /*
  * Decrement the reference count on a TU, freeing it if the count becomes 0.
+ * The decrement has release semantics, and the thread that drops the last
+ * reference issues an acquire fence before freeing, so that all accesses made
+ * through other references happen before the TU is destroyed.
  *
  * @param tu  The TU whose reference count is to be decremented
  * @param reason  A string describing the reason why the count is being decremented
@@ -72,16 +198,12 @@ void tu_ref(TU *tu, char *reason) {
 void tu_unref(TU *tu, char *reason) {
     // TO BE IMPLEMENTED
     if(tu == NULL) return;
-    P(&tu->mutex);
-    if(tu->ref_count < 0) {
-        V(&tu->mutex);
-        return;
-    }
-    --tu->ref_count;
-    int ref_count = tu->ref_count;
+    int ref_count = atomic_fetch_sub_explicit(&tu->ref_count, 1, memory_order_release) - 1;
     debug("tu_unref: Reference count is %d\n", ref_count);
-    V(&tu->mutex);
     if(ref_count == 0) {
+        atomic_thread_fence(memory_order_acquire);
+        outq_release(tu->outq);
+        hunt_fini(atomic_load_explicit(&tu->queue, memory_order_relaxed));
         sem_destroy(&tu->mutex);
         Free(tu);
     }
@@ -100,9 +222,9 @@ void tu_unref(TU *tu, char *reason) {
 int tu_fileno(TU *tu) {
     // TO BE IMPLEMENTED
     if(tu == NULL) return -1;
-    P(&tu->mutex);
+    sem_t *lock = tu_lock(tu);
     int fileno = tu->fd;
-    V(&tu->mutex);
+    V(lock);
     return fileno;
 }
 
@@ -118,22 +240,35 @@ int tu_fileno(TU *tu) {
  */
 int tu_extension(TU *tu) {
     // TO BE IMPLEMENTED
-    return tu_fileno(tu);
+    if(tu == NULL) return -1;
+    sem_t *lock = tu_lock(tu);
+    int ext = tu->ext;
+    V(lock);
+    return ext;
 }
 
 /*
  * Set the extension number for a TU.
  * A notification is set to the client of the TU.
- * This function should be called at most once one any particular TU.
+ * Once the TU has an extension, it can only be changed while the TU is on hook
+ * (see pbx_request_extension()); otherwise the client is notified of its
+ * unchanged state.
  *
  * @param tu  The TU whose extension is being set.
+ * @return 0 if the extension was set, otherwise -1.
  */
 int tu_set_extension(TU *tu, int ext) {
     // TO BE IMPLEMENTED
     if(tu == NULL || ext < 0) return -1;
-    P(&tu->mutex);
-    tu->fd = ext;
-    V(&tu->mutex);
+    sem_t *lock = tu_lock(tu);
+    if(tu->ext >= 0 && tu->state != TU_ON_HOOK) {
+        tu_notify(tu);
+        V(lock);
+        return -1;
+    }
+    tu->ext = ext;
+    tu_notify(tu);
+    V(lock);
     return 0;
 }
 
@@ -173,107 +308,115 @@ int tu_dial(TU *tu, TU *target) {
         debug("tu_dial");
         return -1;
     }
-    char target_is_null = 0, target_is_equal = 0;
-    if(target == NULL) target_is_null = 1;
-    if(tu == target) target_is_equal = 1;
-    char lock_target_first = 0;
-    if(!target_is_null && target < tu) lock_target_first = 1;
-    if(lock_target_first) {
-        if(!target_is_null && !target_is_equal) P(&target->mutex);
-        P(&tu->mutex);
-    }
-    else {
-        P(&tu->mutex);
-        if(!target_is_null && !target_is_equal) P(&target->mutex);
-    }
-    char target_state_changed = 0;
-    if(target_is_null && tu->state == TU_DIAL_TONE) {
-        tu->state = TU_ERROR;
-    }
-    else if(tu->state == TU_DIAL_TONE) {
-        if(target_is_equal || target->peer != NULL || target->state != TU_ON_HOOK) {
-            if(tu == target) debug("tu == target");
-            if(target->peer != NULL) debug("target->peer != NULL");
-            if(target->state != TU_ON_HOOK) debug("target->state != TU_ON_HOOK");
-            tu->state = TU_BUSY_SIGNAL;
+    return tu_connect(tu, target, NULL, 0) < 0 ? -1 : 0;
+}
+
+/*
+ * Determine whether a TU is still making the call identified by a queue and ticket:
+ * with dial tone if the ticket is 0, otherwise waiting in the queue.
+ * The caller must hold the lock of the TU.
+ */
+static int tu_calling(TU *tu, HUNT *hunt, unsigned int ticket) {
+    if(ticket == 0) return tu->state == TU_DIAL_TONE;
+    return tu->state == TU_QUEUED && tu->waiting == hunt && tu->ticket == ticket;
+}
+
+/*
+ * Put a call from a TU through to a target TU that is on hook, as described for
+ * tu_dial().  A TU that is calling from a queue (see hunt.h) is left as it was
+ * if the target is busy, rather than getting a busy signal, and its client is
+ * only notified if the call is put through.
+ *
+ * @param tu  The originating TU.
+ * @param target  The target TU, or NULL as for tu_dial().
+ * @param hunt  The queue from which the TU is calling, or NULL if it is dialing.
+ * @param ticket  The ticket of the TU's wait in the queue, or 0 if the TU has dial tone.
+ * @return 0 if the call was put through, 1 if the target is busy, 2 if the TU
+ * is no longer calling, -1 if the TU transitioned to the TU_ERROR state.
+ */
+int tu_connect(TU *tu, TU *target, HUNT *hunt, unsigned int ticket) {
+    sem_t *lock = tu_lock(tu);
+    int calling = tu_calling(tu, hunt, ticket);
+    if(!calling || target == NULL || (target == tu && hunt == NULL)) {
+        int ret = 2;
+        if(calling) {
+            tu->state = target == NULL ? TU_ERROR : TU_BUSY_SIGNAL;
+            ret = target == NULL ? -1 : 1;
         }
-        else {
-            target_state_changed = 1;
-            if(lock_target_first) {
-                V(&tu->mutex);
-                V(&target->mutex);
+        else if(ticket == 0 && tu->state == TU_ERROR) ret = -1;
+        if(ticket == 0) tu_notify(tu);
+        V(lock);
+        return ret;
+    }
+    // A calling TU is never in a call, so lock is its own mutex.
+    // A target that is in a call is busy and does not need to be locked.
+    // Otherwise try for its mutex without blocking, and only if that fails
+    // release ours and take both in address order.
+    char target_locked = 0;
+    if(target != tu && atomic_load_explicit(&target->lock, memory_order_acquire) == &target->mutex) {
+        if(sem_trywait(&target->mutex) < 0) {
+            V(&tu->mutex);
+            if(target < tu) {
+                metrics_lock(&target->mutex, METRIC_LOCK_TU);
+                metrics_lock(&tu->mutex, METRIC_LOCK_TU);
             }
             else {
+                metrics_lock(&tu->mutex, METRIC_LOCK_TU);
+                metrics_lock(&target->mutex, METRIC_LOCK_TU);
+            }
+            if(atomic_load_explicit(&tu->lock, memory_order_relaxed) != &tu->mutex) {
+                // The originating TU was called while its lock was released.
                 V(&target->mutex);
                 V(&tu->mutex);
+                return tu_connect(tu, target, hunt, ticket);
             }
-            tu_ref(tu, "tu_dial");
-            tu_ref(target, "tu_dial");
-            if(lock_target_first) {
-                P(&target->mutex);
-                P(&tu->mutex);
-            }
-            else {
-                P(&tu->mutex);
-                P(&target->mutex);
-            }
-            target->state = TU_RINGING;
-            tu->state = TU_RING_BACK;
-            tu->peer = target;
-            target->peer = tu;
-            debug("tu_dial: Connecting ext %d to %d\n", tu->fd, target->fd);
-        }
-    }
-    char *tu_buf = Malloc(strlen(tu_state_names[tu->state]) + 1);
-    strcpy(tu_buf, tu_state_names[tu->state]);
-    if(tu->state == TU_ON_HOOK || tu->state == TU_CONNECTED) {
-        char num[12];
-        if(tu->state == TU_ON_HOOK) sprintf(num, " %d", tu->fd);
-        else sprintf(num, " %d", tu->peer->fd);
-        tu_buf = Realloc(tu_buf, strlen(tu_buf) + strlen(num) + 1);
-        strcat(tu_buf, num);
-    }
-    tu_buf = Realloc(tu_buf, strlen(tu_buf) + 3);
-    strcat(tu_buf, EOL);
-    Write(tu->fd, tu_buf, strlen(tu_buf));
-    Free(tu_buf);
-
-    if(target_state_changed) {
-        debug("tu_dial: Notifying target (ext %d)...\n", target->fd);
-        char *target_buf = Malloc(strlen(tu_state_names[target->state]) + 1);
-        strcpy(target_buf, tu_state_names[target->state]);
-        if(target->state == TU_ON_HOOK || target->state == TU_CONNECTED) {
-            char num[12];
-            if(target->state == TU_ON_HOOK) sprintf(num, " %d", target->fd);
-            else sprintf(num, " %d", target->peer->fd);
-            target_buf = Realloc(target_buf, strlen(target_buf) + strlen(num) + 1);
-            strcat(target_buf, num);
-        }
-        target_buf = Realloc(target_buf, strlen(target_buf) + 3);
-        strcat(target_buf, EOL);
-        Write(target->fd, target_buf, strlen(target_buf));
-        Free(target_buf);
-    }
-    if(tu->state == TU_ERROR) {
-        if(lock_target_first) {
-            V(&tu->mutex);
-            if(!target_is_null && !target_is_equal) V(&target->mutex);
         }
-        else {
-            if(!target_is_null && !target_is_equal) V(&target->mutex);
-            V(&tu->mutex);
+        target_locked = 1;
+        if(atomic_load_explicit(&target->lock, memory_order_relaxed) != &target->mutex) {
+            V(&target->mutex);
+            target_locked = 0;
         }
-        debug("tu_dial");
-        return -1;
     }
-    if(lock_target_first) {
+    if(!tu_calling(tu, hunt, ticket)) {
+        if(ticket == 0) tu_notify(tu);
+        if(target_locked) V(&target->mutex);
         V(&tu->mutex);
-        if(!target_is_null && !target_is_equal) V(&target->mutex);
+        return 2;
     }
-    else {
-        if(!target_is_null && !target_is_equal) V(&target->mutex);
+    if(!target_locked || target->state != TU_ON_HOOK) {
+        debug("tu_connect: ext %d is busy\n", target->ext);
+        if(hunt == NULL) {
+            tu->state = TU_BUSY_SIGNAL;
+            tu_notify(tu);
+        }
+        if(target_locked) V(&target->mutex);
         V(&tu->mutex);
-    }
+        return 1;
+    }
+    // Both TUs are now protected by the lock of a new call, which is held until the
+    // notifications have been queued so that no later transition can overtake them.
+    struct call *call = call_get();
+    metrics_lock(&call->mutex, METRIC_LOCK_TU);
+    atomic_store_explicit(&tu->lock, &call->mutex, memory_order_release);
+    atomic_store_explicit(&target->lock, &call->mutex, memory_order_release);
+    tu->call = target->call = call;
+    call->caller = tu;
+    call->cdr = (CDR){ .dial_ns = cdr_now(), .caller = tu->ext, .callee = target->ext };
+    tu_ref(tu, "tu_connect");
+    tu_ref(target, "tu_connect");
+    target->state = TU_RINGING;
+    tu->state = TU_RING_BACK;
+    tu->waiting = NULL;
+    tu->peer = target;
+    target->peer = tu;
+    metrics_add(METRIC_CALLS, 1);
+    metrics_add(METRIC_ACTIVE_CALLS, 1);
+    debug("tu_connect: Connecting ext %d to %d\n", tu->ext, target->ext);
+    V(&target->mutex);
+    V(&tu->mutex);
+    tu_notify(tu);
+    tu_notify(target);
+    V(&call->mutex);
     return 0;
 }
 
@@ -300,84 +443,37 @@ int tu_pickup(TU *tu) {
         debug("tu_pickup");
         return -1;
     }
-    char peer_is_null = 0;
-    P(&tu->mutex);
-    if(tu->peer == NULL) peer_is_null = 1;
-    if(peer_is_null && tu->state == TU_RINGING) {
-        debug("tu_pickup");
-        V(&tu->mutex);
-        return -1;
-    }
-    V(&tu->mutex);
-    char lock_peer_first = 0;
-    if(!peer_is_null && tu->peer < tu) lock_peer_first = 1;
-    if(lock_peer_first) {
-        if(!peer_is_null) P(&tu->peer->mutex);
-        P(&tu->mutex);
-    }
-    else {
-        P(&tu->mutex);
-        if(!peer_is_null) P(&tu->peer->mutex);
-    }
-    char peer_state_changed = 0;
+    sem_t *lock = tu_lock(tu);
     if(tu->state == TU_ON_HOOK) {
         tu->state = TU_DIAL_TONE;
+        tu_notify(tu);
     }
     else if(tu->state == TU_RINGING) {
         tu->state = TU_CONNECTED;
-        peer_state_changed = 1;
         tu->peer->state = TU_CONNECTED;
-    }
-    char *tu_buf = Malloc(strlen(tu_state_names[tu->state]) + 1);
-    strcpy(tu_buf, tu_state_names[tu->state]);
-    if(tu->state == TU_ON_HOOK || tu->state == TU_CONNECTED) {
-        char num[12];
-        if(tu->state == TU_ON_HOOK) sprintf(num, " %d", tu->fd);
-        else sprintf(num, " %d", tu->peer->fd);
-        tu_buf = Realloc(tu_buf, strlen(tu_buf) + strlen(num) + 1);
-        strcat(tu_buf, num);
-    }
-    tu_buf = Realloc(tu_buf, strlen(tu_buf) + 3);
-    strcat(tu_buf, EOL);
-    Write(tu->fd, tu_buf, strlen(tu_buf));
-    Free(tu_buf);
-    if(peer_state_changed) {
-        char *peer_buf = Malloc(strlen(tu_state_names[tu->peer->state]) + 1);
-        strcpy(peer_buf, tu_state_names[tu->peer->state]);
-        if(tu->peer->state == TU_ON_HOOK || tu->peer->state == TU_CONNECTED) {
-            char num[12];
-            if(tu->state == TU_ON_HOOK) sprintf(num, " %d", tu->peer->fd);
-            else sprintf(num, " %d", tu->fd);
-            peer_buf = Realloc(peer_buf, strlen(peer_buf) + strlen(num) + 1);
-            strcat(peer_buf, num);
-        }
-        peer_buf = Realloc(peer_buf, strlen(peer_buf) + 3);
-        strcat(peer_buf, EOL);
-        Write(tu->peer->fd, peer_buf, strlen(peer_buf));
-        Free(peer_buf);
-    }
-    if(tu->state == TU_ERROR) {
-        if(lock_peer_first) {
-            V(&tu->mutex);
-            if(!peer_is_null) V(&tu->peer->mutex);
-        }
-        else {
-            if(!peer_is_null) V(&tu->peer->mutex);
-            V(&tu->mutex);
-        }
-        return -1;
-    }
-    if(lock_peer_first) {
-        V(&tu->mutex);
-        if(!peer_is_null) V(&tu->peer->mutex);
+        tu->call->cdr.connect_ns = cdr_now();
+        tu_notify(tu);
+        tu_notify(tu->peer);
     }
     else {
-        if(!peer_is_null) V(&tu->peer->mutex);
-        V(&tu->mutex);
+        tu_notify(tu);
     }
+    V(lock);
     return 0;
 }
 
+/*
+ * Serve the queues that a TU answers, now that it is on hook: its own queue,
+ * if anybody has queued for it, and the hunt group it belongs to, if any.
+ * No TU locks may be held by the caller.
+ */
+static void tu_ready(TU *tu) {
+    HUNT *hunt = atomic_load_explicit(&tu->queue, memory_order_acquire);
+    if(hunt != NULL) hunt_serve(hunt);
+    hunt = atomic_load_explicit(&tu->group, memory_order_acquire);
+    if(hunt != NULL) hunt_serve(hunt);
+}
+
 /*
  * Hang up a TU (i.e. replace the handset on the switchhook).
  *
@@ -388,8 +484,10 @@ int tu_pickup(TU *tu) {
  *   If the TU was in the TU_RING_BACK state, then it goes to the TU_ON_HOOK state.
  *     In addition, in this case the calling TU (which is in the TU_RINGING state)
  *     simultaneously transitions to the TU_ON_HOOK state.
- *   If the TU was in the TU_DIAL_TONE, TU_BUSY_SIGNAL, or TU_ERROR state,
- *     then it goes to the TU_ON_HOOK state.
+ *   If the TU was in the TU_DIAL_TONE, TU_BUSY_SIGNAL, TU_ERROR or TU_QUEUED state,
+ *     then it goes to the TU_ON_HOOK state, leaving any queue it was waiting in.
+ *
+ * Queues for the TUs that end up on hook are then served (see hunt.h).
  *
  * In all cases, a notification of the resulting state of the specified TU is sent to
  * to the associated network client.  If a peer TU has changed state, then its client
@@ -405,131 +503,71 @@ int tu_hangup(TU *tu) {
         debug("tu_hangup");
         return -1;
     }
-    char peer_is_null = 0;
-    P(&tu->mutex);
-    if(tu->peer == NULL) peer_is_null = 1;
-    if(peer_is_null && (tu->state == TU_CONNECTED || tu->state == TU_RINGING || tu->state == TU_RING_BACK)) {
-        debug("tu_hangup");
-        V(&tu->mutex);
-        return -1;
-    }
-    V(&tu->mutex);
-    char lock_peer_first = 0;
-    if(!peer_is_null && tu->peer < tu) lock_peer_first = 1;
-    if(lock_peer_first) {
-        if(!peer_is_null) P(&tu->peer->mutex);
-        P(&tu->mutex);
-    }
-    else {
-        P(&tu->mutex);
-        if(!peer_is_null) P(&tu->peer->mutex);
+    sem_t *lock = tu_lock(tu);
+    debug("tu_hangup: Reference count is %d\n", atomic_load(&tu->ref_count));
+    if(tu->state == TU_CONFERENCE) {
+        // Leave the conference, going back to being protected by our own mutex.
+        CONF *conf = tu->conf;
+        conf_remove(conf, tu);
+        tu->conf = NULL;
+        tu->state = TU_ON_HOOK;
+        tu_notify(tu);
+        atomic_store_explicit(&tu->lock, &tu->mutex, memory_order_release);
+        metrics_add(METRIC_CONF_MEMBERS, -1);
+        V(lock);
+        conf_put(conf);
+        tu_ready(tu);
+        tu_unref(tu, "tu_hangup");
+        return 0;
     }
-    debug("tu_hangup: Reference count is %d\n", tu->ref_count);
-    char peer_state_changed = 0;
-    char set_to_null = 0;
+    HUNT *hunt = tu->waiting;
+    unsigned int ticket = tu->ticket;
+    TU *peer = tu->peer;
     if(tu->state == TU_CONNECTED || tu->state == TU_RINGING) {
         tu->state = TU_ON_HOOK;
-        peer_state_changed = 1;
-        tu->peer->state = TU_DIAL_TONE;
-        set_to_null = 1;
-        debug("Set to null\n");
+        peer->state = TU_DIAL_TONE;
     }
     else if(tu->state == TU_RING_BACK) {
         tu->state = TU_ON_HOOK;
-        peer_state_changed = 1;
-        tu->peer->state = TU_ON_HOOK;
-        set_to_null = 1;
-        debug("Set to null\n");
-    }
-    else if(tu->state == TU_DIAL_TONE || tu->state == TU_BUSY_SIGNAL || tu->state == TU_ERROR) {
-        tu->state = TU_ON_HOOK;
-    }
-    char *tu_buf = Malloc(strlen(tu_state_names[tu->state]) + 1);
-    strcpy(tu_buf, tu_state_names[tu->state]);
-    if(tu->state == TU_ON_HOOK || tu->state == TU_CONNECTED) {
-        char num[12];
-        if(tu->state == TU_ON_HOOK) sprintf(num, " %d", tu->fd);
-        else sprintf(num, " %d", tu->peer->fd);
-        tu_buf = Realloc(tu_buf, strlen(tu_buf) + strlen(num) + 1);
-        strcat(tu_buf, num);
-    }
-    tu_buf = Realloc(tu_buf, strlen(tu_buf) + 3);
-    strcat(tu_buf, EOL);
-    write(tu->fd, tu_buf, strlen(tu_buf));
-    Free(tu_buf);
-    if(peer_state_changed) {
-        if(peer_is_null) {
-            debug("tu_hangup");
-            V(&tu->mutex);
-            return -1;
-        }
-        char *peer_buf = Malloc(strlen(tu_state_names[tu->peer->state]) + 1);
-        strcpy(peer_buf, tu_state_names[tu->peer->state]);
-        if(tu->peer->state == TU_ON_HOOK || tu->peer->state == TU_CONNECTED) {
-            char num[12];
-            if(tu->peer->state == TU_ON_HOOK) sprintf(num, " %d", tu->peer->fd);
-            else sprintf(num, " %d", tu->fd);
-            peer_buf = Realloc(peer_buf, strlen(peer_buf) + strlen(num) + 1);
-            strcat(peer_buf, num);
-        }
-        peer_buf = Realloc(peer_buf, strlen(peer_buf) + 3);
-        strcat(peer_buf, EOL);
-        write(tu->peer->fd, peer_buf, strlen(peer_buf));
-        Free(peer_buf);
-    }
-    if(tu->state == TU_ERROR) {
-        if(lock_peer_first) {
-            V(&tu->mutex);
-            if(!peer_is_null) V(&tu->peer->mutex);
-        }
-        else {
-            if(!peer_is_null) V(&tu->peer->mutex);
-            V(&tu->mutex);
-        }
-        return -1;
+        peer->state = TU_ON_HOOK;
     }
-    if(set_to_null) {
-        if(lock_peer_first) {
-            V(&tu->mutex);
-            if(!peer_is_null) V(&tu->peer->mutex);
-        }
-        else {
-            if(!peer_is_null) V(&tu->peer->mutex);
-            V(&tu->mutex);
-        }
-        tu_unref(tu->peer, "tu_hangup");
-        tu_unref(tu, "tu_hangup");
-        if(lock_peer_first) {
-            if(!peer_is_null) P(&tu->peer->mutex);
-            P(&tu->mutex);
-        }
-        else {
-            P(&tu->mutex);
-            if(!peer_is_null) P(&tu->peer->mutex);
-        }
-        sem_t *mt = &tu->peer->mutex;
-        tu->peer->peer = NULL;
-        tu->peer = NULL;
-        debug("Finished setting to null\n");
-        if(lock_peer_first) {
-            V(&tu->mutex);
-            V(mt);
-        }
-        else {
-            V(mt);
-            V(&tu->mutex);
-        }
+    else {
+        peer = NULL;
+        if(tu->state == TU_DIAL_TONE || tu->state == TU_BUSY_SIGNAL || tu->state == TU_ERROR
+           || tu->state == TU_QUEUED)
+            tu->state = TU_ON_HOOK;
+    }
+    tu_notify(tu);
+    if(peer == NULL) {
+        tu->waiting = NULL;
+        V(lock);
+        if(hunt != NULL) hunt_cancel(hunt, tu, ticket);
+        tu_ready(tu);
         debug("End of tu_hangup\n");
         return 0;
     }
-    if(lock_peer_first) {
-        V(&tu->mutex);
-        if(!peer_is_null) V(&tu->peer->mutex);
-    }
-    else {
-        if(!peer_is_null) V(&tu->peer->mutex);
-        V(&tu->mutex);
-    }
+    tu_notify(peer);
+    // Tear down the call: each TU goes back to being protected by its own mutex.
+    // The peer references are dropped once the call lock has been released.
+    struct call *call = tu->call;
+    call->cdr.hangup_ns = cdr_now();
+    CDR cdr = call->cdr;
+    peer->peer = NULL;
+    tu->peer = NULL;
+    peer->call = tu->call = NULL;
+    // Once the peer's own mutex is published, another thread may change its
+    // state, so whether it is ready for the next call is decided before that.
+    int peer_ready = peer->state == TU_ON_HOOK;
+    atomic_store_explicit(&peer->lock, &peer->mutex, memory_order_release);
+    atomic_store_explicit(&tu->lock, &tu->mutex, memory_order_release);
+    metrics_add(METRIC_ACTIVE_CALLS, -1);
+    V(lock);
+    call_put(call);
+    cdr_log(&cdr);
+    tu_ready(tu);
+    if(peer_ready) tu_ready(peer);
+    tu_unref(peer, "tu_hangup");
+    tu_unref(tu, "tu_hangup");
     debug("End of tu_hangup\n");
     return 0;
 }
@@ -553,73 +591,246 @@ int tu_chat(TU *tu, char *msg) {
         debug("tu_chat");
         return -1;
     }
-    char peer_is_null = 0;
-    P(&tu->mutex);
-    if(tu->peer == NULL) peer_is_null = 1;
-    if(peer_is_null && tu->state == TU_CONNECTED) {
-        debug("tu_chat error");
-        V(&tu->mutex);
-        return -1;
-    }
-    V(&tu->mutex);
-    char lock_peer_first = 0;
-    if(!peer_is_null && tu->peer < tu) lock_peer_first = 1;
-    if(lock_peer_first) {
-        if(!peer_is_null) P(&tu->peer->mutex);
-        P(&tu->mutex);
-    }
-    else {
-        P(&tu->mutex);
-        if(!peer_is_null) P(&tu->peer->mutex);
+    sem_t *lock = tu_lock(tu);
+    tu_notify(tu);
+    if(tu->state == TU_CONFERENCE) {
+        conf_chat(tu->conf, tu, msg);
+        V(lock);
+        metrics_add(METRIC_CHATS, 1);
+        return 0;
     }
     if(tu->state != TU_CONNECTED) {
-        char *tu_buf = Malloc(strlen(tu_state_names[tu->state]) + 1);
-        strcpy(tu_buf, tu_state_names[tu->state]);
-        if(tu->state == TU_ON_HOOK) {
-            char num[12];
-            sprintf(num, " %d", tu->fd);
-            tu_buf = Realloc(tu_buf, strlen(tu_buf) + strlen(num) + 1);
-            strcat(tu_buf, num);
-        }
-        tu_buf = Realloc(tu_buf, strlen(tu_buf) + 3);
-        strcat(tu_buf, EOL);
-        Write(tu->fd, tu_buf, strlen(tu_buf));
-        Free(tu_buf);
-        if(lock_peer_first) {
-            V(&tu->mutex);
-            if(!peer_is_null) V(&tu->peer->mutex);
-        }
-        else {
-            if(!peer_is_null) V(&tu->peer->mutex);
-            V(&tu->mutex);
-        }
+        V(lock);
         return -1;
     }
-    char *tu_buf = Malloc(strlen(tu_state_names[tu->state]) + 1);
-    strcpy(tu_buf, tu_state_names[tu->state]);
-    char num[12];
-    sprintf(num, " %d", tu->peer->fd);
-    tu_buf = Realloc(tu_buf, strlen(tu_buf) + strlen(num) + 1);
-    strcat(tu_buf, num);
-    tu_buf = Realloc(tu_buf, strlen(tu_buf) + 3);
-    strcat(tu_buf, EOL);
-    Write(tu->fd, tu_buf, strlen(tu_buf));
-    Free(tu_buf);
-    char *msg_buf = Malloc(strlen("CHAT ") + 1);
-    strcpy(msg_buf, "CHAT ");
-    msg_buf = Realloc(msg_buf, strlen(msg_buf) + strlen(msg) + 1);
-    strcat(msg_buf, msg);
-    msg_buf = Realloc(msg_buf, strlen(msg_buf) + 3);
-    strcat(msg_buf, EOL);
-    Write(tu->peer->fd, msg_buf, strlen(msg_buf));
+    size_t len;
+    char *msg_buf = proto_chat(msg, tu->peer->binary, &len);
+    int dir = tu->call->caller == tu ? 0 : 1;
+    tu->call->cdr.chats[dir]++;
+    tu->call->cdr.chat_bytes[dir] += strlen(msg);
+    outq_put(tu->peer->outq, msg_buf, len, OUTQ_DROP);
+    V(lock);
     Free(msg_buf);
-    if(lock_peer_first) {
-        V(&tu->mutex);
-        if(!peer_is_null) V(&tu->peer->mutex);
+    metrics_add(METRIC_CHATS, 1);
+    return 0;
+}
+
+/*
+ * Join a conference room.
+ *   If the TU is not in the TU_DIAL_TONE state, then there is no effect.
+ *   Otherwise the TU becomes a member of the conference in the specified room,
+ *     opening the room if it has no other members, and transitions to the
+ *     TU_CONFERENCE state.  The conference holds a reference to the TU until
+ *     it hangs up.
+ *
+ * In all cases, a notification of the resulting state of the TU is sent to the
+ * associated network client.  Other members are not notified; they only see
+ * the chats of the new member.
+ *
+ * @param tu  The TU joining the conference.
+ * @param room  The number of the conference room.
+ * @return 0 if successful, -1 if the room number is invalid.
+ */
+int tu_conference(TU *tu, int room) {
+    if(tu == NULL) {
+        debug("tu_conference");
+        return -1;
     }
-    else {
-        if(!peer_is_null) V(&tu->peer->mutex);
-        V(&tu->mutex);
+    sem_t *lock = tu_lock(tu);
+    if(tu->state != TU_DIAL_TONE || room < 0) {
+        if(tu->state == TU_DIAL_TONE) tu->state = TU_ERROR;
+        tu_notify(tu);
+        int ret = tu->state == TU_ERROR ? -1 : 0;
+        V(lock);
+        return ret;
+    }
+    // A TU with dial tone is never in a call, so lock is its own mutex.
+    // It is always taken before the conference mutex, never after.
+    CONF *conf = conf_get(room);
+    metrics_lock(conf_mutex(conf), METRIC_LOCK_TU);
+    conf_add(conf, tu, tu->outq, tu->binary);
+    tu->conf = conf;
+    tu->state = TU_CONFERENCE;
+    tu_ref(tu, "tu_conference");
+    atomic_store_explicit(&tu->lock, conf_mutex(conf), memory_order_release);
+    metrics_add(METRIC_CONF_MEMBERS, 1);
+    debug("tu_conference: ext %d joins room %d (%d members)\n", tu->ext, room, conf_size(conf));
+    V(&tu->mutex);
+    tu_notify(tu);
+    V(conf_mutex(conf));
+    return 0;
+}
+
+/*
+ * Put a TU with dial tone into the TU_QUEUED state, to wait in a queue.
+ * Otherwise the client is notified of the unchanged state of the TU.
+ * The caller must hold the mutex of the queue.
+ *
+ * @param tu  The TU.
+ * @param hunt  The queue.
+ * @param number  The extension or group number reported to the client.
+ * @return the ticket identifying the wait, or 0 if the TU did not have dial tone.
+ */
+unsigned int tu_wait(TU *tu, HUNT *hunt, int number) {
+    sem_t *lock = tu_lock(tu);
+    if(tu->state != TU_DIAL_TONE) {
+        tu_notify(tu);
+        V(lock);
+        return 0;
     }
+    if(++tu->ticket == 0) ++tu->ticket;
+    unsigned int ticket = tu->ticket;
+    tu->state = TU_QUEUED;
+    tu->waiting = hunt;
+    tu->queued_for = number;
+    tu_notify(tu);
+    V(lock);
+    return ticket;
+}
+
+/*
+ * Give a TU that is still waiting in a queue a busy signal, because the
+ * extension it is waiting for has gone.
+ */
+void tu_cancel_wait(TU *tu, HUNT *hunt, unsigned int ticket) {
+    sem_t *lock = tu_lock(tu);
+    if(tu_calling(tu, hunt, ticket)) {
+        tu->state = TU_BUSY_SIGNAL;
+        tu->waiting = NULL;
+        tu_notify(tu);
+    }
+    V(lock);
+}
+
+/*
+ * Get the queue of callers waiting for a TU, creating it on first use.
+ *
+ * @param tu  The TU.
+ * @return the queue.
+ */
+HUNT *tu_queue(TU *tu) {
+    HUNT *hunt = atomic_load_explicit(&tu->queue, memory_order_acquire);
+    if(hunt != NULL) return hunt;
+    HUNT *created = hunt_init(tu);
+    if(atomic_compare_exchange_strong(&tu->queue, &hunt, created)) return created;
+    hunt_close(created);
+    hunt_fini(created);
+    return hunt;
+}
+
+/*
+ * Make a TU an agent of a hunt group, for as long as it stays registered.
+ * The client is notified of the state of the TU, which is unchanged unless
+ * a caller waiting for the group is put through to it.
+ *
+ * @param tu  The TU.
+ * @param group  The group number.
+ * @return 0 if successful, -1 if the group number is invalid or the TU
+ * is already an agent.
+ */
+int tu_agent(TU *tu, int group) {
+    if(tu == NULL) return -1;
+    HUNT *hunt = hunt_group(group), *none = NULL;
+    int ret = hunt != NULL && atomic_compare_exchange_strong(&tu->group, &none, hunt) ? 0 : -1;
+    sem_t *lock = tu_lock(tu);
+    tu_notify(tu);
+    V(lock);
+    if(ret == 0) hunt_join(hunt, tu);
+    return ret;
+}
+
+/*
+ * Withdraw a TU that is being unregistered from its hunt group, and give the
+ * callers waiting for it a busy signal.
+ */
+void tu_unplug(TU *tu) {
+    HUNT *hunt = atomic_exchange(&tu->group, NULL);
+    if(hunt != NULL) hunt_leave(hunt, tu);
+    hunt = atomic_load_explicit(&tu->queue, memory_order_acquire);
+    if(hunt != NULL) hunt_close(hunt);
+}
+
+/*
+ * Switch the network client of a TU to the binary framed protocol.
+ * The acknowledgement is the last text sent to the client; it is followed by
+ * a binary notification of the current state of the TU.
+ *
+ * The protocol cannot be changed while the TU is in a conference.
+ *
+ * @param tu  The TU.
+ * @return 0 if successful, -1 if the client already uses the binary protocol
+ * or the TU is in a conference.
+ */
+int tu_set_binary(TU *tu) {
+    if(tu == NULL) return -1;
+    sem_t *lock = tu_lock(tu);
+    if(tu->binary || tu->conf != NULL) {
+        V(lock);
+        return -1;
+    }
+    outq_put(tu->outq, PROTO_BINARY_ACK EOL, strlen(PROTO_BINARY_ACK EOL), 0);
+    tu->binary = 1;
+    tu_notify(tu);
+    V(lock);
     return 0;
 }
+
+/*
+ * Disconnect a TU from its network client, leaving it registered.  A TU that
+ * is in a conference leaves it first.  Until the TU is attached to another
+ * connection, output for it is discarded.
+ *
+ * @param tu  The TU.
+ * @return the outbound queue of the client, whose reference passes to the caller.
+ */
+OUTQ *tu_detach(TU *tu) {
+    if(tu == NULL) return NULL;
+    sem_t *lock = tu_lock(tu);
+    if(tu->state == TU_CONFERENCE) {
+        V(lock);
+        tu_hangup(tu);
+        lock = tu_lock(tu);
+    }
+    OUTQ *outq = tu->outq;
+    tu->outq = NULL;
+    tu->fd = -1;
+    V(lock);
+    return outq;
+}
+
+/*
+ * Attach a TU that has been disconnected to a new network client, which starts
+ * out using the text protocol.  The client is notified of the TU's current state.
+ *
+ * @param tu  The TU.
+ * @param fd  The file descriptor of the new connection.
+ * @param outq  The outbound queue of the new connection, whose reference passes to the TU.
+ */
+void tu_attach(TU *tu, int fd, OUTQ *outq) {
+    sem_t *lock = tu_lock(tu);
+    OUTQ *old = tu->outq;
+    tu->fd = fd;
+    tu->outq = outq;
+    tu->binary = 0;
+    tu_notify(tu);
+    V(lock);
+    outq_release(old);
+}
+
+/*
+ * Send a line of text, other than a state notification, to the client of a TU.
+ *
+ * @param tu  The TU.
+ * @param line  The text, to which the line terminator is added.
+ * @return 0 if the line was sent or queued, otherwise -1.
+ */
+int tu_send(TU *tu, const char *line) {
+    if(tu == NULL) return -1;
+    char *buf = Malloc(strlen(line) + strlen(EOL) + 1);
+    int len = sprintf(buf, "%s%s", line, EOL);
+    sem_t *lock = tu_lock(tu);
+    int ret = outq_put(tu->outq, buf, len, 0);
+    V(lock);
+    Free(buf);
+    return ret;
+}
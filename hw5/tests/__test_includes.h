@@ -26,6 +26,24 @@
 #define SERVER_STARTUP_SLEEP 1
 #define SERVER_SHUTDOWN_SLEEP 1
 
+/*
+ * Meta-commands for features of the server beyond the basic TU commands,
+ * which drive a TU by the messages themselves instead of by its state.
+ * Once a TU has used one of these, its state is no longer tracked, and on
+ * TU_DISCONNECT_CMD any messages are drained until EOF.
+ *
+ * In the text of a TU_SEND_CMD step, "%e" stands for the extension of the TU
+ * given by id_to_dial, and "%w" for the word saved from the last message
+ * that TU expected; with id_to_dial -1 it is the TU itself.  Once the server
+ * has acknowledged the binary protocol, each line of the text is sent as the
+ * equivalent command frame, and frames received are expected in text form.
+ */
+#define TU_SEND_CMD    106  // Send the text as it is, without adding EOL
+#define TU_EXPECT_CMD  107  // The next message must begin with the text;
+                            // the word that follows the text is saved
+#define TU_SKIP_CMD    108  // Messages that begin with the text are discarded;
+                            // the first that does not is kept for the next step
+
 /*
  * Structure describing a single step in a test script.
  */
@@ -36,6 +54,8 @@ typedef struct test_step {
     TU_STATE response;		   // Expected response.
     struct timeval timeout;        // Limit on time to wait for response (zero for no limit)
                                    // or time to delay.
+    char *text;                    // Text sent or expected, for TU_SEND_CMD and TU_EXPECT_CMD.
 } TEST_STEP;
 
 int run_test_script(char *name, TEST_STEP *scr, int port);
+int script_extension(int id);
@@ -50,12 +50,12 @@ static void wait_for_no_server() {
     } while(1);
 }
 
-static void init() {
+static void start_server(char *const argv[]) {
     server_pid = 0;
     wait_for_no_server();
     fprintf(stderr, "***Starting server...");
     if((server_pid = fork()) == 0) {
-	execlp("bin/pbx", "pbx", "-p", SERVER_PORT_STR, NULL);
+	execvp("bin/pbx", argv);
 	fprintf(stderr, "Failed to exec server\n");
 	abort();
     }
@@ -64,6 +64,11 @@ static void init() {
     wait_for_server();
 }
 
+static void init() {
+    static char *const argv[] = { "pbx", "-p", SERVER_PORT_STR, NULL };
+    start_server(argv);
+}
+
 static void fini(int chk) {
     int ret;
     cr_assert(server_pid != 0, "No server was started!\n");
@@ -80,6 +85,34 @@ static void fini(int chk) {
     }
 }
 
+/*
+ * Send SIGHUP to the server and wait up to a specified number of milliseconds
+ * for it to exit, after which it is killed.
+ * Returns the number of milliseconds the server took to exit, or -1 if it had
+ * to be killed, and sets *statusp to its wait status.
+ */
+static long stop_server(long limit_ms, int *statusp) {
+    struct timespec start, now, tick = { 0, 10000000 };
+    cr_assert(server_pid != 0, "No server was started!\n");
+    fprintf(stderr, "***Sending SIGHUP to server pid %d\n", server_pid);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    kill(server_pid, SIGHUP);
+    while(1) {
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long ms = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+	if(waitpid(server_pid, statusp, WNOHANG) == server_pid) {
+	    fprintf(stderr, "***Server exited after %ld ms, status 0x%x\n", ms, *statusp);
+	    return ms;
+	}
+	if(ms > limit_ms) {
+	    kill(server_pid, SIGKILL);
+	    waitpid(server_pid, statusp, 0);
+	    return -1;
+	}
+	nanosleep(&tick, NULL);
+    }
+}
+
 static void killall() {
     system("killall -s KILL pbx /usr/lib/valgrind/memcheck-amd64-linux > /dev/null 2>&1");
 }
@@ -183,3 +216,810 @@ Test(SUITE, TEST_NAME, .init = init, .fini = killall, .timeout = 30) {
     fini(0);
 }
 #undef TEST_NAME
+
+#define TEST_NAME shutdown_stalled_client_test
+/*
+ * TU 1 stops reading while TU 0 chats to it, so that its output backs up,
+ * and TU 2 sends half a command.  Shutdown must still take bounded time.
+ * The chats are not rate limited, so that they are all carried out at once,
+ * more than the socket buffers can hold.
+ */
+#define SHUTDOWN_LIMIT_MS 1000
+#define STALL_CHATS 8000
+#define STALL_CHAT_LEN 1000
+static char stall_flood[STALL_CHATS * STALL_CHAT_LEN + 1];
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT,   TEXT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   2,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   0,  TU_DIAL_CMD,        1,           TU_RING_BACK,   TEN_MSEC },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_CONNECTED,   FTY_MSEC },
+    {   0,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  stall_flood },
+    {   2,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "pick" },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+static void init_unlimited() {
+    static char *const argv[] = { "pbx", "-p", SERVER_PORT_STR, "-l", "0", NULL };
+    start_server(argv);
+}
+
+Test(SUITE, TEST_NAME, .init = init_unlimited, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    for(int i = 0; i < STALL_CHATS; i++) {
+	char *line = stall_flood + i * STALL_CHAT_LEN;
+	memset(line, 'x', STALL_CHAT_LEN);
+	memcpy(line, "chat ", 5);
+	memcpy(line + STALL_CHAT_LEN - 2, EOL, 2);
+    }
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    int status;
+    long ms = stop_server(SHUTDOWN_LIMIT_MS, &status);
+    cr_assert(ms >= 0, "Server did not exit within %d ms\n", SHUTDOWN_LIMIT_MS);
+    cr_assert(WIFEXITED(status), "Server terminated ungracefully\n");
+    cr_assert_eq(WEXITSTATUS(status), 0, "Server exit status was not 0");
+}
+#undef TEST_NAME
+
+#define TEST_NAME conference_test
+/*
+ * Three TUs join a conference room.  A chat from one member reaches the
+ * other two, and once a member has hung up it no longer receives chats:
+ * the next message it gets is the dial tone it asks for.
+ */
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT,   TEXT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   2,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "pickup" EOL },
+    {   0,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "DIAL TONE" },
+    {   0,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "conf 5" EOL },
+    {   0,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "CONFERENCE 5" },
+    {   1,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "pickup" EOL },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "DIAL TONE" },
+    {   1,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "conf 5" EOL },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "CONFERENCE 5" },
+    {   2,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "pickup" EOL },
+    {   2,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "DIAL TONE" },
+    {   2,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "conf 5" EOL },
+    {   2,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "CONFERENCE 5" },
+    {   0,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "chat hello all" EOL },
+    {   0,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "CONFERENCE 5" },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             FTY_MSEC,  "CHAT hello all" },
+    {   2,  TU_EXPECT_CMD,     -1,           -1,             FTY_MSEC,  "CHAT hello all" },
+    {   1,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "hangup" EOL },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "ON HOOK" },
+    {   2,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "chat after leave" EOL },
+    {   2,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "CONFERENCE 5" },
+    {   0,  TU_EXPECT_CMD,     -1,           -1,             FTY_MSEC,  "CHAT after leave" },
+    {   1,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "pickup" EOL },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "DIAL TONE" },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             HND_MSEC },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             HND_MSEC },
+    {   2,  TU_DISCONNECT_CMD, -1,           -1,             HND_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(0);
+}
+#undef TEST_NAME
+
+#define TEST_NAME binary_protocol_test
+/*
+ * TU 0 switches to the binary protocol and calls TU 1, which stays with the
+ * text protocol.  Commands, state notifications and chats in both directions
+ * are carried between the two protocols.
+ */
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT,   TEXT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "binary" EOL },
+    {   0,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "BINARY" },
+    {   0,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "ON HOOK" },
+    {   0,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "pickup" EOL },
+    {   0,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "DIAL TONE" },
+    {   0,  TU_SEND_CMD,        1,           -1,             ZERO_SEC,  "dial %e" EOL },
+    {   0,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "RING BACK" },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "RINGING" },
+    {   1,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "pickup" EOL },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "CONNECTED" },
+    {   0,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "CONNECTED" },
+    {   0,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "chat from binary" EOL },
+    {   0,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "CONNECTED" },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "CHAT from binary" },
+    {   1,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "chat from text" EOL },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "CONNECTED" },
+    {   0,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "CHAT from text" },
+    {   0,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "hangup" EOL },
+    {   0,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "ON HOOK" },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "DIAL TONE" },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             HND_MSEC },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             HND_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(0);
+}
+#undef TEST_NAME
+
+#define TEST_NAME throttle_isolation_test
+/*
+ * TU 0 floods the server with far more commands than its rate limit allows,
+ * while the server has a single worker thread.  TUs 1 and 2 must still be
+ * able to register and set up a call without waiting for TU 0's backlog.
+ */
+#define FLOOD_PAIRS 400
+#define FLOOD_PAIR "pickup" EOL "hangup" EOL
+static char throttle_flood[FLOOD_PAIRS * (sizeof(FLOOD_PAIR) - 1) + 1];
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT,   TEXT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  throttle_flood },
+    {   0,  TU_DELAY_CMD,      -1,           -1,             HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   2,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   FTY_MSEC },
+    {   1,  TU_DIAL_CMD,        2,           TU_RING_BACK,   FTY_MSEC },
+    {   2,  TU_PICKUP_CMD,     -1,           TU_CONNECTED,   FTY_MSEC },
+    {   1,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   2,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             FTY_MSEC },
+    {   2,  TU_DISCONNECT_CMD, -1,           -1,             FTY_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+static void init_throttled() {
+    static char *const argv[] = { "pbx", "-p", SERVER_PORT_STR, "-t", "1",
+				  "-l", "20", "-b", "10", NULL };
+    start_server(argv);
+}
+
+Test(SUITE, TEST_NAME, .init = init_throttled, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    for(int i = 0; i < FLOOD_PAIRS; i++)
+	memcpy(throttle_flood + i * (sizeof(FLOOD_PAIR) - 1), FLOOD_PAIR, sizeof(FLOOD_PAIR) - 1);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(0);
+}
+#undef TEST_NAME
+
+#define TEST_NAME session_resume_test
+/*
+ * TU 0 calls TU 1, opens a session and loses its connection.  A new connection,
+ * made as soon as the old one is seen to close, resumes the session with its
+ * token and finds the call still up, so that chat flows to TU 1 again.  The
+ * token cannot be used while the session is connected, and an unknown token
+ * is refused.
+ */
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT,   TEXT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "pickup" EOL },
+    {   0,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "DIAL TONE" },
+    {   0,  TU_SEND_CMD,        1,           -1,             ZERO_SEC,  "dial %e" EOL },
+    {   0,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "RING BACK" },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "RINGING" },
+    {   1,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "pickup" EOL },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "CONNECTED" },
+    {   0,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "CONNECTED" },
+    {   0,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "session" EOL },
+    {   0,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "SESSION" },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             HND_MSEC },
+    {   2,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   2,  TU_SEND_CMD,        0,           -1,             ZERO_SEC,  "resume %w" EOL },
+    {   2,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "CONNECTED" },
+    {   2,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "chat resumed" EOL },
+    {   2,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "CONNECTED" },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "CHAT resumed" },
+    {   3,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   3,  TU_SEND_CMD,        0,           -1,             ZERO_SEC,  "resume %w" EOL },
+    {   3,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "SESSION EXPIRED" },
+    {   3,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "resume 0123456789abcdef" EOL },
+    {   3,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "SESSION EXPIRED" },
+    {   2,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "hangup" EOL },
+    {   2,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "ON HOOK" },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "DIAL TONE" },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             HND_MSEC },
+    {   2,  TU_DISCONNECT_CMD, -1,           -1,             HND_MSEC },
+    {   3,  TU_DISCONNECT_CMD, -1,           -1,             HND_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(0);
+}
+#undef TEST_NAME
+
+#define TEST_NAME capture_replay_test
+/*
+ * A call is made with capture enabled.  The capture must record the
+ * connections and commands in order, and util/replay must replay it,
+ * in the captured order and in a pseudo-random interleaving.
+ */
+#define CAPTURE_FILE "/tmp/pbx_capture_test.txt"
+static char *capture_events[] = {
+    "0 connect", "1 connect", "0 pickup", "0 dial", "1 pickup", "0 chat",
+    "0 hangup", "1 disconnect", "0 disconnect", NULL
+};
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   0,  TU_DIAL_CMD,        1,           TU_RING_BACK,   TEN_MSEC },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_CONNECTED,   FTY_MSEC },
+    {   0,  TU_CHAT_CMD,       -1,           TU_CONNECTED,   FTY_MSEC },
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             TEN_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+static void init_capture() {
+    static char *const argv[] = { "pbx", "-p", SERVER_PORT_STR, "-r", CAPTURE_FILE, NULL };
+    unlink(CAPTURE_FILE);
+    start_server(argv);
+}
+
+/*
+ * Run util/replay on the capture, with the specified options, and get the
+ * number of events it read and of the chats and state transitions it caused.
+ * Returns the wait status of util/replay.
+ */
+static int run_replay(char *options, int *events, int *transitions, int *chats) {
+    char cmd[256], line[256];
+    snprintf(cmd, sizeof(cmd), "util/replay %s %s", options, CAPTURE_FILE);
+    fprintf(stderr, "***Running %s\n", cmd);
+    FILE *out = popen(cmd, "r");
+    cr_assert_not_null(out, "Failed to run util/replay\n");
+    *events = *transitions = *chats = -1;
+    while(fgets(line, sizeof(line), out) != NULL) {
+	fprintf(stderr, "%s", line);
+	sscanf(line, "capture events=%d", events);
+	sscanf(line, "totals transitions=%d notifications=%*d chats=%d", transitions, chats);
+    }
+    return pclose(out);
+}
+
+Test(SUITE, TEST_NAME, .init = init_capture, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(1);
+
+    // Each event follows the time at which it was captured.
+    FILE *capture = fopen(CAPTURE_FILE, "r");
+    cr_assert_not_null(capture, "No capture file was written\n");
+    char line[256];
+    char **event = capture_events;
+    while(*event != NULL && fgets(line, sizeof(line), capture) != NULL) {
+	char *ep = strchr(line, ' ');
+	cr_assert(ep != NULL && strncmp(ep + 1, *event, strlen(*event)) == 0,
+		  "Captured \"%s\" where \"%s\" was expected\n", line, *event);
+	event++;
+    }
+    fclose(capture);
+    cr_assert_null(*event, "Event \"%s\" was not captured\n", *event);
+
+    cr_assert_eq(access("util/replay", X_OK), 0, "util/replay has not been built\n");
+    int events, transitions, chats;
+    int status = run_replay("", &events, &transitions, &chats);
+    cr_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0, "util/replay failed\n");
+    cr_assert_eq(events, 9, "Replay read %d events, expected 9\n", events);
+    cr_assert_eq(chats, 1, "Replay delivered %d chats, expected 1\n", chats);
+    cr_assert_gt(transitions, 0, "Replay caused no state transitions\n");
+    status = run_replay("-S 7 -i 20", &events, &transitions, &chats);
+    cr_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0, "util/replay -S failed\n");
+    cr_assert_eq(events, 9, "Replay read %d events, expected 9\n", events);
+}
+#undef TEST_NAME
+
+#define TEST_NAME hunt_queue_test
+/*
+ * TUs 0 and 1 are the agents of hunt group 3.  Calls to the group go to each
+ * agent in turn, and a third caller is queued until an agent is back on hook.
+ * TU 5 queues for TU 1's extension itself, and is put through when TU 1 hangs up.
+ */
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT,   TEXT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   2,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   3,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   4,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   5,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "agent 3" EOL },
+    {   0,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "ON HOOK" },
+    {   1,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "agent 3" EOL },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "ON HOOK" },
+    {   2,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "pickup" EOL "hunt 3" EOL },
+    {   2,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "DIAL TONE" },
+    {   2,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "RING BACK" },
+    {   0,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "RINGING" },
+    {   3,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "pickup" EOL "hunt 3" EOL },
+    {   3,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "DIAL TONE" },
+    {   3,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "RING BACK" },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "RINGING" },
+    {   4,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "pickup" EOL "hunt 3" EOL },
+    {   4,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "DIAL TONE" },
+    {   4,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "QUEUED 3" },
+    {   0,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "pickup" EOL },
+    {   0,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "CONNECTED" },
+    {   2,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "CONNECTED" },
+    {   1,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "pickup" EOL },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "CONNECTED" },
+    {   3,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "CONNECTED" },
+    {   5,  TU_SEND_CMD,        1,           -1,             ZERO_SEC,  "pickup" EOL "queue %e" EOL },
+    {   5,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "DIAL TONE" },
+    {   5,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "QUEUED" },
+    {   2,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "hangup" EOL },
+    {   2,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "ON HOOK" },
+    {   0,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "DIAL TONE" },
+    {   0,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "hangup" EOL },
+    {   0,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "ON HOOK" },
+    {   0,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "RINGING" },
+    {   4,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "RING BACK" },
+    {   3,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "hangup" EOL },
+    {   3,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "ON HOOK" },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "DIAL TONE" },
+    {   1,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "hangup" EOL },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "ON HOOK" },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "RINGING" },
+    {   5,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "RING BACK" },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             HND_MSEC },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             HND_MSEC },
+    {   2,  TU_DISCONNECT_CMD, -1,           -1,             HND_MSEC },
+    {   3,  TU_DISCONNECT_CMD, -1,           -1,             HND_MSEC },
+    {   4,  TU_DISCONNECT_CMD, -1,           -1,             HND_MSEC },
+    {   5,  TU_DISCONNECT_CMD, -1,           -1,             HND_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(0);
+}
+#undef TEST_NAME
+
+#define TEST_NAME outq_cut_test
+/*
+ * TUs 0 and 1 are in a conference, and TU 1 stops reading while TU 0 chats,
+ * so that more than OUTQ_MAX_BYTES of chat backs up for it.  The chats that
+ * do not fit are dropped, but once TU 1 is owed a state notification that
+ * does not fit either, it is disconnected.  TU 0 keeps getting its own
+ * notifications throughout, and the conference goes on without TU 1.
+ */
+#define CUT_CHATS 2000
+#define CUT_CHAT_LEN 5000
+#define CUT_PICKUPS 2000
+static char cut_flood[CUT_CHATS * CUT_CHAT_LEN + 1];
+static char cut_pickups[CUT_PICKUPS * (sizeof("pickup" EOL) - 1) + 1];
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT,   TEXT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "pickup" EOL "conf 5" EOL },
+    {   0,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "DIAL TONE" },
+    {   0,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "CONFERENCE 5" },
+    {   1,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "pickup" EOL "conf 5" EOL },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "DIAL TONE" },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "CONFERENCE 5" },
+    {   0,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  cut_flood },
+    {   0,  TU_DELAY_CMD,      -1,           -1,             QTR_SEC },
+    {   1,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  cut_pickups },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             ONE_SEC,   NULL },
+    {   0,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "hangup" EOL },
+    {   0,  TU_SKIP_CMD,       -1,           -1,             ONE_SEC,   "CONFERENCE 5" },
+    {   0,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "ON HOOK" },
+    {   2,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   2,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "pickup" EOL "conf 5" EOL },
+    {   2,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "DIAL TONE" },
+    {   2,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "CONFERENCE 5" },
+    {   0,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "pickup" EOL "conf 5" EOL },
+    {   0,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "DIAL TONE" },
+    {   0,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "CONFERENCE 5" },
+    {   0,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "chat after cut" EOL },
+    {   0,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "CONFERENCE 5" },
+    {   2,  TU_EXPECT_CMD,     -1,           -1,             FTY_MSEC,  "CHAT after cut" },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             HND_MSEC },
+    {   2,  TU_DISCONNECT_CMD, -1,           -1,             HND_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init_unlimited, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    for(int i = 0; i < CUT_CHATS; i++) {
+	char *line = cut_flood + i * CUT_CHAT_LEN;
+	memset(line, 'x', CUT_CHAT_LEN);
+	memcpy(line, "chat ", 5);
+	memcpy(line + CUT_CHAT_LEN - 2, EOL, 2);
+    }
+    for(int i = 0; i < CUT_PICKUPS; i++)
+	memcpy(cut_pickups + i * (sizeof("pickup" EOL) - 1), "pickup" EOL, sizeof("pickup" EOL) - 1);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(0);
+}
+#undef TEST_NAME
+
+#define TEST_NAME metrics_test
+/*
+ * After a call with two chats, the admin port must give the metrics in
+ * Prometheus text format, counting the call, the chats and the commands.
+ */
+#define ADMIN_PORT_STR "9998"
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT,   TEXT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   0,  TU_DIAL_CMD,        1,           TU_RING_BACK,   TEN_MSEC },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_CONNECTED,   FTY_MSEC },
+    {   0,  TU_CHAT_CMD,       -1,           TU_CONNECTED,   FTY_MSEC },
+    {   1,  TU_CHAT_CMD,       -1,           TU_CONNECTED,   FTY_MSEC },
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+static void init_admin() {
+    static char *const argv[] = { "pbx", "-p", SERVER_PORT_STR, "-a", ADMIN_PORT_STR, NULL };
+    start_server(argv);
+}
+
+/*
+ * Read everything that the admin port sends, into a string to be freed
+ * by the caller.
+ */
+static char *read_admin(void) {
+    struct addrinfo hints = {0}, *list;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    cr_assert_eq(getaddrinfo("localhost", ADMIN_PORT_STR, &hints, &list), 0,
+		 "Failed to look up the admin port\n");
+    int fd = socket(list->ai_family, list->ai_socktype, list->ai_protocol);
+    cr_assert(fd >= 0 && connect(fd, list->ai_addr, list->ai_addrlen) == 0,
+	      "Failed to connect to the admin port\n");
+    freeaddrinfo(list);
+    char *text;
+    size_t len;
+    FILE *mem = open_memstream(&text, &len);
+    char buf[4096];
+    ssize_t n;
+    while((n = read(fd, buf, sizeof(buf))) > 0)
+	fwrite(buf, 1, n, mem);
+    fclose(mem);
+    close(fd);
+    return text;
+}
+
+/*
+ * Get the value of a metric, given the text of its line up to the value.
+ */
+static double metric_value(char *text, char *metric) {
+    char *line = text;
+    size_t len = strlen(metric);
+    while(line != NULL && *line != '\0') {
+	if(!strncmp(line, metric, len) && line[len] == ' ')
+	    return atof(line + len + 1);
+	line = strchr(line, '\n');
+	if(line != NULL)
+	    line++;
+    }
+    cr_assert_fail("Metric %s was not reported\n", metric);
+    return -1;
+}
+
+Test(SUITE, TEST_NAME, .init = init_admin, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+
+    char *text = read_admin();
+    fprintf(stderr, "%s", text);
+    // Every line is a metric name, with any labels, and a value.
+    for(char *line = text; *line != '\0'; ) {
+	char *eol = strchr(line, '\n');
+	cr_assert_not_null(eol, "Unterminated line in metrics\n");
+	char *sp = memchr(line, ' ', eol - line);
+	cr_assert(sp != NULL && sp > line && strncmp(line, "pbx_", 4) == 0,
+		  "Malformed metrics line: %.*s\n", (int)(eol - line), line);
+	char *end;
+	strtod(sp + 1, &end);
+	cr_assert_eq(end, eol, "Malformed value: %.*s\n", (int)(eol - line), line);
+	line = eol + 1;
+    }
+    cr_assert_eq(metric_value(text, "pbx_registered_tus"), 2, "Wrong number of registered TUs\n");
+    cr_assert_eq(metric_value(text, "pbx_calls_total"), 1, "Wrong number of calls\n");
+    cr_assert_eq(metric_value(text, "pbx_active_calls"), 0, "Wrong number of active calls\n");
+    cr_assert_eq(metric_value(text, "pbx_chats_total"), 2, "Wrong number of chats\n");
+    cr_assert_eq(metric_value(text, "pbx_command_latency_us_count{cmd=\"pickup\"}"), 2,
+		 "Wrong number of pickup commands\n");
+    cr_assert_eq(metric_value(text, "pbx_command_latency_us_count{cmd=\"dial\"}"), 1,
+		 "Wrong number of dial commands\n");
+    cr_assert_eq(metric_value(text, "pbx_command_latency_us_count{cmd=\"chat\"}"), 2,
+		 "Wrong number of chat commands\n");
+    cr_assert_eq(metric_value(text, "pbx_command_latency_us_bucket{cmd=\"dial\",le=\"+Inf\"}"), 1,
+		 "Wrong count in the last latency bucket\n");
+    cr_assert_gt(metric_value(text, "pbx_bytes_in_total"), 0, "No input was counted\n");
+    cr_assert_gt(metric_value(text, "pbx_bytes_out_total"), 0, "No output was counted\n");
+    free(text);
+    fini(1);
+}
+#undef TEST_NAME
+
+#define TEST_NAME cdr_test
+/*
+ * With -c, one CDR line must be written for each completed call, giving
+ * the parties and the chats in each direction.  The first call is answered
+ * and has chats both ways; the second is hung up while still ringing.
+ */
+#define CDR_FILE "/tmp/pbx_cdr_test.csv"
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT,   TEXT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+    {   0,  TU_DIAL_CMD,        1,           TU_RING_BACK,   TEN_MSEC },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_CONNECTED,   FTY_MSEC },
+    {   0,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "chat hello" EOL "chat again" EOL },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "CHAT hello" },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "CHAT again" },
+    {   1,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "chat hi" EOL },
+    {   0,  TU_SKIP_CMD,       -1,           -1,             TEN_MSEC,  "CONNECTED" },
+    {   0,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "CHAT hi" },
+    {   0,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "hangup" EOL },
+    {   0,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "ON HOOK" },
+    {   1,  TU_SKIP_CMD,       -1,           -1,             TEN_MSEC,  "CONNECTED" },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "DIAL TONE" },
+    {   1,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "hangup" EOL "pickup" EOL },
+    {   1,  TU_SEND_CMD,        0,           -1,             ZERO_SEC,  "dial %e" EOL "hangup" EOL },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "ON HOOK" },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "DIAL TONE" },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "RING BACK" },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "ON HOOK" },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+static void init_cdr() {
+    static char *const argv[] = { "pbx", "-p", SERVER_PORT_STR, "-c", CDR_FILE, NULL };
+    unlink(CDR_FILE);
+    start_server(argv);
+}
+
+Test(SUITE, TEST_NAME, .init = init_cdr, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    int ext0 = script_extension(0), ext1 = script_extension(1);
+    fini(1);
+
+    FILE *cdr = fopen(CDR_FILE, "r");
+    cr_assert_not_null(cdr, "No CDR file was written\n");
+    char line[256];
+    cr_assert_not_null(fgets(line, sizeof(line), cdr), "The CDR file is empty\n");
+    cr_assert_str_eq(line, "dial_ns,connect_ns,hangup_ns,caller,callee,"
+		     "caller_chats,caller_chat_bytes,callee_chats,callee_chat_bytes\n",
+		     "Wrong CDR header: %s\n", line);
+
+    long long dial, conn, hangup;
+    int caller, callee;
+    unsigned chats0, chats1;
+    unsigned long long bytes0, bytes1;
+    cr_assert_not_null(fgets(line, sizeof(line), cdr), "No CDR for the answered call\n");
+    cr_assert_eq(sscanf(line, "%lld,%lld,%lld,%d,%d,%u,%llu,%u,%llu\n", &dial, &conn, &hangup,
+			&caller, &callee, &chats0, &bytes0, &chats1, &bytes1), 9,
+		 "Malformed CDR: %s\n", line);
+    cr_assert(caller == ext0 && callee == ext1, "Wrong parties in CDR: %s\n", line);
+    cr_assert(dial > 0 && dial <= conn && conn <= hangup, "Wrong times in CDR: %s\n", line);
+    cr_assert(chats0 == 2 && bytes0 == 10, "Wrong caller chats in CDR: %s\n", line);
+    cr_assert(chats1 == 1 && bytes1 == 2, "Wrong callee chats in CDR: %s\n", line);
+
+    cr_assert_not_null(fgets(line, sizeof(line), cdr), "No CDR for the unanswered call\n");
+    cr_assert_eq(sscanf(line, "%lld,%lld,%lld,%d,%d,%u,%llu,%u,%llu\n", &dial, &conn, &hangup,
+			&caller, &callee, &chats0, &bytes0, &chats1, &bytes1), 9,
+		 "Malformed CDR: %s\n", line);
+    cr_assert(caller == ext1 && callee == ext0, "Wrong parties in CDR: %s\n", line);
+    cr_assert(dial > 0 && conn == 0 && dial <= hangup, "Wrong times in CDR: %s\n", line);
+    cr_assert(chats0 == 0 && chats1 == 0, "Wrong chats in CDR: %s\n", line);
+
+    cr_assert_null(fgets(line, sizeof(line), cdr), "Extra CDR: %s\n", line);
+    fclose(cdr);
+}
+#undef TEST_NAME
+
+#define TEST_NAME ext_test
+/*
+ * TUs 0, 1 and 2 get extensions 1, 2 and 3 on connecting.  TU 0 moves to the
+ * free extension 100, after which TU 1 is refused it, as well as extensions
+ * that are out of range, but may take extension 1 that TU 0 left free.
+ * TU 2 then calls TU 0 at its new extension, and may not move while off hook.
+ */
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT,   TEXT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   2,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "ext 100" EOL },
+    {   0,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "ON HOOK 100" },
+    {   1,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "ext 100" EOL },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "ON HOOK 2" },
+    {   1,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "ext 0" EOL },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "ON HOOK 2" },
+    {   1,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "ext -7" EOL },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "ON HOOK 2" },
+    {   1,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "ext seven" EOL },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "ON HOOK 2" },
+    // PBX_EXTENSION_LIMIT
+    {   1,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "ext 1048576" EOL },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "ON HOOK 2" },
+    {   1,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "ext 1048575" EOL },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "ON HOOK 1048575" },
+    {   1,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "ext 1" EOL },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "ON HOOK 1" },
+    {   2,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "pickup" EOL "dial 2" EOL },
+    {   2,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "DIAL TONE" },
+    {   2,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "ERROR" },
+    {   2,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "hangup" EOL "pickup" EOL "dial 100" EOL },
+    {   2,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "ON HOOK 3" },
+    {   2,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "DIAL TONE" },
+    {   2,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "RING BACK" },
+    {   0,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "RINGING" },
+    {   2,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "ext 200" EOL },
+    {   2,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "RING BACK" },
+    {   2,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "hangup" EOL },
+    {   2,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "ON HOOK 3" },
+    {   0,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "ON HOOK 100" },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(1);
+}
+#undef TEST_NAME
+
+#define TEST_NAME extension_reuse_test
+/*
+ * With a single shard, TU 1 is reconnected over and over while TU 0 keeps
+ * extension 1.  Each time it gets the extension that has been free the
+ * longest, so that its old extension only comes round again once the rest of
+ * the shard has been used.  More TUs are then connected until the shard has
+ * to grow, and a TU at one of the new extensions calls TU 0.
+ */
+#define REUSE_TUS 17
+static void init_one_shard() {
+    static char *const argv[] = { "pbx", "-p", SERVER_PORT_STR, "-s", "1", NULL };
+    start_server(argv);
+}
+
+Test(SUITE, TEST_NAME, .init = init_one_shard, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    TEST_STEP script[REUSE_TUS + 1] = {
+	{   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+	{   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+	{   -1, -1,                -1,           -1,             ZERO_SEC }
+    };
+    int ret = run_test_script(name, script, SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    cr_assert(script_extension(0) == 1 && script_extension(1) == 2,
+	      "Wrong initial extensions %d and %d\n", script_extension(0), script_extension(1));
+
+    // The shard starts with 16 slots, and extension 0 is never used.
+    int expected[] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 2, 3 };
+    for(int n = 0; n < sizeof(expected) / sizeof(expected[0]); n++) {
+	TEST_STEP reconnect[] = {
+	    {   1,  TU_DISCONNECT_CMD, -1,           -1,             HND_MSEC },
+	    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+	    {   -1, -1,                -1,           -1,             ZERO_SEC }
+	};
+	ret = run_test_script(name, reconnect, SERVER_PORT);
+	cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+	cr_assert_eq(script_extension(1), expected[n],
+		     "Reconnection %d got extension %d, expected %d\n",
+		     n, script_extension(1), expected[n]);
+    }
+
+    // Extensions 4 to 15 and then 2 are free, and the shard then doubles.
+    for(int id = 2; id < REUSE_TUS; id++)
+	script[id - 2] = (TEST_STEP){ id, TU_CONNECT_CMD, -1, TU_ON_HOOK, HND_MSEC };
+    script[REUSE_TUS - 2] = (TEST_STEP){ -1, -1, -1, -1, ZERO_SEC };
+    ret = run_test_script(name, script, SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    for(int id = 2; id < REUSE_TUS; id++) {
+	int ext = id <= 13 ? id + 2 : id == 14 ? 2 : id + 1;
+	cr_assert_eq(script_extension(id), ext, "TU %d got extension %d, expected %d\n",
+		     id, script_extension(id), ext);
+    }
+
+    TEST_STEP call[] = {
+	{  16,  TU_PICKUP_CMD,     -1,           TU_DIAL_TONE,   TEN_MSEC },
+	{  16,  TU_DIAL_CMD,        0,           TU_RING_BACK,   TEN_MSEC },
+	{   0,  TU_PICKUP_CMD,     -1,           TU_CONNECTED,   FTY_MSEC },
+	{   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+	{  16,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     FTY_MSEC },
+	{   -1, -1,                -1,           -1,             ZERO_SEC }
+    };
+    ret = run_test_script(name, call, SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    fini(1);
+}
+#undef TEST_NAME
+
+#define TEST_NAME shard_growth_test
+/*
+ * With four shards, TUs 0 and 1 move to extensions in other shards, far beyond
+ * the initial size of those shards, which must then grow.  Calls are made
+ * across shards to the moved TUs, and from one of them to a TU that has not
+ * moved.
+ */
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT,   TEXT
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   2,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   3,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "ext 4002" EOL },
+    {   0,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "ON HOOK 4002" },
+    {   1,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "ext 80003" EOL },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "ON HOOK 80003" },
+    {   2,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "pickup" EOL "dial 4002" EOL },
+    {   2,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "DIAL TONE" },
+    {   2,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "RING BACK" },
+    {   0,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "RINGING" },
+    {   3,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "pickup" EOL "dial 80003" EOL },
+    {   3,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "DIAL TONE" },
+    {   3,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "RING BACK" },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "RINGING" },
+    {   0,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "pickup" EOL "chat to 3" EOL },
+    {   0,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "CONNECTED" },
+    {   2,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "CONNECTED" },
+    {   2,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "CHAT to 3" },
+    {   1,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "hangup" EOL },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "ON HOOK 80003" },
+    {   3,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "DIAL TONE" },
+    {   3,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "hangup" EOL },
+    {   3,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "ON HOOK 4" },
+    {   1,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "pickup" EOL "dial 4" EOL },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "DIAL TONE" },
+    {   1,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "RING BACK" },
+    {   3,  TU_EXPECT_CMD,     -1,           -1,             TEN_MSEC,  "RINGING" },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+static void init_four_shards() {
+    static char *const argv[] = { "pbx", "-p", SERVER_PORT_STR, "-s", "4", NULL };
+    start_server(argv);
+}
+
+Test(SUITE, TEST_NAME, .init = init_four_shards, .fini = killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    // Extensions are allocated from the shards in turn, from shard 1.
+    cr_assert(script_extension(2) == 3 && script_extension(3) == 4,
+	      "Wrong extensions %d and %d\n", script_extension(2), script_extension(3));
+    fini(1);
+}
+#undef TEST_NAME
@@ -10,7 +10,11 @@
 #include <sys/time.h>
 
 #include "pbx.h"
+#include "pbx_ext.h"
 #include "server.h"
+#include "conf.h"
+#include "hunt.h"
+#include "proto.h"
 #include "__test_includes.h"
 #include "debug.h"
 
@@ -117,6 +121,9 @@ int next_states[NUM_STATES][NUM_COMMANDS] = {
   }
 };
 
+/* There isn't really a maximum message length, but this is just a test driver... */
+#define MAX_MESSAGE_LEN 256
+
 /*
  * Structure that records the state of a single TU under test.
  */
@@ -160,6 +167,23 @@ typedef struct tu {
      * notification is received.
      */
     TU_COMMAND last_command;
+
+    /* Flag that indicates that the TU is driven by TU_SEND_CMD and TU_EXPECT_CMD. */
+    int raw;
+
+    /*
+     * Flag that indicates that the server has acknowledged the binary protocol.
+     * Text sent by TU_SEND_CMD is then sent as command frames, and frames
+     * received are checked by TU_EXPECT_CMD in their text form.
+     */
+    int binary;
+
+    /* The word that followed the text of the last message expected by TU_EXPECT_CMD. */
+    char word[64];
+
+    /* Message read but not yet used, after TU_SKIP_CMD, if "held" is set. */
+    char message[MAX_MESSAGE_LEN];
+    int held;
 } TU;
 
 /*
@@ -213,6 +237,10 @@ static int connect_command(TU *tu, int port);
 static void disconnect_command(TU *tu);
 static int connect_to_server(struct in_addr *addr, int port);
 static int read_responses(TU *tu, TU_STATE exp, struct timeval tv);
+static int send_text(TU *tu, TU *ref, char *text);
+static int send_frames(TU *tu, char *text);
+static int read_message(TU *tu, char *msg, size_t size);
+static int expect_message(TU *tu, char *text, int skip, struct timeval tv);
 
 /*
  * Temporary main until this is fleshed out.
@@ -288,6 +316,24 @@ int run_test_script(char *name, TEST_STEP *scr, int port) {
 	    tms.tv_nsec = ts->timeout.tv_usec * 1000l;
 	    nanosleep(&tms, NULL);
 	    break;
+	case TU_SEND_CMD:
+	    fprintf(stderr, "%s: [%ld] (step #%ld) TU_SEND_CMD\n", timestamp(), TU_ID(tu), ts - scr);
+	    tu->raw = 1;
+	    if(send_text(tu, ts->id_to_dial >= 0 ? &tus[ts->id_to_dial] : tu, ts->text) == -1)
+		return -1;
+	    break;
+	case TU_EXPECT_CMD:
+	    fprintf(stderr, "%s: [%ld] (step #%ld) TU_EXPECT_CMD\n", timestamp(), TU_ID(tu), ts - scr);
+	    tu->raw = 1;
+	    if(expect_message(tu, ts->text, 0, ts->timeout) == -1)
+		return -1;
+	    break;
+	case TU_SKIP_CMD:
+	    fprintf(stderr, "%s: [%ld] (step #%ld) TU_SKIP_CMD\n", timestamp(), TU_ID(tu), ts - scr);
+	    tu->raw = 1;
+	    if(expect_message(tu, ts->text, 1, ts->timeout) == -1)
+		return -1;
+	    break;
 	case TU_AWAIT_CMD:
 	    fprintf(stderr, "%s: [%ld] (step #%ld) TU_AWAIT_CMD\n", timestamp(), TU_ID(tu), ts - scr);
 	    // Process incoming messages until specified state seen
@@ -322,7 +368,15 @@ int run_test_script(char *name, TEST_STEP *scr, int port) {
 		  timestamp(), TU_ID(tu), ts - scr, cmd);
 	    return -1;
 	}
-	if(cmd <= TU_CHAT_CMD) {
+	if(tu->raw) {
+	    // The state of a TU driven by messages is not tracked, and whatever it
+	    // is sent after disconnecting is drained without being checked.
+	    if(cmd == TU_DISCONNECT_CMD && tu->infd
+	       && expect_message(tu, NULL, 0, ts->timeout) == -1)
+		return -1;
+	    ts++;
+	    continue;
+	} else if(cmd <= TU_CHAT_CMD) {
 	    tu->last_command = cmd;
 	    tu->expected_states = next_states[tu->current_state][cmd];
 	} else if(cmd == TU_CONNECT_CMD) {
@@ -353,6 +407,14 @@ int run_test_script(char *name, TEST_STEP *scr, int port) {
     return 0;
 }
 
+/*
+ * Get the extension of a TU under test, as last reported by the server.
+ * The extension is known once the TU has connected with TU_CONNECT_CMD.
+ */
+int script_extension(int id) {
+    return tus[id].extension;
+}
+
 /*
  * Connect a specified TU to the server.
  * Returns 0 on success, -1 on error.
@@ -419,15 +481,15 @@ static void disconnect_command(TU *tu) {
 #endif
 }
 
-/* There isn't really a maximum message length, but this is just a test driver... */
-#define MAX_MESSAGE_LEN 256
 
 static struct timeval current_timeout;
+static volatile sig_atomic_t timed_out;
 
 static TU *tu_to_read;
 static void alarm_handler(int sig) {
   fprintf(stderr, "%s: [%ld] Timeout (%ld, %ld)\n", timestamp(), TU_ID(tu_to_read),
 	  current_timeout.tv_sec, current_timeout.tv_usec);
+  timed_out = 1;
   shutdown(tu_to_read->infd, SHUT_RD);  // Force return from fgets
 }
 
@@ -557,6 +619,209 @@ static int read_responses(TU *tu, TU_STATE exp, struct timeval tv) {
     return ret;
 }
 
+/*
+ * Send text to the server for a TU, expanding "%e" to the extension of
+ * another TU and "%w" to the word it last saved.
+ * Returns 0 on success, -1 on error.
+ */
+static int send_text(TU *tu, TU *ref, char *text) {
+    if(!tu->out) {
+	fprintf(stderr, "%s: [%ld] Test error: not connected\n", timestamp(), TU_ID(tu));
+	return -1;
+    }
+    char *buf;
+    size_t len;
+    FILE *mem = open_memstream(&buf, &len);
+    for(char *tp = text; *tp != '\0'; tp++) {
+	if(*tp == '%' && tp[1] == 'e') {
+	    fprintf(mem, "%d", ref->extension);
+	    tp++;
+	} else if(*tp == '%' && tp[1] == 'w') {
+	    fputs(ref->word, mem);
+	    tp++;
+	} else {
+	    fputc(*tp, mem);
+	}
+    }
+    fclose(mem);
+    int ret = 0;
+    if(tu->binary)
+	ret = send_frames(tu, buf);
+    else
+	fwrite(buf, 1, len, tu->out);
+    free(buf);
+    if(ret == 0 && fflush(tu->out) == EOF) {
+	fprintf(stderr, "%s: [%ld] Error sending to server\n", timestamp(), TU_ID(tu));
+	ret = -1;
+    }
+    return ret;
+}
+
+/*
+ * Get the code of a command, given its name in the text protocol.
+ * Returns the code, or -1 if there is no such command.
+ */
+static int command_code(char *name) {
+    for(int i = 0; i <= TU_CHAT_CMD; i++) {
+	if(!strcmp(name, tu_command_names[i]))
+	    return i;
+    }
+    if(!strcmp(name, CONF_COMMAND_NAME))
+	return TU_CONF_CMD;
+    if(!strcmp(name, EXT_COMMAND_NAME))
+	return TU_EXT_CMD;
+    if(!strcmp(name, QUEUE_COMMAND_NAME))
+	return TU_QUEUE_CMD;
+    if(!strcmp(name, HUNT_COMMAND_NAME))
+	return TU_HUNT_CMD;
+    if(!strcmp(name, AGENT_COMMAND_NAME))
+	return TU_AGENT_CMD;
+    return -1;
+}
+
+/*
+ * Send each line of a text as the equivalent binary command frame: the
+ * message of a chat is the payload, and the argument of any other command
+ * is the numeric argument of the frame.
+ * Returns 0 on success, -1 on error.
+ */
+static int send_frames(TU *tu, char *text) {
+    char *saveptr;
+    for(char *line = strtok_r(text, EOL, &saveptr); line != NULL;
+	line = strtok_r(NULL, EOL, &saveptr)) {
+	char *arg = strchr(line, ' ');
+	if(arg)
+	    *arg++ = '\0';
+	int code = command_code(line);
+	if(code < 0) {
+	    fprintf(stderr, "%s: [%ld] Test error: no frame for command %s\n",
+		    timestamp(), TU_ID(tu), line);
+	    return -1;
+	}
+	PROTO_FRAME frame = { PROTO_COMMAND, code, 0, PROTO_NO_ARG };
+	if(code == TU_CHAT_CMD)
+	    frame.len = arg ? strlen(arg) : 0;
+	else if(arg)
+	    frame.arg = atoi(arg);
+	char header[PROTO_HEADER_SIZE];
+	proto_encode(header, &frame);
+	fwrite(header, 1, PROTO_HEADER_SIZE, tu->out);
+	if(frame.len)
+	    fwrite(arg, 1, frame.len, tu->out);
+    }
+    return 0;
+}
+
+/*
+ * Read the next message from the server for a TU, without its line terminator.
+ * A binary frame is given in the form of the equivalent text message.
+ * Returns 0 on success, -1 on EOF.
+ */
+static int read_message(TU *tu, char *msg, size_t size) {
+    if(tu->held) {
+	snprintf(msg, size, "%s", tu->message);
+	tu->held = 0;
+	return 0;
+    }
+    if(!tu->binary) {
+	if(fgets(msg, size, tu->in) == NULL)
+	    return -1;
+	trim_eol(msg);
+	if(!strcmp(msg, PROTO_BINARY_ACK))
+	    tu->binary = 1;
+	return 0;
+    }
+    char header[PROTO_HEADER_SIZE];
+    PROTO_FRAME frame;
+    if(fread(header, 1, PROTO_HEADER_SIZE, tu->in) != PROTO_HEADER_SIZE)
+	return -1;
+    proto_decode(header, &frame);
+    char *payload = malloc(frame.len + 1);
+    if(fread(payload, 1, frame.len, tu->in) != frame.len) {
+	free(payload);
+	return -1;
+    }
+    payload[frame.len] = '\0';
+    if(frame.type == PROTO_CHAT) {
+	snprintf(msg, size, "CHAT %s", payload);
+    } else if(frame.type == PROTO_STATE) {
+	char *name = frame.code == TU_CONFERENCE ? CONF_STATE_NAME
+		     : frame.code == TU_QUEUED ? QUEUED_STATE_NAME
+		     : frame.code < NUM_STATES ? tu_state_names[frame.code] : "?";
+	if(frame.arg == PROTO_NO_ARG)
+	    snprintf(msg, size, "%s", name);
+	else
+	    snprintf(msg, size, "%s %u", name, frame.arg);
+    } else {
+	snprintf(msg, size, "(frame type %d)", frame.type);
+    }
+    free(payload);
+    return 0;
+}
+
+/*
+ * Read the next message from the server for a TU, and check that it begins with
+ * a specified text, saving the word that follows.  If the text is NULL, messages
+ * are read and discarded until EOF.  If "skip" is set, messages that begin with
+ * the text are instead discarded, and the first that does not is held for the
+ * next read.
+ * Returns 0 on success, -1 on failure.
+ */
+static int expect_message(TU *tu, char *text, int skip, struct timeval tv) {
+    char msg[MAX_MESSAGE_LEN];
+    int ret = 0;
+    fprintf(stderr, "%s: [%ld] Expecting: %s\n", timestamp(), TU_ID(tu), text ? text : "EOF");
+    tu_to_read = tu;
+    timed_out = 0;
+    struct itimerval itv = {0};
+    struct sigaction sa = {0}, oa;
+    sa.sa_handler = alarm_handler;
+    sa.sa_flags = SA_RESTART;
+    current_timeout = tv;
+    sigaction(SIGALRM, &sa, &oa);
+    itv.it_value = tv;
+    setitimer(ITIMER_REAL, &itv, NULL);
+    while(1) {
+	if(read_message(tu, msg, MAX_MESSAGE_LEN) == -1) {
+	    fprintf(stderr, "%s: [%ld] EOF reading message from server\n", timestamp(), TU_ID(tu));
+	    fclose(tu->in);
+	    tu->in = NULL;
+	    tu->infd = 0;
+	    if(text || timed_out)
+		ret = -1;
+	    break;
+	}
+	fprintf(stderr, "%s: [%ld] Message from server: %s\n", timestamp(), TU_ID(tu), msg);
+	if(text == NULL)
+	    continue;
+	size_t len = strlen(text);
+	if(skip) {
+	    if(!strncmp(msg, text, len))
+		continue;
+	    snprintf(tu->message, sizeof(tu->message), "%s", msg);
+	    tu->held = 1;
+	    break;
+	}
+	if(strncmp(msg, text, len)) {
+	    fprintf(stderr, "%s: [%ld] Message does not begin with \"%s\"\n",
+		    timestamp(), TU_ID(tu), text);
+	    ret = -1;
+	    break;
+	}
+	char *wp = msg + len;
+	while(*wp == ' ')
+	    wp++;
+	wp[strcspn(wp, " ")] = '\0';
+	snprintf(tu->word, sizeof(tu->word), "%s", wp);
+	break;
+    }
+    itv = (struct itimerval) {0};
+    setitimer(ITIMER_REAL, &itv, NULL);
+    sigaction(SIGALRM, &oa, NULL);
+    tu_to_read = NULL;
+    return ret;
+}
+
 /*
  * Parse a message from the PBX, determining the new state.
  */
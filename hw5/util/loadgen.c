@@ -0,0 +1,764 @@
+/*
+ * Load generator and latency benchmark for the PBX server.
+ *
+ * Opens a large number of TU connections to a running PBX, drives a mix of
+ * pickup/dial/chat/hangup commands at a target aggregate rate, and reports
+ * connection setup time, per-command round-trip latency and the throughput
+ * of asynchronous notifications fanned out by the server.
+ *
+ * Usage: loadgen -p <port> [-h host] [-n connections] [-t threads]
+ *                [-r commands/sec] [-d seconds] [-c chats/call] [-s chat bytes]
+ *                [-i idle seconds] [-w workload] [-k hot extensions] [-m members] [-b]
+ *                [-f flooders] [-q]
+ *
+ * Workloads:
+ *   mix   (default) Every TU picks up, dials random extensions, answers incoming
+ *         calls, chats and hangs up, driven by its current state.
+ *   dial  Connections are paired; one TU of each pair repeatedly picks up, dials
+ *         its partner and hangs up as soon as it hears ring back, while the partner
+ *         stays on hook.  This measures the dial/hangup cycle rate.
+ *   storm Every TU dials, as fast as it can, one of a small set of "hot" extensions
+ *         (-k, default 4), which answer and immediately hang up.  This measures
+ *         throughput and latency under heavy contention for the same TUs.
+ *         A caller that gets a busy signal hangs up and tries again; with -q,
+ *         callers instead queue for the hot extensions and wait to be put
+ *         through, which shows how many commands the retries cost.
+ *   conf  TUs join conference rooms of -m members each (default 128) and chat
+ *         continuously.  Every chat is fanned out to all other members of its
+ *         room, so the chats received per second measure fan-out throughput.
+ *   churn The connections stay idle while each thread repeatedly opens a new
+ *         connection, waits for its extension to be assigned and closes it.
+ *         This measures how fast the server takes on and releases clients.
+ *
+ * With -f, that many of the connections misbehave instead of following the
+ * workload: they write pickup/hangup commands as fast as the server will take
+ * them, without waiting for responses.  Latencies are reported for the
+ * well-behaved connections only, showing how well they are isolated.
+ *
+ * With -b, every connection negotiates the binary framed protocol before the
+ * run starts, so that the two protocols can be compared under the same load.
+ *
+ * A rate of 0 (the default) runs closed-loop: every idle connection issues its
+ * next command as soon as the response to its previous one has arrived.
+ *
+ * Each connection has at most one command outstanding, and the first state
+ * notification received after a command is sent is taken as its response.
+ * An asynchronous notification that crosses a command in transit is therefore
+ * occasionally counted as the response, which slightly understates latency.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "pbx.h"
+#include "server.h"
+#include "conf.h"
+#include "hunt.h"
+#include "proto.h"
+#include "csapp.h"
+
+#define NUM_STATES 7
+#define NUM_COMMANDS (TU_QUEUE_CMD + 1)
+
+/* Time a caller waits in RING BACK before giving up and hanging up. */
+#define RING_TIMEOUT 0.1
+
+#define INBUF_SIZE 4096
+
+/*
+ * Latency histogram with logarithmic buckets: values below HIST_SUB are exact,
+ * and each further power of two is split into HIST_SUB sub-buckets.
+ */
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (HIST_SUB + 40 * HIST_SUB)
+
+typedef struct hist {
+    unsigned long count[HIST_BUCKETS];
+    unsigned long total;
+    unsigned long max;
+    double sum;
+} HIST;
+
+/*
+ * Structure that records the state of a single simulated TU.
+ */
+typedef struct conn {
+    int fd;
+    int ext;
+    int partner;
+    int hot;
+    int flood;
+    int room;
+    TU_STATE state;
+    int outstanding;
+    TU_COMMAND last_command;
+    double sent_at;
+    double wait_until;
+    int chats_left;
+    size_t inlen;
+    char inbuf[INBUF_SIZE];
+} CONN;
+
+/*
+ * Per-thread statistics, merged once the run is over.
+ */
+typedef struct stats {
+    HIST setup;
+    HIST churn;
+    HIST cmd[NUM_COMMANDS];
+    unsigned long commands;
+    unsigned long calls;
+    unsigned long busy;
+    unsigned long notifications;
+    unsigned long chats;
+    unsigned long missed;
+    unsigned long disconnects;
+    unsigned long flooded;
+    unsigned long churned;
+} STATS;
+
+typedef struct worker {
+    pthread_t tid;
+    unsigned int seed;
+    CONN *conns;
+    int nconns;
+    STATS stats;
+} WORKER;
+
+static char *host = "localhost";
+static char *port = NULL;
+static int nconns = 100;
+static int nthreads = 4;
+static double rate = 0;
+static double duration = 10;
+static int chats_per_call = 3;
+static int chat_size = 32;
+static double idle_time = 0.2;
+
+static int hot_count = 4;
+static int conf_members = 128;
+static int binary = 0;
+static int flood_count = 0;
+static int queue_calls = 0;
+
+typedef enum workload {
+    WORKLOAD_MIX, WORKLOAD_DIAL, WORKLOAD_STORM, WORKLOAD_CONF, WORKLOAD_CHURN
+} WORKLOAD;
+
+static char *workload_names[] = {
+    [WORKLOAD_MIX]   "mix",
+    [WORKLOAD_DIAL]  "dial",
+    [WORKLOAD_STORM] "storm",
+    [WORKLOAD_CONF]  "conf",
+    [WORKLOAD_CHURN] "churn"
+};
+
+static WORKLOAD workload = WORKLOAD_MIX;
+
+static int *extensions;
+static int nextensions;
+static int *hot_extensions;
+static int nhot_extensions;
+static pthread_barrier_t barrier;
+static char *chat_msg;
+static size_t chat_len;
+
+/* Number of commands written by a flooding connection per attempt. */
+#define FLOOD_BATCH 32
+
+static char *flood_msg;
+static size_t flood_len;
+
+static char *command_name(int cmd) {
+    return cmd == TU_CONF_CMD ? CONF_COMMAND_NAME
+           : cmd == TU_EXT_CMD ? EXT_COMMAND_NAME
+           : cmd == TU_QUEUE_CMD ? QUEUE_COMMAND_NAME : tu_command_names[cmd];
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int hist_index(unsigned long v) {
+    if(v < HIST_SUB) return v;
+    int e = 63 - __builtin_clzl(v);
+    int i = HIST_SUB + (e - HIST_SUB_BITS) * HIST_SUB + ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+    return i < HIST_BUCKETS ? i : HIST_BUCKETS - 1;
+}
+
+static unsigned long hist_value(int i) {
+    if(i < HIST_SUB) return i;
+    int e = (i - HIST_SUB) / HIST_SUB + HIST_SUB_BITS;
+    return (1UL << e) + ((unsigned long)((i - HIST_SUB) % HIST_SUB) << (e - HIST_SUB_BITS));
+}
+
+static void hist_add(HIST *h, double seconds) {
+    unsigned long us = seconds * 1e6;
+    h->count[hist_index(us)]++;
+    h->total++;
+    h->sum += us;
+    if(us > h->max) h->max = us;
+}
+
+static void hist_merge(HIST *to, HIST *from) {
+    for(int i = 0; i < HIST_BUCKETS; i++) to->count[i] += from->count[i];
+    to->total += from->total;
+    to->sum += from->sum;
+    if(from->max > to->max) to->max = from->max;
+}
+
+static unsigned long hist_percentile(HIST *h, double p) {
+    unsigned long target = h->total * p, seen = 0;
+    for(int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->count[i];
+        if(seen > target) return hist_value(i);
+    }
+    return h->max;
+}
+
+static void hist_print(char *name, HIST *h) {
+    printf("%-16s count=%lu mean_us=%.1f p50_us=%lu p90_us=%lu p99_us=%lu p999_us=%lu max_us=%lu\n",
+           name, h->total, h->total ? h->sum / h->total : 0.0,
+           hist_percentile(h, 0.50), hist_percentile(h, 0.90), hist_percentile(h, 0.99),
+           hist_percentile(h, 0.999), h->max);
+}
+
+static int connect_to_server(void) {
+    struct addrinfo hints = {0}, *list, *p;
+    int fd = -1;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    if(getaddrinfo(host, port, &hints, &list) != 0) return -1;
+    for(p = list; p != NULL; p = p->ai_next) {
+        if((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) continue;
+        if(connect(fd, p->ai_addr, p->ai_addrlen) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(list);
+    if(fd >= 0) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+/*
+ * Parse a state notification from the server.
+ * Returns the state, or -1 if the line is not a state notification.
+ */
+static int parse_state(char *line, int *arg) {
+    for(int s = 0; s < NUM_STATES; s++) {
+        size_t len = strlen(tu_state_names[s]);
+        if(strncmp(line, tu_state_names[s], len) == 0 && (line[len] == '\0' || line[len] == ' ')) {
+            *arg = line[len] == ' ' ? atoi(line + len + 1) : -1;
+            return s;
+        }
+    }
+    size_t len = strlen(CONF_STATE_NAME);
+    if(strncmp(line, CONF_STATE_NAME, len) == 0 && line[len] == ' ') {
+        *arg = atoi(line + len + 1);
+        return TU_CONFERENCE;
+    }
+    len = strlen(QUEUED_STATE_NAME);
+    if(strncmp(line, QUEUED_STATE_NAME, len) == 0 && line[len] == ' ') {
+        *arg = atoi(line + len + 1);
+        return TU_QUEUED;
+    }
+    return -1;
+}
+
+/*
+ * Read one line synchronously; used only while connections are being set up.
+ */
+static int read_line(CONN *c, char *line, size_t size) {
+    size_t i = 0;
+    char ch;
+    while(read(c->fd, &ch, 1) == 1) {
+        if(ch == '\n') {
+            if(i > 0 && line[i - 1] == '\r') i--;
+            line[i] = '\0';
+            return 0;
+        }
+        if(i < size - 1) line[i++] = ch;
+    }
+    return -1;
+}
+
+static void send_command(WORKER *w, CONN *c, TU_COMMAND cmd, double t);
+
+static void handle_state(WORKER *w, CONN *c, int s, double t) {
+    // A queued caller hears ring back as a notification rather than a response.
+    if(s == TU_RING_BACK && c->state != TU_RING_BACK) w->stats.calls++;
+    if(s == TU_BUSY_SIGNAL && c->state != TU_BUSY_SIGNAL) w->stats.busy++;
+    if(c->outstanding) {
+        hist_add(&w->stats.cmd[c->last_command], t - c->sent_at);
+        c->outstanding = 0;
+    } else {
+        w->stats.notifications++;
+    }
+    if(s == TU_RING_BACK && c->state != TU_RING_BACK) c->wait_until = t + RING_TIMEOUT;
+    // Phones stay on hook for a random idle period, so that there is someone to call.
+    if(s == TU_ON_HOOK && c->state != TU_ON_HOOK)
+        c->wait_until = t + 2 * idle_time * rand_r(&w->seed) / RAND_MAX;
+    if(s == TU_CONNECTED && c->state != TU_CONNECTED) c->chats_left = chats_per_call;
+    c->state = s;
+    // Ringing phones are answered right away rather than waiting for their turn.
+    if((workload == WORKLOAD_MIX || c->hot) && s == TU_RINGING && !c->outstanding) send_command(w, c, TU_PICKUP_CMD, t);
+}
+
+static void handle_line(WORKER *w, CONN *c, char *line, double t) {
+    int arg;
+    if(strncmp(line, "CHAT", 4) == 0) {
+        w->stats.chats++;
+        return;
+    }
+    int s = parse_state(line, &arg);
+    if(s >= 0) handle_state(w, c, s, t);
+}
+
+/*
+ * Process the complete lines or frames in a connection's input buffer.
+ */
+static void handle_input(WORKER *w, CONN *c, double t) {
+    char *p = c->inbuf, *end = c->inbuf + c->inlen;
+    if(c->flood) {
+        // Responses to a flooding connection are read only to keep it going.
+        p = end;
+    } else if(binary) {
+        PROTO_FRAME frame;
+        while(end - p >= PROTO_HEADER_SIZE) {
+            proto_decode(p, &frame);
+            if(end - p < PROTO_HEADER_SIZE + frame.len) break;
+            if(frame.type == PROTO_CHAT) w->stats.chats++;
+            else if(frame.type == PROTO_STATE) handle_state(w, c, frame.code, t);
+            p += PROTO_HEADER_SIZE + frame.len;
+        }
+    } else {
+        char *eol;
+        while((eol = memchr(p, '\n', end - p)) != NULL) {
+            *eol = '\0';
+            if(eol > p && eol[-1] == '\r') eol[-1] = '\0';
+            handle_line(w, c, p, t);
+            p = eol + 1;
+        }
+    }
+    c->inlen -= p - c->inbuf;
+    memmove(c->inbuf, p, c->inlen);
+    if(c->inlen == INBUF_SIZE) c->inlen = 0;
+}
+
+static void send_command(WORKER *w, CONN *c, TU_COMMAND cmd, double t) {
+    char buf[64];
+    char *out = buf;
+    int len, ext = -1;
+    if(cmd == TU_DIAL_CMD || cmd == TU_QUEUE_CMD) {
+        if(c->partner >= 0) ext = c->partner;
+        else if(workload == WORKLOAD_STORM) ext = hot_extensions[rand_r(&w->seed) % nhot_extensions];
+        else ext = extensions[rand_r(&w->seed) % nextensions];
+    }
+    if(binary && cmd == TU_CHAT_CMD) {
+        out = chat_msg;
+        len = chat_len;
+    } else if(binary) {
+        PROTO_FRAME frame = { PROTO_COMMAND, cmd, 0, PROTO_NO_ARG };
+        if(cmd == TU_DIAL_CMD || cmd == TU_QUEUE_CMD) frame.arg = ext;
+        if(cmd == TU_CONF_CMD) frame.arg = c->room;
+        proto_encode(buf, &frame);
+        len = PROTO_HEADER_SIZE;
+    } else if(cmd == TU_DIAL_CMD || cmd == TU_QUEUE_CMD) {
+        len = snprintf(buf, sizeof(buf), "%s %d\r\n", command_name(cmd), ext);
+    } else if(cmd == TU_CONF_CMD) {
+        len = snprintf(buf, sizeof(buf), "%s %d\r\n", CONF_COMMAND_NAME, c->room);
+    } else if(cmd == TU_CHAT_CMD) {
+        out = chat_msg;
+        len = chat_len;
+    } else {
+        len = snprintf(buf, sizeof(buf), "%s\r\n", tu_command_names[cmd]);
+    }
+    if(write(c->fd, out, len) != len) {
+        w->stats.disconnects++;
+        close(c->fd);
+        c->fd = -1;
+        return;
+    }
+    c->outstanding = 1;
+    c->last_command = cmd;
+    c->sent_at = t;
+    w->stats.commands++;
+}
+
+/*
+ * Choose the next command for a TU based on its current state.
+ * Returns -1 if the TU should not issue a command right now.
+ */
+static int choose_command(CONN *c, double t) {
+    if(workload == WORKLOAD_DIAL) {
+        if(c->partner < 0) return -1;
+        switch(c->state) {
+        case TU_ON_HOOK:
+            return TU_PICKUP_CMD;
+        case TU_DIAL_TONE:
+            return TU_DIAL_CMD;
+        default:
+            return TU_HANGUP_CMD;
+        }
+    }
+    if(workload == WORKLOAD_CONF) {
+        // TU_CONFERENCE is not a member of the TU_STATE enumeration.
+        if(c->state == TU_ON_HOOK) return TU_PICKUP_CMD;
+        if(c->state == TU_DIAL_TONE) return TU_CONF_CMD;
+        if(c->state == TU_CONFERENCE) return TU_CHAT_CMD;
+        return TU_HANGUP_CMD;
+    }
+    if(workload == WORKLOAD_STORM) {
+        // TU_QUEUED is not a member of the TU_STATE enumeration either.
+        if(c->state == TU_QUEUED) return -1;
+        switch(c->state) {
+        case TU_ON_HOOK:
+            return c->hot ? -1 : TU_PICKUP_CMD;
+        case TU_RINGING:
+            return TU_PICKUP_CMD;
+        case TU_DIAL_TONE:
+            if(c->hot) return TU_HANGUP_CMD;
+            return queue_calls ? TU_QUEUE_CMD : TU_DIAL_CMD;
+        default:
+            return TU_HANGUP_CMD;
+        }
+    }
+    switch(c->state) {
+    case TU_ON_HOOK:
+        return t >= c->wait_until ? TU_PICKUP_CMD : -1;
+    case TU_RINGING:
+        return TU_PICKUP_CMD;
+    case TU_DIAL_TONE:
+        return TU_DIAL_CMD;
+    case TU_RING_BACK:
+        return t >= c->wait_until ? TU_HANGUP_CMD : -1;
+    case TU_CONNECTED:
+        if(c->chats_left > 0) {
+            c->chats_left--;
+            return TU_CHAT_CMD;
+        }
+        return TU_HANGUP_CMD;
+    default:
+        return TU_HANGUP_CMD;
+    }
+}
+
+/*
+ * Write as many commands on a flooding connection as the socket will take.
+ */
+static void flood(WORKER *w, CONN *c) {
+    ssize_t n = write(c->fd, flood_msg, flood_len);
+    if(n > 0) w->stats.flooded += FLOOD_BATCH * n / flood_len;
+    else if(n < 0 && errno != EAGAIN) {
+        w->stats.disconnects++;
+        close(c->fd);
+        c->fd = -1;
+    }
+}
+
+/*
+ * Issue a command on the next idle connection, scanning round-robin from *next.
+ * Returns 0 if a command was sent, -1 if no connection was idle.
+ */
+static int issue_one(WORKER *w, int *next, double t) {
+    for(int k = 0; k < w->nconns; k++) {
+        CONN *c = &w->conns[*next];
+        *next = (*next + 1) % w->nconns;
+        if(c->fd < 0 || c->outstanding || c->flood) continue;
+        int cmd = choose_command(c, t);
+        if(cmd < 0) continue;
+        send_command(w, c, cmd, t);
+        return 0;
+    }
+    return -1;
+}
+
+/*
+ * Open, register and close connections one after another until the end of the run.
+ * Connections are reset rather than closed, so that the client does not run
+ * out of ports to TIME_WAIT.
+ */
+static void churn(WORKER *w, double end) {
+    char line[INBUF_SIZE];
+    struct linger linger = { 1, 0 };
+    CONN c;
+    int arg;
+    double t0;
+    while((t0 = now()) < end) {
+        c.fd = connect_to_server();
+        if(c.fd < 0) {
+            w->stats.disconnects++;
+            continue;
+        }
+        setsockopt(c.fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+        if(read_line(&c, line, sizeof(line)) == 0 && parse_state(line, &arg) == TU_ON_HOOK) {
+            hist_add(&w->stats.churn, now() - t0);
+            w->stats.churned++;
+        } else {
+            w->stats.disconnects++;
+        }
+        close(c.fd);
+    }
+}
+
+static void *worker_thread(void *arg) {
+    WORKER *w = arg;
+    char line[INBUF_SIZE];
+    int arg_ext;
+
+    // Open and register all connections, timing each until its extension arrives.
+    for(int i = 0; i < w->nconns; i++) {
+        CONN *c = &w->conns[i];
+        double t0 = now();
+        c->fd = connect_to_server();
+        if(c->fd < 0 || read_line(c, line, sizeof(line)) < 0 ||
+           parse_state(line, &arg_ext) != TU_ON_HOOK) {
+            if(c->fd >= 0) close(c->fd);
+            c->fd = -1;
+            w->stats.disconnects++;
+            continue;
+        }
+        if(binary) {
+            char *negotiate = PROTO_BINARY_COMMAND "\r\n";
+            if(write(c->fd, negotiate, strlen(negotiate)) < 0) line[0] = '\0';
+            else while(read_line(c, line, sizeof(line)) == 0 && strcmp(line, PROTO_BINARY_ACK) != 0);
+            // The acknowledgement is followed by a frame giving the current state.
+            if(strcmp(line, PROTO_BINARY_ACK) != 0 ||
+               rio_readn(c->fd, line, PROTO_HEADER_SIZE) != PROTO_HEADER_SIZE) {
+                close(c->fd);
+                c->fd = -1;
+                w->stats.disconnects++;
+                continue;
+            }
+        }
+        hist_add(&w->stats.setup, now() - t0);
+        c->ext = arg_ext;
+        c->partner = -1;
+        c->state = TU_ON_HOOK;
+        fcntl(c->fd, F_SETFL, O_NONBLOCK);
+        if(c->flood) {
+            // A small send buffer keeps the cost of flooding on the server side.
+            int size = 16 * 1024;
+            setsockopt(c->fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+        }
+    }
+    if(workload == WORKLOAD_DIAL) {
+        for(int i = 0; i + 1 < w->nconns; i += 2)
+            w->conns[i].partner = w->conns[i + 1].ext;
+    }
+    pthread_barrier_wait(&barrier);
+    pthread_barrier_wait(&barrier);
+
+    double start = now(), end = start + duration;
+    if(workload == WORKLOAD_CHURN) {
+        churn(w, end);
+        for(int i = 0; i < w->nconns; i++)
+            if(w->conns[i].fd >= 0) close(w->conns[i].fd);
+        return NULL;
+    }
+    struct pollfd *fds = calloc(w->nconns, sizeof(struct pollfd));
+    double interval = rate > 0 ? nthreads / rate : 0;
+    double next_send = start;
+    int next = 0;
+    double t;
+    while((t = now()) < end) {
+        if(interval > 0) {
+            while(next_send <= t) {
+                if(issue_one(w, &next, t) < 0) w->stats.missed++;
+                next_send += interval;
+            }
+        } else {
+            while(issue_one(w, &next, t) == 0);
+        }
+        for(int i = 0; i < w->nconns; i++) {
+            if(w->conns[i].flood && w->conns[i].fd >= 0) flood(w, &w->conns[i]);
+            fds[i].fd = w->conns[i].fd;
+            fds[i].events = POLLIN;
+        }
+        double wait = interval > 0 ? next_send - t : 0.001;
+        if(wait > end - t) wait = end - t;
+        if(poll(fds, w->nconns, wait > 0 ? (int)(wait * 1000) + 1 : 0) < 0) continue;
+        t = now();
+        for(int i = 0; i < w->nconns; i++) {
+            CONN *c = &w->conns[i];
+            if(c->fd < 0 || !fds[i].revents) continue;
+            ssize_t n = read(c->fd, c->inbuf + c->inlen, INBUF_SIZE - c->inlen);
+            if(n <= 0) {
+                if(n < 0 && errno == EAGAIN) continue;
+                w->stats.disconnects++;
+                close(c->fd);
+                c->fd = -1;
+                continue;
+            }
+            c->inlen += n;
+            handle_input(w, c, t);
+        }
+    }
+    free(fds);
+    for(int i = 0; i < w->nconns; i++)
+        if(w->conns[i].fd >= 0) close(w->conns[i].fd);
+    return NULL;
+}
+
+static void usage(char *name) {
+    fprintf(stderr, "Usage: %s -p <port> [-h host] [-n connections] [-t threads] "
+            "[-r commands/sec] [-d seconds] [-c chats/call] [-s chat bytes] [-i idle seconds] "
+            "[-w mix|dial|storm|conf|churn] [-k hot extensions] [-m members] [-b] [-f flooders] [-q]\n", name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while((opt = getopt(argc, argv, "p:h:n:t:r:d:c:s:i:w:k:m:bf:q")) != -1) {
+        switch(opt) {
+        case 'p': port = optarg; break;
+        case 'h': host = optarg; break;
+        case 'n': nconns = atoi(optarg); break;
+        case 't': nthreads = atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 'd': duration = atof(optarg); break;
+        case 'c': chats_per_call = atoi(optarg); break;
+        case 's': chat_size = atoi(optarg); break;
+        case 'i': idle_time = atof(optarg); break;
+        case 'w':
+            for(workload = 0; workload <= WORKLOAD_CHURN; workload++)
+                if(strcmp(optarg, workload_names[workload]) == 0) break;
+            if(workload > WORKLOAD_CHURN) usage(argv[0]);
+            break;
+        case 'k': hot_count = atoi(optarg); break;
+        case 'm': conf_members = atoi(optarg); break;
+        case 'b': binary = 1; break;
+        case 'f': flood_count = atoi(optarg); break;
+        case 'q': queue_calls = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if(port == NULL || nconns <= 0 || nthreads <= 0 || duration <= 0 || chat_size < 0 || idle_time < 0 ||
+       hot_count <= 0 || conf_members <= 0 || flood_count < 0 || flood_count >= nconns || (binary && chat_size > PROTO_MAX_PAYLOAD) || (workload == WORKLOAD_STORM && hot_count >= nconns))
+        usage(argv[0]);
+    if(nthreads > nconns) nthreads = nconns;
+
+    if(binary) {
+        PROTO_FRAME frame = { PROTO_COMMAND, TU_CHAT_CMD, chat_size, PROTO_NO_ARG };
+        chat_len = PROTO_HEADER_SIZE + chat_size;
+        chat_msg = malloc(chat_len);
+        proto_encode(chat_msg, &frame);
+        memset(chat_msg + PROTO_HEADER_SIZE, 'x', chat_size);
+    } else {
+        chat_msg = malloc(chat_size + 8);
+        strcpy(chat_msg, "chat ");
+        memset(chat_msg + 5, 'x', chat_size);
+        strcpy(chat_msg + 5 + chat_size, "\r\n");
+        chat_len = strlen(chat_msg);
+    }
+
+    char cmds[2 * PROTO_HEADER_SIZE + 16];
+    size_t cmds_len = 0;
+    if(binary) {
+        PROTO_FRAME pickup = { PROTO_COMMAND, TU_PICKUP_CMD, 0, PROTO_NO_ARG };
+        PROTO_FRAME hangup = { PROTO_COMMAND, TU_HANGUP_CMD, 0, PROTO_NO_ARG };
+        proto_encode(cmds, &pickup);
+        proto_encode(cmds + PROTO_HEADER_SIZE, &hangup);
+        cmds_len = 2 * PROTO_HEADER_SIZE;
+    } else {
+        cmds_len = sprintf(cmds, "%s\r\n%s\r\n", tu_command_names[TU_PICKUP_CMD], tu_command_names[TU_HANGUP_CMD]);
+    }
+    flood_len = FLOOD_BATCH / 2 * cmds_len;
+    flood_msg = malloc(flood_len);
+    for(int i = 0; i < FLOOD_BATCH / 2; i++) memcpy(flood_msg + i * cmds_len, cmds, cmds_len);
+
+    WORKER *workers = calloc(nthreads, sizeof(WORKER));
+    CONN *conns = calloc(nconns, sizeof(CONN));
+    extensions = calloc(nconns, sizeof(int));
+    hot_extensions = calloc(nconns, sizeof(int));
+    if(workload == WORKLOAD_STORM) {
+        // Spread the hot extensions across the worker threads.
+        for(int i = 0; i < hot_count; i++) conns[i * (nconns / hot_count)].hot = 1;
+    }
+    // Flooders are spread across the worker threads too.
+    for(int i = 0; i < flood_count; i++) conns[i * (nconns / flood_count) + nconns / flood_count / 2].flood = 1;
+    for(int i = 0; i < nconns; i++) conns[i].room = i / conf_members;
+    pthread_barrier_init(&barrier, NULL, nthreads + 1);
+    double t0 = now();
+    for(int i = 0, first = 0; i < nthreads; i++) {
+        WORKER *w = &workers[i];
+        w->nconns = nconns / nthreads + (i < nconns % nthreads);
+        w->conns = conns + first;
+        w->seed = i + 1;
+        first += w->nconns;
+        pthread_create(&w->tid, NULL, worker_thread, w);
+    }
+    pthread_barrier_wait(&barrier);
+    double setup_time = now() - t0;
+    for(int i = 0; i < nconns; i++) {
+        if(conns[i].fd < 0 || conns[i].flood) continue;
+        extensions[nextensions++] = conns[i].ext;
+        if(conns[i].hot) hot_extensions[nhot_extensions++] = conns[i].ext;
+    }
+    if(nextensions == 0 || (workload == WORKLOAD_STORM && nhot_extensions == 0)) {
+        fprintf(stderr, "loadgen: no connections could be established\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_barrier_wait(&barrier);
+    for(int i = 0; i < nthreads; i++) pthread_join(workers[i].tid, NULL);
+
+    STATS total = {0};
+    HIST all = {0};
+    for(int i = 0; i < nthreads; i++) {
+        STATS *s = &workers[i].stats;
+        hist_merge(&total.setup, &s->setup);
+        hist_merge(&total.churn, &s->churn);
+        for(int c = 0; c < NUM_COMMANDS; c++) hist_merge(&total.cmd[c], &s->cmd[c]);
+        total.commands += s->commands;
+        total.calls += s->calls;
+        total.busy += s->busy;
+        total.notifications += s->notifications;
+        total.chats += s->chats;
+        total.missed += s->missed;
+        total.disconnects += s->disconnects;
+        total.flooded += s->flooded;
+        total.churned += s->churned;
+    }
+    printf("workload         %s protocol=%s\n", workload_names[workload], binary ? "binary" : "text");
+    printf("connections      requested=%d established=%d setup_s=%.3f\n", nconns, nextensions, setup_time);
+    hist_print("setup", &total.setup);
+    for(int c = 0; c < NUM_COMMANDS; c++) {
+        hist_merge(&all, &total.cmd[c]);
+        if(total.cmd[c].total > 0 || c < TU_CONF_CMD) hist_print(command_name(c), &total.cmd[c]);
+    }
+    hist_print("all", &all);
+    printf("throughput       commands_per_s=%.1f calls_per_s=%.1f notifications_per_s=%.1f chats_per_s=%.1f\n",
+           total.commands / duration, total.calls / duration,
+           total.notifications / duration, total.chats / duration);
+    if(workload == WORKLOAD_CONF)
+        printf("fanout           members=%d chats_sent=%lu chats_received=%lu deliveries_per_chat=%.1f\n",
+               conf_members, total.cmd[TU_CHAT_CMD].total, total.chats,
+               total.cmd[TU_CHAT_CMD].total ? (double)total.chats / total.cmd[TU_CHAT_CMD].total : 0.0);
+    if(workload == WORKLOAD_STORM)
+        printf("contention       busy_signals=%lu commands_per_call=%.2f\n", total.busy,
+               total.calls ? (double)total.commands / total.calls : 0.0);
+    if(workload == WORKLOAD_CHURN) {
+        hist_print("churn", &total.churn);
+        printf("churn            connections_per_s=%.1f\n", total.churned / duration);
+    }
+    if(flood_count > 0)
+        printf("flood            flooders=%d commands_written_per_s=%.1f\n", flood_count, total.flooded / duration);
+    printf("errors           missed_sends=%lu disconnects=%lu\n", total.missed, total.disconnects);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,500 @@
+/*
+ * Deterministic replay harness for the TU state machine.
+ *
+ * Reads a capture of client sessions recorded by the server (pbx -r, see
+ * include/capture.h) and replays it in-process, as fast as possible, by calling
+ * the PBX and TU functions directly.  Each captured connection is given a TU
+ * whose "network connection" is one end of a socketpair; the other ends are
+ * read by a drainer thread, which follows the notifications to count the
+ * state transitions that the replay causes.
+ *
+ * Usage: replay [-t threads] [-S seed] [-i iterations] [-s shards] <capture file>
+ *
+ * With one thread (the default) the events are carried out in a fixed order
+ * and the run is deterministic: by default the order of the capture, or with
+ * -S a pseudo-random interleaving of the connections, determined by the seed,
+ * that preserves the order of the events of each connection.  Varying the seed
+ * explores different interleavings of the same sessions reproducibly.
+ *
+ * With -t, the connections are divided among that many threads, each of which
+ * carries out the events of its connections in order without waiting for the
+ * others.  This exposes the state machine to real concurrency and measures
+ * lock contention.
+ *
+ * For each PBX/TU function, the report gives the number of calls, their
+ * latency, and the number of lock acquisitions within those calls that had to
+ * wait and the time spent waiting.  The commands "session", "resume" and
+ * "binary" concern the connection rather than the state machine, and are not
+ * replayed.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "pbx.h"
+#include "pbx_ext.h"
+#include "server.h"
+#include "conf.h"
+#include "hunt.h"
+#include "capture.h"
+#include "metrics.h"
+#include "csapp.h"
+
+#define NUM_STATES 7
+
+#define INBUF_SIZE 4096
+
+/* Socket buffer size for each connection, so that the drainer rarely falls behind. */
+#define SOCKET_BUFFER (256 * 1024)
+
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (HIST_SUB + 40 * HIST_SUB)
+
+typedef struct hist {
+    unsigned long count[HIST_BUCKETS];
+    unsigned long total;
+    unsigned long max;
+    double sum;
+} HIST;
+
+/*
+ * Operations that can be replayed, one for each PBX/TU function exercised.
+ */
+typedef enum op {
+    OP_CONNECT, OP_DISCONNECT, OP_PICKUP, OP_HANGUP, OP_DIAL, OP_CHAT, OP_CONF, OP_EXT,
+    OP_QUEUE, OP_HUNT, OP_AGENT,
+    NUM_OPS
+} OP;
+
+static char *op_names[] = {
+    [OP_CONNECT]    "pbx_register",
+    [OP_DISCONNECT] "pbx_unregister",
+    [OP_PICKUP]     "tu_pickup",
+    [OP_HANGUP]     "tu_hangup",
+    [OP_DIAL]       "pbx_dial",
+    [OP_CHAT]       "tu_chat",
+    [OP_CONF]       "tu_conference",
+    [OP_EXT]        "pbx_request_extension",
+    [OP_QUEUE]      "pbx_queue",
+    [OP_HUNT]       "hunt_call",
+    [OP_AGENT]      "tu_agent"
+};
+
+typedef struct event {
+    int conn;
+    OP op;
+    int arg;
+    char *text;
+} EVENT;
+
+/*
+ * A captured connection, used only by the thread replaying it.
+ */
+typedef struct conn {
+    TU *tu;
+    int worker;
+} CONN;
+
+/*
+ * The client end of a replayed connection, used only by the drainer, which
+ * frees it once the PBX has closed the connection.
+ */
+typedef struct client {
+    int fd;
+    int state;
+    size_t inlen;
+    char inbuf[INBUF_SIZE];
+} CLIENT;
+
+typedef struct opstats {
+    HIST latency;
+    unsigned long waits;
+    unsigned long wait_ns;
+} OPSTATS;
+
+typedef struct worker {
+    pthread_t tid;
+    int id;
+    OPSTATS ops[NUM_OPS];
+} WORKER;
+
+static int nthreads = 1;
+static unsigned int seed = 0;
+static int iterations = 1;
+
+static EVENT *events;
+static int nevents;
+static int *order;
+static CONN *conns;
+static int nconns;
+static unsigned long ignored;
+
+static int epfd;
+static volatile int draining_done;
+static unsigned long transitions, notifications, chats, open_fds;
+static pthread_mutex_t drainer_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int hist_index(unsigned long v) {
+    if(v < HIST_SUB) return v;
+    int e = 63 - __builtin_clzl(v);
+    int i = HIST_SUB + (e - HIST_SUB_BITS) * HIST_SUB + ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+    return i < HIST_BUCKETS ? i : HIST_BUCKETS - 1;
+}
+
+static unsigned long hist_value(int i) {
+    if(i < HIST_SUB) return i;
+    int e = (i - HIST_SUB) / HIST_SUB + HIST_SUB_BITS;
+    return (1UL << e) + ((unsigned long)((i - HIST_SUB) % HIST_SUB) << (e - HIST_SUB_BITS));
+}
+
+static void hist_add(HIST *h, unsigned long ns) {
+    h->count[hist_index(ns)]++;
+    h->total++;
+    h->sum += ns;
+    if(ns > h->max) h->max = ns;
+}
+
+static void hist_merge(HIST *to, HIST *from) {
+    for(int i = 0; i < HIST_BUCKETS; i++) to->count[i] += from->count[i];
+    to->total += from->total;
+    to->sum += from->sum;
+    if(from->max > to->max) to->max = from->max;
+}
+
+static unsigned long hist_percentile(HIST *h, double p) {
+    unsigned long target = h->total * p, seen = 0;
+    for(int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->count[i];
+        if(seen > target) return hist_value(i);
+    }
+    return h->max;
+}
+
+/*
+ * Parse one line of a capture into an event.
+ * Returns 0 if the line is an event to be replayed, otherwise -1.
+ */
+static int parse_event(char *line, EVENT *e) {
+    long us;
+    int conn, n;
+    if(sscanf(line, "%ld %d %n", &us, &conn, &n) < 2 || conn < 0) return -1;
+    char *cmd = line + n;
+    char *arg = strpbrk(cmd, " \t");
+    size_t len = arg != NULL ? arg - cmd : strlen(cmd);
+    if(arg != NULL) ++arg;
+    e->conn = conn;
+    e->arg = arg != NULL ? atoi(arg) : -1;
+    e->text = NULL;
+    if(len == strlen(CAPTURE_CONNECT) && strncmp(cmd, CAPTURE_CONNECT, len) == 0) e->op = OP_CONNECT;
+    else if(len == strlen(CAPTURE_DISCONNECT) && strncmp(cmd, CAPTURE_DISCONNECT, len) == 0) e->op = OP_DISCONNECT;
+    else if(strncmp(cmd, tu_command_names[TU_PICKUP_CMD], len) == 0 && len == strlen(tu_command_names[TU_PICKUP_CMD])) e->op = OP_PICKUP;
+    else if(strncmp(cmd, tu_command_names[TU_HANGUP_CMD], len) == 0 && len == strlen(tu_command_names[TU_HANGUP_CMD])) e->op = OP_HANGUP;
+    else if(strncmp(cmd, tu_command_names[TU_DIAL_CMD], len) == 0 && len == strlen(tu_command_names[TU_DIAL_CMD])) e->op = OP_DIAL;
+    else if(strncmp(cmd, tu_command_names[TU_CHAT_CMD], len) == 0 && len == strlen(tu_command_names[TU_CHAT_CMD])) {
+        e->op = OP_CHAT;
+        // The server skips the whitespace that separates the message from the command.
+        while(arg != NULL && (*arg == ' ' || *arg == '\t')) ++arg;
+        e->text = strdup(arg != NULL ? arg : "");
+    }
+    else if(strncmp(cmd, CONF_COMMAND_NAME, len) == 0 && len == strlen(CONF_COMMAND_NAME)) e->op = OP_CONF;
+    else if(strncmp(cmd, EXT_COMMAND_NAME, len) == 0 && len == strlen(EXT_COMMAND_NAME)) e->op = OP_EXT;
+    else if(strncmp(cmd, QUEUE_COMMAND_NAME, len) == 0 && len == strlen(QUEUE_COMMAND_NAME)) e->op = OP_QUEUE;
+    else if(strncmp(cmd, HUNT_COMMAND_NAME, len) == 0 && len == strlen(HUNT_COMMAND_NAME)) e->op = OP_HUNT;
+    else if(strncmp(cmd, AGENT_COMMAND_NAME, len) == 0 && len == strlen(AGENT_COMMAND_NAME)) e->op = OP_AGENT;
+    else return -1;
+    if(e->op != OP_CONNECT && e->op != OP_DISCONNECT && e->op != OP_PICKUP && e->op != OP_HANGUP
+       && e->op != OP_CHAT && arg == NULL) return -1;
+    return 0;
+}
+
+static void load_capture(char *path) {
+    FILE *in = fopen(path, "r");
+    if(in == NULL) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    int capacity = 1024;
+    events = malloc(capacity * sizeof(EVENT));
+    while((len = getline(&line, &size, in)) > 0) {
+        if(line[len - 1] == '\n') line[len - 1] = '\0';
+        if(nevents == capacity) {
+            capacity *= 2;
+            events = realloc(events, capacity * sizeof(EVENT));
+        }
+        if(parse_event(line, &events[nevents]) < 0) {
+            ignored++;
+            continue;
+        }
+        if(events[nevents].conn >= nconns) nconns = events[nevents].conn + 1;
+        nevents++;
+    }
+    free(line);
+    fclose(in);
+}
+
+/*
+ * Choose the order in which events are carried out: the order of the capture,
+ * or if a seed was given, a random interleaving of the connections that keeps
+ * the events of each connection in order.
+ */
+static void make_order(void) {
+    order = malloc(nevents * sizeof(int));
+    if(seed == 0) {
+        for(int i = 0; i < nevents; i++) order[i] = i;
+        return;
+    }
+    // Events of each connection, linked in capture order.
+    int *next = malloc(nevents * sizeof(int));
+    int *head = malloc(nconns * sizeof(int)), *tail = malloc(nconns * sizeof(int));
+    for(int c = 0; c < nconns; c++) head[c] = tail[c] = -1;
+    for(int i = 0; i < nevents; i++) {
+        int c = events[i].conn;
+        next[i] = -1;
+        if(tail[c] >= 0) next[tail[c]] = i;
+        else head[c] = i;
+        tail[c] = i;
+    }
+    int *active = malloc(nconns * sizeof(int)), nactive = 0;
+    for(int c = 0; c < nconns; c++) if(head[c] >= 0) active[nactive++] = c;
+    unsigned int state = seed;
+    for(int n = 0; n < nevents; n++) {
+        int k = rand_r(&state) % nactive;
+        int c = active[k];
+        order[n] = head[c];
+        head[c] = next[head[c]];
+        if(head[c] < 0) active[k] = active[--nactive];
+    }
+    free(next);
+    free(head);
+    free(tail);
+    free(active);
+}
+
+/*
+ * Parse a state notification, returning the state or -1 if the line is not one.
+ */
+static int parse_state(char *line) {
+    for(int s = 0; s < NUM_STATES; s++) {
+        size_t len = strlen(tu_state_names[s]);
+        if(strncmp(line, tu_state_names[s], len) == 0 && (line[len] == '\0' || line[len] == ' '))
+            return s;
+    }
+    size_t len = strlen(CONF_STATE_NAME);
+    if(strncmp(line, CONF_STATE_NAME, len) == 0 && (line[len] == '\0' || line[len] == ' '))
+        return TU_CONFERENCE;
+    len = strlen(QUEUED_STATE_NAME);
+    if(strncmp(line, QUEUED_STATE_NAME, len) == 0 && (line[len] == '\0' || line[len] == ' '))
+        return TU_QUEUED;
+    return -1;
+}
+
+static void drain(CLIENT *c) {
+    ssize_t n;
+    while((n = read(c->fd, c->inbuf + c->inlen, INBUF_SIZE - c->inlen)) > 0) {
+        c->inlen += n;
+        char *start = c->inbuf, *eol;
+        while((eol = memchr(start, '\n', c->inbuf + c->inlen - start)) != NULL) {
+            *eol = '\0';
+            if(eol > start && eol[-1] == '\r') eol[-1] = '\0';
+            int s = parse_state(start);
+            if(s >= 0) {
+                notifications++;
+                if(s != c->state) transitions++;
+                c->state = s;
+            }
+            else chats++;
+            start = eol + 1;
+        }
+        c->inlen -= start - c->inbuf;
+        memmove(c->inbuf, start, c->inlen);
+        // A line longer than the buffer is a chat; discard it.
+        if(c->inlen == INBUF_SIZE) c->inlen = 0;
+    }
+    if(n == 0 || (errno != EAGAIN && errno != EINTR)) {
+        close(c->fd);
+        free(c);
+        pthread_mutex_lock(&drainer_mutex);
+        open_fds--;
+        pthread_mutex_unlock(&drainer_mutex);
+    }
+}
+
+/*
+ * Thread function for the drainer, which reads everything the PBX sends to
+ * the replayed connections until they have all been closed.
+ */
+static void *drainer_thread(void *arg) {
+    struct epoll_event ready[256];
+    while(1) {
+        pthread_mutex_lock(&drainer_mutex);
+        int finished = draining_done && open_fds == 0;
+        pthread_mutex_unlock(&drainer_mutex);
+        if(finished) break;
+        int n = epoll_wait(epfd, ready, 256, 50);
+        for(int i = 0; i < n; i++) drain(ready[i].data.ptr);
+    }
+    return NULL;
+}
+
+static void do_connect(CONN *c, int ext) {
+    int sv[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        perror("socketpair");
+        exit(EXIT_FAILURE);
+    }
+    int size = SOCKET_BUFFER;
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(sv[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    fcntl(sv[1], F_SETFL, O_NONBLOCK);
+    CLIENT *client = malloc(sizeof(CLIENT));
+    client->fd = sv[1];
+    client->state = -1;
+    client->inlen = 0;
+    pthread_mutex_lock(&drainer_mutex);
+    open_fds++;
+    pthread_mutex_unlock(&drainer_mutex);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = client };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, client->fd, &ev);
+    c->tu = tu_init(sv[0]);
+    // The captured extension may still be taken if the interleaving differs.
+    if(pbx_register(pbx, c->tu, ext) < 0) pbx_register(pbx, c->tu, PBX_ANY_EXTENSION);
+}
+
+static void do_disconnect(CONN *c) {
+    pbx_unregister(pbx, c->tu);
+    tu_unref(c->tu, "replay");
+    c->tu = NULL;
+}
+
+static void replay_event(WORKER *w, EVENT *e) {
+    CONN *c = &conns[e->conn];
+    if(e->op != OP_CONNECT && c->tu == NULL) return;
+    if(e->op == OP_CONNECT && c->tu != NULL) return;
+    long waits0, ns0, waits1, ns1;
+    metrics_thread_waits(&waits0, &ns0);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    switch(e->op) {
+    case OP_CONNECT: do_connect(c, e->arg); break;
+    case OP_DISCONNECT: do_disconnect(c); break;
+    case OP_PICKUP: tu_pickup(c->tu); break;
+    case OP_HANGUP: tu_hangup(c->tu); break;
+    case OP_DIAL: pbx_dial(pbx, c->tu, e->arg); break;
+    case OP_CHAT: tu_chat(c->tu, e->text); break;
+    case OP_CONF: tu_conference(c->tu, e->arg); break;
+    case OP_EXT: pbx_request_extension(pbx, c->tu, e->arg); break;
+    case OP_QUEUE: pbx_queue(pbx, c->tu, e->arg); break;
+    case OP_HUNT: hunt_call(hunt_group(e->arg), c->tu, e->arg); break;
+    case OP_AGENT: tu_agent(c->tu, e->arg); break;
+    default: return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    metrics_thread_waits(&waits1, &ns1);
+    OPSTATS *s = &w->ops[e->op];
+    hist_add(&s->latency, (end.tv_sec - start.tv_sec) * 1000000000UL + end.tv_nsec - start.tv_nsec);
+    s->waits += waits1 - waits0;
+    s->wait_ns += ns1 - ns0;
+}
+
+static void *worker_thread(void *arg) {
+    WORKER *w = arg;
+    for(int n = 0; n < nevents; n++) {
+        EVENT *e = &events[order[n]];
+        if(conns[e->conn].worker == w->id) replay_event(w, e);
+    }
+    // Connections still open at the end of the capture are closed.
+    EVENT e = { .op = OP_DISCONNECT };
+    for(e.conn = 0; e.conn < nconns; e.conn++) {
+        if(conns[e.conn].worker == w->id) replay_event(w, &e);
+    }
+    return NULL;
+}
+
+static void usage(char *name) {
+    fprintf(stderr, "Usage: %s [-t threads] [-S seed] [-i iterations] [-s shards] <capture file>\n", name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while((opt = getopt(argc, argv, "t:S:i:s:")) != -1) {
+        switch(opt) {
+        case 't': nthreads = atoi(optarg); break;
+        case 'S': seed = strtoul(optarg, NULL, 0); break;
+        case 'i': iterations = atoi(optarg); break;
+        case 's': pbx_shards = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if(optind != argc - 1 || nthreads <= 0 || iterations <= 0 || pbx_shards <= 0) usage(argv[0]);
+    load_capture(argv[optind]);
+    if(nevents == 0) {
+        fprintf(stderr, "replay: no events in %s\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+    make_order();
+    conns = calloc(nconns, sizeof(CONN));
+    for(int c = 0; c < nconns; c++) conns[c].worker = c % nthreads;
+
+    signal(SIGPIPE, SIG_IGN);
+    metrics_init();
+    pbx = pbx_init();
+    epfd = epoll_create1(0);
+    pthread_t drainer;
+    pthread_create(&drainer, NULL, drainer_thread, NULL);
+
+    WORKER *workers = calloc(nthreads, sizeof(WORKER));
+    double t0 = now();
+    for(int i = 0; i < iterations; i++) {
+        for(int t = 0; t < nthreads; t++) {
+            workers[t].id = t;
+            pthread_create(&workers[t].tid, NULL, worker_thread, &workers[t]);
+        }
+        for(int t = 0; t < nthreads; t++) pthread_join(workers[t].tid, NULL);
+    }
+    double elapsed = now() - t0;
+    pbx_shutdown(pbx);
+    pthread_mutex_lock(&drainer_mutex);
+    draining_done = 1;
+    pthread_mutex_unlock(&drainer_mutex);
+    pthread_join(drainer, NULL);
+
+    printf("capture          events=%d connections=%d ignored_lines=%lu\n", nevents, nconns, ignored);
+    printf("replay           threads=%d seed=%u iterations=%d shards=%d elapsed_s=%.3f\n",
+           nthreads, seed, iterations, pbx_shards, elapsed);
+    unsigned long calls = 0;
+    for(int op = 0; op < NUM_OPS; op++) {
+        OPSTATS total = {0};
+        for(int t = 0; t < nthreads; t++) {
+            hist_merge(&total.latency, &workers[t].ops[op].latency);
+            total.waits += workers[t].ops[op].waits;
+            total.wait_ns += workers[t].ops[op].wait_ns;
+        }
+        calls += total.latency.total;
+        if(total.latency.total == 0) continue;
+        printf("%-22s calls=%lu mean_ns=%.0f p50_ns=%lu p99_ns=%lu max_ns=%lu lock_waits=%lu lock_wait_ns=%lu\n",
+               op_names[op], total.latency.total, total.latency.sum / total.latency.total,
+               hist_percentile(&total.latency, 0.50), hist_percentile(&total.latency, 0.99),
+               total.latency.max, total.waits, total.wait_ns);
+    }
+    printf("throughput       calls_per_s=%.1f transitions_per_s=%.1f notifications_per_s=%.1f chats_per_s=%.1f\n",
+           calls / elapsed, transitions / elapsed, notifications / elapsed, chats / elapsed);
+    printf("totals           transitions=%lu notifications=%lu chats=%lu\n", transitions, notifications, chats);
+    return EXIT_SUCCESS;
+}